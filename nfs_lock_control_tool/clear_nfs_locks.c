@@ -1,38 +1,62 @@
+#define _GNU_SOURCE
 #include <fcntl.h>
 #include <netdb.h>
 #include <errno.h>
 #include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/poll.h>
-#include <rpc/pmap_prot.h>
-#include <rpc/pmap_clnt.h>
+#include <sys/param.h>
+#include <sys/un.h>
+#include <rpc/rpc.h>
+
+#include "nsm_engine.h"
+#include "nsm_resolv.h"
+#include "nsm_pmap.h"
+#include "nsm_port.h"
+#include "nsm_discover.h"
+#include "nsm_metrics.h"
+#include "nsm_pcap.h"
+#include "nsm_clock.h"
 
 #define NSM_PROGRAM		100024
 #define NSM_VERSION		1
 #define NSM_NOTIFY		6
-#define MAX_MESSAGE_SIZE	256
 
 #define MAGIC_NSM_STATE		1
-#define SERVER_ANSWER_SIZE	24
+
+#define NSMD_MAX_JOBS		1024	/* default jobs in flight */
+#define NSMD_MAX_CONNS		64
+#define NSMD_LINE		2048
+#define NSMD_MAX_OUT		(1 << 20)	/* unread answers per client */
+#define NSMD_LOOKUPS		8	/* lookup threads at once */
+#define NSMD_FAIL_TTL		30	/* seconds a failed lookup holds */
 
 struct server_info {
 	char *			name;
 	unsigned short		statd_port;
+	int			port_cached;	/* statd port from the cache */
+	struct nsm_job		job;
 };
 
 struct client_info {
 	char		*name;
-	int		name_lenght;
-	uint32_t	statd_state;
+	struct nsm_tmpl	tmpl;
+	uint32_t	statd_state[2];
+	int		nr_states;
 };
 
 static int verbose;
+static int use_uring;
 
 #define v_printf	if (verbose) printf
 
 static struct addrinfo *host_lookup(const char *node)
 {
 	struct addrinfo	hints = {
-		.ai_family	= AF_INET,
+		.ai_family	= AF_UNSPEC,
 		.ai_protocol	= IPPROTO_UDP,
 	};
 	struct addrinfo	*result;
@@ -43,177 +67,1486 @@ static struct addrinfo *host_lookup(const char *node)
 	return NULL;
 }
 
-static int receive_server_answer(int sock)
+static void set_states(uint32_t *states, int *nr_states, uint32_t statd_state)
+{
+	*nr_states = 0;
+	if (statd_state == MAGIC_NSM_STATE) {
+		/* Tricky hack. At least some versions of rpc.statd doesn't
+		 * drops locks, when receiving reboot counter, equal to 1,
+		 * if servers reboot counter for this client is equal to 3.
+		 * So, we first try state equal to 3, and than magic state.
+		 */
+		states[(*nr_states)++] = 3;
+	}
+	states[(*nr_states)++] = statd_state;
+}
+
+static void server_done(struct nsm_engine *e, struct nsm_job *job)
+{
+	if (!job->result)
+		v_printf("Locks on %s are cleared.\n", job->name);
+}
+
+/*
+ * Switch a new engine to io_uring, if asked to and the kernel can.
+ */
+static void engine_io(struct nsm_engine *e)
+{
+	int result;
+
+	if (!use_uring)
+		return;
+	result = nsm_engine_uring(e);
+	if (result < 0)
+		v_printf("io_uring is not available (%s), using sendmmsg\n",
+							strerror(-result));
+}
+
+/*
+ * Wait for the engine to finish all the jobs.
+ */
+static void run_engine(struct nsm_engine *e)
 {
-	unsigned int	buffer[MAX_MESSAGE_SIZE];
-	int		result;
-	struct pollfd	pfd;
-	long		wait_in_msec = 10000;
+	struct pollfd pfd[NSM_PORT_POOL_MAX];
+	unsigned int i;
 
-	pfd.fd = sock;
-	pfd.events = POLLIN;
+	for (i = 0; i < e->ports->nr; i++) {
+		pfd[i].fd = e->ports->socks[i];
+		pfd[i].events = POLLIN;
+	}
 
-	v_printf("Waiting for server answer...\n");
+	while (e->active) {
+		if (e->uring)
+			nsm_uring_wait(e->uring, nsm_engine_timeout(e));
+		else
+			poll(pfd, e->ports->nr, nsm_engine_timeout(e));
+		nsm_engine_process(e);
+		nsm_metrics_check();
+	}
+}
 
-	if ((poll(&pfd, 1, wait_in_msec) != 1) ||
-		((result = recv(sock, buffer, sizeof(buffer), 0)) < 0)) {
-		fprintf(stderr, "Failed to receive the answer from server\n");
+/*
+ * Send notifications to all the servers at once and wait for the
+ * answers on the same sockets.
+ */
+static int nfs_clear_locks(const struct nsm_port_pool *ports, struct server_info *servers,
+			int nr_servers, struct client_info *client)
+{
+	struct nsm_engine engine;
+	int i, failed = 0;
+
+	if (nsm_engine_init(&engine, ports, nr_servers, server_done) < 0) {
+		fprintf(stderr, "Failed to allocate message buffers\n");
 		return -1;
 	}
+	engine.verbose = verbose;
+	engine_io(&engine);
+
+	for (i = 0; i < nr_servers; i++) {
+		struct nsm_job *job = &servers[i].job;
+
+		job->name = servers[i].name;
+		job->tmpl = &client->tmpl;
+		memcpy(job->states, client->statd_state,
+					sizeof(client->statd_state));
+		job->nr_states = client->nr_states;
+		nsm_engine_submit(&engine, job);
+	}
+
+	v_printf("Waiting for server answers...\n");
+	run_engine(&engine);
+
+	for (i = 0; i < nr_servers; i++)
+		if (servers[i].job.result < 0)
+			failed++;
 
-	v_printf("Received server answer. Checking...\n");
+	nsm_engine_fini(&engine);
+	return failed ? -1 : 0;
+}
+
+static int clear_nfs_locks(const struct nsm_port_pool *ports, struct server_info *servers,
+		int nr_servers, char *client_name, uint32_t statd_state)
+{
+	struct client_info client_info;
 
-	if (result < SERVER_ANSWER_SIZE) {
-		fprintf(stderr, "Server answer size is less, than it should be "
-			       		"(%d instead of %d).\n", result, SERVER_ANSWER_SIZE);
+	memset (&client_info, 0, sizeof(struct client_info));
+	client_info.name = client_name;
+	if (nsm_tmpl_init(&client_info.tmpl, client_name) < 0) {
+		fprintf(stderr, "Client name '%s' is too long\n", client_name);
 		return -1;
 	}
-	
-	if (buffer[1] != htonl(1) ||	/* Reply code */
-	    buffer[2] != htonl(0) ||	/* Accepted code */
-	    buffer[3] != htonl(0) ||
-	    buffer[4] != htonl(0) ||
-	    buffer[4] != htonl(0)) {	/* Success code */
-		fprintf(stderr, "Server returned error. Notify failed!\n");
+
+	set_states(client_info.statd_state, &client_info.nr_states,
+							statd_state);
+	return nfs_clear_locks(ports, servers, nr_servers, &client_info);
+}
+
+static int resolve_server(struct server_info *server,
+				struct nsm_target *target)
+{
+	if (target->error) {
+		fprintf(stderr, "DNS resolution of %s failed: %s\n",
+				server->name, gai_strerror(target->error));
 		return -1;
 	}
 
+	memcpy(server->job.addrs, target->addrs, sizeof(target->addrs));
+	server->job.nr_addrs = target->nr_addrs;
 	return 0;
 }
 
+static void set_port(struct sockaddr_storage *addr, unsigned short port)
+{
+	if (addr->ss_family == AF_INET)
+		((struct sockaddr_in *)addr)->sin_port = htons(port);
+	else
+		((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+}
+
+static unsigned short get_port(const struct sockaddr_storage *addr)
+{
+	if (addr->ss_family == AF_INET)
+		return ntohs(((struct sockaddr_in *)addr)->sin_port);
+	return ntohs(((struct sockaddr_in6 *)addr)->sin6_port);
+}
+
+static void set_job_port(struct nsm_job *job, unsigned short port)
+{
+	unsigned int i;
+
+	for (i = 0; i < job->nr_addrs; i++)
+		set_port(&job->addrs[i], port);
+}
+
+static void set_statd_port(struct server_info *server, unsigned short port)
+{
+	server->statd_port = port;
+	set_job_port(&server->job, port);
+}
+
 /*
- * Send notification to a single host
+ * Portmapper queries for all the addresses of a server.
  */
-static int send_unlock_message(int sock, struct server_info *server, 
-					struct client_info *client)
+static void statd_queries(struct nsm_pmap_query *q,
+			const struct sockaddr_storage *addrs, unsigned int nr)
 {
-	struct addrinfo *ai;
-	struct sockaddr_storage address;
-	struct sockaddr *addr = (struct sockaddr *)&address;
-	struct sockaddr_in *addr_in = (struct sockaddr_in *)&address;
-	struct sockaddr_in6 *addr_in6 = (struct sockaddr_in6 *)&address;
-	uint32_t buffer[MAX_MESSAGE_SIZE], *p;
-	unsigned pkt_size;
-
-	ai = host_lookup(server->name);
-	if (!ai) {
-		fprintf(stderr, "DNS resolution of %s failed\n", server->name);
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		memset(&q[i], 0, sizeof(q[i]));
+		q[i].addr = addrs[i];
+		q[i].more = i < nr - 1;
+	}
+}
+
+/*
+ * The query, which found the port on one of the server's addresses, or
+ * the first one if none did. The address, which answered, goes first, so
+ * that notifications try it first as well.
+ */
+static struct nsm_pmap_query *statd_found(struct nsm_pmap_query *q,
+			struct sockaddr_storage *addrs, unsigned int nr)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		if (q[i].port) {
+			nsm_addr_prefer(addrs, i);
+			return &q[i];
+		}
+	}
+	return &q[0];
+}
+
+/*
+ * Ask portmappers of all the servers for rpc.statd port at once. The
+ * addresses of a server are asked one after another, NSM_ADDR_DELAY
+ * apart, until one answers.
+ */
+static int get_statd_ports(struct server_info *servers, int nr_servers,
+						const char *cache)
+{
+	struct nsm_pmap_query *queries, *q;
+	unsigned int nr = 0;
+	int i, failed = 0;
+
+	queries = calloc(nr_servers * NSM_RESOLV_MAXADDRS,
+					sizeof(struct nsm_pmap_query));
+	if (!queries) {
+		fprintf(stderr, "Out of memory\n");
 		return -1;
 	}
 
-	memcpy(&address, ai->ai_addr, ai->ai_addrlen);
+	for (i = 0; i < nr_servers; i++) {
+		statd_queries(&queries[nr], servers[i].job.addrs,
+					servers[i].job.nr_addrs);
+		nr += servers[i].job.nr_addrs;
+	}
+
+	nsm_pmap_getport(queries, nr, NSM_PROGRAM, NSM_VERSION,
+						IPPROTO_UDP, cache);
+
+	for (i = 0, q = queries; i < nr_servers; i++) {
+		struct nsm_job *job = &servers[i].job;
+		struct nsm_pmap_query *found;
+
+		found = statd_found(q, job->addrs, job->nr_addrs);
+		q += job->nr_addrs;
+		if (!found->port) {
+			fprintf(stderr, "rpc.statd not found on %s: %s\n",
+				servers[i].name, strerror(-found->error));
+			failed++;
+			continue;
+		}
+		servers[i].port_cached = found->cached;
+		set_statd_port(&servers[i], found->port);
+	}
+
+	free(queries);
+	return failed ? -1 : 0;
+}
+
+static void forget_statd_port(const char *cache,
+			const struct sockaddr_storage *addrs, unsigned int nr)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+		nsm_pmap_forget(cache, (struct sockaddr *)&addrs[i],
+				NSM_PROGRAM, NSM_VERSION, IPPROTO_UDP);
+}
+
+/*
+ * A cached port is stale, if the server was rebooted since. Forget the
+ * ports of the servers, which didn't make it, and try them once again
+ * with ports from their portmappers.
+ */
+static int retry_stale_ports(const struct nsm_port_pool *ports, struct server_info *servers,
+		int nr_servers, char *client_name, uint32_t statd_state,
+		const char *cache)
+{
+	int i, nr_stale = 0, failed = 0;
+
+	for (i = 0; i < nr_servers; i++) {
+		struct server_info *server = &servers[i];
+
+		if (server->job.result >= 0)
+			continue;
+		if (!server->port_cached) {
+			failed++;
+			continue;
+		}
+
+		v_printf("Retrying %s with a fresh rpc.statd port\n",
+							server->name);
+		forget_statd_port(cache, server->job.addrs,
+					server->job.nr_addrs);
+
+		nsm_rtt_init(&server->job.rtt);
+		servers[nr_stale++] = *server;
+	}
+
+	if (!nr_stale)
+		return -1;
+
+	if (get_statd_ports(servers, nr_stale, cache) < 0 ||
+	    clear_nfs_locks(ports, servers, nr_stale, client_name,
+						statd_state) < 0)
+		return -1;
+
+	return failed ? -1 : 0;
+}
+
+/*
+ * Daemon mode.
+ *
+ * The RPC sockets, the resolved addresses, statd ports and RTT estimates
+ * of the servers are kept between jobs, and so are failed lookups, for
+ * NSMD_FAIL_TTL. Lookups run in threads, see nsmd_run_lookups(). Jobs
+ * come over a Unix socket, one per line:
+ *
+ *	<id> <client_name> <server> [<statd_state> [<port>]]
+ *
+ * and are answered out of order, as they finish:
+ *
+ *	<id> ok <usec>
+ *	<id> error <reason> <usec>
+ *
+ * Bulk mode runs the same way over a job file, where lines have no id
+ * and answers are CSV or JSON lines on stdout, identified by the line
+ * number.
+ */
+
+enum {
+	NSMD_PLAIN,
+	NSMD_CSV,
+	NSMD_JSON,
+};
+
+struct nsmd_server {
+	struct nsmd_server *	next;
+	char *			name;
+	struct sockaddr_storage	addrs[NSM_RESOLV_MAXADDRS];
+	unsigned int		nr_addrs;	/* preferred first */
+	time_t			addr_expires;
+	unsigned short		port;
+	int			port_cached;	/* from the cache file */
+	time_t			port_expires;
+	struct nsm_rtt		rtt;
+	char			error[64];	/* why the last lookup failed */
+	int			error_port;	/* finding the port did */
+	time_t			error_expires;
+	int			lookup;		/* NSMD_LOOKUP_* */
+	int			lookup_port;	/* it asks for the port too */
+	struct nsmd_server *	lookup_next;	/* queued for a lookup */
+	struct nsmd_job *	waiting;	/* jobs waiting for it */
+};
+
+enum {
+	NSMD_LOOKUP_NONE,
+	NSMD_LOOKUP_QUEUED,
+	NSMD_LOOKUP_RUNNING,
+};
+
+struct nsmd_conn {
+	int			fd;		/* -1 once broken */
+	int			out_fd;		/* where answers go */
+	int			format;
+	int			eof;		/* no more requests */
+	unsigned long		lines;
+	char			buf[NSMD_LINE];
+	unsigned int		len;
+	char *			out;		/* answers not sent yet */
+	size_t			out_len;
+	size_t			out_size;
+	unsigned int		jobs;		/* jobs in flight */
+	int			detached;	/* the last job frees it */
+};
+
+struct nsmd_req {
+	const char *		id;		/* daemon mode */
+	unsigned long		line;		/* bulk mode */
+	const char *		client;
+	const char *		server;
+	uint32_t		state;
+	unsigned short		port;
+};
+
+struct nsmd_job {
+	struct nsm_job		job;
+	struct nsmd_conn *	conn;
+	struct nsmd_server *	server;
+	int			retried;	/* or has the port given */
+	long			start;		/* usec, lookups count */
+	struct nsmd_job *	next;		/* waiting or ready */
+	struct nsmd_req		req;
+	struct nsm_tmpl		tmpl;
+	char			line[];		/* the request fields */
+};
+
+struct nsmd {
+	struct nsm_engine	engine;
+	struct nsmd_server *	servers;
+	struct nsmd_conn *	conns[NSMD_MAX_CONNS];
+	unsigned int		nr_conns;
+	const char *		cache;
+	const char *		pmap_cache;
+	int			family;		/* of server addresses */
+	uint32_t		state;		/* defaults for requests */
+	unsigned short		port;
+	unsigned long		failed;
+	unsigned int		max_jobs;
+	unsigned int		nr_waiting;	/* for lookups */
+	struct nsmd_job *	ready;		/* for room in the engine */
+	struct nsmd_job **	ready_tail;
+	struct nsmd_server *	queued;		/* for the next lookup */
+	unsigned int		nr_lookups;	/* running */
+	struct nsmd_lookups *	lookups;
+};
+
+/*
+ * What a lookup thread found for a server. The thread doesn't touch the
+ * server, the loop applies the results.
+ */
+struct nsmd_found {
+	struct nsmd_server *	srv;
+	struct nsm_target	target;
+	int			resolve;	/* the addresses too */
+	int			getport;
+	unsigned short		port;
+	int			port_cached;
+	int			port_error;	/* negative errno */
+};
+
+struct nsmd_batch {
+	struct nsmd_batch *	next;		/* done */
+	int			last;		/* of its lookup */
+	struct nsmd_lookups *	l;
+	const char *		cache;
+	const char *		pmap_cache;
+	int			family;
+	unsigned int		nr;
+	struct nsmd_found	found[];
+};
+
+/*
+ * Shared with the lookup threads. It outlives the daemon, if they are
+ * still running when it exits.
+ */
+struct nsmd_lookups {
+	pthread_mutex_t		lock;
+	struct nsmd_batch *	done;
+	int			pipe[2];	/* a byte per batch done */
+};
+
+static volatile sig_atomic_t nsmd_stop;
+
+static void nsmd_signal(int sig)
+{
+	nsmd_stop = 1;
+}
+
+static void nsmd_free_conn(struct nsmd_conn *conn)
+{
+	free(conn->out);
+	free(conn);
+}
+
+static void nsmd_broken(struct nsmd_conn *conn)
+{
+	if (conn->fd >= 0)
+		close(conn->fd);
+	conn->fd = -1;
+	conn->out_len = 0;
+}
+
+/*
+ * Quote a string for CSV or JSON.
+ */
+static int nsmd_quote(char *buf, size_t size, const char *s, int format)
+{
+	size_t len = 0;
+
+	if (format == NSMD_CSV && !strpbrk(s, ",\""))
+		return snprintf(buf, size, "%s", s);
+
+	if (len + 1 < size)
+		buf[len++] = '"';
+	for (; *s && len + 7 < size; s++) {
+		if (*s == '"')
+			buf[len++] = format == NSMD_CSV ? '"' : '\\';
+		else if (*s == '\\' && format == NSMD_JSON)
+			buf[len++] = '\\';
+		else if ((unsigned char)*s < 0x20) {
+			len += sprintf(buf + len, "\\u%04x", *s);
+			continue;
+		}
+		buf[len++] = *s;
+	}
+	if (len + 1 < size)
+		buf[len++] = '"';
+	buf[len] = '\0';
+	return len;
+}
+
+static int nsmd_format(char *line, size_t size, int format,
+			const struct nsmd_req *req, int result,
+			const char *reason, long usec)
+{
+	char client[NSMD_LINE / 4], server[NSMD_LINE / 4], error[256];
+
+	if (!reason)
+		reason = result ? strerror(-result) : "";
+
+	if (format == NSMD_PLAIN) {
+		if (!result)
+			return snprintf(line, size, "%s ok %ld\n",
+							req->id, usec);
+		return snprintf(line, size, "%s error %s %ld\n", req->id,
+							reason, usec);
+	}
+
+	nsmd_quote(client, sizeof(client), req->client ? : "", format);
+	nsmd_quote(server, sizeof(server), req->server ? : "", format);
+	nsmd_quote(error, sizeof(error), reason, format);
+
+	if (format == NSMD_CSV)
+		return snprintf(line, size, "%lu,%s,%s,%u,%u,%s,%s,%ld\n",
+				req->line, client, server, req->state,
+				req->port, result ? "error" : "ok", error,
+				usec);
+
+	return snprintf(line, size, "{\"line\":%lu,\"client\":%s,"
+			"\"server\":%s,\"state\":%u,\"port\":%u,"
+			"\"result\":\"%s\",\"error\":%s,\"usec\":%ld}\n",
+			req->line, client, server, req->state, req->port,
+			result ? "error" : "ok", result ? error : "null",
+			usec);
+}
+
+/*
+ * Answers are collected and sent once per loop, a client, which doesn't
+ * read them, is dropped.
+ */
+static void nsmd_reply(struct nsmd_conn *conn, const struct nsmd_req *req,
+			int result, const char *reason, long usec)
+{
+	char line[NSMD_LINE];
+	int len;
+
+	if (conn->fd < 0)
+		return;
+
+	len = nsmd_format(line, sizeof(line), conn->format, req, result,
+							reason, usec);
+	len = MIN(len, sizeof(line) - 1);
+
+	if (conn->out_len + len > conn->out_size) {
+		size_t size = MAX(conn->out_size * 2, 4096);
+		char *out;
+
+		if (size > NSMD_MAX_OUT || !(out = realloc(conn->out, size))) {
+			nsmd_broken(conn);
+			return;
+		}
+		conn->out = out;
+		conn->out_size = size;
+	}
+
+	memcpy(conn->out + conn->out_len, line, len);
+	conn->out_len += len;
+}
+
+static void nsmd_flush(struct nsmd_conn *conn)
+{
+	ssize_t res;
+
+	if (conn->fd < 0 || !conn->out_len)
+		return;
+
+	/* SIGPIPE is ignored */
+	res = write(conn->out_fd, conn->out, conn->out_len);
+	if (res < 0) {
+		if (errno != EAGAIN)
+			nsmd_broken(conn);
+		return;
+	}
+
+	conn->out_len -= res;
+	memmove(conn->out, conn->out + res, conn->out_len);
+}
+
+static struct nsmd_server *nsmd_server(struct nsmd *d, const char *name)
+{
+	struct nsmd_server *srv;
+
+	for (srv = d->servers; srv; srv = srv->next)
+		if (!strcmp(srv->name, name))
+			return srv;
+
+	srv = calloc(1, sizeof(*srv));
+	if (!srv)
+		return NULL;
+	srv->name = strdup(name);
+	if (!srv->name) {
+		free(srv);
+		return NULL;
+	}
+	nsm_rtt_init(&srv->rtt);
+
+	srv->next = d->servers;
+	d->servers = srv;
+	return srv;
+}
+
+static void nsmd_lookup_done(struct nsmd_batch *b)
+{
+	struct nsmd_lookups *l = b->l;
+
+	pthread_mutex_lock(&l->lock);
+	b->next = l->done;
+	l->done = b;
+	pthread_mutex_unlock(&l->lock);
+	if (write(l->pipe[1], "", 1) < 0 && errno != EAGAIN)
+		perror("write");
+}
+
+/*
+ * Hand the servers, which need no port, back before asking portmappers,
+ * which may take long to time out.
+ */
+static void nsmd_lookup_resolved(struct nsmd_batch *b)
+{
+	struct nsmd_batch *early;
+	unsigned int i;
+
+	for (i = 0; i < b->nr; i++)
+		if (!b->found[i].getport || !b->found[i].target.nr_addrs)
+			break;
+	if (i == b->nr)
+		return;
+
+	/* the whole batch comes back later then */
+	early = calloc(1, sizeof(*early) + b->nr * sizeof(b->found[0]));
+	if (!early)
+		return;
+	for (i = 0; i < b->nr; i++) {
+		struct nsmd_found *f = &b->found[i];
+
+		if (!f->srv || (f->getport && f->target.nr_addrs))
+			continue;
+		early->found[early->nr++] = *f;
+		f->srv = NULL;
+	}
+	early->l = b->l;
+	nsmd_lookup_done(early);
+}
+
+/*
+ * Resolve the names of a batch of servers at once, then ask their
+ * portmappers at once. The loop gets the batch back through the pipe.
+ */
+static void *nsmd_lookup_thread(void *arg)
+{
+	struct nsmd_batch *b = arg;
+	struct nsm_pmap_query *queries, *q;
+	struct nsm_target *targets;
+	unsigned int i, nr = 0;
+
+	targets = calloc(b->nr, sizeof(*targets));
+	queries = calloc(b->nr * NSM_RESOLV_MAXADDRS, sizeof(*queries));
+	if (!targets || !queries) {
+		for (i = 0; i < b->nr; i++) {
+			b->found[i].resolve = 1;
+			b->found[i].target.nr_addrs = 0;
+			b->found[i].target.error = EAI_MEMORY;
+		}
+		goto done;
+	}
+
+	for (i = 0; i < b->nr; i++)
+		if (b->found[i].resolve)
+			targets[nr++] = b->found[i].target;
+	if (nr)
+		nsm_resolve(targets, nr, b->family, b->cache);
+	for (i = 0, nr = 0; i < b->nr; i++)
+		if (b->found[i].resolve)
+			b->found[i].target = targets[nr++];
+	nsmd_lookup_resolved(b);
+
+	for (i = 0, nr = 0; i < b->nr; i++) {
+		struct nsmd_found *f = &b->found[i];
+
+		if (!f->srv || !f->getport || !f->target.nr_addrs)
+			continue;
+		statd_queries(&queries[nr], f->target.addrs,
+					f->target.nr_addrs);
+		nr += f->target.nr_addrs;
+	}
+	if (nr)
+		nsm_pmap_getport(queries, nr, NSM_PROGRAM, NSM_VERSION,
+					IPPROTO_UDP, b->pmap_cache);
+	for (i = 0, q = queries; i < b->nr; i++) {
+		struct nsmd_found *f = &b->found[i];
+		struct nsm_pmap_query *found;
+
+		if (!f->srv || !f->getport || !f->target.nr_addrs)
+			continue;
+		found = statd_found(q, f->target.addrs, f->target.nr_addrs);
+		q += f->target.nr_addrs;
+		f->port = found->port;
+		f->port_cached = found->cached;
+		f->port_error = found->error;
+	}
+
+done:
+	free(targets);
+	free(queries);
+	b->last = 1;
+	nsmd_lookup_done(b);
+	return NULL;
+}
+
+/*
+ * Answer the job and forget it.
+ */
+static void nsmd_finish(struct nsmd *d, struct nsmd_job *dj, int result,
+				const char *reason, long usec)
+{
+	struct nsmd_conn *conn = dj->conn;
+
+	if (result)
+		d->failed++;
+	nsmd_reply(conn, &dj->req, result, reason, usec);
+
+	if (!--conn->jobs && conn->detached)
+		nsmd_free_conn(conn);
+	free(dj);
+}
+
+static void nsmd_queue_lookup(struct nsmd *d, struct nsmd_server *srv,
+						int need_port)
+{
+	if (srv->lookup == NSMD_LOOKUP_NONE) {
+		srv->lookup = NSMD_LOOKUP_QUEUED;
+		srv->lookup_port = 0;
+		srv->lookup_next = d->queued;
+		d->queued = srv;
+	}
+	/* jobs of a running one, which needs more, queue it once again */
+	if (srv->lookup == NSMD_LOOKUP_QUEUED)
+		srv->lookup_port |= need_port;
+}
+
+/*
+ * Submit the job, if the server address and statd port are known, or
+ * answer it, if the last lookup of the server failed not long ago.
+ * Otherwise the job waits for a lookup, or for room in the engine.
+ */
+static void nsmd_start(struct nsmd *d, struct nsmd_job *dj)
+{
+	struct nsmd_server *srv = dj->server;
+	struct nsm_job *job = &dj->job;
+	int need_port = !dj->req.port;
+	time_t now = time(NULL);
+
+	if (srv->error_expires > now && (need_port || !srv->error_port)) {
+		nsmd_finish(d, dj, -EHOSTUNREACH, srv->error,
+					nsm_now_usec() - dj->start);
+		return;
+	}
+
+	if (srv->addr_expires <= now ||
+	    (need_port && srv->port_expires <= now)) {
+		nsmd_queue_lookup(d, srv, need_port);
+		dj->next = srv->waiting;
+		srv->waiting = dj;
+		d->nr_waiting++;
+		return;
+	}
+
+	job->name = srv->name;
+	job->tmpl = &dj->tmpl;
+	job->data = dj;
+	job->rtt = srv->rtt;
+	memcpy(job->addrs, srv->addrs, sizeof(srv->addrs));
+	job->nr_addrs = srv->nr_addrs;
+	set_job_port(job, need_port ? srv->port : dj->req.port);
+
+	if (nsm_engine_submit(&d->engine, job) < 0) {
+		dj->next = NULL;
+		*d->ready_tail = dj;
+		d->ready_tail = &dj->next;
+		return;
+	}
+	/* the time spent on lookups counts */
+	job->started = dj->start;
+}
 
-	if (addr->sa_family == AF_INET)
-		addr_in->sin_port = htons(server->statd_port);
+static void nsmd_job_done(struct nsm_engine *e, struct nsm_job *job)
+{
+	struct nsmd *d = (struct nsmd *)e;
+	struct nsmd_job *dj = job->data;
+	struct nsmd_server *srv = dj->server;
+	unsigned short port = get_port(&job->addrs[0]);
+
+	srv->rtt = job->rtt;
+	/* the address, which answered, goes first next time */
+	if (job->answered > 0 && job->answered < srv->nr_addrs)
+		nsm_addr_prefer(srv->addrs, job->answered);
+
+	/*
+	 * The server may have been rebooted since the port was cached. The
+	 * job waits for a fresh one then, unless another job has got it
+	 * already.
+	 */
+	if (job->result == -ETIMEDOUT && !dj->retried &&
+	    (srv->port_cached || port != srv->port)) {
+		v_printf("Retrying %s with a fresh rpc.statd port\n",
+							srv->name);
+		if (port == srv->port) {
+			forget_statd_port(d->pmap_cache, srv->addrs,
+						srv->nr_addrs);
+			srv->port_expires = 0;
+			/* the timeouts say nothing of the new one */
+			nsm_rtt_init(&srv->rtt);
+		}
+		dj->retried = 1;
+		nsmd_start(d, dj);
+		return;
+	}
+
+	dj->req.port = port;
+	nsmd_finish(d, dj, job->result, NULL, job->finished - job->started);
+}
+
+/*
+ * Take what a lookup has found for the server, and start its jobs. A
+ * failure is kept for NSMD_FAIL_TTL, the jobs to the server fail at
+ * once till then.
+ */
+static void nsmd_found(struct nsmd *d, const struct nsmd_found *f)
+{
+	struct nsmd_server *srv = f->srv;
+	struct nsmd_job *jobs = srv->waiting;
+	time_t now = time(NULL);
+
+	srv->lookup = NSMD_LOOKUP_NONE;
+	srv->waiting = NULL;
+
+	if (f->resolve && !f->target.nr_addrs) {
+		snprintf(srv->error, sizeof(srv->error), "%s",
+			gai_strerror(f->target.error ? : EAI_NONAME));
+		srv->error_port = 0;
+		srv->error_expires = now + NSMD_FAIL_TTL;
+	} else if (f->getport && !f->port) {
+		snprintf(srv->error, sizeof(srv->error), "%s",
+						strerror(-f->port_error));
+		srv->error_port = 1;
+		srv->error_expires = now + NSMD_FAIL_TTL;
+	} else {
+		if (f->resolve || f->getport) {
+			/* the address, which answered, goes first */
+			memcpy(srv->addrs, f->target.addrs,
+						sizeof(srv->addrs));
+			srv->nr_addrs = f->target.nr_addrs;
+		}
+		if (f->resolve)
+			srv->addr_expires = now + NSM_RESOLV_TTL;
+		if (f->getport) {
+			srv->port = f->port;
+			srv->port_cached = f->port_cached;
+			srv->port_expires = now + NSM_PMAP_TTL;
+		}
+		if (f->getport || !srv->error_port)
+			srv->error_expires = 0;
+	}
+	if (srv->error_expires > now)
+		v_printf("Lookup of %s failed: %s\n", srv->name, srv->error);
+
+	while (jobs) {
+		struct nsmd_job *dj = jobs;
+
+		jobs = dj->next;
+		d->nr_waiting--;
+		nsmd_start(d, dj);
+	}
+}
+
+static void nsmd_lookups_done(struct nsmd *d)
+{
+	struct nsmd_lookups *l = d->lookups;
+	struct nsmd_batch *b;
+	char buf[64];
+	unsigned int i;
+
+	while (read(l->pipe[0], buf, sizeof(buf)) > 0)
+		;
+
+	pthread_mutex_lock(&l->lock);
+	b = l->done;
+	l->done = NULL;
+	pthread_mutex_unlock(&l->lock);
+
+	while (b) {
+		struct nsmd_batch *next = b->next;
+
+		for (i = 0; i < b->nr; i++)
+			if (b->found[i].srv)
+				nsmd_found(d, &b->found[i]);
+		if (b->last)
+			d->nr_lookups--;
+		free(b);
+		b = next;
+	}
+}
+
+/*
+ * Look all the servers queued since the last batch up at once, in a
+ * thread of its own, so that jobs to servers, which are known, go on
+ * meanwhile. Up to NSMD_LOOKUPS batches run at once.
+ */
+static void nsmd_run_lookups(struct nsmd *d)
+{
+	struct nsmd_server *srv;
+	struct nsmd_batch *b;
+	pthread_attr_t attr;
+	pthread_t thread;
+	unsigned int nr = 0;
+	time_t now = time(NULL);
+
+	if (!d->queued || d->nr_lookups == NSMD_LOOKUPS)
+		return;
+
+	for (srv = d->queued; srv; srv = srv->lookup_next)
+		nr++;
+	/* tried again on the next round */
+	b = calloc(1, sizeof(*b) + nr * sizeof(b->found[0]));
+	if (!b)
+		return;
+	b->l = d->lookups;
+	b->cache = d->cache;
+	b->pmap_cache = d->pmap_cache;
+	b->family = d->family;
+
+	for (srv = d->queued; srv; srv = srv->lookup_next) {
+		struct nsmd_found *f = &b->found[b->nr++];
+
+		f->srv = srv;
+		f->target.name = srv->name;
+		f->resolve = srv->addr_expires <= now;
+		f->getport = srv->lookup_port && srv->port_expires <= now;
+		if (!f->resolve) {
+			memcpy(f->target.addrs, srv->addrs,
+						sizeof(srv->addrs));
+			f->target.nr_addrs = srv->nr_addrs;
+		}
+		srv->lookup = NSMD_LOOKUP_RUNNING;
+	}
+	d->queued = NULL;
+	d->nr_lookups++;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	/* without a thread the loop waits for it */
+	if (pthread_create(&thread, &attr, nsmd_lookup_thread, b))
+		nsmd_lookup_thread(b);
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * Submit the jobs, which have waited for room in the engine, first come
+ * first served.
+ */
+static void nsmd_submit_ready(struct nsmd *d)
+{
+	while (d->ready && !nsm_engine_full(&d->engine)) {
+		struct nsmd_job *dj = d->ready;
+
+		d->ready = dj->next;
+		if (!d->ready)
+			d->ready_tail = &d->ready;
+		nsmd_start(d, dj);
+	}
+}
+
+/*
+ * New requests wait while the engine is full, jobs wait for room in it,
+ * or as many wait for lookups as it holds.
+ */
+static int nsmd_room(const struct nsmd *d)
+{
+	return !nsm_engine_full(&d->engine) && !d->ready &&
+		d->nr_waiting < d->max_jobs;
+}
+
+static void nsmd_request(struct nsmd *d, struct nsmd_conn *conn, char *line)
+{
+	struct nsmd_req *req, nomem = { .id = "-", .line = ++conn->lines };
+	char *state, *port, *save, *delim = " \t\r";
+	struct nsmd_server *srv;
+	struct nsmd_job *dj;
+	long start = nsm_now_usec();
+
+	line += strspn(line, delim);
+	if (!*line || *line == '#')
+		return;
+
+	dj = calloc(1, sizeof(*dj) + strlen(line) + 1);
+	if (!dj) {
+		nsmd_reply(conn, &nomem, -ENOMEM, NULL, 0);
+		return;
+	}
+	strcpy(dj->line, line);
+	req = &dj->req;
+	req->line = conn->lines;
+	req->state = d->state;
+	req->port = d->port;
+
+	/* job files may be comma separated */
+	if (conn->format == NSMD_PLAIN)
+		req->id = strtok_r(dj->line, delim, &save);
 	else
-		addr_in6->sin6_port = htons(server->statd_port);
+		delim = " \t\r,";
+	req->client = strtok_r(req->id ? NULL : dj->line, delim, &save);
+	req->server = strtok_r(NULL, delim, &save);
+	state = strtok_r(NULL, delim, &save);
+	port = strtok_r(NULL, delim, &save);
 
-	/* Create SM_NOTIFY packet */
-	memset(buffer, 0, sizeof(buffer));
+	if (!req->client || !req->server) {
+		nsmd_reply(conn, req, -EINVAL, conn->format == NSMD_PLAIN ?
+				"usage: <id> <client_name> <server> "
+				"[<statd_state> [<port>]]" :
+				"usage: <client_name> <server> "
+				"[<statd_state> [<port>]]", 0);
+		goto fail;
+	}
+	if (state)
+		req->state = strtoul(state, NULL, 0);
+	if (port)
+		req->port = atoi(port);
 
-	p = &buffer[2];
-	*p++ = htonl(2);
-	*p++ = htonl(NSM_PROGRAM);
-	*p++ = htonl(NSM_VERSION);
-	*p++ = htonl(NSM_NOTIFY);
-	p += 4;
+	srv = nsmd_server(d, req->server);
+	if (!srv) {
+		nsmd_reply(conn, req, -ENOMEM, NULL, 0);
+		goto fail;
+	}
 
-	*p++ = htonl(client->name_lenght);
-	memcpy(p, client->name, client->name_lenght);
-	p += (client->name_lenght + 3) >> 2;
+	if (nsm_tmpl_init(&dj->tmpl, req->client) < 0) {
+		nsmd_reply(conn, req, -ENAMETOOLONG, NULL, 0);
+		goto fail;
+	}
+
+	dj->conn = conn;
+	dj->server = srv;
+	dj->retried = req->port != 0;
+	dj->start = start;
+	set_states(dj->job.states, &dj->job.nr_states, req->state);
 
-	*p++ = htonl(client->statd_state);
+	conn->jobs++;
+	nsmd_start(d, dj);
+	return;
 
-	pkt_size = (p - buffer) << 2;
+fail:
+	d->failed++;
+	free(dj);
+}
 
-	v_printf("Sending clearing locks message to server %s with state %d...\n", 
-							server->name, 
-							client->statd_state);
+/*
+ * Start a job per complete line, as long as there is room.
+ */
+static void nsmd_parse(struct nsmd *d, struct nsmd_conn *conn)
+{
+	char *line = conn->buf, *end;
 
-	if (sendto(sock, buffer, pkt_size, 0, addr, sizeof(address)) < 0) {
-		fprintf(stderr, "Sending clearing locks message to %s failed: %s",
-					server->name, strerror(errno));
-		return -2;
+	/* the last line may come without a newline */
+	if (conn->eof && conn->len && conn->buf[conn->len - 1] != '\n') {
+		conn->buf[conn->len++] = '\n';
+		conn->buf[conn->len] = '\0';
 	}
 
-	return 0;
+	while (nsmd_room(d) && conn->fd >= 0 &&
+	       (end = strchr(line, '\n'))) {
+		*end = '\0';
+		nsmd_request(d, conn, line);
+		line = end + 1;
+	}
+
+	conn->len -= line - conn->buf;
+	memmove(conn->buf, line, conn->len + 1);
 }
 
-static int nfs_clear_locks(int sock, struct server_info *server,
-	       				struct client_info *client)
+static void nsmd_read(struct nsmd_conn *conn)
 {
-	int error;
-	
-	error = send_unlock_message(sock, server, client);
-	if (!error)
-		error = receive_server_answer(sock);
+	int res;
+
+	/* full of lines waiting for room, reading 0 bytes isn't EOF */
+	if (conn->len == sizeof(conn->buf) - 2)
+		return;
+
+	res = read(conn->fd, conn->buf + conn->len,
+				sizeof(conn->buf) - conn->len - 2);
+	if (res < 0) {
+		if (errno != EAGAIN)
+			nsmd_broken(conn);
+		return;
+	}
+	if (!res) {
+		conn->eof = 1;
+		return;
+	}
+
+	conn->len += res;
+	conn->buf[conn->len] = '\0';
 
-	return error;
+	if (conn->len == sizeof(conn->buf) - 2 && !strchr(conn->buf, '\n')) {
+		struct nsmd_req req = { .id = "-", .line = conn->lines + 1 };
+
+		nsmd_reply(conn, &req, -E2BIG, NULL, 0);
+		conn->len = 0;
+		conn->eof = 1;
+	}
 }
 
-static int clear_nfs_locks(int sock, struct server_info *server_info,
-				char *client_name, uint32_t statd_state)
+/*
+ * Lines, which have waited for room, are there to start.
+ */
+static int nsmd_pending(const struct nsmd_conn *conn)
 {
-	struct client_info client_info;
+	return conn->fd >= 0 && (strchr(conn->buf, '\n') ||
+				 (conn->eof && conn->len));
+}
 
-	memset (&client_info, 0, sizeof(struct client_info));
-	client_info.name = client_name;
-	client_info.name_lenght = strlen(client_name);
+/*
+ * The client is gone, or has sent everything and got all the answers.
+ */
+static int nsmd_finished(struct nsmd_conn *conn)
+{
+	return conn->fd < 0 || (conn->eof && !conn->len && !conn->jobs &&
+				!conn->out_len);
+}
 
-	if (statd_state == MAGIC_NSM_STATE) {
-		int result;
-		/* Tricky hack. At least some versions of rpc.statd doesn't 
-		 * drops locks, when receiving reboot counter, equal to 1, 
-		 * if servers reboot counter for this client is equal to 3.
-		 * So, we first try state equal to 3, and than magic state.
-		 */
-		client_info.statd_state = 3;
-		result = nfs_clear_locks(sock, server_info, &client_info);
-		if (result < 0)
-		       return result;	
+static void nsmd_close(struct nsmd *d, unsigned int i)
+{
+	struct nsmd_conn *conn = d->conns[i];
+
+	nsmd_broken(conn);
+	/* Jobs in flight free it when they are done */
+	if (!conn->jobs)
+		nsmd_free_conn(conn);
+	else
+		conn->detached = 1;
+	d->conns[i] = d->conns[--d->nr_conns];
+}
+
+static void nsmd_accept(struct nsmd *d, int lsock)
+{
+	struct nsmd_conn *conn;
+	int fd;
+
+	fd = accept(lsock, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	if (d->nr_conns == NSMD_MAX_CONNS ||
+	    !(conn = calloc(1, sizeof(*conn)))) {
+		close(fd);
+		return;
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	conn->fd = fd;
+	conn->out_fd = fd;
+	d->conns[d->nr_conns++] = conn;
+}
+
+static int nsmd_listen(const char *path)
+{
+	struct sockaddr_un sun;
+	int sock;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "Socket path %s is too long\n", path);
+		return -1;
 	}
 
-	client_info.statd_state = statd_state;
-	return nfs_clear_locks(sock, server_info, &client_info);
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		fprintf(stderr, "Failed to create control socket: %s\n",
+				strerror(errno));
+		return -1;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	unlink(path);
+
+	if (bind(sock, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+	    listen(sock, NSMD_MAX_CONNS) < 0) {
+		fprintf(stderr, "Failed to listen on %s: %s\n", path,
+				strerror(errno));
+		close(sock);
+		return -1;
+	}
+	fcntl(sock, F_SETFL, O_NONBLOCK);
+	return sock;
 }
 
-static int get_statd_port(char *host)
+static void nsmd_free_lookups(struct nsmd_lookups *l)
 {
-	struct sockaddr_in sin;
-	struct pmaplist *prog_list;
+	close(l->pipe[0]);
+	close(l->pipe[1]);
+	pthread_mutex_destroy(&l->lock);
+	free(l);
+}
 
-	sin.sin_family = AF_INET;
-	sin.sin_addr.s_addr = inet_addr(host);
-	sin.sin_port = htons(111);
-	
-	prog_list = pmap_getmaps(&sin);
-	if (!prog_list) {
-		fprintf(stderr, "Failed to connect to portmapper on %s\n", host);
+static int nsmd_init(struct nsmd *d, const struct nsm_port_pool *ports,
+			unsigned int max_jobs, const char *cache,
+			const char *pmap_cache, uint32_t state,
+			unsigned short port)
+{
+	struct sigaction sa;
+
+	memset(d, 0, sizeof(*d));
+	d->cache = cache;
+	d->pmap_cache = pmap_cache;
+	/* dual-stack sockets reach both families */
+	d->family = ports->family == AF_INET6 ? AF_UNSPEC : ports->family;
+	d->state = state;
+	d->port = port;
+	d->max_jobs = max_jobs;
+	d->ready_tail = &d->ready;
+
+	d->lookups = calloc(1, sizeof(*d->lookups));
+	if (!d->lookups) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	if (pipe2(d->lookups->pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+		fprintf(stderr, "Failed to create pipe: %s\n", strerror(errno));
+		free(d->lookups);
+		return -1;
+	}
+	pthread_mutex_init(&d->lookups->lock, NULL);
+
+	/* nsmd_job_done() finds the daemon by the engine */
+	if (nsm_engine_init(&d->engine, ports, max_jobs, nsmd_job_done) < 0) {
+		fprintf(stderr, "Failed to allocate message buffers\n");
+		nsmd_free_lookups(d->lookups);
+		return -1;
+	}
+	d->engine.verbose = verbose;
+	engine_io(&d->engine);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = nsmd_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+	return 0;
+}
+
+static void nsmd_fini(struct nsmd *d)
+{
+	while (d->nr_conns)
+		nsmd_close(d, 0);
+	nsm_engine_fini(&d->engine);
+
+	/* the threads, which still run, use them; exiting frees it all */
+	if (d->nr_lookups) {
+		v_printf("Exiting, %u lookups left running\n",
+						d->nr_lookups);
+		return;
+	}
+	nsmd_free_lookups(d->lookups);
+	while (d->servers) {
+		struct nsmd_server *srv = d->servers;
+
+		d->servers = srv->next;
+		free(srv->name);
+		free(srv);
+	}
+}
+
+static int nsmd_timeout(struct nsmd *d)
+{
+	int timeout = nsm_engine_timeout(&d->engine);
+	unsigned int i;
+
+	if (d->ready && !nsm_engine_full(&d->engine))
 		return 0;
+	/* the room may have come after they were parsed */
+	if (nsmd_room(d))
+		for (i = 0; i < d->nr_conns; i++)
+			if (nsmd_pending(d->conns[i]))
+				return 0;
+	/* a batch, which failed to start, is tried again soon */
+	if (d->queued && d->nr_lookups < NSMD_LOOKUPS &&
+	    (timeout < 0 || timeout > 100))
+		return 100;
+	return timeout;
+}
+
+/*
+ * Serve the connections until a signal comes, or, without the listening
+ * socket, until all of them are done.
+ */
+static void nsmd_loop(struct nsmd *d, int lsock)
+{
+	const struct nsm_port_pool *ports = d->engine.ports;
+	struct pollfd pfd[1 + NSMD_MAX_CONNS + NSM_PORT_POOL_MAX + 1];
+	unsigned int i, nr, nr_socks;
+
+	while (!nsmd_stop && (lsock >= 0 || d->nr_conns)) {
+		pfd[0].fd = lsock;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < d->nr_conns; i++) {
+			struct nsmd_conn *conn = d->conns[i];
+
+			pfd[1 + i].fd = conn->fd;
+			pfd[1 + i].events = 0;
+			/* no new requests while there is no room */
+			if (!conn->eof && nsmd_room(d) &&
+			    conn->len < sizeof(conn->buf) - 2)
+				pfd[1 + i].events |= POLLIN;
+			if (conn->out_len && conn->out_fd == conn->fd)
+				pfd[1 + i].events |= POLLOUT;
+			/* nor a hangup to spin on till then */
+			if (!pfd[1 + i].events)
+				pfd[1 + i].fd = -1;
+		}
+		nr = 1 + d->nr_conns;
+		/* with io_uring all the answers come to its ring */
+		nr_socks = d->engine.uring ? 1 : ports->nr;
+		for (i = 0; i < nr_socks; i++) {
+			pfd[nr + i].fd = d->engine.uring ?
+					d->engine.uring->fd : ports->socks[i];
+			pfd[nr + i].events = POLLIN;
+		}
+		/* lookups done */
+		pfd[nr + nr_socks].fd = d->lookups->pipe[0];
+		pfd[nr + nr_socks].events = POLLIN;
+
+		if (poll(pfd, nr + nr_socks + 1, nsmd_timeout(d)) < 0 &&
+		    errno != EINTR)
+			break;
+
+		if (pfd[nr + nr_socks].revents & POLLIN)
+			nsmd_lookups_done(d);
+		nsmd_submit_ready(d);
+
+		for (i = 0; i < d->nr_conns; i++) {
+			if (pfd[1 + i].revents & (POLLIN | POLLHUP | POLLERR))
+				nsmd_read(d->conns[i]);
+			nsmd_parse(d, d->conns[i]);
+		}
+
+		if (pfd[0].revents & POLLIN)
+			nsmd_accept(d, lsock);
+
+		nsm_engine_process(&d->engine);
+		nsmd_run_lookups(d);
+
+		for (i = 0; i < d->nr_conns; i++)
+			nsmd_flush(d->conns[i]);
+
+		for (i = d->nr_conns; i-- > 0; )
+			if (nsmd_finished(d->conns[i]))
+				nsmd_close(d, i);
+
+		nsm_metrics_check();
 	}
 
-	do {
-		static int iter = 0;
-		struct pmap *m = &prog_list->pml_map;
+	if (d->engine.active)
+		v_printf("Exiting, %u jobs in flight dropped\n",
+						d->engine.active);
+}
+
+static int run_daemon(const struct nsm_port_pool *ports, const char *path,
+			unsigned int max_jobs, const char *cache,
+			const char *pmap_cache, uint32_t state,
+			unsigned short port)
+{
+	struct nsmd d;
+	int lsock;
 
-		if ((m->pm_prog == NSM_PROGRAM) && (m->pm_prot == IPPROTO_UDP))
-			return m->pm_port;
-		iter++;
-	} while(prog_list = prog_list->pml_next);
-	
-	fprintf(stderr, "rpc.statd not found on %s\n", host);
+	if (nsmd_init(&d, ports, max_jobs, cache, pmap_cache, state,
+								port) < 0)
+		return -1;
+
+	lsock = nsmd_listen(path);
+	if (lsock < 0) {
+		nsmd_fini(&d);
+		return -1;
+	}
+
+	v_printf("Waiting for jobs on %s\n", path);
+	nsmd_loop(&d, lsock);
+
+	close(lsock);
+	unlink(path);
+	nsmd_fini(&d);
 	return 0;
 }
 
+static int open_job_file(const char *path)
+{
+	int fd;
+
+	fd = strcmp(path, "-") ? open(path, O_RDONLY) : dup(STDIN_FILENO);
+	if (fd < 0)
+		fprintf(stderr, "Failed to open job file %s: %s\n", path,
+				strerror(errno));
+	return fd;
+}
+
+/*
+ * Find what the rpc.statd directories matching the patterns have to
+ * notify, and write it out as a job file. Returns the number of
+ * directories, which couldn't be read, or -1 if there are none at all.
+ */
+static int discover_jobs(char **roots, int nr_roots, FILE *out)
+{
+	struct nsm_notify_set set;
+	unsigned int i;
+	int result;
+
+	if (nsm_discover(roots, nr_roots, &set) < 0) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	if (!set.nr_roots) {
+		fprintf(stderr, "No rpc.statd directories found\n");
+		nsm_notify_set_free(&set);
+		return -1;
+	}
+	v_printf("%u servers to notify from %u rpc.statd directories "
+			"(%u unreadable)\n", set.nr, set.nr_roots, set.failed);
+
+	for (i = 0; i < set.nr; i++)
+		fprintf(out, "%s %s %u\n", set.entries[i].client,
+				set.entries[i].server, set.entries[i].state);
+
+	result = set.failed;
+	nsm_notify_set_free(&set);
+	return result;
+}
+
+/*
+ * Run the jobs from a job file, at most 'max_jobs' at once, and print a
+ * CSV or JSON line per job. Fails if any job did.
+ */
+static int run_bulk(const struct nsm_port_pool *ports, int fd,
+			int format, unsigned int max_jobs, const char *cache,
+			const char *pmap_cache, uint32_t state,
+			unsigned short port)
+{
+	struct nsmd_conn *conn;
+	struct nsmd d;
+
+	conn = calloc(1, sizeof(*conn));
+	if (!conn || nsmd_init(&d, ports, max_jobs, cache, pmap_cache,
+						state, port) < 0) {
+		if (!conn)
+			fprintf(stderr, "Out of memory\n");
+		free(conn);
+		close(fd);
+		return -1;
+	}
+	conn->fd = fd;
+	conn->out_fd = STDOUT_FILENO;
+	conn->format = format;
+	d.conns[d.nr_conns++] = conn;
+
+	if (format == NSMD_CSV)
+		printf("line,client,server,state,port,result,error,usec\n");
+	fflush(stdout);
+
+	nsmd_loop(&d, -1);
+
+	nsmd_fini(&d);
+	if (d.failed)
+		fprintf(stderr, "%lu jobs failed\n", d.failed);
+	return d.failed || nsmd_stop ? -1 : 0;
+}
+
 static void help(char *name)
 {
-	printf("Usage: clear_nfs_locks -c client_name -s server [OPTIONS]\n\n",
-									name);
+	printf("Usage: clear_nfs_locks -c client_name -s server "
+				"[-s server ...] [OPTIONS]\n", name);
+	printf("       clear_nfs_locks -D socket [OPTIONS]\n");
+	printf("       clear_nfs_locks -f job_file [OPTIONS]\n");
+	printf("       clear_nfs_locks -S statd_dir [-S statd_dir ...] "
+				"[OPTIONS]\n\n");
 	printf("\tclient_name               Client domain name, which locks "
 					    "have to be droped. Server uses "
 					    "this name as an identifier.\n");
 	printf("\tserver_name                Server domain name or IP to drop "
-					    "locks on.\n");
+					    "locks on. May be repeated: all "
+					    "servers are notified in "
+					    "parallel.\n");
 	printf("\nOptions:\n");
 	printf("\t-p port                   Server's rpc.statd port. Requested "
 					    "using pormapper by default.\n\n");
@@ -222,6 +1555,51 @@ static void help(char *name)
 					    "by default.\n\n");
 	printf("\t-l local_ip               Specify local ip address to "
 					    "work on.\n\n");
+	printf("\t-C cache_file             Name resolution cache. Default is "
+					    "%s, \"\" disables it.\n\n",
+					    NSM_RESOLV_CACHE);
+	printf("\t-P cache_file             rpc.statd port cache. Default is "
+					    "%s, \"\" disables it.\n\n",
+					    NSM_PMAP_CACHE);
+	printf("\t-D socket                 Stay in foreground and take jobs "
+					    "from Unix socket, one per line:\n"
+	       "\t                          \"<id> <client_name> <server> "
+					    "[<statd_state> [<port>]]\".\n"
+	       "\t                          Answers are \"<id> ok <usec>\" "
+					    "or \"<id> error <reason> "
+					    "<usec>\".\n\n");
+	printf("\t-f job_file               Run jobs from file (\"-\" for "
+					    "stdin), one per line:\n"
+	       "\t                          \"<client_name> <server> "
+					    "[<statd_state> [<port>]]\",\n"
+	       "\t                          comma or space separated. "
+					    "Prints a result line per job.\n\n");
+	printf("\t-S statd_dir              Run jobs for everything the rpc.statd "
+					    "directories matching the pattern\n"
+	       "\t                          have to notify, as with -f. May be "
+					    "repeated.\n\n");
+	printf("\t-L                        Only print the jobs found with -S."
+					    "\n\n");
+	printf("\t-j jobs                   Jobs to run at once with -D, -f or -S. "
+					    "Default is %d.\n\n", NSMD_MAX_JOBS);
+	printf("\t-n ports                  Reserved source ports to spread "
+					    "jobs over. Default is %d with -D "
+					    "or -f.\n\n", NSM_PORT_POOL);
+	printf("\t-o csv|json               Format of -f results. Default is "
+					    "csv.\n\n");
+	printf("\t-M metrics_file           Write per server counters and "
+					    "latency histograms there on exit\n"
+	       "\t                          and on SIGUSR1. Prometheus text "
+					    "format, JSON if the name ends\n"
+	       "\t                          in \".json\".\n\n");
+	printf("\t-W pcap_file              Capture all the packets sent and "
+					    "received to a pcap file, written\n"
+	       "\t                          by a separate thread.\n\n");
+	printf("\t-I mmsg|uring             Send and receive with sendmmsg() "
+					    "and recvmmsg(), the default, or\n"
+	       "\t                          with io_uring, falling back to "
+					    "the former if the kernel\n"
+	       "\t                          can't.\n\n");
 	printf("\t-v                        Be verbose: print work progress\n\n");
 	printf("\t-h                        This help.\n\n");
 	printf("Report bugs to skinsbursky@parallels.com\n");
@@ -230,27 +1608,49 @@ static void help(char *name)
 
 int main(int argc, char **argv)
 {
-	static char *client_name, *server_name;
+	static char *client_name;
 	static unsigned short port;
 	static char *local_address;
+	char *cache = NSM_RESOLV_CACHE;
+	char *pmap_cache = NSM_PMAP_CACHE;
+	char *control = NULL;
+	char *job_file = NULL;
+	char *metrics_file = NULL;
+	char *pcap_file = NULL;
+	unsigned int max_jobs = NSMD_MAX_JOBS;
+	int format = NSMD_CSV;
+	char **roots = NULL;
+	int nr_roots = 0, list = 0, job_fd = -1, unreadable = 0;
+	struct nsm_target *targets;
 	uint32_t statd_state = MAGIC_NSM_STATE;
-	struct server_info server_info;
+	struct server_info *servers = NULL;
+	int nr_servers = 0, i;
 	struct sockaddr_storage address;
 	struct sockaddr *local_addr = (struct sockaddr *)&address;
-	int sock, result, bind_retries = 10;
+	struct nsm_port_pool ports;
+	unsigned int nr_ports = 0;
+	int result;
 
 	if (argc == 1) {
 		printf("Missed required options. Try '-h' to get help.\n");
 		return 0;
 	}
-	
-	while ((result = getopt(argc, argv, "c:s:p:i:l:vh")) != EOF) {
+
+	while ((result = getopt(argc, argv, "c:s:p:i:l:C:P:D:f:j:o:n:S:M:W:I:Lvh")) != EOF) {
 		switch (result) {
 			case 'c':
 				client_name = optarg;
 				break;
 			case 's':
-				server_name = optarg;
+				servers = realloc(servers, (nr_servers + 1) *
+						sizeof(struct server_info));
+				if (!servers) {
+					fprintf(stderr, "Out of memory\n");
+					exit(1);
+				}
+				memset(&servers[nr_servers], 0,
+						sizeof(struct server_info));
+				servers[nr_servers++].name = optarg;
 				break;
 			case 'p':
 				port = atoi(optarg);
@@ -261,6 +1661,74 @@ int main(int argc, char **argv)
 			case 'l':
 				local_address = optarg;
 				break;
+			case 'C':
+				cache = *optarg ? optarg : NULL;
+				break;
+			case 'P':
+				pmap_cache = *optarg ? optarg : NULL;
+				break;
+			case 'D':
+				control = optarg;
+				break;
+			case 'f':
+				job_file = optarg;
+				break;
+			case 'j':
+				max_jobs = atoi(optarg);
+				if (!max_jobs) {
+					fprintf(stderr, "Bad number of jobs: "
+							"%s\n", optarg);
+					exit(2);
+				}
+				break;
+			case 'S':
+				roots = realloc(roots, (nr_roots + 1) *
+							sizeof(char *));
+				if (!roots) {
+					fprintf(stderr, "Out of memory\n");
+					exit(1);
+				}
+				roots[nr_roots++] = optarg;
+				break;
+			case 'L':
+				list = 1;
+				break;
+			case 'n':
+				nr_ports = atoi(optarg);
+				if (!nr_ports || nr_ports > NSM_PORT_POOL_MAX) {
+					fprintf(stderr, "Bad number of source "
+						"ports: %s\n", optarg);
+					exit(2);
+				}
+				break;
+			case 'o':
+				if (!strcmp(optarg, "csv"))
+					format = NSMD_CSV;
+				else if (!strcmp(optarg, "json"))
+					format = NSMD_JSON;
+				else {
+					fprintf(stderr, "Unknown format: "
+							"%s\n", optarg);
+					exit(2);
+				}
+				break;
+			case 'M':
+				metrics_file = optarg;
+				break;
+			case 'W':
+				pcap_file = optarg;
+				break;
+			case 'I':
+				if (!strcmp(optarg, "mmsg"))
+					use_uring = 0;
+				else if (!strcmp(optarg, "uring"))
+					use_uring = 1;
+				else {
+					fprintf(stderr, "Unknown I/O method: "
+							"%s\n", optarg);
+					exit(2);
+				}
+				break;
 			case 'v':
 				verbose = 1;
 				break;
@@ -276,23 +1744,53 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if (!client_name) {
+	if (nr_roots && job_file) {
+		fprintf(stderr, "Options -S and -f can't be used together.\n");
+		exit(2);
+	}
+
+	if (nr_roots) {
+		FILE *f = list ? stdout : tmpfile();
+
+		if (!f || (unreadable = discover_jobs(roots, nr_roots, f)) < 0 ||
+		    fflush(f) == EOF)
+			exit(1);
+		free(roots);
+		if (list)
+			return unreadable ? 1 : 0;
+		rewind(f);
+		job_fd = dup(fileno(f));
+		fclose(f);
+	} else if (job_file) {
+		job_fd = open_job_file(job_file);
+		if (job_fd < 0)
+			exit(1);
+	}
+
+	if (!client_name && !control && job_fd < 0) {
 		fprintf(stderr, "You must specity client name.\n");
 		help(argv[0]);
 		exit(1);
 	}
 
-	if (!server_name) {
+	if (!nr_servers && !control && job_fd < 0) {
 		fprintf(stderr, "You must specity server.\n");
 		help(argv[0]);
 		exit(1);
 	}
 
-	if (!port) {
-		if (!(port = get_statd_port(server_name)))
-			exit(1);
+	if (metrics_file && nsm_metrics_init(metrics_file) < 0) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
 	}
 
+	if (pcap_file && (result = nsm_pcap_open(pcap_file)) < 0) {
+		fprintf(stderr, "Failed to start capture to %s: %s\n",
+					pcap_file, strerror(-result));
+		exit(1);
+	}
+
+	memset(&address, 0, sizeof(address));
 	if (local_address) {
 		struct addrinfo *ai;
 
@@ -302,56 +1800,83 @@ int main(int argc, char **argv)
 				local_address);
 			exit(1);
 		}
-	
-		/* We know it's IPv4 at this point */
+
 		memcpy(local_addr, ai->ai_addr, ai->ai_addrlen);
 		freeaddrinfo(ai);
 	}
 
-	v_printf("Client name     : '%s'\n", client_name);
-	v_printf("Server name     : '%s'\n", server_name);
-	v_printf("Port            : %d\n", port);
-	v_printf("rpc.statd state : %u\n", statd_state);
+	targets = calloc(nr_servers, sizeof(struct nsm_target));
+	if (nr_servers && !targets) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < nr_servers; i++)
+		targets[i].name = servers[i].name;
+	/* only the local address family, all of them without one */
+	if (nr_servers)
+		nsm_resolve(targets, nr_servers, local_address ?
+				local_addr->sa_family : AF_UNSPEC, cache);
 
-	do {
-		struct servent *se;
-		struct sockaddr_in *sin = (struct sockaddr_in *)local_addr;
+	for (i = 0; i < nr_servers; i++) {
+		struct server_info *server = &servers[i];
 
-		sock = socket(AF_INET, SOCK_DGRAM, 0);
-		if (sock < 0) {
-			fprintf(stderr, "Failed to create RPC socket: %s\n",
-				strerror(errno));
+		nsm_rtt_init(&server->job.rtt);
+		if (resolve_server(server, &targets[i]) < 0)
 			exit(1);
-		}
-		fcntl(sock, F_SETFL, O_NONBLOCK);
-
-		bindresvport(sock, sin);
+		set_statd_port(server, port);
+	}
+	free(targets);
 
-		/* try to avoid known ports */
-		se = getservbyport(sin->sin_port, "udp");
-		if (!se)
-			break;
+	if (nr_servers && !port &&
+	    get_statd_ports(servers, nr_servers, pmap_cache) < 0)
+		exit(1);
 
-		close(sock);
-	} while(bind_retries--);
+	if (client_name)
+		v_printf("Client name     : '%s'\n", client_name);
+	for (i = 0; i < nr_servers; i++)
+		v_printf("Server name     : '%s' (port %d)\n",
+				servers[i].name, servers[i].statd_port);
+	v_printf("rpc.statd state : %u\n", statd_state);
 
-	if (!bind_retries) {
+	if (!nr_ports)
+		nr_ports = (control || job_fd >= 0) ? NSM_PORT_POOL :
+					MIN(nr_servers, NSM_PORT_POOL);
+	if (nsm_port_pool_init(&ports, nr_ports,
+				local_address ? local_addr : NULL) < 0) {
 		fprintf(stderr, "Failed to bind RPC socket: %s\n",
-			strerror(errno));
+				strerror(errno));
 		exit(1);
 	}
+	if (ports.nr < nr_ports)
+		v_printf("Only %u of %u source ports are free\n", ports.nr,
+							nr_ports);
 
-	memset (&server_info, 0, sizeof(struct server_info));
-	server_info.name = server_name;
-	server_info.statd_port = port;
+	if (control) {
+		result = run_daemon(&ports, control, max_jobs, cache,
+					pmap_cache, statd_state, port);
+		goto out;
+	}
+
+	if (job_fd >= 0) {
+		result = run_bulk(&ports, job_fd, format, max_jobs, cache,
+					pmap_cache, statd_state, port);
+		if (unreadable)
+			result = -1;
+		goto out;
+	}
 
-	result = clear_nfs_locks(sock, &server_info, client_name, statd_state);
+	result = clear_nfs_locks(&ports, servers, nr_servers, client_name,
+								statd_state);
+	if (result < 0 && !port)
+		result = retry_stale_ports(&ports, servers, nr_servers,
+					client_name, statd_state, pmap_cache);
 	if (result < 0)
 		perror("Clearing NFS locks failed.");
 	else
 		v_printf("Clearing NFS locks successfully completed.\n");
 
-error:
-	close(sock);
+out:
+	nsm_port_pool_fini(&ports);
+	free(servers);
 	return result;
 }
@@ -0,0 +1,369 @@
+/*
+ * File lock contention benchmark.
+ *
+ * N processes (or threads, "-T") open the same file each and lock and
+ * unlock byte ranges of it in a loop for a while: classic POSIX locks
+ * (F_SETLKW), open file description ones (F_OFD_SETLKW) and flock(), one
+ * kind after another. Every acquire and release is timed with
+ * clock_gettime() into a histogram (nsm_hist, in nsec), and a line per
+ * kind gives the operations per second and the percentiles of both, so
+ * the same run on a local filesystem and on an NFS mount compares them.
+ *
+ * Contention is set with the number of ranges ("-R") the workers pick
+ * from at random and their length ("-l"): one range, the default, has
+ * all of them fight for the same bytes. flock() always locks the whole
+ * file. POSIX locks belong to the process, so with threads they don't
+ * contend and are skipped.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/wait.h>
+
+#include "nsm_metrics.h"
+#include "nsm_clock.h"
+
+#define BENCH_WORKERS		4
+#define BENCH_MAX_WORKERS	1024
+#define BENCH_SECONDS		2
+#define BENCH_FILE		"lock_bench.dat"
+
+enum {
+	LOCK_FCNTL,
+	LOCK_OFD,
+	LOCK_FLOCK,
+	LOCK_KINDS,
+};
+
+static const char *kind_names[LOCK_KINDS] = { "fcntl", "ofd", "flock" };
+
+/* In shared memory: the workers may be processes */
+struct worker_stats {
+	unsigned long		ops;
+	int			error;		/* errno, which stopped it */
+	struct nsm_hist		acquire;	/* nsec */
+	struct nsm_hist		release;
+};
+
+struct bench {
+	const char *		path;
+	int			kind;
+	unsigned int		ranges;
+	off_t			len;
+	int			shared;		/* read locks */
+	long			hold;		/* nsec to hold the lock */
+	long			duration;	/* nsec of a kind */
+	int			go;		/* pipe the workers wait on */
+	struct worker_stats *	stats;
+};
+
+static struct bench bench;
+
+static int do_lock(int fd, int kind, int type, off_t start, off_t len)
+{
+	struct flock fl = {
+		.l_type		= type,
+		.l_whence	= SEEK_SET,
+		.l_start	= start,
+		.l_len		= len,
+	};
+
+	switch (kind) {
+	case LOCK_FCNTL:
+		return fcntl(fd, F_SETLKW, &fl);
+	case LOCK_OFD:
+		return fcntl(fd, F_OFD_SETLKW, &fl);
+	default:
+		return flock(fd, type == F_UNLCK ? LOCK_UN :
+				type == F_RDLCK ? LOCK_SH : LOCK_EX);
+	}
+}
+
+static void run_worker(unsigned int id)
+{
+	struct worker_stats *ws = &bench.stats[id];
+	unsigned int seed = id + 1;
+	int fd, type = bench.shared ? F_RDLCK : F_WRLCK;
+	long start, end, deadline;
+	off_t offset;
+	char c;
+
+	fd = open(bench.path, O_RDWR);
+	if (fd < 0) {
+		ws->error = errno;
+		return;
+	}
+
+	/* all at once, when the pipe is closed */
+	if (read(bench.go, &c, 1) < 0)
+		c = 0;
+	deadline = nsm_now_nsec() + bench.duration;
+
+	while ((start = nsm_now_nsec()) < deadline) {
+		offset = rand_r(&seed) % bench.ranges * bench.len;
+
+		if (do_lock(fd, bench.kind, type, offset, bench.len) < 0) {
+			ws->error = errno;
+			break;
+		}
+		end = nsm_now_nsec();
+		nsm_hist_add(&ws->acquire, end - start);
+
+		while (bench.hold && nsm_now_nsec() - end < bench.hold)
+			;
+
+		start = nsm_now_nsec();
+		if (do_lock(fd, bench.kind, F_UNLCK, offset, bench.len) < 0) {
+			ws->error = errno;
+			break;
+		}
+		nsm_hist_add(&ws->release, nsm_now_nsec() - start);
+		ws->ops++;
+	}
+	close(fd);
+}
+
+static void *worker_thread(void *arg)
+{
+	run_worker((unsigned long)arg);
+	return NULL;
+}
+
+/*
+ * Run the workers of one kind of locks and sum their stats up in 'total'.
+ */
+static int run_kind(unsigned int nr, int threads, struct worker_stats *total)
+{
+	pthread_t tids[BENCH_MAX_WORKERS];
+	pid_t pids[BENCH_MAX_WORKERS];
+	unsigned int i, started;
+	int fds[2], error = 0;
+
+	memset(bench.stats, 0, nr * sizeof(*bench.stats));
+	if (pipe(fds) < 0)
+		return -errno;
+	bench.go = fds[0];
+
+	for (started = 0; started < nr; started++) {
+		if (threads) {
+			error = pthread_create(&tids[started], NULL,
+				worker_thread, (void *)(unsigned long)started);
+			if (error)
+				break;
+			continue;
+		}
+
+		pids[started] = fork();
+		if (pids[started] < 0) {
+			error = errno;
+			break;
+		}
+		if (!pids[started]) {
+			close(fds[1]);
+			run_worker(started);
+			_exit(0);
+		}
+	}
+
+	close(fds[1]);
+
+	for (i = 0; i < started; i++) {
+		if (threads)
+			pthread_join(tids[i], NULL);
+		else
+			waitpid(pids[i], NULL, 0);
+	}
+	close(fds[0]);
+
+	memset(total, 0, sizeof(*total));
+	for (i = 0; i < started; i++) {
+		total->ops += bench.stats[i].ops;
+		if (bench.stats[i].error && !total->error)
+			total->error = bench.stats[i].error;
+		nsm_hist_merge(&total->acquire, &bench.stats[i].acquire);
+		nsm_hist_merge(&total->release, &bench.stats[i].release);
+	}
+	return error ? -error : 0;
+}
+
+static void report(const char *name, const struct worker_stats *t,
+						double seconds)
+{
+	printf("%-6s %10lu %10.0f %9u %9u %9u %9u %9u %9u %9u", name,
+		t->ops, t->ops / seconds,
+		nsm_hist_quantile(&t->acquire, 0.5),
+		nsm_hist_quantile(&t->acquire, 0.9),
+		nsm_hist_quantile(&t->acquire, 0.99),
+		nsm_hist_quantile(&t->acquire, 0.999), t->acquire.max,
+		nsm_hist_quantile(&t->release, 0.5),
+		nsm_hist_quantile(&t->release, 0.99));
+	if (t->error)
+		printf("  (%s)", strerror(t->error));
+	printf("\n");
+}
+
+static int parse_kinds(const char *s, int *kinds)
+{
+	char *copy = strdup(s), *name, *save = NULL;
+	int i, nr = 0;
+
+	if (!copy)
+		return -1;
+	for (name = strtok_r(copy, ",", &save); name;
+				name = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < LOCK_KINDS; i++)
+			if (!strcmp(name, kind_names[i]))
+				break;
+		if (i == LOCK_KINDS) {
+			fprintf(stderr, "Unknown lock kind: %s\n", name);
+			free(copy);
+			return -1;
+		}
+		if (nr < LOCK_KINDS)
+			kinds[nr++] = i;
+	}
+	free(copy);
+	return nr;
+}
+
+static void help(char *name)
+{
+	printf("Usage: %s [OPTIONS]\n\n", name);
+	printf("\t-f file                   File to lock, created if needed "
+				"(default: %s).\n\n", BENCH_FILE);
+	printf("\t-n workers                Processes, or threads, contending "
+				"(default: %d).\n\n", BENCH_WORKERS);
+	printf("\t-T                        Threads instead of processes.\n\n");
+	printf("\t-k fcntl,ofd,flock        Kinds of locks (default: all of "
+				"them).\n\n");
+	printf("\t-d seconds                Time of every kind (default: %d).\n\n",
+				BENCH_SECONDS);
+	printf("\t-R ranges                 Ranges the workers pick from "
+				"(default: 1, all on the same one).\n\n");
+	printf("\t-l bytes                  Length of a range (default: 1, 0 "
+				"is to the end of file).\n\n");
+	printf("\t-s                        Shared (read) locks instead of "
+				"exclusive ones.\n\n");
+	printf("\t-H usec                   Hold every lock that long "
+				"(default: 0).\n\n");
+	printf("\t-h                        This help.\n\n");
+	printf("Latencies are in nsec, kept up to %.1f seconds.\n",
+				UINT32_MAX / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int workers = BENCH_WORKERS, seconds = BENCH_SECONDS, i;
+	int kinds[LOCK_KINDS] = { LOCK_FCNTL, LOCK_OFD, LOCK_FLOCK };
+	int nr_kinds = LOCK_KINDS, threads = 0, fd, result;
+	struct worker_stats total;
+
+	bench.path = BENCH_FILE;
+	bench.ranges = 1;
+	bench.len = 1;
+
+	while ((result = getopt(argc, argv, "f:n:Tk:d:R:l:sH:h")) != EOF) {
+		switch (result) {
+			case 'f':
+				bench.path = optarg;
+				break;
+			case 'n':
+				workers = atoi(optarg);
+				break;
+			case 'T':
+				threads = 1;
+				break;
+			case 'k':
+				nr_kinds = parse_kinds(optarg, kinds);
+				if (nr_kinds <= 0)
+					exit(2);
+				break;
+			case 'd':
+				seconds = atoi(optarg);
+				break;
+			case 'R':
+				bench.ranges = atoi(optarg);
+				break;
+			case 'l':
+				bench.len = atol(optarg);
+				break;
+			case 's':
+				bench.shared = 1;
+				break;
+			case 'H':
+				bench.hold = atol(optarg) * 1000;
+				break;
+			case 'h':
+				help(argv[0]);
+				exit(0);
+			default:
+				help(argv[0]);
+				exit(2);
+		}
+	}
+
+	if (!workers || workers > BENCH_MAX_WORKERS || !seconds ||
+	    !bench.ranges || bench.len < 0) {
+		fprintf(stderr, "Bad workers, time, ranges or length.\n");
+		exit(2);
+	}
+	bench.duration = seconds * 1000000000L;
+	if (!bench.len && bench.ranges > 1) {
+		fprintf(stderr, "Ranges to the end of file overlap, -R needs "
+				"-l.\n");
+		exit(2);
+	}
+
+	fd = open(bench.path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s: %s\n", bench.path,
+						strerror(errno));
+		exit(1);
+	}
+	close(fd);
+
+	bench.stats = mmap(NULL, workers * sizeof(*bench.stats),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			-1, 0);
+	if (bench.stats == MAP_FAILED) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	printf("%u %s, %u range%s of %ld bytes, %s locks, %u seconds each\n",
+		workers, threads ? "threads" : "processes", bench.ranges,
+		bench.ranges > 1 ? "s" : "", (long)bench.len,
+		bench.shared ? "shared" : "exclusive", seconds);
+	printf("%-6s %10s %10s %9s %9s %9s %9s %9s %9s %9s\n", "kind", "ops",
+		"ops/s", "acq p50", "acq p90", "acq p99", "acq p999",
+		"acq max", "rel p50", "rel p99");
+
+	for (i = 0; i < nr_kinds; i++) {
+		bench.kind = kinds[i];
+		if (threads && bench.kind == LOCK_FCNTL) {
+			printf("%-6s skipped: POSIX locks of threads don't "
+				"conflict\n", kind_names[bench.kind]);
+			continue;
+		}
+
+		result = run_kind(workers, threads, &total);
+		if (result < 0)
+			fprintf(stderr, "Not all workers started: %s\n",
+						strerror(-result));
+		report(kind_names[bench.kind], &total, seconds);
+	}
+
+	munmap(bench.stats, workers * sizeof(*bench.stats));
+	return 0;
+}
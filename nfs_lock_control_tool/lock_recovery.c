@@ -0,0 +1,581 @@
+/*
+ * End-to-end lock recovery latency: how long a client waits for a lock
+ * its dead peer held, when the peer's locks are dropped by notifying the
+ * server on its behalf.
+ *
+ * Every run starts two NFS clients of nlm_client.c on the export of the
+ * local nfsd. The holder takes a write lock of a file like test_lock does
+ * and keeps it, the waiter asks for the same lock with F_SETLKW and blocks.
+ * Then the holder dies: its link is cut and its PID namespace killed, so
+ * it never unlocks. The notifier (clear_nfs_locks, or notify, which takes
+ * the same options) tells the server's statd the holder rebooted, with
+ * the holder's statd state plus 2, the server's lockd drops its locks and
+ * grants the waiter's. The notifier writes its metrics as JSON ("-M"), so
+ * the time from the kill to the grant splits up into:
+ *
+ *	resolve	 name lookups of the notifier ("dns" usec sum),
+ *	portmap	 asking the server's portmapper for statd ("pmap" usec sum),
+ *	notify	 the rest of the notifier's run, mostly SM_NOTIFY and its
+ *		 reply,
+ *	grant	 from the notifier's exit to the waiter's F_SETLKW return,
+ *		 negative if the server granted it before the notifier was
+ *		 done (0 in the percentiles),
+ *
+ * and "kill", cutting the holder off before the notifier starts. A line
+ * per run and the percentiles of every part over all runs are printed.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/wait.h>
+
+#include "nsm_metrics.h"
+#include "nlm_client.h"
+#include "nsm_clock.h"
+
+#define RECOVERY_RUNS		10
+#define RECOVERY_FILE		"lock_recovery.dat"
+#define RECOVERY_SETTLE		500		/* msec */
+#define RECOVERY_TIMEOUT	120		/* seconds */
+#define RECOVERY_NOTIFIER	"./clear_nfs_locks"
+#define RECOVERY_METRICS	"/tmp/lock_recovery.json"
+#define RECOVERY_STATE		"/var/lib/nfs/statd/state"
+#define RECOVERY_HOSTNAMES	"/proc/sys/fs/nfs/nsm_use_hostnames"
+
+enum {
+	PART_KILL,
+	PART_RESOLVE,
+	PART_PORTMAP,
+	PART_NOTIFY,
+	PART_GRANT,
+	PART_TOTAL,
+	PARTS,
+};
+
+static const char *part_names[PARTS] = {
+	"kill", "resolve", "portmap", "notify", "grant", "total",
+};
+
+/* In shared memory: what the clients tell */
+struct recovery_client {
+	int			state;		/* holder's statd state, 0 */
+	long			granted;	/* waiter's, usec */
+	int			error;
+	const char *		stage;		/* where it failed */
+};
+
+struct recovery {
+	struct nlm_client_conf	conf;
+	unsigned int		runs;
+	const char *		notifier;
+	const char *		metrics;
+	long			settle;		/* usec */
+	int			timeout;	/* seconds */
+	int			hostnames;	/* notify with the nodename */
+	int			events[2];	/* a byte per client event */
+	struct recovery_client *shared;		/* holder, waiter */
+	struct nsm_hist		parts[PARTS];	/* usec */
+};
+
+static struct recovery rec;
+
+#define v_printf	if (rec.conf.verbose) printf
+
+static void event(char b)
+{
+	if (write(rec.events[1], &b, 1) < 0)
+		b = 0;
+}
+
+static int client_failed(struct recovery_client *rc, const char *stage)
+{
+	rc->error = errno;
+	rc->stage = stage;
+	event('e');
+	return 1;
+}
+
+static int read_state(void)
+{
+	int fd, state = 0;
+
+	fd = open(RECOVERY_STATE, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (read(fd, &state, sizeof(state)) != sizeof(state))
+		state = 0;
+	close(fd);
+	return state;
+}
+
+static int holder_main(struct nlm_client *c, const char *stage)
+{
+	struct recovery_client *rc = c->data;
+	struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+	char path[PATH_MAX];
+	int fd;
+
+	if (stage)
+		return client_failed(rc, stage);
+	close(rec.events[0]);
+
+	snprintf(path, sizeof(path), "%s/%s", NLM_CLIENT_MNT, RECOVERY_FILE);
+	fd = open(path, O_RDWR | O_CREAT, 0666);
+	if (fd < 0)
+		return client_failed(rc, "open");
+	if (fcntl(fd, F_SETLKW, &fl) < 0)
+		return client_failed(rc, "lock");
+
+	/* statd has the state it tells the server now */
+	rc->state = read_state();
+	event('h');
+
+	/* until it is killed, with the lock */
+	for (;;)
+		pause();
+	return 0;
+}
+
+static int waiter_main(struct nlm_client *c, const char *stage)
+{
+	struct recovery_client *rc = c->data;
+	struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+	char path[PATH_MAX];
+	int fd;
+
+	if (stage)
+		return client_failed(rc, stage);
+	close(rec.events[0]);
+
+	snprintf(path, sizeof(path), "%s/%s", NLM_CLIENT_MNT, RECOVERY_FILE);
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		return client_failed(rc, "open");
+
+	/* the holder has it, or there is nothing to wait for */
+	if (fcntl(fd, F_GETLK, &fl) < 0)
+		return client_failed(rc, "test");
+	if (fl.l_type == F_UNLCK) {
+		errno = EAGAIN;
+		return client_failed(rc, "not locked");
+	}
+
+	fl.l_type = F_WRLCK;
+	event('w');
+	if (fcntl(fd, F_SETLKW, &fl) < 0)
+		return client_failed(rc, "lock");
+	rc->granted = nsm_now_usec();
+	event('g');
+	return 0;
+}
+
+/*
+ * Wait for the event 'what' of a client. Returns 0, -EIO if a client
+ * failed or -ETIMEDOUT.
+ */
+static int wait_event(char what, int seconds)
+{
+	struct pollfd pfd = { .fd = rec.events[0], .events = POLLIN };
+	long deadline = nsm_now_usec() + seconds * 1000000L, left;
+	char b;
+
+	while ((left = deadline - nsm_now_usec()) > 0) {
+		if (poll(&pfd, 1, left / 1000 + 1) <= 0)
+			continue;
+		if (read(rec.events[0], &b, 1) != 1 || b == 'e')
+			return -EIO;
+		if (b == what)
+			return 0;
+	}
+	return -ETIMEDOUT;
+}
+
+/*
+ * The sum of the histogram 'name' ("dns" or "pmap") of the notifier's
+ * JSON metrics, 0 if it has none.
+ */
+static long metrics_sum(const char *json, const char *name)
+{
+	char key[32];
+	const char *p;
+
+	snprintf(key, sizeof(key), "\"%s\":", name);
+	p = strstr(json, key);
+	if (!p || !(p = strstr(p, "\"sum\":")))
+		return 0;
+	return atol(p + strlen("\"sum\":"));
+}
+
+static int read_metrics(long *resolve, long *portmap)
+{
+	char json[16384];
+	ssize_t len;
+	int fd;
+
+	*resolve = *portmap = 0;
+	fd = open(rec.metrics, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	len = read(fd, json, sizeof(json) - 1);
+	close(fd);
+	if (len < 0)
+		return -EIO;
+	json[len] = 0;
+
+	*resolve = metrics_sum(json, "dns");
+	*portmap = metrics_sum(json, "pmap");
+	return 0;
+}
+
+/*
+ * Notify the server the holder rebooted. Returns the exit status of the
+ * notifier or -1.
+ */
+static int notify(const struct nlm_client *holder, int state)
+{
+	char name[64], state_arg[16];
+	const char *argv[16];
+	int argc = 0, status;
+	pid_t pid;
+
+	/* the name the server's statd monitors the holder by */
+	if (rec.hostnames)
+		snprintf(name, sizeof(name), "%s", holder->name);
+	else
+		nlm_client_addr(name, sizeof(name), holder->id);
+
+	argv[argc++] = rec.notifier;
+	argv[argc++] = "-c";
+	argv[argc++] = name;
+	argv[argc++] = "-s";
+	argv[argc++] = NLM_CLIENT_SERVER;
+	if (state) {
+		/* odd, the holder is up again */
+		snprintf(state_arg, sizeof(state_arg), "%d", (state | 1) + 2);
+		argv[argc++] = "-i";
+		argv[argc++] = state_arg;
+	}
+	/* a fresh lookup every run */
+	argv[argc++] = "-C";
+	argv[argc++] = "";
+	argv[argc++] = "-P";
+	argv[argc++] = "";
+	argv[argc++] = "-M";
+	argv[argc++] = rec.metrics;
+	if (rec.conf.verbose)
+		argv[argc++] = "-v";
+	argv[argc] = NULL;
+
+	unlink(rec.metrics);
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0)
+		return -1;
+	if (!pid) {
+		close(rec.events[0]);
+		close(rec.events[1]);
+		execvp(argv[0], (char **)argv);
+		fprintf(stderr, "Failed to run %s: %s\n", argv[0],
+							strerror(errno));
+		_exit(127);
+	}
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+		return -1;
+	return WEXITSTATUS(status);
+}
+
+static void report_client(unsigned int run, const char *who,
+					const struct recovery_client *rc)
+{
+	fprintf(stderr, "Run %u: %s %s failed: %s\n", run, who,
+			rc->stage ? rc->stage : "start", strerror(rc->error));
+}
+
+/*
+ * Kill the client, and reap it if it goes within a second: one whose
+ * mount hangs on the server it can't reach any more is left behind.
+ */
+static void client_kill(struct nlm_client *c)
+{
+	int i;
+
+	if (c->pid <= 0)
+		return;
+	kill(c->pid, SIGKILL);
+	for (i = 0; i < 100; i++) {
+		if (waitpid(c->pid, NULL, WNOHANG))
+			return;
+		usleep(10000);
+	}
+	v_printf("Client %s is still exiting\n", c->name);
+}
+
+/*
+ * One run. Returns 0 with the parts in 'parts', or -1.
+ */
+static int run_once(unsigned int run, void *stack, long *parts)
+{
+	struct recovery_client *rc = rec.shared;
+	struct nlm_client holder, waiter;
+	long t0, t1, t2;
+	int result = -1, status;
+	char b;
+
+	memset(rc, 0, 2 * sizeof(*rc));
+	memset(&holder, 0, sizeof(holder));
+	memset(&waiter, 0, sizeof(waiter));
+	holder.pid = waiter.pid = -1;
+
+	/* fresh names and addresses, the old ones may still be going */
+	holder.id = 2 * run;
+	snprintf(holder.name, sizeof(holder.name), "nlm-holder-%u", run);
+	holder.conf = &rec.conf;
+	holder.fn = holder_main;
+	holder.data = &rc[0];
+	waiter.id = 2 * run + 1;
+	snprintf(waiter.name, sizeof(waiter.name), "nlm-waiter-%u", run);
+	waiter.conf = &rec.conf;
+	waiter.fn = waiter_main;
+	waiter.data = &rc[1];
+
+	status = nlm_client_start(&holder, stack);
+	if (status < 0 || wait_event('h', rec.timeout) < 0) {
+		if (status < 0)
+			rc[0].error = -status;
+		report_client(run, "holder", &rc[0]);
+		goto out;
+	}
+	v_printf("Run %u: %s holds the lock, statd state %d\n", run,
+						holder.name, rc[0].state);
+
+	status = nlm_client_start(&waiter, stack);
+	if (status < 0 || wait_event('w', rec.timeout) < 0) {
+		if (status < 0)
+			rc[1].error = -status;
+		report_client(run, "waiter", &rc[1]);
+		goto out;
+	}
+	/* F_SETLKW gets to the server and blocks there */
+	usleep(rec.settle);
+
+	t0 = nsm_now_usec();
+	nlm_client_cut(&holder);
+	kill(holder.pid, SIGKILL);
+	t1 = nsm_now_usec();
+	status = notify(&holder, rc[0].state);
+	t2 = nsm_now_usec();
+	if (status) {
+		fprintf(stderr, "Run %u: %s failed (%d)\n", run, rec.notifier,
+								status);
+		goto out;
+	}
+
+	if (wait_event('g', rec.timeout) < 0) {
+		if (!rc[1].stage) {
+			rc[1].stage = "grant";
+			rc[1].error = ETIMEDOUT;
+		}
+		report_client(run, "waiter", &rc[1]);
+		goto out;
+	}
+
+	parts[PART_KILL] = t1 - t0;
+	read_metrics(&parts[PART_RESOLVE], &parts[PART_PORTMAP]);
+	parts[PART_NOTIFY] = t2 - t1 - parts[PART_RESOLVE] -
+						parts[PART_PORTMAP];
+	if (parts[PART_NOTIFY] < 0)
+		parts[PART_NOTIFY] = 0;
+	parts[PART_GRANT] = rc[1].granted - t2;
+	parts[PART_TOTAL] = rc[1].granted - t0;
+	result = 0;
+out:
+	client_kill(&waiter);
+	client_kill(&holder);
+	/* the events of this run */
+	while (poll(&(struct pollfd){ .fd = rec.events[0], .events = POLLIN },
+							1, 0) > 0)
+		if (read(rec.events[0], &b, 1) != 1)
+			break;
+	return result;
+}
+
+static int use_hostnames(void)
+{
+	char b = '0';
+	int fd;
+
+	fd = open(RECOVERY_HOSTNAMES, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (read(fd, &b, 1) != 1)
+		b = '0';
+	close(fd);
+	return b == '1';
+}
+
+static void help(char *name)
+{
+	printf("Usage: %s -e export [OPTIONS]\n\n", name);
+	printf("\t-e export                 Path the local nfsd exports to "
+				"%s.0.0/16.\n\n", NLM_CLIENT_NET);
+	printf("\t-r runs                   Runs (default: %d).\n\n",
+				RECOVERY_RUNS);
+	printf("\t-N notifier               clear_nfs_locks or notify binary "
+				"(default: %s).\n\n", RECOVERY_NOTIFIER);
+	printf("\t-M metrics_file           Where the notifier writes its "
+				"JSON metrics (default: %s).\n\n",
+				RECOVERY_METRICS);
+	printf("\t-s msec                   Time for the waiter's lock to block "
+				"on the server (default: %d).\n\n",
+				RECOVERY_SETTLE);
+	printf("\t-t seconds                Give up on a client after that "
+				"(default: %d).\n\n", RECOVERY_TIMEOUT);
+	printf("\t-n                        Notify with the holder's nodename "
+				"instead of its address.\n");
+	printf("\t                          The default follows "
+				"fs.nfs.nsm_use_hostnames.\n\n");
+	printf("\t-o options                More NFS mount options, e.g. "
+				"\"proto=udp\".\n\n");
+	printf("\t-B command                Starts rpcbind in a client "
+				"(default: \"rpcbind -w\", \"\" for none).\n\n");
+	printf("\t-S command                Starts rpc.statd in a client "
+				"(default: \"rpc.statd --no-notify\").\n\n");
+	printf("\t-v                        Be verbose: print work progress"
+				"\n\n");
+	printf("\t-h                        This help.\n\n");
+	printf("Needs root. The clients get %s.0.2 and up on bridge %s, "
+				"which has %s.\n", NLM_CLIENT_NET,
+				NLM_CLIENT_BRIDGE, NLM_CLIENT_SERVER);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i, done = 0;
+	long parts[PARTS];
+	void *stack;
+	int result, k;
+
+	rec.runs = RECOVERY_RUNS;
+	rec.notifier = RECOVERY_NOTIFIER;
+	rec.metrics = RECOVERY_METRICS;
+	rec.settle = RECOVERY_SETTLE * 1000L;
+	rec.timeout = RECOVERY_TIMEOUT;
+	rec.hostnames = use_hostnames();
+	rec.conf.options = "";
+	rec.conf.rpcbind = "rpcbind -w";
+	rec.conf.statd = "rpc.statd --no-notify";
+
+	while ((result = getopt(argc, argv, "e:r:N:M:s:t:no:B:S:vh")) != EOF) {
+		switch (result) {
+			case 'e':
+				rec.conf.export = optarg;
+				break;
+			case 'r':
+				rec.runs = atoi(optarg);
+				break;
+			case 'N':
+				rec.notifier = optarg;
+				break;
+			case 'M':
+				rec.metrics = optarg;
+				break;
+			case 's':
+				rec.settle = atol(optarg) * 1000;
+				break;
+			case 't':
+				rec.timeout = atoi(optarg);
+				break;
+			case 'n':
+				rec.hostnames = 1;
+				break;
+			case 'o':
+				rec.conf.options = optarg;
+				break;
+			case 'B':
+				rec.conf.rpcbind = optarg;
+				break;
+			case 'S':
+				rec.conf.statd = optarg;
+				break;
+			case 'v':
+				rec.conf.verbose = 1;
+				break;
+			case 'h':
+				help(argv[0]);
+				exit(0);
+			default:
+				help(argv[0]);
+				exit(2);
+		}
+	}
+
+	if (!rec.conf.export) {
+		fprintf(stderr, "You must specify the export.\n");
+		help(argv[0]);
+		exit(2);
+	}
+	if (!rec.runs || rec.runs > 16000 || rec.settle < 0 ||
+	    rec.timeout <= 0) {
+		fprintf(stderr, "Bad runs, settle time or timeout.\n");
+		exit(2);
+	}
+
+	rec.shared = mmap(NULL, 2 * sizeof(*rec.shared),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			-1, 0);
+	stack = malloc(NLM_CLIENT_STACK);
+	if (rec.shared == MAP_FAILED || !stack ||
+	    pipe2(rec.events, O_CLOEXEC) < 0) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	if (nlm_client_bridge(&rec.conf) < 0)
+		exit(1);
+
+	printf("%5s", "run");
+	for (k = 0; k < PARTS; k++)
+		printf(" %9s", part_names[k]);
+	printf("\n");
+
+	for (i = 0; i < rec.runs; i++) {
+		if (run_once(i, stack, parts) < 0)
+			continue;
+		printf("%5u", i);
+		for (k = 0; k < PARTS; k++) {
+			printf(" %9ld", parts[k]);
+			nsm_hist_add(&rec.parts[k], parts[k]);
+		}
+		printf("\n");
+		fflush(stdout);
+		done++;
+	}
+
+	if (done) {
+		printf("\n%-9s %9s %9s %9s %9s %9s\n", "usec", "min", "p50",
+						"p90", "p99", "max");
+		for (k = 0; k < PARTS; k++)
+			printf("%-9s %9u %9u %9u %9u %9u\n", part_names[k],
+				rec.parts[k].min,
+				nsm_hist_quantile(&rec.parts[k], 0.5),
+				nsm_hist_quantile(&rec.parts[k], 0.9),
+				nsm_hist_quantile(&rec.parts[k], 0.99),
+				rec.parts[k].max);
+	}
+	printf("%u of %u runs recovered\n", done, rec.runs);
+
+	nlm_client_bridge_del(&rec.conf);
+	munmap(rec.shared, 2 * sizeof(*rec.shared));
+	free(stack);
+	return done ? 0 : 1;
+}
@@ -0,0 +1,1063 @@
+/*
+ * Lock inventory: /proc/locks indexed, joined to what holds the locks, and
+ * diffed between snapshots.
+ *
+ * /proc/locks is read in 64k chunks and parsed in place in one pass,
+ * entries going to an array, which only grows, so a snapshot of hundreds
+ * of thousands of locks costs no allocation per line. Blocked requests
+ * ("->") are tied to the lock they wait on. The entries are indexed by
+ * device and inode and by pid (hash chains through the array), and every
+ * pid holding locks is joined once: the paths of its open files matching
+ * the locked inodes, its container (envID of /proc/<pid>/status, or its
+ * cgroup), its nodename (from its UTS namespace) and the mounts the locks
+ * are on (from its mountinfo, read once per mount namespace).
+ *
+ * With "-n snapshots", /proc/locks is read every "-i seconds" and matched
+ * against the previous snapshot, so a lock has an age: when it was first
+ * seen. The locks of the last snapshot are printed as CSV with flags:
+ *
+ *	long	held for "-a seconds" or longer,
+ *	stuck	others wait for it,
+ *	orphan	its pid is no process here: its holder is gone, or it is
+ *		held for a remote client (lockd on an NFS server).
+ *
+ * "-o jobs" prints clear_nfs_locks job lines instead: the nodename and
+ * the server of every flagged lock on an NFSv2/v3 mount, once each.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/utsname.h>
+
+#define INDEX_LOCKS		"/proc/locks"
+#define INDEX_CHUNK		(64 << 10)
+#define INDEX_AGE		60		/* seconds */
+#define INDEX_INTERVAL		10
+#define INDEX_DEPTH		16		/* of "->" chains */
+#define INDEX_EOF		UINT64_MAX
+
+enum {
+	FLAG_LONG	= 1,
+	FLAG_STUCK	= 2,
+	FLAG_ORPHAN	= 4,
+};
+
+static const char *kind_names[] = {
+	"POSIX", "FLOCK", "OFDLCK", "LEASE", "DELEG", "ACCESS", "?",
+};
+#define KIND_UNKNOWN	(sizeof(kind_names) / sizeof(kind_names[0]) - 1)
+
+static const char *access_names[] = {
+	"READ", "WRITE", "UNLCK", "NONE", "RW", "?",
+};
+#define ACCESS_UNKNOWN	(sizeof(access_names) / sizeof(access_names[0]) - 1)
+
+struct lock_entry {
+	unsigned int		id;		/* of /proc/locks */
+	unsigned char		kind;
+	unsigned char		access;
+	unsigned char		depth;		/* 0 holds, waits otherwise */
+	unsigned char		flags;
+	int			pid;
+	dev_t			dev;
+	uint64_t		ino;
+	uint64_t		start;
+	uint64_t		end;		/* INDEX_EOF */
+	int			blocker;	/* entry it waits on, -1 */
+	unsigned int		waiters;
+	long			first;		/* seen, seconds */
+	int			next_inode;	/* index chains, -1 */
+	int			next_pid;
+	unsigned char		joined;
+	unsigned char		dead;		/* pid is no process */
+	unsigned char		checked;
+	/* string pool offsets, 0 is "" */
+	unsigned int		path;
+	unsigned int		ctid;
+	unsigned int		node;
+	unsigned int		fstype;
+	unsigned int		source;
+};
+
+struct snapshot {
+	struct lock_entry *	entries;
+	unsigned int		nr;
+	unsigned int		size;
+	int *			inode_heads;
+	int *			pid_heads;
+	unsigned int		mask;		/* of the heads */
+};
+
+/* For matching the locks of a snapshot to the previous one */
+struct track {
+	dev_t			dev;
+	uint64_t		ino;
+	uint64_t		start;
+	uint64_t		end;
+	int			pid;
+	unsigned char		kind;
+	unsigned char		access;
+	unsigned char		depth;
+	unsigned int		count;		/* of the same lock, 0 is free */
+	unsigned int		left;		/* not matched yet */
+	long			first;
+};
+
+struct track_table {
+	struct track *		slots;
+	unsigned int		mask;
+	unsigned int		nr;
+};
+
+struct mount_rec {
+	dev_t			dev;
+	unsigned int		fstype;
+	unsigned int		source;
+};
+
+/* Mount and UTS namespaces already read */
+struct ns_rec {
+	ino_t			ns;
+	unsigned int		first;		/* mount_recs, or node */
+	unsigned int		nr;
+};
+
+static struct snapshot snap;
+static struct track_table tracks, old_tracks;
+
+static char *pool;
+static size_t pool_len, pool_size;
+
+static struct mount_rec *mounts;
+static unsigned int nr_mounts, mounts_size;
+static struct ns_rec *mnt_ns, *uts_ns;
+static unsigned int nr_mnt_ns, nr_uts_ns, mnt_ns_size, uts_ns_size;
+static int self_uts = -1;
+
+static int verbose;
+static int do_join = 1;
+
+#define v_printf	if (verbose) printf
+
+static void *grow(void *array, unsigned int *size, unsigned int need,
+						size_t elem)
+{
+	unsigned int n = *size ? *size : 64;
+	void *p;
+
+	if (need <= *size)
+		return array;
+	while (n < need)
+		n *= 2;
+	p = realloc(array, (size_t)n * elem);
+	if (!p) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	*size = n;
+	return p;
+}
+
+static unsigned int pool_add(const char *s, size_t len)
+{
+	size_t off = pool_len;
+	char *p;
+
+	if (!len)
+		return 0;
+	if (pool_len + len + 1 > pool_size) {
+		pool_size = pool_size ? pool_size : 65536;
+		while (pool_len + len + 1 > pool_size)
+			pool_size *= 2;
+		p = realloc(pool, pool_size);
+		if (!p) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		pool = p;
+	}
+	memcpy(pool + pool_len, s, len);
+	pool[pool_len + len] = 0;
+	pool_len += len + 1;
+	return off;
+}
+
+static void pool_reset(void)
+{
+	/* offset 0 is the empty string */
+	pool_len = 0;
+	pool_add("", 1);
+}
+
+static inline const char *str(unsigned int off)
+{
+	return pool + off;
+}
+
+/*
+ * /proc/locks parsing, in place.
+ */
+
+static const char *next_word(const char **s, const char *end, size_t *len)
+{
+	const char *w;
+
+	while (*s < end && (**s == ' ' || **s == '\t'))
+		(*s)++;
+	w = *s;
+	while (*s < end && **s != ' ' && **s != '\t')
+		(*s)++;
+	*len = *s - w;
+	return w;
+}
+
+static int word_index(const char *w, size_t len, const char **names,
+							unsigned int unknown)
+{
+	unsigned int i;
+
+	for (i = 0; i < unknown; i++)
+		if (strlen(names[i]) == len && !memcmp(names[i], w, len))
+			return i;
+	return unknown;
+}
+
+static uint64_t parse_num(const char *w, size_t len, int base, int *bad)
+{
+	uint64_t v = 0;
+	size_t i;
+	int d;
+
+	if (!len)
+		*bad = 1;
+	for (i = 0; i < len; i++) {
+		if (w[i] >= '0' && w[i] <= '9')
+			d = w[i] - '0';
+		else if (base == 16 && w[i] >= 'a' && w[i] <= 'f')
+			d = w[i] - 'a' + 10;
+		else {
+			*bad = 1;
+			break;
+		}
+		v = v * base + d;
+	}
+	return v;
+}
+
+/*
+ * "1: -> POSIX  ADVISORY  WRITE 1234 00:2e:5678 0 EOF", the arrows, one
+ * per level, for blocked requests. Returns 0 or -1 if it isn't one.
+ */
+static int parse_line(const char *s, const char *end, struct lock_entry *e)
+{
+	const char *w;
+	size_t len;
+	int bad = 0;
+	int neg;
+
+	memset(e, 0, sizeof(*e));
+	e->blocker = -1;
+
+	w = next_word(&s, end, &len);
+	if (!len || w[len - 1] != ':')
+		return -1;
+	e->id = parse_num(w, len - 1, 10, &bad);
+
+	for (;;) {
+		w = next_word(&s, end, &len);
+		if (len != 2 || memcmp(w, "->", 2))
+			break;
+		e->depth++;
+	}
+	e->kind = word_index(w, len, kind_names, KIND_UNKNOWN);
+
+	next_word(&s, end, &len);		/* ADVISORY, ACTIVE, ... */
+	w = next_word(&s, end, &len);
+	e->access = word_index(w, len, access_names, ACCESS_UNKNOWN);
+
+	w = next_word(&s, end, &len);
+	neg = len && *w == '-';
+	e->pid = parse_num(w + neg, len - neg, 10, &bad);
+	if (neg)
+		e->pid = -e->pid;
+
+	/* "maj:min:ino" in hex, hex, decimal or "<none>:0" */
+	w = next_word(&s, end, &len);
+	if (len && *w != '<') {
+		const char *c1 = memchr(w, ':', len), *c2;
+		unsigned int major, minor;
+
+		c2 = c1 ? memchr(c1 + 1, ':', w + len - c1 - 1) : NULL;
+		if (!c2)
+			return -1;
+		major = parse_num(w, c1 - w, 16, &bad);
+		minor = parse_num(c1 + 1, c2 - c1 - 1, 16, &bad);
+		e->dev = makedev(major, minor);
+		e->ino = parse_num(c2 + 1, w + len - c2 - 1, 10, &bad);
+	}
+
+	w = next_word(&s, end, &len);
+	e->start = parse_num(w, len, 10, &bad);
+	w = next_word(&s, end, &len);
+	if (len == 3 && !memcmp(w, "EOF", 3))
+		e->end = INDEX_EOF;
+	else
+		e->end = parse_num(w, len, 10, &bad);
+	return bad ? -1 : 0;
+}
+
+static void add_entry(const struct lock_entry *e, int *stack)
+{
+	struct lock_entry *n;
+	unsigned int depth = MIN(e->depth, INDEX_DEPTH - 1);
+
+	snap.entries = grow(snap.entries, &snap.size, snap.nr + 1,
+						sizeof(*snap.entries));
+	n = &snap.entries[snap.nr];
+	*n = *e;
+
+	/* a blocked request follows what it waits on, one level up */
+	if (depth && stack[depth - 1] >= 0) {
+		n->blocker = stack[depth - 1];
+		snap.entries[n->blocker].waiters++;
+	}
+	stack[depth] = snap.nr;
+	if (depth + 1 < INDEX_DEPTH)
+		stack[depth + 1] = -1;
+	snap.nr++;
+}
+
+/*
+ * Read the whole file in one pass. Returns the number of lines, which
+ * weren't locks, or negative errno.
+ */
+static int read_locks(const char *path)
+{
+	static char buf[INDEX_CHUNK];
+	int stack[INDEX_DEPTH], fd, bad = 0;
+	size_t have = 0;
+	struct lock_entry e;
+	char *line, *nl;
+	ssize_t len;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	snap.nr = 0;
+	stack[0] = -1;
+	while ((len = read(fd, buf + have, sizeof(buf) - have)) > 0) {
+		have += len;
+		line = buf;
+		while ((nl = memchr(line, '\n', buf + have - line))) {
+			if (parse_line(line, nl, &e) < 0)
+				bad++;
+			else
+				add_entry(&e, stack);
+			line = nl + 1;
+		}
+		/* the rest of a line comes with the next chunk */
+		have = buf + have - line;
+		memmove(buf, line, have);
+		if (have == sizeof(buf)) {
+			bad++;
+			have = 0;
+		}
+	}
+	if (len < 0) {
+		len = -errno;
+		close(fd);
+		return len;
+	}
+	close(fd);
+	return bad;
+}
+
+/*
+ * Indexes.
+ */
+
+static unsigned int hash_inode(dev_t dev, uint64_t ino)
+{
+	uint64_t h = (ino ^ ((uint64_t)dev << 32)) * 0x9e3779b97f4a7c15ULL;
+
+	return h >> 32;
+}
+
+static unsigned int hash_pid(int pid)
+{
+	return (unsigned int)pid * 0x9e3779b1U;
+}
+
+static void build_index(void)
+{
+	unsigned int i, size = 64, old = snap.mask + 1;
+	struct lock_entry *e;
+	int *p;
+
+	while (size < 2 * snap.nr)
+		size *= 2;
+	if (size > old || !snap.inode_heads) {
+		snap.inode_heads = realloc(snap.inode_heads,
+					size * sizeof(*snap.inode_heads));
+		snap.pid_heads = realloc(snap.pid_heads,
+					size * sizeof(*snap.pid_heads));
+		if (!snap.inode_heads || !snap.pid_heads) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		snap.mask = size - 1;
+	}
+	memset(snap.inode_heads, 0xff,
+			(snap.mask + 1) * sizeof(*snap.inode_heads));
+	memset(snap.pid_heads, 0xff, (snap.mask + 1) * sizeof(*snap.pid_heads));
+
+	for (i = 0; i < snap.nr; i++) {
+		e = &snap.entries[i];
+		p = &snap.inode_heads[hash_inode(e->dev, e->ino) & snap.mask];
+		e->next_inode = *p;
+		*p = i;
+		p = &snap.pid_heads[hash_pid(e->pid) & snap.mask];
+		e->next_pid = *p;
+		*p = i;
+	}
+}
+
+#define for_each_inode(e, i, d, n)					\
+	for (i = snap.inode_heads[hash_inode(d, n) & snap.mask];	\
+	     i >= 0 && ((e) = &snap.entries[i]); i = (e)->next_inode)	\
+		if ((e)->dev == (d) && (e)->ino == (n))
+
+#define for_each_pid(e, i, p)						\
+	for (i = snap.pid_heads[hash_pid(p) & snap.mask];		\
+	     i >= 0 && ((e) = &snap.entries[i]); i = (e)->next_pid)	\
+		if ((e)->pid == (p))
+
+/*
+ * Joins: what the holders of the locks are.
+ */
+
+static ssize_t read_file(const char *path, char *buf, size_t size)
+{
+	ssize_t len, total = 0;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	while (total < size - 1 &&
+	       (len = read(fd, buf + total, size - 1 - total)) > 0)
+		total += len;
+	close(fd);
+	buf[total] = 0;
+	return total;
+}
+
+static void join_paths(int pid)
+{
+	char dir[64], link[PATH_MAX + 64], target[PATH_MAX];
+	struct lock_entry *e;
+	struct dirent *de;
+	struct stat st;
+	unsigned int off;
+	ssize_t len;
+	DIR *d;
+	int i;
+
+	snprintf(dir, sizeof(dir), "/proc/%d/fd", pid);
+	d = opendir(dir);
+	if (!d)
+		return;
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(link, sizeof(link), "%s/%s", dir, de->d_name);
+		if (stat(link, &st) < 0)
+			continue;
+		off = 0;
+		for_each_inode(e, i, st.st_dev, st.st_ino) {
+			if (e->path || (e->pid != pid && e->pid > 0))
+				continue;
+			if (!off) {
+				len = readlink(link, target, sizeof(target));
+				if (len <= 0)
+					break;
+				off = pool_add(target, len);
+			}
+			e->path = off;
+		}
+	}
+	closedir(d);
+}
+
+static unsigned int container_id(int pid)
+{
+	char path[64], buf[8192], *p, *nl, *slash;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	if (read_file(path, buf, sizeof(buf)) > 0 &&
+	    (p = strstr(buf, "\nenvID:"))) {
+		p += strlen("\nenvID:");
+		p += strspn(p, " \t");
+		return pool_add(p, strcspn(p, "\n"));
+	}
+
+	/* the cgroup v2 line, or the first one */
+	snprintf(path, sizeof(path), "/proc/%d/cgroup", pid);
+	if (read_file(path, buf, sizeof(buf)) <= 0)
+		return 0;
+	p = strstr(buf, "0::");
+	if (!p || (p != buf && p[-1] != '\n'))
+		p = buf;
+	nl = strchr(p, '\n');
+	if (nl)
+		*nl = 0;
+	slash = strrchr(p, '/');
+	if (!slash || !slash[1])
+		return pool_add("-", 1);
+	return pool_add(slash + 1, strlen(slash + 1));
+}
+
+static ino_t ns_ino(int pid, const char *ns)
+{
+	char path[64];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "/proc/%d/ns/%s", pid, ns);
+	return stat(path, &st) < 0 ? 0 : st.st_ino;
+}
+
+static struct ns_rec *ns_find(struct ns_rec *recs, unsigned int nr, ino_t ns)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++)
+		if (recs[i].ns == ns)
+			return &recs[i];
+	return NULL;
+}
+
+/*
+ * The nodename in the UTS namespace of the pid: that's the name its
+ * lockd and statd go by.
+ */
+static unsigned int nodename(int pid)
+{
+	struct utsname u;
+	struct ns_rec *r;
+	char path[64];
+	ino_t ns;
+	int fd;
+
+	ns = ns_ino(pid, "uts");
+	if (!ns)
+		return 0;
+	r = ns_find(uts_ns, nr_uts_ns, ns);
+	if (r)
+		return r->first;
+
+	uts_ns = grow(uts_ns, &uts_ns_size, nr_uts_ns + 1, sizeof(*uts_ns));
+	r = &uts_ns[nr_uts_ns++];
+	r->ns = ns;
+	r->first = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/ns/uts", pid);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (setns(fd, CLONE_NEWUTS) == 0) {
+		if (uname(&u) == 0)
+			r->first = pool_add(u.nodename, strlen(u.nodename));
+		if (setns(self_uts, CLONE_NEWUTS) < 0) {
+			fprintf(stderr, "Failed to get back to own UTS "
+					"namespace: %s\n", strerror(errno));
+			exit(1);
+		}
+	} else
+		v_printf("No nodename of pid %d: %s\n", pid, strerror(errno));
+	close(fd);
+	return r->first;
+}
+
+/*
+ * The mounts of the pid's mount namespace, read once per namespace:
+ * "36 35 98:0 /root /mnt opts - nfs server:/export opts".
+ */
+static struct ns_rec *mount_table(int pid)
+{
+	static char buf[1 << 20];
+	char path[64], *line, *nl, *sep, *f;
+	unsigned int major, minor;
+	struct mount_rec *m;
+	struct ns_rec *r;
+	ino_t ns;
+
+	ns = ns_ino(pid, "mnt");
+	if (!ns)
+		return NULL;
+	r = ns_find(mnt_ns, nr_mnt_ns, ns);
+	if (r)
+		return r;
+
+	mnt_ns = grow(mnt_ns, &mnt_ns_size, nr_mnt_ns + 1, sizeof(*mnt_ns));
+	r = &mnt_ns[nr_mnt_ns++];
+	r->ns = ns;
+	r->first = nr_mounts;
+	r->nr = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/mountinfo", pid);
+	if (read_file(path, buf, sizeof(buf)) <= 0)
+		return r;
+	for (line = buf; *line; line = nl + 1) {
+		nl = strchr(line, '\n');
+		if (!nl)
+			break;
+		*nl = 0;
+		sep = strstr(line, " - ");
+		if (!sep || sscanf(line, "%*u %*u %u:%u", &major, &minor) != 2)
+			continue;
+
+		mounts = grow(mounts, &mounts_size, nr_mounts + 1,
+							sizeof(*mounts));
+		m = &mounts[nr_mounts++];
+		m->dev = makedev(major, minor);
+		f = sep + 3;
+		m->fstype = pool_add(f, strcspn(f, " "));
+		f += strcspn(f, " ");
+		f += strspn(f, " ");
+		m->source = pool_add(f, strcspn(f, " "));
+		r->nr++;
+	}
+	return r;
+}
+
+static const struct mount_rec *find_mount(const struct ns_rec *r, dev_t dev)
+{
+	unsigned int i;
+
+	for (i = r->first; i < r->first + r->nr; i++)
+		if (mounts[i].dev == dev)
+			return &mounts[i];
+	return NULL;
+}
+
+static void join_pid(int pid)
+{
+	unsigned int ctid, node;
+	const struct mount_rec *m;
+	struct lock_entry *e;
+	struct ns_rec *r;
+	int i;
+
+	join_paths(pid);
+	ctid = container_id(pid);
+	node = nodename(pid);
+	r = mount_table(pid);
+
+	for_each_pid(e, i, pid) {
+		e->joined = 1;
+		e->ctid = ctid;
+		e->node = node;
+		if (r && (m = find_mount(r, e->dev))) {
+			e->fstype = m->fstype;
+			e->source = m->source;
+		}
+	}
+}
+
+static void join(void)
+{
+	struct lock_entry *e;
+	unsigned int i;
+
+	/* the namespaces may have changed since the last snapshot */
+	pool_reset();
+	nr_mounts = nr_mnt_ns = nr_uts_ns = 0;
+
+	for (i = 0; i < snap.nr; i++) {
+		e = &snap.entries[i];
+		if (e->joined || e->pid <= 0 || e->dead)
+			continue;
+		join_pid(e->pid);
+	}
+}
+
+/*
+ * Snapshot diffing.
+ */
+
+static unsigned int hash_track(const struct track *t)
+{
+	return hash_inode(t->dev, t->ino ^ t->start ^ ((uint64_t)t->pid << 16) ^
+					t->end) ^ (t->kind << 8 | t->access);
+}
+
+static void track_key(struct track *t, const struct lock_entry *e)
+{
+	memset(t, 0, sizeof(*t));
+	t->dev = e->dev;
+	t->ino = e->ino;
+	t->start = e->start;
+	t->end = e->end;
+	t->pid = e->pid;
+	t->kind = e->kind;
+	t->access = e->access;
+	t->depth = e->depth;
+}
+
+static int track_equal(const struct track *a, const struct track *b)
+{
+	return a->dev == b->dev && a->ino == b->ino &&
+		a->start == b->start && a->end == b->end &&
+		a->pid == b->pid && a->kind == b->kind &&
+		a->access == b->access && a->depth == b->depth;
+}
+
+static struct track *track_find(struct track_table *tt,
+					const struct track *key)
+{
+	struct track *t;
+	unsigned int h;
+
+	for (h = hash_track(key) & tt->mask; (t = &tt->slots[h])->count;
+						h = (h + 1) & tt->mask)
+		if (track_equal(t, key))
+			return t;
+	return t;
+}
+
+/*
+ * Match the snapshot to the previous one: the locks, which were there,
+ * keep their age. The same lock twice (waiters may be) is one slot with
+ * a count. Counts the new and the gone ones.
+ */
+static void diff(long now, unsigned int *added, unsigned int *gone)
+{
+	struct track_table swap;
+	struct track key, *t;
+	unsigned int i, size = 64, matched = 0;
+	int is_new;
+
+	swap = old_tracks;
+	old_tracks = tracks;
+	tracks = swap;
+
+	while (size < 2 * snap.nr)
+		size *= 2;
+	if (size != tracks.mask + 1 || !tracks.slots) {
+		free(tracks.slots);
+		tracks.slots = malloc(size * sizeof(*tracks.slots));
+		if (!tracks.slots) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		tracks.mask = size - 1;
+	}
+	memset(tracks.slots, 0, size * sizeof(*tracks.slots));
+	tracks.nr = 0;
+
+	*added = 0;
+	for (i = 0; i < snap.nr; i++) {
+		track_key(&key, &snap.entries[i]);
+		key.first = now;
+		is_new = 1;
+
+		if (old_tracks.slots) {
+			t = track_find(&old_tracks, &key);
+			if (t->count && t->left) {
+				t->left--;
+				key.first = t->first;
+				is_new = 0;
+				matched++;
+			}
+		}
+		*added += is_new;
+		snap.entries[i].first = key.first;
+
+		t = track_find(&tracks, &key);
+		if (!t->count)
+			*t = key;
+		else if (key.first < t->first)
+			t->first = key.first;
+		t->count++;
+		t->left++;
+		tracks.nr++;
+	}
+	*gone = old_tracks.nr - matched;
+}
+
+static void set_flags(long now, long age)
+{
+	struct lock_entry *e, *p;
+	unsigned int i;
+	int dead, k;
+
+	for (i = 0; i < snap.nr; i++) {
+		e = &snap.entries[i];
+		/* once per pid */
+		if (!e->checked && e->pid > 0) {
+			dead = kill(e->pid, 0) < 0 && errno == ESRCH;
+			for_each_pid(p, k, e->pid) {
+				p->checked = 1;
+				p->dead = dead;
+			}
+		}
+
+		e->flags = 0;
+		if (e->depth)
+			continue;
+		if (now - e->first >= age)
+			e->flags |= FLAG_LONG;
+		if (e->waiters)
+			e->flags |= FLAG_STUCK;
+		if (e->dead)
+			e->flags |= FLAG_ORPHAN;
+	}
+}
+
+/*
+ * Output.
+ */
+
+static void csv_field(const char *s)
+{
+	if (!strpbrk(s, ",\"\n")) {
+		fputs(s, stdout);
+		return;
+	}
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"')
+			putchar('"');
+		putchar(*s);
+	}
+	putchar('"');
+}
+
+static void print_csv(long now, int flagged_only)
+{
+	static const char *flag_names[] = { "long", "stuck", "orphan" };
+	struct lock_entry *e;
+	unsigned int i, k;
+	int first;
+
+	printf("id,kind,access,pid,dev,inode,start,end,waiters,blocker,age,"
+		"flags,ctid,node,path,fstype,source\n");
+	for (i = 0; i < snap.nr; i++) {
+		e = &snap.entries[i];
+		if (flagged_only && !e->flags)
+			continue;
+		printf("%u,%s,%s,%d,%02x:%02x,%llu,%llu,", e->id,
+			kind_names[e->kind], access_names[e->access], e->pid,
+			major(e->dev), minor(e->dev),
+			(unsigned long long)e->ino,
+			(unsigned long long)e->start);
+		if (e->end == INDEX_EOF)
+			printf("EOF,");
+		else
+			printf("%llu,", (unsigned long long)e->end);
+		printf("%u,", e->waiters);
+		if (e->blocker >= 0)
+			printf("%u", snap.entries[e->blocker].id);
+		printf(",%ld,", now - e->first);
+		for (k = 0, first = 1; k < 3; k++)
+			if (e->flags & (1 << k)) {
+				printf("%s%s", first ? "" : "+", flag_names[k]);
+				first = 0;
+			}
+		putchar(',');
+		csv_field(str(e->ctid));
+		putchar(',');
+		csv_field(str(e->node));
+		putchar(',');
+		csv_field(str(e->path));
+		putchar(',');
+		csv_field(str(e->fstype));
+		putchar(',');
+		csv_field(str(e->source));
+		putchar('\n');
+	}
+}
+
+static int cmp_job(const void *a, const void *b)
+{
+	const unsigned int *x = a, *y = b;
+	int r = strcmp(str(x[0]), str(y[0]));
+
+	return r ? r : strcmp(str(x[1]), str(y[1]));
+}
+
+/*
+ * "<client_name> <server>" of every flagged lock on an NFS mount, a job
+ * line for clear_nfs_locks -f.
+ */
+static void print_jobs(void)
+{
+	unsigned int (*jobs)[2] = NULL, size = 0, nr = 0, i;
+	const char *colon, *server;
+	struct lock_entry *e;
+	char host[256];
+	size_t len;
+
+	for (i = 0; i < snap.nr; i++) {
+		e = &snap.entries[i];
+		if (!e->flags || !e->node || strcmp(str(e->fstype), "nfs"))
+			continue;
+		/* "server:/export", "[v6addr]:/export" */
+		server = str(e->source);
+		if (*server == '[') {
+			colon = strstr(server, "]:");
+			server++;
+		} else
+			colon = strchr(server, ':');
+		if (!colon || colon == server)
+			continue;
+		len = colon - server;
+		jobs = grow(jobs, &size, nr + 1, sizeof(*jobs));
+		jobs[nr][0] = e->node;
+		/* the pool may move */
+		len = MIN(len, sizeof(host) - 1);
+		memcpy(host, server, len);
+		jobs[nr][1] = pool_add(host, len);
+		nr++;
+	}
+
+	qsort(jobs, nr, sizeof(*jobs), cmp_job);
+	for (i = 0; i < nr; i++)
+		if (!i || cmp_job(jobs[i], jobs[i - 1]))
+			printf("%s %s\n", str(jobs[i][0]), str(jobs[i][1]));
+	free(jobs);
+}
+
+static void help(char *name)
+{
+	printf("Usage: %s [OPTIONS]\n\n", name);
+	printf("\t-f file                   Lock list to read (default: %s).\n\n",
+				INDEX_LOCKS);
+	printf("\t-n snapshots              Read it that many times "
+				"(default: 1).\n\n");
+	printf("\t-i seconds                Between the snapshots (default: %d)."
+				"\n\n", INDEX_INTERVAL);
+	printf("\t-a seconds                Locks seen for that long are long "
+				"held (default: %d).\n\n", INDEX_AGE);
+	printf("\t-l                        Only print the flagged locks: long "
+				"held, stuck or orphan.\n\n");
+	printf("\t-o csv|jobs               Locks as CSV, the default, or "
+				"clear_nfs_locks job lines of\n");
+	printf("\t                          the flagged ones on NFS mounts.\n\n");
+	printf("\t-P                        Don't join locks to paths, "
+				"containers and mounts.\n\n");
+	printf("\t-v                        Be verbose: print work progress"
+				"\n\n");
+	printf("\t-h                        This help.\n\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *file = INDEX_LOCKS, *output = "csv";
+	unsigned int snapshots = 1, interval = INDEX_INTERVAL, i, k;
+	unsigned int added, gone, blocked;
+	long age = INDEX_AGE, now = 0;
+	struct timespec ts;
+	int result, flagged_only = 0;
+
+	while ((result = getopt(argc, argv, "f:n:i:a:lo:Pvh")) != EOF) {
+		switch (result) {
+			case 'f':
+				file = optarg;
+				break;
+			case 'n':
+				snapshots = atoi(optarg);
+				break;
+			case 'i':
+				interval = atoi(optarg);
+				break;
+			case 'a':
+				age = atol(optarg);
+				break;
+			case 'l':
+				flagged_only = 1;
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			case 'P':
+				do_join = 0;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			case 'h':
+				help(argv[0]);
+				exit(0);
+			default:
+				help(argv[0]);
+				exit(2);
+		}
+	}
+
+	if (!snapshots || age < 0 ||
+	    (strcmp(output, "csv") && strcmp(output, "jobs"))) {
+		fprintf(stderr, "Bad snapshots, age or output.\n");
+		exit(2);
+	}
+	if (!strcmp(output, "jobs") && !do_join) {
+		fprintf(stderr, "Jobs need the joins, -P can't go with them.\n");
+		exit(2);
+	}
+
+	self_uts = open("/proc/self/ns/uts", O_RDONLY);
+	pool_reset();
+
+	for (i = 0; i < snapshots; i++) {
+		if (i)
+			sleep(interval);
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		now = ts.tv_sec;
+
+		result = read_locks(file);
+		if (result < 0) {
+			fprintf(stderr, "Failed to read %s: %s\n", file,
+						strerror(-result));
+			exit(1);
+		}
+		if (result)
+			v_printf("%d lines of %s aren't locks\n", result, file);
+
+		build_index();
+		diff(now, &added, &gone);
+		for (blocked = 0, k = 0; k < snap.nr; k++)
+			blocked += !!snap.entries[k].depth;
+		if (snapshots > 1)
+			fprintf(stderr, "Snapshot %u: %u locks, %u blocked, "
+				"%u new, %u gone\n", i + 1, snap.nr, blocked,
+				i ? added : snap.nr, i ? gone : 0);
+	}
+
+	set_flags(now, age);
+	if (do_join)
+		join();
+
+	if (!strcmp(output, "jobs"))
+		print_jobs();
+	else
+		print_csv(now, flagged_only);
+
+	if (self_uts >= 0)
+		close(self_uts);
+	return 0;
+}
@@ -45,6 +45,10 @@ int main (int argc, char **argv)
 	mount_server_addr.sin_port = htons(111);
 	
 	prog_list = pmap_getmaps(&mount_server_addr);
+	if (!prog_list) {
+		printf("Failed to get the port mappings of %s\n", server);
+		return -1;
+	}
 	
 	do {
 		static int iter = 0;
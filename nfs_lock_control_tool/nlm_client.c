@@ -0,0 +1,179 @@
+/*
+ * NFS clients in namespaces of their own, on one machine.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <net/if.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "nlm_client.h"
+
+#define NLM_CMD			512
+
+/*
+ * Run a shell command, quietly unless 'verbose'. Returns its exit status
+ * or -1.
+ */
+int nlm_run(int verbose, const char *fmt, ...)
+{
+	char cmd[NLM_CMD + 32];
+	va_list ap;
+	int status;
+
+	va_start(ap, fmt);
+	vsnprintf(cmd, NLM_CMD, fmt, ap);
+	va_end(ap);
+	if (!verbose)
+		strcat(cmd, " >/dev/null 2>&1");
+
+	status = system(cmd);
+	if (status < 0 || !WIFEXITED(status))
+		return -1;
+	return WEXITSTATUS(status);
+}
+
+void nlm_client_addr(char *buf, size_t size, unsigned int id)
+{
+	/* .0.1 is the bridge */
+	snprintf(buf, size, "%s.%u.%u", NLM_CLIENT_NET, (id + 2) / 256,
+							(id + 2) % 256);
+}
+
+/*
+ * The bridge the clients are linked to, with the server address on it.
+ */
+int nlm_client_bridge(const struct nlm_client_conf *conf)
+{
+	/* left over from a run, which was killed */
+	nlm_client_bridge_del(conf);
+	if (nlm_run(conf->verbose, "ip link add " NLM_CLIENT_BRIDGE
+			" type bridge && ip addr add " NLM_CLIENT_SERVER
+			"/16 dev " NLM_CLIENT_BRIDGE " && ip link set "
+			NLM_CLIENT_BRIDGE " up")) {
+		fprintf(stderr, "Failed to set bridge " NLM_CLIENT_BRIDGE
+								" up\n");
+		return -1;
+	}
+	return 0;
+}
+
+void nlm_client_bridge_del(const struct nlm_client_conf *conf)
+{
+	nlm_run(conf->verbose, "ip link del " NLM_CLIENT_BRIDGE);
+}
+
+/*
+ * Make the client's namespaces a machine of its own. Returns the stage,
+ * which failed, with errno set, or NULL.
+ */
+static const char *client_setup(struct nlm_client *c)
+{
+	const struct nlm_client_conf *conf = c->conf;
+	char addr[32];
+
+	if (sethostname(c->name, strlen(c->name)) < 0)
+		return "sethostname";
+
+	/* rpcbind's socket, statd's files and the mount are its own */
+	if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) < 0)
+		return "mount private";
+	if (mount("nlm_client", "/run", "tmpfs", 0, NULL) < 0 ||
+	    mount("nlm_client", "/var/lib/nfs", "tmpfs", 0, NULL) < 0)
+		return "mount tmpfs";
+	if (mkdir("/var/lib/nfs/statd", 0755) < 0 ||
+	    mkdir("/var/lib/nfs/statd/sm", 0755) < 0 ||
+	    mkdir("/var/lib/nfs/statd/sm.bak", 0755) < 0 ||
+	    mkdir(NLM_CLIENT_MNT, 0755) < 0)
+		return "mkdir";
+
+	nlm_client_addr(addr, sizeof(addr), c->id);
+	errno = EIO;
+	if (nlm_run(conf->verbose, "ip link set lo up && ip addr add %s/16 "
+				"dev eth0 && ip link set eth0 up", addr))
+		return "network";
+	if (*conf->rpcbind && nlm_run(conf->verbose, "%s", conf->rpcbind))
+		return "rpcbind";
+	if (*conf->statd && nlm_run(conf->verbose, "%s", conf->statd))
+		return "rpc.statd";
+	if (nlm_run(conf->verbose, "mount -t nfs -o vers=3%s%s %s:%s %s",
+			*conf->options ? "," : "", conf->options,
+			NLM_CLIENT_SERVER, conf->export, NLM_CLIENT_MNT))
+		return "mount nfs";
+	return NULL;
+}
+
+static int client_main(void *arg)
+{
+	struct nlm_client *c = arg;
+	const char *stage;
+	char b = 0;
+
+	close(c->net[1]);
+
+	/* the parent has moved the link in, or failed to */
+	if (read(c->net[0], &b, 1) != 1 || b) {
+		errno = EIO;
+		stage = "veth";
+	} else
+		stage = client_setup(c);
+	close(c->net[0]);
+
+	return c->fn(c, stage);
+}
+
+/*
+ * Clone the client with 'stack' (NLM_CLIENT_STACK bytes, the client gets
+ * its copy, so one will do for all of them) and move its end of a new
+ * veth link in. The client runs c->fn() then. Returns 0 or negative
+ * errno; c->pid is set if it was cloned.
+ */
+int nlm_client_start(struct nlm_client *c, void *stack)
+{
+	char link[IFNAMSIZ];
+	char b = 0;
+
+	c->pid = -1;
+	if (pipe2(c->net, O_CLOEXEC) < 0)
+		return -errno;
+
+	fflush(stdout);
+	c->pid = clone(client_main, (char *)stack + NLM_CLIENT_STACK,
+			CLONE_NEWNET | CLONE_NEWNS | CLONE_NEWUTS |
+			CLONE_NEWPID | SIGCHLD, c);
+	close(c->net[0]);
+	if (c->pid < 0) {
+		close(c->net[1]);
+		return -errno;
+	}
+
+	snprintf(link, sizeof(link), "nlm%u", c->id);
+	if (nlm_run(c->conf->verbose, "ip link add %s type veth peer name "
+			"eth0 netns %d && ip link set %s master "
+			NLM_CLIENT_BRIDGE " up", link, c->pid, link))
+		b = 1;
+	if (write(c->net[1], &b, 1) < 0)
+		b = 1;
+	close(c->net[1]);
+	return b ? -EIO : 0;
+}
+
+/*
+ * Take the client off the network, as if it crashed: nothing it sends
+ * reaches the server any more, its unlocks neither.
+ */
+int nlm_client_cut(struct nlm_client *c)
+{
+	return nlm_run(c->conf->verbose, "ip link del nlm%u", c->id) ?
+								-EIO : 0;
+}
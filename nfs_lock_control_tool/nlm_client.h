@@ -0,0 +1,60 @@
+/*
+ * NFS clients in namespaces of their own, on one machine.
+ *
+ * A client is a process cloned into new network, mount, UTS and PID
+ * namespaces, as netns-sandbox/make_sandbox does. It gets its own
+ * nodename, a veth link to bridge NLM_CLIENT_BRIDGE with address
+ * NLM_CLIENT_NET.x.y, private /run and /var/lib/nfs with its own rpcbind
+ * and rpc.statd (kernel lockd needs both in its namespace), and an
+ * NFSv3 mount of an export of the local nfsd at NLM_CLIENT_MNT, reached
+ * through the bridge address. Then the caller's function runs in it.
+ * When that returns, the PID namespace takes the daemons down, and the
+ * namespaces, the mount and the link go away.
+ */
+
+#ifndef __NLM_CLIENT_H__
+#define __NLM_CLIENT_H__
+
+#include <sys/types.h>
+
+#define NLM_CLIENT_BRIDGE	"nlmbr0"
+#define NLM_CLIENT_NET		"10.99"		/* /16, the bridge is .0.1 */
+#define NLM_CLIENT_SERVER	NLM_CLIENT_NET ".0.1"
+#define NLM_CLIENT_MNT		"/run/nlm_client"
+#define NLM_CLIENT_STACK	(64 << 10)
+
+struct nlm_client_conf {
+	const char *		export;		/* on the local nfsd */
+	const char *		options;	/* more mount options */
+	const char *		rpcbind;	/* commands, "" for none */
+	const char *		statd;
+	int			verbose;
+};
+
+struct nlm_client;
+
+/*
+ * Runs in the client, 'stage' is what failed to set it up (errno tells
+ * why) or NULL. Returns the exit status of the client.
+ */
+typedef int (*nlm_client_fn)(struct nlm_client *, const char *stage);
+
+struct nlm_client {
+	unsigned int		id;		/* picks the address */
+	char			name[64];	/* nodename */
+	const struct nlm_client_conf *conf;
+	nlm_client_fn		fn;
+	void *			data;
+	pid_t			pid;
+	int			net[2];		/* its link is there */
+};
+
+extern int		nlm_run(int, const char *, ...)
+				__attribute__((format(printf, 2, 3)));
+extern int		nlm_client_bridge(const struct nlm_client_conf *);
+extern void		nlm_client_bridge_del(const struct nlm_client_conf *);
+extern int		nlm_client_start(struct nlm_client *, void *);
+extern int		nlm_client_cut(struct nlm_client *);
+extern void		nlm_client_addr(char *, size_t, unsigned int);
+
+#endif /* __NLM_CLIENT_H__ */
@@ -0,0 +1,374 @@
+/*
+ * NLM load generator: many NFS clients on one machine.
+ *
+ * Every client is one of nlm_client.c: namespaces of its own with its
+ * own nodename (the name lockd and statd know it by), address, rpcbind,
+ * rpc.statd and NFSv3 mount of the export of the local nfsd. Once all of
+ * them are up, every client runs workers locking and unlocking byte
+ * ranges of one file on the export with F_SETLKW for a while. The grant
+ * and release times go to histograms (nsm_hist, usec) in shared memory,
+ * and the totals give the lock throughput and the grant latency
+ * percentiles of the server.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/wait.h>
+
+#include "nsm_metrics.h"
+#include "nlm_client.h"
+#include "nsm_clock.h"
+
+#define LOAD_CLIENTS		100
+#define LOAD_MAX_CLIENTS	16000
+#define LOAD_WORKERS		1	/* per client */
+#define LOAD_SECONDS		10
+#define LOAD_FILE		"nlm_load.dat"
+
+/* In shared memory, a slot per worker */
+struct load_stats {
+	unsigned long		ops;
+	int			error;		/* errno, which stopped it */
+	const char *		stage;		/* where it failed */
+	struct nsm_hist		grant;		/* usec */
+	struct nsm_hist		release;
+};
+
+struct load {
+	unsigned int		nr_clients;
+	unsigned int		workers;
+	struct nlm_client_conf	conf;
+	const char *		prefix;		/* of the nodenames */
+	unsigned int		ranges;
+	off_t			len;
+	long			duration;	/* usec */
+	long			hold;		/* usec */
+	int			ready[2];	/* a byte per client set up */
+	int			go[2];		/* closed when all are */
+	struct load_stats *	stats;
+};
+
+static struct load load;
+
+#define v_printf	if (load.conf.verbose) printf
+
+static void worker(struct load_stats *ws, const char *path,
+					unsigned int seed)
+{
+	struct flock fl = { .l_whence = SEEK_SET, .l_len = load.len };
+	long start, end, deadline;
+	int fd;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		ws->error = errno;
+		ws->stage = "open";
+		return;
+	}
+
+	deadline = nsm_now_usec() + load.duration;
+	while ((start = nsm_now_usec()) < deadline) {
+		fl.l_type = F_WRLCK;
+		fl.l_start = rand_r(&seed) % load.ranges * load.len;
+		if (fcntl(fd, F_SETLKW, &fl) < 0) {
+			ws->error = errno;
+			ws->stage = "lock";
+			break;
+		}
+		end = nsm_now_usec();
+		nsm_hist_add(&ws->grant, end - start);
+
+		while (load.hold && nsm_now_usec() - end < load.hold)
+			;
+
+		fl.l_type = F_UNLCK;
+		start = nsm_now_usec();
+		if (fcntl(fd, F_SETLK, &fl) < 0) {
+			ws->error = errno;
+			ws->stage = "unlock";
+			break;
+		}
+		nsm_hist_add(&ws->release, nsm_now_usec() - start);
+		ws->ops++;
+	}
+	close(fd);
+}
+
+static int client_main(struct nlm_client *c, const char *stage)
+{
+	struct load_stats *ws = &load.stats[c->id * load.workers];
+	char path[PATH_MAX], b = 0;
+	pid_t pids[load.workers];
+	unsigned int i;
+	int fd;
+
+	/* the first client makes the file, the others find it */
+	snprintf(path, sizeof(path), "%s/%s", NLM_CLIENT_MNT, LOAD_FILE);
+	if (!stage && (fd = open(path, O_RDWR | O_CREAT, 0666)) >= 0)
+		close(fd);
+	else if (!stage)
+		stage = "create";
+	if (stage) {
+		ws->error = errno;
+		ws->stage = stage;
+	}
+
+	close(load.go[1]);
+	close(load.ready[0]);
+
+	if (write(load.ready[1], &b, 1) < 0 || ws->stage)
+		return 1;
+
+	/* all at once */
+	if (read(load.go[0], &b, 1) < 0)
+		b = 0;
+
+	/* processes: POSIX locks of threads don't conflict */
+	for (i = 0; i < load.workers; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			ws[i].error = errno;
+			ws[i].stage = "fork";
+			continue;
+		}
+		if (!pids[i]) {
+			worker(&ws[i], path, c->id * load.workers + i + 1);
+			_exit(0);
+		}
+	}
+
+	/* exiting kills the daemons, this is init of the PID namespace */
+	for (i = 0; i < load.workers; i++)
+		if (pids[i] > 0)
+			waitpid(pids[i], NULL, 0);
+	return 0;
+}
+
+static void report_failures(unsigned int nr)
+{
+	unsigned int i, shown = 0, failed = 0;
+	struct load_stats *ws;
+
+	for (i = 0; i < nr; i++) {
+		ws = &load.stats[i];
+		if (!ws->stage)
+			continue;
+		if (shown++ < 10)
+			fprintf(stderr, "Client %u, worker %u: %s failed: %s\n",
+				i / load.workers, i % load.workers, ws->stage,
+				strerror(ws->error));
+		failed++;
+	}
+	if (failed > shown)
+		fprintf(stderr, "... %u more\n", failed - shown);
+}
+
+static void report(unsigned int clients, double seconds)
+{
+	unsigned int i, nr = load.nr_clients * load.workers;
+	struct nsm_hist grant, release;
+	unsigned long ops = 0;
+
+	memset(&grant, 0, sizeof(grant));
+	memset(&release, 0, sizeof(release));
+	for (i = 0; i < nr; i++) {
+		ops += load.stats[i].ops;
+		nsm_hist_merge(&grant, &load.stats[i].grant);
+		nsm_hist_merge(&release, &load.stats[i].release);
+	}
+
+	printf("%u clients, %u workers each, %.3f seconds\n", clients,
+						load.workers, seconds);
+	printf("%10s %10s %9s %9s %9s %9s %9s %9s %9s\n", "locks",
+		"locks/s", "grant p50", "grant p90", "grant p99", "p999",
+		"max", "rel p50", "rel p99");
+	printf("%10lu %10.0f %9u %9u %9u %9u %9u %9u %9u\n", ops,
+		seconds > 0 ? ops / seconds : 0,
+		nsm_hist_quantile(&grant, 0.5), nsm_hist_quantile(&grant, 0.9),
+		nsm_hist_quantile(&grant, 0.99),
+		nsm_hist_quantile(&grant, 0.999), grant.max,
+		nsm_hist_quantile(&release, 0.5),
+		nsm_hist_quantile(&release, 0.99));
+	printf("Latencies in usec\n");
+	report_failures(nr);
+}
+
+static void help(char *name)
+{
+	printf("Usage: %s -e export [OPTIONS]\n\n", name);
+	printf("\t-e export                 Path the local nfsd exports to "
+				"%s.0.0/16.\n\n", NLM_CLIENT_NET);
+	printf("\t-n clients                Clients (default: %d).\n\n",
+				LOAD_CLIENTS);
+	printf("\t-w workers                Locking processes per client "
+				"(default: %d).\n\n", LOAD_WORKERS);
+	printf("\t-d seconds                Time of the load (default: %d)."
+				"\n\n", LOAD_SECONDS);
+	printf("\t-R ranges                 Ranges of the file the workers "
+				"pick from (default: 1).\n\n");
+	printf("\t-l bytes                  Length of a range (default: 1)."
+				"\n\n");
+	printf("\t-H usec                   Hold every lock that long "
+				"(default: 0).\n\n");
+	printf("\t-o options                More NFS mount options, e.g. "
+				"\"proto=udp\".\n\n");
+	printf("\t-B command                Starts rpcbind in a client "
+				"(default: \"rpcbind -w\", \"\" for none).\n\n");
+	printf("\t-S command                Starts rpc.statd in a client "
+				"(default: \"rpc.statd --no-notify\").\n\n");
+	printf("\t-c prefix                 Of the client nodenames "
+				"(default: \"nlm-client-\").\n\n");
+	printf("\t-v                        Be verbose: print work progress"
+				"\n\n");
+	printf("\t-h                        This help.\n\n");
+	printf("Needs root. The clients get %s.0.2 and up on bridge %s, "
+				"which has %s.\n", NLM_CLIENT_NET,
+				NLM_CLIENT_BRIDGE, NLM_CLIENT_SERVER);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i, started = 0, up = 0;
+	struct nlm_client *clients;
+	size_t stats_size;
+	long start;
+	void *stack;
+	int result;
+	char b;
+
+	load.nr_clients = LOAD_CLIENTS;
+	load.workers = LOAD_WORKERS;
+	load.conf.options = "";
+	load.conf.rpcbind = "rpcbind -w";
+	load.conf.statd = "rpc.statd --no-notify";
+	load.prefix = "nlm-client-";
+	load.ranges = 1;
+	load.len = 1;
+	load.duration = LOAD_SECONDS * 1000000L;
+
+	while ((result = getopt(argc, argv, "e:n:w:d:R:l:H:o:B:S:c:vh")) != EOF) {
+		switch (result) {
+			case 'e':
+				load.conf.export = optarg;
+				break;
+			case 'n':
+				load.nr_clients = atoi(optarg);
+				break;
+			case 'w':
+				load.workers = atoi(optarg);
+				break;
+			case 'd':
+				load.duration = atol(optarg) * 1000000L;
+				break;
+			case 'R':
+				load.ranges = atoi(optarg);
+				break;
+			case 'l':
+				load.len = atol(optarg);
+				break;
+			case 'H':
+				load.hold = atol(optarg);
+				break;
+			case 'o':
+				load.conf.options = optarg;
+				break;
+			case 'B':
+				load.conf.rpcbind = optarg;
+				break;
+			case 'S':
+				load.conf.statd = optarg;
+				break;
+			case 'c':
+				load.prefix = optarg;
+				break;
+			case 'v':
+				load.conf.verbose = 1;
+				break;
+			case 'h':
+				help(argv[0]);
+				exit(0);
+			default:
+				help(argv[0]);
+				exit(2);
+		}
+	}
+
+	if (!load.conf.export) {
+		fprintf(stderr, "You must specify the export.\n");
+		help(argv[0]);
+		exit(2);
+	}
+	if (!load.nr_clients || load.nr_clients > LOAD_MAX_CLIENTS ||
+	    !load.workers || load.duration <= 0 || !load.ranges ||
+	    load.len <= 0) {
+		fprintf(stderr, "Bad clients, workers, time, ranges or "
+				"length.\n");
+		exit(2);
+	}
+
+	stats_size = load.nr_clients * load.workers * sizeof(*load.stats);
+	load.stats = mmap(NULL, stats_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	clients = calloc(load.nr_clients, sizeof(*clients));
+	/* cloned without CLONE_VM, every client has its copy of it */
+	stack = malloc(NLM_CLIENT_STACK);
+	if (load.stats == MAP_FAILED || !clients || !stack ||
+	    pipe2(load.ready, O_CLOEXEC) < 0 ||
+	    pipe2(load.go, O_CLOEXEC) < 0) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	if (nlm_client_bridge(&load.conf) < 0)
+		exit(1);
+
+	for (i = 0; i < load.nr_clients; i++) {
+		clients[i].id = i;
+		snprintf(clients[i].name, sizeof(clients[i].name), "%s%u",
+							load.prefix, i);
+		clients[i].conf = &load.conf;
+		clients[i].fn = client_main;
+		result = nlm_client_start(&clients[i], stack);
+		if (clients[i].pid > 0)
+			started++;
+		if (result < 0)
+			v_printf("Client %u: failed to start: %s\n", i,
+							strerror(-result));
+		if (load.conf.verbose && (i + 1) % 100 == 0)
+			printf("%u clients started\n", i + 1);
+	}
+	close(load.ready[1]);
+	close(load.go[0]);
+
+	/* a byte from every client, which was set up or failed to */
+	for (i = 0; i < started && read(load.ready[0], &b, 1) == 1; i++)
+		;
+	for (i = 0; i < load.nr_clients; i++)
+		if (clients[i].pid > 0 &&
+		    !load.stats[i * load.workers].stage)
+			up++;
+	v_printf("%u of %u clients are up\n", up, load.nr_clients);
+
+	start = nsm_now_usec();
+	close(load.go[1]);
+	for (i = 0; i < load.nr_clients; i++)
+		if (clients[i].pid > 0)
+			waitpid(clients[i].pid, NULL, 0);
+
+	report(up, (nsm_now_usec() - start) / 1e6);
+
+	nlm_client_bridge_del(&load.conf);
+	munmap(load.stats, stats_size);
+	free(clients);
+	free(stack);
+	return up ? 0 : 1;
+}
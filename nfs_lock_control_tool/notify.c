@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -19,28 +20,108 @@
 #include <grp.h>
 #include <getopt.h>
 
-#include <rpc/pmap_prot.h>
-#include <rpc/pmap_clnt.h>
+#include <limits.h>
+
+#include <rpc/rpc.h>
+
+#include "nsm_batch.h"
+#include "nsm_timer.h"
+#include "nsm_rto.h"
+#include "nsm_resolv.h"
+#include "nsm_pmap.h"
+#include "nsm_tmpl.h"
+#include "nsm_port.h"
+#include "nsm_nlm.h"
+#include "nsm_cand.h"
+#include "nsm_discover.h"
+#include "nsm_metrics.h"
+#include "nsm_pcap.h"
+#include "nsm_clock.h"
 
 #define NSM_PROGRAM	100024
 #define NSM_VERSION	1
 #define NSM_NOTIFY	6
 #define MAXMSGSIZE	256
+#define NSM_WINDOW	4096	/* states in flight during forced sweep */
+#define NSM_PROBE_WAIT		5000	/* msec for the locks to go after
+					   a notification */
+#define NSM_PROBE_INTERVAL	200	/* msec between probes meanwhile */
+#define NSM_PROBE_PERIOD	1000	/* msec between probes in a sweep */
+#define NSM_PROBE_TIMEOUT	1000	/* msec for nlockmgr to answer */
+#define NSM_CAND_WAIT		500	/* msec for the locks to go after
+					   a candidate state */
 
 struct nsm_host {
 	struct nsm_host *	next;
 	char *			name;
 	char *			path;
-	struct sockaddr_storage	addr;
-	struct addrinfo		*ai;
-	time_t			last_used;
-	time_t			send_next;
-	unsigned int		timeout;
+	struct sockaddr_storage	addr;		/* in use, as the socket
+						   sends to it */
+	socklen_t		addrlen;
+	struct nsm_target	target;
+	time_t			last_used;	/* msec, last transmission */
+	time_t			send_next;	/* msec, retransmit time */
+	unsigned int		timeout;	/* msec */
 	unsigned int		retries;
 	unsigned int		xid;
+	struct nsm_rtt		rtt;
+	unsigned long		sent;		/* SM_NOTIFY packets */
+	struct nsm_server_stats	*stats;		/* NULL without metrics */
+};
+
+/*
+ * SM_NOTIFY call in flight during forced sweep.
+ */
+struct nsm_call {
+	struct nsm_timer	timer;		/* retransmit timer */
+	struct nsm_call *	hnext;		/* XID hash chain */
+	struct nsm_call *	next;		/* free list */
+	uint32_t		xid;
+	uint32_t		state;
+	long			sent;		/* usec, last transmission */
+	unsigned int		retries;
+};
+
+struct nsm_sweep {
+	struct nsm_host *	host;
+	struct nsm_tmpl		tmpl;		/* client's SM_NOTIFY */
+	struct nsm_call *	calls;
+	struct nsm_call **	hash;
+	unsigned int		hash_mask;
+	struct nsm_call *	free;
+	struct nsm_timer_heap	timers;
+	struct nsm_cwnd		cwnd;
+	struct nsm_batch	tx;
+	struct nsm_batch	rx;
+	unsigned int		in_flight;
+	uint32_t		xid_base;
+	uint32_t		next_state;
+	const uint32_t *	skip;		/* states tried already, sorted */
+	unsigned int		nr_skip;
+	unsigned long		sent;
+	unsigned long		answered;
+	unsigned long		retransmits;
+	unsigned long		timedout;
+};
+
+/*
+ * Files locked by the client: NLM_TEST probes of them tell when the
+ * locks are gone.
+ */
+struct nsm_probe {
+	struct nsm_nlm_file *	files;
+	unsigned int		nr_files;
+	struct sockaddr_storage	addr;		/* nlockmgr */
+	const struct sockaddr *	local;
+	char			caller[HOST_NAME_MAX + 1];
 };
 
 static int verbose;
+static struct nsm_probe probe;
+static char *resolv_cache = NSM_RESOLV_CACHE;
+static char *pmap_cache = NSM_PMAP_CACHE;
+static int addr_family = AF_UNSPEC;	/* of server addresses */
+static int sock_family = AF_INET;
 
 #define v_printf	if (verbose) printf
 
@@ -50,7 +131,7 @@ static struct addrinfo *smn_lookup(const char *name)
 #if HAVE_DECL_AI_ADDRCONFIG
 		.ai_flags	= AI_ADDRCONFIG,
 #endif	/* HAVE_DECL_AI_ADDRCONFIG */
-		.ai_family	= AF_INET,
+		.ai_family	= AF_UNSPEC,
 		.ai_protocol	= IPPROTO_UDP,
 	};
 	int error;
@@ -61,22 +142,6 @@ static struct addrinfo *smn_lookup(const char *name)
 	return NULL;
 }
 
-static void dump(void *data, int size)
-{
-	unsigned char *mem = data;
-	int i;
-
-	printf("Dumping %d bytes from 0x%p:\n", size, data);
-	
-	printf(" 0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F\n");
-	for (i = 0; i < size; i++) {
-		printf("%02x ", mem[i]);
-		if (i && !(i % 16))
-			printf("\n");
-	}
-	printf("\n");
-}
-
 static void smn_set_port(struct sockaddr *sap, const unsigned short port)
 {
 	switch (sap->sa_family) {
@@ -100,34 +165,10 @@ static unsigned short smn_get_port(const struct sockaddr *sap)
 	return 0;
 }
 
-static int recv_reply(int sock)
+static int smn_check_reply(uint32_t *msgbuf, int res)
 {
-	uint32_t	msgbuf[MAXMSGSIZE], *p, *end;
-	int		res;
-	struct pollfd	pfd;
-	long		wait = 10;
-
-	pfd.fd = sock;
-	pfd.events = POLLIN;
-
-	v_printf("Waiting for server answer...\n");
-
-	wait *= 1000;
-	if (wait < 100)
-		wait = 100;
-	if (poll(&pfd, 1, wait) != 1) {
-		fprintf(stderr, "Failed to receive the answer from server\n");
-		return 0;
-	}
+	uint32_t *p, *end;
 
-	res = recv(sock, msgbuf, sizeof(msgbuf), 0);
-	if (res < 0) {
-		v_printf("Failed to receive server answer.\n");
-		return -1;
-	}
-
-	v_printf("Received server answer. Checking...");
-	
 	p = msgbuf;
 	end = p + (res >> 2);
 
@@ -151,149 +192,756 @@ static int recv_reply(int sock)
 }
 
 /*
- * Send notification to a single host
+ * Wait for the answer to the call in flight until it's time to
+ * retransmit it. Returns 1 if nothing came in time. The index of the
+ * address, which answered, is stored in 'from', -1 if it's none of the
+ * host's.
+ */
+static int recv_reply(int sock, struct nsm_host *server, int *from)
+{
+	uint32_t	msgbuf[MAXMSGSIZE];
+	struct sockaddr_storage addr;
+	socklen_t	addrlen;
+	int		res;
+	unsigned int	i;
+	struct pollfd	pfd;
+	long		wait;
+
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+
+	v_printf("Waiting for server answer...\n");
+
+	while ((wait = server->send_next - nsm_now_msec()) > 0) {
+		nsm_metrics_check();
+		if (poll(&pfd, 1, wait) != 1)
+			continue;
+
+		addrlen = sizeof(addr);
+		res = recvfrom(sock, msgbuf, sizeof(msgbuf), 0,
+				(struct sockaddr *)&addr, &addrlen);
+		if (res < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				continue;
+			v_printf("Failed to receive server answer.\n");
+			return -1;
+		}
+
+		nsm_batch_tap_buf(sock, msgbuf, res, (struct sockaddr *)&addr, 0);
+		if (res < sizeof(uint32_t) || ntohl(msgbuf[0]) != server->xid)
+			continue;	/* stale or foreign reply */
+
+		v_printf("Received server answer. Checking...");
+		nsm_metrics_reply(server->stats, msgbuf, res);
+
+		*from = -1;
+		for (i = 0; i < server->target.nr_addrs; i++)
+			if (nsm_addr_match((struct sockaddr *)&addr,
+				(struct sockaddr *)&server->target.addrs[i]))
+				*from = i;
+		return smn_check_reply(msgbuf, res);
+	}
+
+	return 1;
+}
+
+static int smn_resolve(struct nsm_host *server)
+{
+	if (server->target.nr_addrs)
+		return 0;
+
+	server->target.name = server->name;
+	if (nsm_resolve(&server->target, 1, addr_family, resolv_cache)) {
+		fprintf(stderr, "DNS resolution of %s failed: %s\n",
+			server->name, gai_strerror(server->target.error));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Make address 'i' of the host the one in use, in the form the socket
+ * sends to.
+ */
+static int smn_use_addr(struct nsm_host *server, unsigned int i)
+{
+	server->addrlen = nsm_addr_map(&server->addr,
+			(struct sockaddr *)&server->target.addrs[i],
+			sock_family);
+	return server->addrlen ? 0 : -1;
+}
+
+/*
+ * Send notification to a single host. Its addresses are tried one after
+ * another, NSM_ADDR_DELAY apart, without waiting for the ones before to
+ * time out. The first one to answer wins.
  */
 static int notify_host(int sock, struct nsm_host *server, unsigned short server_port, char *client_name, int nstatd_state)
 {
-	struct sockaddr_storage address;
-	struct sockaddr *dest = (struct sockaddr *)&address;
-	socklen_t destlen = sizeof(address);
 	static unsigned int	xid = 0;
-	uint32_t		msgbuf[MAXMSGSIZE], *p;
-	unsigned int		len;
+	struct nsm_target	*t = &server->target;
+	struct nsm_tmpl		tmpl;
+	uint32_t		words[2];
+	struct iovec		iov[NSM_TMPL_IOVS];
+	struct msghdr		msg = {
+		.msg_name	= &server->addr,
+		.msg_iov	= iov,
+		.msg_iovlen	= NSM_TMPL_IOVS,
+	};
+	unsigned int		i, tried = 0, failed = 0;
+	int			result, from, error = 0;
+	long			sent;
 
 	if (!xid)
 		xid = getpid() + time(NULL);
 	if (!server->xid)
 		server->xid = xid++;
 
-	if (server->ai == NULL) {
-		server->ai = smn_lookup(server->name);
-		if (server->ai == NULL) {
-			fprintf(stderr, "DNS resolution of %s failed; "
-				"retrying later\n", server->name);
-			return -1;
+	if (nsm_tmpl_init(&tmpl, client_name) < 0) {
+		fprintf(stderr, "Client name '%s' is too long\n", client_name);
+		return -1;
+	}
+	nsm_tmpl_fill(&tmpl, words, server->xid, nstatd_state, iov);
+
+	if (smn_resolve(server) < 0)
+		return -1;
+	for (i = 0; i < t->nr_addrs; i++)
+		smn_set_port((struct sockaddr *)&t->addrs[i], server_port);
+
+	server->retries = 0;
+	for (;;) {
+		/* a new address first, all of them again on timeout */
+		if (tried < t->nr_addrs)
+			i = tried++;
+		else if (server->retries++ == NSM_RETRIES)
+			break;
+		else
+			i = 0;
+
+		for (; i < tried; i++) {
+			if (failed & 1U << i)
+				continue;
+
+			v_printf("Sending clearing locks message to server %s.\n", server->name);
+
+			if (smn_use_addr(server, i) < 0)
+				errno = EAFNOSUPPORT;
+			else {
+				msg.msg_namelen = server->addrlen;
+				if ((result = sendmsg(sock, &msg, 0)) >= 0) {
+					nsm_batch_tap_msg(sock, &msg, result, 1);
+					server->sent++;
+					nsm_metrics_count(server->stats, sent);
+					if (server->retries)
+						nsm_metrics_count(server->stats,
+								retransmits);
+					continue;
+				}
+			}
+			error = errno;
+			v_printf("Sending to address %u failed: %s\n", i,
+							strerror(error));
+			failed |= 1U << i;
+		}
+
+		if (failed == (1U << t->nr_addrs) - 1) {
+			fprintf(stderr, "Sending Reboot Notification to "
+				"'%s' failed: errno %d (%s)\n", server->name, error, strerror(error));
+			return -2;
+		}
+		if (failed & 1U << (tried - 1) && tried < t->nr_addrs)
+			continue;	/* no use waiting for it */
+
+		sent = nsm_now_usec();
+		server->last_used = sent / 1000;
+		server->timeout = nsm_rtt_timeout(&server->rtt, server->retries);
+		if (tried < t->nr_addrs)
+			server->timeout = MIN(server->timeout, NSM_ADDR_DELAY);
+		server->send_next = server->last_used + server->timeout;
+
+		result = recv_reply(sock, server, &from);
+		if (result <= 0) {
+			/* Only calls sent once give a reliable RTT sample */
+			if (!result && !server->retries && from == tried - 1) {
+				sent = nsm_now_usec() - sent;
+				nsm_rtt_update(&server->rtt, sent);
+				nsm_metrics_rtt(server->stats, sent);
+			}
+			if (!result && from >= 0)
+				smn_use_addr(server, from);
+			return result;
 		}
+
+		v_printf("No answer in %u msec.\n", server->timeout);
 	}
 
-	memset(msgbuf, 0, sizeof(msgbuf));
+	fprintf(stderr, "Failed to receive the answer from server\n");
+	nsm_metrics_count(server->stats, timeouts);
+	return -1;
+}
 
-	p = msgbuf;
-	*p++ = htonl(server->xid);
-	*p++ = 0;
-	*p++ = htonl(2);
-
-	if (server->ai->ai_next == NULL)
-		memcpy(&server->addr, server->ai->ai_addr,
-					server->ai->ai_addrlen);
-	else {
-		struct addrinfo *first = server->ai;
-		struct addrinfo **next = &server->ai;
-
-		/* remove the first entry from the list */
-		server->ai = first->ai_next;
-		first->ai_next = NULL;
-		/* find the end of the list */
-		next = &first->ai_next;
-		while ( *next )
-			next = & (*next)->ai_next;
-		/* put first entry at end */
-		*next = first;
-		memcpy(&server->addr, first->ai_addr,
-					first->ai_addrlen);
-	}
-
-	smn_set_port((struct sockaddr *)&server->addr, server_port);
-
-	memcpy(dest, &server->addr, destlen);
-	/* Build an SM_NOTIFY packet */
-	v_printf("Sending clearing locks message to server %s.\n", server->name);
-
-	*p++ = htonl(NSM_PROGRAM);
-	*p++ = htonl(NSM_VERSION);
-	*p++ = htonl(NSM_NOTIFY);
-
-	/* Auth and verf */
-	*p++ = 0; *p++ = 0;
-	*p++ = 0; *p++ = 0;
-
-	/* state change */
-	len = strlen(client_name);
-	*p++ = htonl(len);
-	memcpy(p, client_name, len);
-	p += (len + 3) >> 2;
-	*p++ = htonl(nstatd_state);
-
-	len = (p - msgbuf) << 2;
-
-	if (sendto(sock, msgbuf, len, 0, dest, destlen) < 0) {
-		fprintf(stderr, "Sending Reboot Notification to "
-			"'%s' failed: errno %d (%s)\n", server->name, errno, strerror(errno));
-		return -2;
-	}
-
-	return recv_reply(sock);
+/*
+ * Ask the portmapper of the host for the port of 'service'. Sets
+ * 'cached' if the port was taken from the cache.
+ */
+static unsigned short get_rpc_port(struct nsm_host *server, uint32_t prog,
+			uint32_t vers, const char *service, int *cached)
+{
+	struct nsm_pmap_query queries[NSM_RESOLV_MAXADDRS];
+	struct nsm_target *t = &server->target;
+	unsigned int i;
+
+	if (smn_resolve(server) < 0)
+		return 0;
+
+	/* all the addresses, NSM_ADDR_DELAY apart, the first answer wins */
+	for (i = 0; i < t->nr_addrs; i++) {
+		memset(&queries[i], 0, sizeof(queries[i]));
+		queries[i].addr = t->addrs[i];
+		queries[i].more = i < t->nr_addrs - 1;
+	}
+	nsm_pmap_getport(queries, t->nr_addrs, prog, vers, IPPROTO_UDP,
+							pmap_cache);
+
+	for (i = 0; i < t->nr_addrs; i++) {
+		if (queries[i].port) {
+			/* notifications try it first as well */
+			nsm_addr_prefer(t->addrs, i);
+			*cached = queries[i].cached;
+			return queries[i].port;
+		}
+	}
+
+	fprintf(stderr, "%s not found on %s: %s\n", service, server->name,
+					strerror(-queries[0].error));
+	return 0;
+}
+
+static unsigned short get_statd_port(struct nsm_host *server, int *cached)
+{
+	return get_rpc_port(server, NSM_PROGRAM, NSM_VERSION, "rpc.statd",
+								cached);
 }
 
+/*
+ * Find nlockmgr of the host for the probes.
+ */
+static int probe_init(struct nsm_host *server, const struct sockaddr *local)
+{
+	unsigned short port;
+	int cached;
+
+	port = get_rpc_port(server, NLM_PROGRAM, NLM_VERSION, "nlockmgr",
+								&cached);
+	if (!port)
+		return -1;
 
-int get_statd_port(char *host)
+	probe.addr = server->target.addrs[0];
+	smn_set_port((struct sockaddr *)&probe.addr, port);
+	probe.local = local;
+	if (gethostname(probe.caller, sizeof(probe.caller) - 1) < 0)
+		strcpy(probe.caller, "localhost");
+	return 0;
+}
+
+/*
+ * Returns the number of files, which are still locked or unknown.
+ */
+static unsigned int probe_locks(void)
 {
-	struct sockaddr_in sin;
-	struct pmaplist *prog_list;
+	unsigned int i, held;
 
-	sin.sin_family = AF_INET;
-	sin.sin_addr.s_addr = inet_addr(host);
-	sin.sin_port = htons(111);
-	
-	prog_list = pmap_getmaps(&sin);
-	if (!prog_list) {
-		fprintf(stderr, "Failed to connect to portmapper on %s\n", host);
-		return 0;
+	held = nsm_nlm_test((struct sockaddr *)&probe.addr, probe.local,
+			probe.caller, probe.files, probe.nr_files,
+			NSM_PROBE_TIMEOUT);
+
+	for (i = 0; i < probe.nr_files; i++)
+		v_printf("%s: %s\n", probe.files[i].name,
+				nsm_nlm_status(probe.files[i].status));
+	return held;
+}
+
+/*
+ * rpc.statd hands the notification to lockd on its own, so the locks are
+ * probed for up to 'wait' msec. Returns the number of files, which are
+ * still locked or unknown.
+ */
+static unsigned int wait_locks(long wait)
+{
+	long deadline = nsm_now_msec() + wait;
+	unsigned int held;
+
+	while ((held = probe_locks()) &&
+	       nsm_now_msec() + NSM_PROBE_INTERVAL < deadline)
+		usleep(NSM_PROBE_INTERVAL * 1000);
+	return held;
+}
+
+static int verify_locks(void)
+{
+	struct nsm_nlm_file *f;
+	unsigned int i;
+
+	if (wait_locks(NSM_PROBE_WAIT)) {
+		for (i = 0; i < probe.nr_files; i++) {
+			f = &probe.files[i];
+			if (f->status == NSM_NLM_DENIED)
+				fprintf(stderr, "%s is still locked "
+					"(svid %d)\n", f->name, f->svid);
+			else if (f->status != NSM_NLM_GRANTED)
+				fprintf(stderr, "%s: lock state is "
+					"unknown: %s\n", f->name,
+					nsm_nlm_status(f->status));
+		}
+		errno = EBUSY;
+		return -1;
+	}
+
+	printf("Locks on all %u files are released\n", probe.nr_files);
+	return 0;
+}
+
+static void sweep_fini(struct nsm_sweep *sw)
+{
+	free(sw->calls);
+	free(sw->hash);
+	nsm_batch_fini(&sw->tx);
+	nsm_batch_fini(&sw->rx);
+	nsm_timer_heap_fini(&sw->timers);
+}
+
+/*
+ * Move on from the states, which were tried before the sweep.
+ */
+static void sweep_skip(struct nsm_sweep *sw)
+{
+	for (;;) {
+		while (sw->nr_skip && *sw->skip < sw->next_state) {
+			sw->skip++;
+			sw->nr_skip--;
+		}
+		if (!sw->nr_skip || *sw->skip != sw->next_state ||
+		    sw->next_state == UINT_MAX)
+			break;
+		sw->next_state += 2;
+	}
+}
+
+static int sweep_init(struct nsm_sweep *sw, struct nsm_host *server,
+				char *client_name, unsigned int window,
+				const uint32_t *skip, unsigned int nr_skip)
+{
+	unsigned int i, hash_size = 1;
+
+	memset(sw, 0, sizeof(*sw));
+
+	if (nsm_tmpl_init(&sw->tmpl, client_name) < 0) {
+		fprintf(stderr, "Client name '%s' is too long\n", client_name);
+		return -1;
 	}
 
+	while (hash_size < 2 * window)
+		hash_size <<= 1;
+
+	sw->calls = calloc(window, sizeof(struct nsm_call));
+	sw->hash = calloc(hash_size, sizeof(struct nsm_call *));
+	if (!sw->calls || !sw->hash ||
+	    nsm_batch_init(&sw->tx, MIN(window, NSM_BATCH_SIZE)) < 0 ||
+	    nsm_batch_init(&sw->rx, MIN(window, NSM_BATCH_SIZE)) < 0 ||
+	    nsm_timer_heap_init(&sw->timers, window) < 0) {
+		fprintf(stderr, "Failed to allocate sweep window of %u "
+				"states\n", window);
+		sweep_fini(sw);
+		return -1;
+	}
+
+	for (i = 0; i < window; i++) {
+		sw->calls[i].next = sw->free;
+		sw->free = &sw->calls[i];
+	}
+
+	nsm_cwnd_init(&sw->cwnd, window);
+
+	sw->host = server;
+	sw->hash_mask = hash_size - 1;
+	sw->xid_base = getpid() + time(NULL);
+	sw->next_state = 1;
+	sw->skip = skip;
+	sw->nr_skip = nr_skip;
+	sweep_skip(sw);
+	return 0;
+}
+
+static struct nsm_call *sweep_find(struct nsm_sweep *sw, uint32_t xid)
+{
+	struct nsm_call *call;
+
+	for (call = sw->hash[xid & sw->hash_mask]; call; call = call->hnext)
+		if (call->xid == xid)
+			return call;
+	return NULL;
+}
+
+static void sweep_release(struct nsm_sweep *sw, struct nsm_call *call)
+{
+	struct nsm_call **pp = &sw->hash[call->xid & sw->hash_mask];
+
+	while (*pp != call)
+		pp = &(*pp)->hnext;
+	*pp = call->hnext;
+
+	nsm_timer_del(&sw->timers, &call->timer);
+
+	call->next = sw->free;
+	sw->free = call;
+	sw->in_flight--;
+}
+
+/*
+ * (Re)transmit the call and arm its retransmit timer. The timer heap is
+ * sized for the whole window, so arming never fails.
+ */
+static void sweep_xmit(struct nsm_sweep *sw, struct nsm_call *call)
+{
+	unsigned int i = sw->tx.count;
+
+	nsm_tmpl_fill(&sw->tmpl, nsm_batch_buf(&sw->tx, i), call->xid,
+				call->state, nsm_batch_iov(&sw->tx, i));
+	nsm_batch_queue_iov(&sw->tx, NSM_TMPL_IOVS,
+			(struct sockaddr *)&sw->host->addr, sw->host->addrlen);
+	nsm_metrics_count(sw->host->stats, sent);
+
+	call->sent = nsm_now_usec();
+	nsm_timer_add(&sw->timers, &call->timer, call->sent / 1000 +
+			nsm_rtt_timeout(&sw->host->rtt, call->retries));
+}
+
+/*
+ * Queue the next state of the sweep for sending.
+ */
+static void sweep_queue(struct nsm_sweep *sw)
+{
+	struct nsm_call *call = sw->free;
+	struct nsm_call **head;
+
+	sw->free = call->next;
+
+	/* Odd states only, so every state gets its own XID */
+	call->state = sw->next_state;
+	call->xid = sw->xid_base + (call->state >> 1);
+	call->retries = 0;
+
+	head = &sw->hash[call->xid & sw->hash_mask];
+	call->hnext = *head;
+	*head = call;
+
+	sweep_xmit(sw, call);
+
+	sw->in_flight++;
+	sw->next_state += 2;
+	sweep_skip(sw);
+	if (!(++sw->sent & 0xffffff))
+		printf("Sent states up to %u\n", call->state);
+}
+
+/*
+ * Fill the congestion window and send it out in batches, together with
+ * the queued retransmits. Returns 1 if the socket is full.
+ */
+static int sweep_send(int sock, struct nsm_sweep *sw)
+{
+	int result;
+
 	do {
-		static int iter = 0;
-		struct pmap *m = &prog_list->pml_map;
+		while (sw->in_flight < sw->cwnd.cwnd &&
+		       sw->next_state < UINT_MAX && !nsm_batch_full(&sw->tx))
+			sweep_queue(sw);
+
+		result = nsm_batch_flush(sock, &sw->tx);
+		if (result < 0) {
+			fprintf(stderr, "Sending Reboot Notification to "
+				"'%s' failed: errno %d (%s)\n", sw->host->name, errno, strerror(errno));
+			return -2;
+		}
+	} while (!result && sw->in_flight < sw->cwnd.cwnd &&
+		 sw->next_state < UINT_MAX);
 
-		if ((m->pm_prog == NSM_PROGRAM) && (m->pm_prot == IPPROTO_UDP))
-			return m->pm_port;
-		iter++;
-	} while(prog_list = prog_list->pml_next);
-	
-	fprintf(stderr, "rpc.statd not found on %s\n", host);
+	return result;
+}
+
+/*
+ * Retransmit the calls, which were not answered in time, with doubled
+ * timeout, and give up on the ones out of retries. Every loss shrinks
+ * the congestion window.
+ */
+static void sweep_expire(struct nsm_sweep *sw)
+{
+	struct nsm_timer *timer;
+	struct nsm_call *call;
+	long now = nsm_now_msec();
+
+	while ((timer = nsm_timer_first(&sw->timers)) &&
+	       timer->expires <= now) {
+		call = nsm_timer_entry(timer, struct nsm_call, timer);
+
+		nsm_cwnd_loss(&sw->cwnd, call->sent / 1000, now);
+
+		if (call->retries == NSM_RETRIES) {
+			sw->timedout++;
+			nsm_metrics_count(sw->host->stats, timeouts);
+			sweep_release(sw, call);
+			continue;
+		}
+
+		if (nsm_batch_full(&sw->tx))
+			break;		/* next round */
+
+		call->retries++;
+		sw->retransmits++;
+		nsm_metrics_count(sw->host->stats, retransmits);
+		sweep_xmit(sw, call);
+	}
+}
+
+/*
+ * Read all the replies queued on the socket. Replies may come in any
+ * order, they are matched to the calls by XID.
+ */
+static int sweep_recv(int sock, struct nsm_sweep *sw)
+{
+	uint32_t	*msgbuf;
+	struct nsm_call	*call;
+	int		res, i;
+
+	while ((res = nsm_batch_recv(sock, &sw->rx)) > 0) {
+		for (i = 0; i < res; i++) {
+			msgbuf = nsm_batch_buf(&sw->rx, i);
+			if (nsm_batch_len(&sw->rx, i) < sizeof(uint32_t))
+				continue;
+
+			call = sweep_find(sw, ntohl(msgbuf[0]));
+			if (!call)
+				continue;	/* late or foreign reply */
+
+			nsm_metrics_reply(sw->host->stats, msgbuf,
+						nsm_batch_len(&sw->rx, i));
+			if (smn_check_reply(msgbuf, nsm_batch_len(&sw->rx, i)) < 0) {
+				fprintf(stderr, "State %u was rejected\n", call->state);
+				return -1;
+			}
+
+			/* Only calls sent once give a reliable RTT sample */
+			if (!call->retries) {
+				long rtt = nsm_now_usec() - call->sent;
+
+				nsm_rtt_update(&sw->host->rtt, rtt);
+				nsm_metrics_rtt(sw->host->stats, rtt);
+			}
+			nsm_cwnd_ack(&sw->cwnd);
+
+			sw->answered++;
+			sweep_release(sw, call);
+		}
+	}
+
+	if (res < 0) {
+		fprintf(stderr, "Failed to receive server answer: %s\n",
+							strerror(errno));
+		return -1;
+	}
 	return 0;
 }
 
-uint32_t get_statd_state(char *dir)
+/*
+ * Forced mode: go over all the odd rpc.statd states, but the 'nr_skip'
+ * ones in 'skip', keeping up to 'window' notifications in flight. The
+ * actual number of calls in flight follows the congestion window.
+ */
+static int sweep_states(int sock, struct nsm_host *server,
+			unsigned short server_port, char *client_name,
+			unsigned int window, const uint32_t *skip,
+			unsigned int nr_skip)
 {
-	char statd_path[1024];
-	int fd;
+	struct nsm_sweep sweep, *sw = &sweep;
+	struct pollfd pfd;
+	long next_probe;
+	int result = 0, bufsize;
+
+	/* The sweep goes to the first address, which is the one the
+	 * portmapper answered on, if it was asked. */
+	if (smn_resolve(server) < 0)
+		return -1;
+	smn_set_port((struct sockaddr *)&server->target.addrs[0], server_port);
+	if (smn_use_addr(server, 0) < 0) {
+		fprintf(stderr, "%s can't be reached from the local address\n",
+							server->name);
+		return -1;
+	}
+
+	/* Make room for the replies to the whole window */
+	bufsize = MIN(window, 65536) * 1024;
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &bufsize, sizeof(bufsize)) < 0)
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+	if (sweep_init(sw, server, client_name, window, skip, nr_skip) < 0)
+		return -1;
+
+	pfd.fd = sock;
+	next_probe = nsm_now_msec() + NSM_PROBE_PERIOD;
+
+	while (sw->next_state < UINT_MAX || sw->in_flight) {
+		int blocked;
+		long wait;
+
+		if (probe.nr_files && nsm_now_msec() >= next_probe) {
+			if (!probe_locks()) {
+				printf("Locks are released, stopping the "
+					"sweep after state %u\n",
+					sw->next_state - 2);
+				break;
+			}
+			next_probe = nsm_now_msec() + NSM_PROBE_PERIOD;
+		}
+
+		sweep_expire(sw);
+		nsm_metrics_check();
+
+		result = blocked = sweep_send(sock, sw);
+		if (result < 0)
+			goto out;
+
+		wait = nsm_timer_wait(&sw->timers, nsm_now_msec());
+		if (probe.nr_files && (wait < 0 || wait > next_probe - nsm_now_msec()))
+			wait = MAX(next_probe - nsm_now_msec(), 0);
+
+		pfd.events = POLLIN;
+		if (blocked) {
+			/* expired timers wait for the socket to drain */
+			pfd.events |= POLLOUT;
+			wait = -1;
+		}
+
+		if (poll(&pfd, 1, wait) > 0 && (pfd.revents & POLLIN)) {
+			result = sweep_recv(sock, sw);
+			if (result < 0)
+				goto out;
+		}
+	}
+	result = 0;
+out:
+	printf("Sweep: %lu states sent, %lu answered, %lu retransmitted, "
+			"%lu timed out\n", sw->sent, sw->answered,
+			sw->retransmits, sw->timedout);
+	printf("RTT %ld usec, RTO %u msec, window %u\n", server->rtt.srtt,
+			server->rtt.rto, sw->cwnd.cwnd);
+	server->sent += sw->sent + sw->retransmits;
+	sweep_fini(sw);
+	return result;
+}
+
+/*
+ * Remember the state, which released the locks, for the next search.
+ */
+static void save_state(const char *history, uint32_t state)
+{
+	int result = nsm_cand_save(history, state);
+
+	if (result < 0)
+		fprintf(stderr, "Failed to save state to %s: %s\n", history,
+							strerror(-result));
+}
+
+/*
+ * Search mode: notify the candidate states one at a time, with the locks
+ * probed after each, and sweep the rest of the states only if none of
+ * them worked. Without files to probe every candidate is sent before the
+ * sweep.
+ */
+static int search_states(int sock, struct nsm_host *server,
+			unsigned short server_port, char *client_name,
+			unsigned int window, struct nsm_cand *cand,
+			const char *history)
+{
+	uint32_t *sorted;
+	unsigned int i;
 	int result;
-	uint32_t statd_state;
 
-	if (strlen(dir) > 1000) {
-		fprintf(stderr, "Path to rpc.statd database is too long (Max: 1000 symbols)\n");
+	/* free already: no candidate may be credited with it */
+	if (probe.nr_files && !probe_locks()) {
+		printf("Locks on all %u files are free already, nothing to "
+			"search for\n", probe.nr_files);
 		return 0;
 	}
-	strcpy(statd_path, dir);
-	strcat(statd_path, "/state");
-	fd = open(statd_path, O_RDONLY, 0644);
-	if (fd < 0) {
-		perror("open");
+
+	for (i = 0; i < cand->nr; i++) {
+		server->xid = 0;	/* a new call */
+		result = notify_host(sock, server, server_port, client_name,
+							cand->states[i]);
+		if (result < 0)
+			return result;
+
+		if (!probe.nr_files || wait_locks(NSM_CAND_WAIT))
+			continue;
+
+		printf("Locks are released by state %u, candidate %u of %u, "
+			"after %lu packets\n", cand->states[i], i + 1,
+			cand->nr, server->sent);
+		if (history)
+			save_state(history, cand->states[i]);
 		return 0;
 	}
-	result = lseek(fd, 0, SEEK_SET);
-	if (result < 0) {
-		perror("lseek");
-		return 0;
+
+	if (probe.nr_files)
+		printf("None of %u candidate states released the locks "
+			"(%lu packets), sweeping the rest\n", cand->nr,
+			server->sent);
+	else
+		printf("%u candidate states sent in %lu packets, sweeping "
+			"the rest\n", cand->nr, server->sent);
+
+	sorted = nsm_cand_sorted(cand);
+	if (!sorted) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
 	}
+	result = sweep_states(sock, server, server_port, client_name,
+				window, sorted, cand->nr);
+	free(sorted);
 
-	result = read(fd, &statd_state, 4);
-	if (result < 0) {
-		perror("read");
-		return 0;	
+	printf("Search: %lu packets in total\n", server->sent);
+	return result;
+}
+
+/*
+ * Candidates of the search: the given state, the one in 'state_dir', the
+ * history, the states around all of them, and the magic ones.
+ */
+static int get_candidates(struct nsm_cand *cand, uint32_t statd_state,
+			const char *state_dir, const char *history)
+{
+	uint32_t state;
+	int result = 0;
+
+	if (statd_state)
+		result = nsm_cand_add(cand, statd_state);
+	if (result >= 0 && state_dir) {
+		if (!nsm_statd_state(state_dir, &state) && state)
+			result = nsm_cand_add(cand, state);
+		else
+			fprintf(stderr, "Failed to get rpc.statd state value, "
+					"searching without it.\n");
+	}
+	if (result >= 0 && history) {
+		result = nsm_cand_load(cand, history);
+		if (result < 0)
+			fprintf(stderr, "Failed to read %s: %s\n", history,
+					strerror(-result));
 	}
-	return statd_state;
+	if (result >= 0)
+		result = nsm_cand_around(cand, NSM_CAND_RANGE);
+	if (result >= 0)
+		result = nsm_cand_magic(cand);
+	return result;
 }
 
 void help(char *name)
@@ -310,7 +958,21 @@ void help(char *name)
 	printf("\t-v                        Be verbose: print work progress\n\n");
 	printf("\t-f                        Force go over all possible rpc.statd state id values.\n");
 	printf("\t                          Warning: Since program is unable to determine if the locks are dropped on server,\n");
-	printf("\t                                   going over all possible values takes a lot of time.\n\n");
+	printf("\t                                   going over all possible values takes a lot of time. Use '-t' to stop early.\n\n");
+	printf("\t-w=window                 Number of states in flight in forced mode (default: %d).\n\n", NSM_WINDOW);
+	printf("\t-a                        Search the state: try the likely ones first, one at a time, then all the rest as '-f' does.\n");
+	printf("\t                          Candidates are 'statd_state', the state in 'state_dir', the history, the states up to %d\n", NSM_CAND_RANGE);
+	printf("\t                          away from those, and the magic states 3 and 1. Use '-t' to tell when a candidate worked.\n\n");
+	printf("\t-H=history_file           States, which released the locks before, one per line. Read by '-a', and the state,\n");
+	printf("\t                          which is confirmed by '-t' to release the locks, is appended.\n\n");
+	printf("\t-t=file                   File locked by the client: a file on the NFS mount or its NFSv3 file handle in hex. May be repeated.\n");
+	printf("\t                          After notification nlockmgr is asked with NLM_TEST, whether the locks on them are gone,\n");
+	printf("\t                          and forced mode stops as soon as they are.\n\n");
+	printf("\t-C=cache_file             Name resolution cache (default: %s). Empty name disables it.\n\n", NSM_RESOLV_CACHE);
+	printf("\t-P=cache_file             rpc.statd port cache (default: %s). Empty name disables it.\n\n", NSM_PMAP_CACHE);
+	printf("\t-M=metrics_file           Write packet counters and latency histograms there on exit and on SIGUSR1.\n");
+	printf("\t                          Prometheus text format, JSON if the name ends in \".json\".\n\n");
+	printf("\t-W=pcap_file              Capture all the packets sent and received to a pcap file, written by a separate thread.\n\n");
 	printf("\nReport bugs to skinsbursky@parallels.com\n");
 	return;
 }
@@ -321,6 +983,7 @@ int main(int argc, char **argv)
 	struct sockaddr_storage address;
 	struct sockaddr *local_addr = (struct sockaddr *)&address;
 	int	sock = -1;
+	struct nsm_port_pool ports;
 	struct addrinfo *ai;
 	int result;
 	static char *client;
@@ -330,13 +993,21 @@ int main(int argc, char **argv)
 	static uint32_t statd_state;
 	static char *local_address;
 	static int forced;
+	static int search;
+	static char *history;
+	static char *metrics_file;
+	static char *pcap_file;
+	struct nsm_cand cand = { 0 };
+	static unsigned int window = NSM_WINDOW;
+	int port_cached = 0, held = 0;
+	unsigned int i;
 
 	if (argc == 1) {
 		help(argv[0]);
 		return 0;
 	}
 	
-	while ((result = getopt(argc, argv, "c:d:s:p:i:l:vfh")) != EOF) {
+	while ((result = getopt(argc, argv, "c:d:s:p:i:l:w:C:P:t:H:M:W:vfah")) != EOF) {
 		switch (result) {
 			case 'c':
 				client = optarg;
@@ -362,6 +1033,44 @@ int main(int argc, char **argv)
 			case 'f':
 				forced = 1;
 				break;
+			case 'a':
+				search = 1;
+				break;
+			case 'H':
+				history = optarg;
+				break;
+			case 'M':
+				metrics_file = optarg;
+				break;
+			case 'W':
+				pcap_file = optarg;
+				break;
+			case 'w':
+				window = atoi(optarg);
+				break;
+			case 'C':
+				resolv_cache = *optarg ? optarg : NULL;
+				break;
+			case 'P':
+				pmap_cache = *optarg ? optarg : NULL;
+				break;
+			case 't':
+				probe.files = realloc(probe.files,
+						(probe.nr_files + 1) *
+						sizeof(struct nsm_nlm_file));
+				if (!probe.files) {
+					fprintf(stderr, "Out of memory\n");
+					exit(1);
+				}
+				result = nsm_nlm_fh(optarg,
+						&probe.files[probe.nr_files++]);
+				if (result < 0) {
+					fprintf(stderr, "No NFS file handle for "
+						"%s: %s\n", optarg,
+						strerror(-result));
+					exit(1);
+				}
+				break;
 			case 'h':
 				help(argv[0]);
 				exit(0);
@@ -384,13 +1093,25 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	if (!state_dir && !statd_state && !forced) {
+	if (!window) {
+		fprintf(stderr, "Window must be at least 1.\n");
+		exit(1);
+	}
+
+	if (!state_dir && !statd_state && !forced && !search) {
 		fprintf(stderr, "You must specify at least 'state_dir' or 'server' and 'statd_state' values.\n");
 		exit(1);
 	}
 
-	if (state_dir) {
-		if ((statd_state = get_statd_state(state_dir)) <= 0) {
+	if (search) {
+		if (get_candidates(&cand, statd_state, state_dir, history) < 0) {
+			fprintf(stderr, "Failed to make the candidate states.\n");
+			exit(1);
+		}
+		forced = 0;
+	} else if (state_dir) {
+		if (nsm_statd_state(state_dir, &statd_state) < 0 ||
+		    !statd_state) {
 			fprintf(stderr, "Failed to get rpc.statd state value.\n");
 			exit(1);
 		}
@@ -405,26 +1126,45 @@ int main(int argc, char **argv)
 		forced = 0;
 	}
 	
-	if (forced && verbose) {
-		printf("Option '-v' ommited since '-f' is specified\n");
+	if ((forced || search) && verbose) {
+		printf("Option '-v' ommited since '-%c' is specified\n",
+						search ? 'a' : 'f');
 		verbose = 0;
 	}
 
-	if (!port) {
-		if (!(port = get_statd_port(server)))
-			exit(1);
-	}
-
+	memset(&address, 0, sizeof(address));
 	if (local_address) {
 		if (!(ai = smn_lookup(local_address))) {
 			fprintf(stderr, "Not a valid hostname or address: \"%s\"\n",
 				local_address);
 			exit(1);
 		}
-	
-		/* We know it's IPv4 at this point */
+
 		memcpy(local_addr, ai->ai_addr, ai->ai_addrlen);
 		freeaddrinfo(ai);
+		/* servers are reached over the local address family only */
+		addr_family = local_addr->sa_family;
+	}
+
+	if (metrics_file && nsm_metrics_init(metrics_file) < 0) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	if (pcap_file && (result = nsm_pcap_open(pcap_file)) < 0) {
+		fprintf(stderr, "Failed to start capture to %s: %s\n",
+					pcap_file, strerror(-result));
+		exit(1);
+	}
+
+	memset (&host, 0, sizeof(struct nsm_host));
+	host.name = server;
+	host.stats = nsm_metrics_server(server);
+	nsm_rtt_init(&host.rtt);
+
+	if (!port) {
+		if (!(port = get_statd_port(&host, &port_cached)))
+			exit(1);
 	}
 
 	v_printf("Client          : '%s'\n", client);
@@ -432,52 +1172,57 @@ int main(int argc, char **argv)
 	v_printf("Port            : %d\n", port);
 	v_printf("prc.statd state : %d\n", statd_state);
 	v_printf("Forced mode     : %s\n", (forced) ? "Yes" : "No");
+	v_printf("Search mode     : %s\n", (search) ? "Yes" : "No");
 
-	do {
-		int retries = 10;
-		struct servent *se;
-		struct sockaddr_in *sin = (struct sockaddr_in *)local_addr;
-
-		sock = socket(AF_INET, SOCK_DGRAM, 0);
-		if (sock < 0) {
-			fprintf(stderr, "Failed to create RPC socket: %s\n",
-				strerror(errno));
-			exit(1);
-		}
-		fcntl(sock, F_SETFL, O_NONBLOCK);
-
-		bindresvport(sock, sin);
-		/* try to avoid known ports */
-		if (se = getservbyport(sin->sin_port, "udp")) {
-			retries--;
-			close(sock);
-		} else 
-			break;
-		if (!retries) {
-			fprintf(stderr, "Failed to bind RPC socket: %s\n",
-				stderror(errno));
-			exit(1);
-		}
-	} while (1);
+	if (nsm_port_pool_init(&ports, 1, local_address ? local_addr : NULL) < 0) {
+		fprintf(stderr, "Failed to bind RPC socket: %s\n",
+			strerror(errno));
+		exit(1);
+	}
+	sock = ports.socks[0];
+	sock_family = ports.family;
 
-	memset (&host, 0, sizeof(struct nsm_host));
-	host.name = server;
+	if (probe.nr_files &&
+	    probe_init(&host, local_address ? local_addr : NULL) < 0)
+		exit(1);
 
-	if (!forced) {
+	if (search)
+		result = search_states(sock, &host, port, client, window,
+							&cand, history);
+	else if (!forced) {
+		/* the state only released the locks if they were held */
+		held = probe.nr_files && probe_locks();
 		result = notify_host(sock, &host, port, client, statd_state);
-	} else {
-		int i;
-		for (i = 1; i < UINT_MAX; i += 2)
-			if ((result = notify_host(sock, &host, port, client, i)) < 0)
-				break;
-	}
+		if (result == -1 && port_cached) {
+			/* The server may have been rebooted since */
+			v_printf("Retrying with a fresh rpc.statd port\n");
+			for (i = 0; i < host.target.nr_addrs; i++)
+				nsm_pmap_forget(pmap_cache,
+					(struct sockaddr *)&host.target.addrs[i],
+					NSM_PROGRAM, NSM_VERSION, IPPROTO_UDP);
+			port_cached = 0;
+			if (!(port = get_statd_port(&host, &port_cached)))
+				exit(1);
+			result = notify_host(sock, &host, port, client,
+								statd_state);
+		}
+		if (!result && probe.nr_files) {
+			result = verify_locks();
+			if (!result && history && held)
+				save_state(history, statd_state);
+		}
+	} else
+		result = sweep_states(sock, &host, port, client, window,
+								NULL, 0);
 
 	if (result < 0	)
 		perror("Clearing NFS locks failed");
 	else
 		v_printf("Clearing NFS locks successfully completed.\n");
 
-	close(sock);
+	nsm_port_pool_fini(&ports);
+	free(probe.files);
+	nsm_cand_fini(&cand);
 
 	return result;
 }
@@ -7,6 +7,8 @@
 
 #include <netinet/in.h>
 
+#include "nsm_timer.h"
+
 /*
  * Primary information structure.
  */
@@ -22,6 +24,8 @@ struct notify_list {
   struct notify_list	*prev;	/* Linked list backward pointer. */
   u_int32_t		xid;	/* XID of MS_NOTIFY RPC call */
   time_t		when;	/* notify: timeout for re-xmit */
+  struct nsm_timer	timer;	/* re-xmit timer */
+  struct notify_list	*xnext;	/* XID hash chain */
 };
 
 typedef struct notify_list notify_list;
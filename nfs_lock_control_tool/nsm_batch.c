@@ -0,0 +1,179 @@
+/*
+ * Batched datagram I/O for NSM notification traffic.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "nsm_batch.h"
+
+nsm_tap_t nsm_batch_tap;
+
+int nsm_batch_init(struct nsm_batch *b, unsigned int size)
+{
+	unsigned int i;
+
+	memset(b, 0, sizeof(*b));
+
+	b->msgs = calloc(size, sizeof(struct mmsghdr));
+	b->iov = calloc(size * NSM_BATCH_IOVS, sizeof(struct iovec));
+	b->addrs = calloc(size, sizeof(struct sockaddr_storage));
+	b->bufs = calloc(size, NSM_BATCH_MSGSIZE * sizeof(uint32_t));
+	if (!b->msgs || !b->iov || !b->addrs || !b->bufs) {
+		nsm_batch_fini(b);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	b->size = size;
+
+	for (i = 0; i < size; i++) {
+		b->msgs[i].msg_hdr.msg_iov = nsm_batch_iov(b, i);
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
+		b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+		nsm_batch_iov(b, i)->iov_base = nsm_batch_buf(b, i);
+	}
+
+	return 0;
+}
+
+void nsm_batch_fini(struct nsm_batch *b)
+{
+	free(b->msgs);
+	free(b->iov);
+	free(b->addrs);
+	free(b->bufs);
+	memset(b, 0, sizeof(*b));
+}
+
+/*
+ * Queue the packet built in nsm_batch_buf(b, b->count).
+ */
+void nsm_batch_queue(struct nsm_batch *b, unsigned int len,
+			const struct sockaddr *addr, socklen_t addrlen)
+{
+	struct iovec *iov = nsm_batch_iov(b, b->count);
+
+	iov->iov_base = nsm_batch_buf(b, b->count);
+	iov->iov_len = len;
+	nsm_batch_queue_iov(b, 1, addr, addrlen);
+}
+
+/*
+ * Queue the packet gathered from the first 'iovlen' iovecs at
+ * nsm_batch_iov(b, b->count). The data they point to is not copied and
+ * must stay intact until the batch is flushed.
+ */
+void nsm_batch_queue_iov(struct nsm_batch *b, unsigned int iovlen,
+			const struct sockaddr *addr, socklen_t addrlen)
+{
+	unsigned int i = b->count++;
+
+	b->msgs[i].msg_hdr.msg_iovlen = iovlen;
+	memcpy(&b->addrs[i], addr, addrlen);
+	b->msgs[i].msg_hdr.msg_namelen = addrlen;
+}
+
+/*
+ * Send all the queued packets.
+ *
+ * Returns 0 if everything was sent and the batch is empty again, 1 if
+ * the socket is full and the rest has to be sent later. On error -1 is
+ * returned and the failed packet is left at b->head: the caller may
+ * skip it by incrementing b->head and flush again.
+ */
+int nsm_batch_flush(int sock, struct nsm_batch *b)
+{
+	int res;
+
+	while (b->head < b->count) {
+		res = sendmmsg(sock, &b->msgs[b->head], b->count - b->head, 0);
+		if (res < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (nsm_batch_tap)
+			nsm_batch_tap(sock, &b->msgs[b->head], res, 1);
+		b->head += res;
+	}
+
+	b->head = b->count = 0;
+	return 0;
+}
+
+/*
+ * Receive as many packets as are queued on the socket, up to the batch
+ * size, without blocking.
+ *
+ * Returns the number of packets received, or -1 on error.
+ */
+int nsm_batch_recv(int sock, struct nsm_batch *b)
+{
+	unsigned int i;
+	int res;
+
+	for (i = 0; i < b->size; i++) {
+		struct iovec *iov = nsm_batch_iov(b, i);
+
+		iov->iov_base = nsm_batch_buf(b, i);
+		iov->iov_len = NSM_BATCH_MSGSIZE * sizeof(uint32_t);
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
+		b->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+	}
+
+	b->head = b->count = 0;
+
+	res = recvmmsg(sock, b->msgs, b->size, MSG_DONTWAIT, NULL);
+	if (res < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		return -1;
+	}
+
+	b->count = res;
+	if (nsm_batch_tap)
+		nsm_batch_tap(sock, b->msgs, res, 0);
+	return res;
+}
+
+/*
+ * Show the tap a datagram of 'len' bytes sent or received with 'hdr'.
+ */
+void nsm_batch_tap_msg(int sock, const struct msghdr *hdr, unsigned int len,
+								int out)
+{
+	struct mmsghdr msg;
+
+	if (!nsm_batch_tap)
+		return;
+	msg.msg_hdr = *hdr;
+	msg.msg_len = len;
+	nsm_batch_tap(sock, &msg, 1, out);
+}
+
+/*
+ * Same for a datagram in a single buffer, 'peer' is where it went or
+ * came from.
+ */
+void nsm_batch_tap_buf(int sock, const void *buf, unsigned int len,
+				const struct sockaddr *peer, int out)
+{
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+	struct msghdr hdr = {
+		.msg_name	= (void *)peer,
+		.msg_namelen	= peer->sa_family == AF_INET6 ?
+					sizeof(struct sockaddr_in6) :
+					sizeof(struct sockaddr_in),
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+	};
+
+	nsm_batch_tap_msg(sock, &hdr, len, out);
+}
@@ -0,0 +1,60 @@
+/*
+ * Batched datagram I/O for NSM notification traffic.
+ *
+ * Packets are queued into a batch and sent with a single sendmmsg(),
+ * answers are drained with a single recvmmsg().
+ */
+
+#ifndef __NSM_BATCH_H__
+#define __NSM_BATCH_H__
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define NSM_BATCH_SIZE		256	/* packets per syscall */
+#define NSM_BATCH_MSGSIZE	256	/* packet buffer size in 32-bit words */
+#define NSM_BATCH_IOVS		3	/* pieces a packet may be gathered from */
+
+/*
+ * Sees every packet sent ('out' set) or received on 'sock', if it's set
+ * (nsm_pcap does that). The single datagram paths call it too, through
+ * nsm_batch_tap_msg() and nsm_batch_tap_buf().
+ */
+struct mmsghdr;
+
+typedef void (*nsm_tap_t)(int sock, const struct mmsghdr *, unsigned int,
+								int out);
+
+extern nsm_tap_t	nsm_batch_tap;
+
+struct nsm_batch {
+	unsigned int		size;	/* packets the batch can hold */
+	unsigned int		head;	/* first packet not sent yet */
+	unsigned int		count;	/* packets queued or received */
+	struct mmsghdr *	msgs;
+	struct iovec *		iov;	/* NSM_BATCH_IOVS per packet */
+	struct sockaddr_storage	*addrs;
+	uint32_t *		bufs;
+};
+
+extern int		nsm_batch_init(struct nsm_batch *, unsigned int);
+extern void		nsm_batch_fini(struct nsm_batch *);
+extern void		nsm_batch_queue(struct nsm_batch *, unsigned int,
+					const struct sockaddr *, socklen_t);
+extern void		nsm_batch_queue_iov(struct nsm_batch *, unsigned int,
+					const struct sockaddr *, socklen_t);
+extern int		nsm_batch_flush(int, struct nsm_batch *);
+extern int		nsm_batch_recv(int, struct nsm_batch *);
+extern void		nsm_batch_tap_msg(int, const struct msghdr *,
+					unsigned int, int);
+extern void		nsm_batch_tap_buf(int, const void *, unsigned int,
+					const struct sockaddr *, int);
+
+#define nsm_batch_buf(B, I)	(&(B)->bufs[(I) * NSM_BATCH_MSGSIZE])
+#define nsm_batch_iov(B, I)	(&(B)->iov[(I) * NSM_BATCH_IOVS])
+#define nsm_batch_len(B, I)	((B)->msgs[(I)].msg_len)
+#define nsm_batch_addr(B, I)	((struct sockaddr *)&(B)->addrs[(I)])
+#define nsm_batch_full(B)	((B)->count == (B)->size)
+#define nsm_batch_pending(B)	((B)->head < (B)->count)
+
+#endif /* __NSM_BATCH_H__ */
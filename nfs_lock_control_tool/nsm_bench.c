@@ -0,0 +1,606 @@
+/*
+ * SM_NOTIFY throughput benchmark.
+ *
+ * Forks a local UDP stand-in, which answers every SM_NOTIFY with
+ * success, and pushes the same number of notifications to it using one
+ * sendto()/poll()/recv() per packet and using batched sendmmsg() and
+ * recvmmsg(). Both modes keep the same window of packets in flight.
+ * The batched mode is run once more with packets made of precompiled
+ * templates.
+ *
+ * Before that, the cost of building packets alone is measured: full
+ * encoding into a cleared buffer against patching a template, and the
+ * libtirpc XDR path against the fixed layout of nsm_xdr for the messages
+ * rmtcall sends and receives, with the heap allocations of each.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/poll.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <rpc/rpc.h>
+#include <rpc/pmap_prot.h>
+
+#include "nsm_batch.h"
+#include "nsm_tmpl.h"
+#include "nsm_xdr.h"
+#include "nsm_clock.h"
+
+#define NSM_PROGRAM	100024
+#define NSM_VERSION	1
+#define NSM_NOTIFY	6
+
+#define REPLY_SIZE	24
+#define BENCH_TIMEOUT	1000	/* msec to wait before counting packets lost */
+#define BENCH_SOCKBUF	(16 << 20)
+#define BENCH_CLIENT	"bench-client"
+
+struct bench_result {
+	unsigned long	sent;
+	unsigned long	answered;
+	unsigned long	lost;
+	double		seconds;
+};
+
+/*
+ * Heap use is counted by wrapping the allocator, libtirpc included.
+ */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static unsigned long nr_allocs, alloc_bytes;
+
+void *malloc(size_t size)
+{
+	nr_allocs++;
+	alloc_bytes += size;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	nr_allocs++;
+	alloc_bytes += nmemb * size;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	nr_allocs++;
+	alloc_bytes += size;
+	return __libc_realloc(ptr, size);
+}
+
+static unsigned int build_notify(uint32_t *msgbuf, uint32_t xid,
+				const char *client_name, uint32_t state)
+{
+	uint32_t	*p = msgbuf;
+	unsigned int	len = strlen(client_name);
+
+	*p++ = htonl(xid);
+	*p++ = 0;
+	*p++ = htonl(2);
+	*p++ = htonl(NSM_PROGRAM);
+	*p++ = htonl(NSM_VERSION);
+	*p++ = htonl(NSM_NOTIFY);
+	*p++ = 0; *p++ = 0;
+	*p++ = 0; *p++ = 0;
+	*p++ = htonl(len);
+	p[len >> 2] = 0;
+	memcpy(p, client_name, len);
+	p += (len + 3) >> 2;
+	*p++ = htonl(state);
+
+	return (p - msgbuf) << 2;
+}
+
+/*
+ * Packets built per second, with a sum of their words to keep the
+ * compiler from dropping the work.
+ */
+static void bench_encode(unsigned long packets)
+{
+	uint32_t msgbuf[NSM_BATCH_MSGSIZE], words[2], sum = 0;
+	struct iovec iov[NSM_TMPL_IOVS];
+	struct nsm_tmpl tmpl;
+	unsigned long i;
+	unsigned int len, j;
+	double start, full, patch;
+
+	start = nsm_now_sec();
+	for (i = 0; i < packets; i++) {
+		memset(msgbuf, 0, sizeof(msgbuf));
+		len = build_notify(msgbuf, i, BENCH_CLIENT, 2 * i + 1);
+		for (j = 0; j < len / 4; j++)
+			sum += msgbuf[j];
+	}
+	full = nsm_now_sec() - start;
+
+	start = nsm_now_sec();
+	nsm_tmpl_init(&tmpl, BENCH_CLIENT);
+	for (i = 0; i < packets; i++) {
+		nsm_tmpl_fill(&tmpl, words, i, 2 * i + 1, iov);
+		for (j = 0; j < NSM_TMPL_IOVS; j++)
+			sum += *(uint32_t *)iov[j].iov_base;
+	}
+	patch = nsm_now_sec() - start;
+
+	printf("%-10s %12s %8s\n", "encode", "packets/s", "seconds");
+	printf("%-10s %12.0f %8.3f\n", "full", packets / full, full);
+	printf("%-10s %12.0f %8.3f\n", "template", packets / patch, patch);
+	printf("(checksum %08x)\n\n", sum);
+}
+
+struct bench_status {
+	char *		mon_name;
+	int		state;
+	char		priv[NSM_XDR_PRIV_SIZE];
+};
+
+static bool_t xdr_bench_status(XDR *xdrs, struct bench_status *st)
+{
+	return xdr_string(xdrs, &st->mon_name, 1024) &&
+	       xdr_int(xdrs, &st->state) &&
+	       xdr_opaque(xdrs, st->priv, NSM_XDR_PRIV_SIZE);
+}
+
+/*
+ * A status callback (pmap == 0) or a GETPORT call, the way xmit_call()
+ * did it.
+ */
+static unsigned int tirpc_encode(uint32_t *msgbuf, uint32_t xid, int pmap,
+					struct bench_status *st)
+{
+	struct rpc_msg mesg;
+	struct pmap map;
+	XDR xdr;
+	xdrproc_t func = (xdrproc_t)xdr_bench_status;
+	void *obj = st;
+	unsigned int len = 0;
+
+	memset(&mesg, 0, sizeof(mesg));
+	mesg.rm_xid = xid;
+	mesg.rm_direction = CALL;
+	mesg.rm_call.cb_rpcvers = 2;
+	mesg.rm_call.cb_cred.oa_flavor = AUTH_NULL;
+	mesg.rm_call.cb_verf.oa_flavor = AUTH_NULL;
+	if (pmap) {
+		mesg.rm_call.cb_prog = PMAPPROG;
+		mesg.rm_call.cb_vers = PMAPVERS;
+		mesg.rm_call.cb_proc = PMAPPROC_GETPORT;
+		map.pm_prog = 100021;
+		map.pm_vers = 3;
+		map.pm_prot = IPPROTO_UDP;
+		map.pm_port = 0;
+		func = (xdrproc_t)xdr_pmap;
+		obj = &map;
+	} else {
+		mesg.rm_call.cb_prog = 100021;
+		mesg.rm_call.cb_vers = 3;
+		mesg.rm_call.cb_proc = 16;
+	}
+
+	xdrmem_create(&xdr, (caddr_t)msgbuf, NSM_BATCH_MSGSIZE * 4,
+							XDR_ENCODE);
+	if (xdr_callmsg(&xdr, &mesg) && func(&xdr, obj))
+		len = xdr_getpos(&xdr);
+	xdr_destroy(&xdr);
+	return len;
+}
+
+static unsigned int nsm_encode(uint32_t *msgbuf, uint32_t xid, int pmap,
+					struct bench_status *st)
+{
+	uint32_t *p;
+
+	if (pmap) {
+		p = nsm_xdr_call(msgbuf, xid, PMAPPROG, PMAPVERS,
+						PMAPPROC_GETPORT);
+		p = nsm_xdr_pmap(p, 100021, 3, IPPROTO_UDP, 0);
+	} else {
+		p = nsm_xdr_call(msgbuf, xid, 100021, 3, 16);
+		p = nsm_xdr_status(p, st->mon_name, strlen(st->mon_name),
+						st->state, st->priv);
+	}
+	return (p - msgbuf) << 2;
+}
+
+static uint32_t tirpc_decode(uint32_t *msgbuf, unsigned int len)
+{
+	struct rpc_msg mesg;
+	u_long port = 0;
+	XDR xdr;
+
+	xdrmem_create(&xdr, (caddr_t)msgbuf, len, XDR_DECODE);
+	memset(&mesg, 0, sizeof(mesg));
+	mesg.rm_reply.rp_acpt.ar_results.where = NULL;
+	mesg.rm_reply.rp_acpt.ar_results.proc = (xdrproc_t)xdr_void;
+	if (xdr_replymsg(&xdr, &mesg) &&
+	    mesg.rm_reply.rp_stat == MSG_ACCEPTED &&
+	    mesg.rm_reply.rp_acpt.ar_stat == SUCCESS)
+		xdr_u_long(&xdr, &port);
+	xdr_destroy(&xdr);
+	return mesg.rm_xid + port;
+}
+
+static uint32_t nsm_decode(uint32_t *msgbuf, unsigned int len)
+{
+	const uint32_t *res;
+	uint32_t xid = 0, port = 0;
+
+	if (nsm_xdr_reply(msgbuf, len, &xid, &res) == NSM_XDR_SUCCESS)
+		nsm_xdr_get_u32(&res, msgbuf + len / 4, &port);
+	return xid + port;
+}
+
+static void xdr_report(const char *name, unsigned long n, double start,
+			unsigned long allocs, unsigned long bytes)
+{
+	double sec = nsm_now_sec() - start;
+
+	printf("%-14s %12.0f %10.2f %10.1f\n", name, n / sec,
+			(double)(nr_allocs - allocs) / n,
+			(double)(alloc_bytes - bytes) / n);
+}
+
+/*
+ * Messages per second and heap use per message of both XDR paths. The
+ * messages alternate between a status callback and a GETPORT call, like
+ * rmtcall's, and replies are GETPORT answers.
+ */
+static void bench_xdr(unsigned long n)
+{
+	uint32_t msgbuf[NSM_BATCH_MSGSIZE], other[NSM_BATCH_MSGSIZE];
+	uint32_t reply[7], sum = 0;
+	struct bench_status st = { .mon_name = BENCH_CLIENT, .state = 3 };
+	unsigned long i, allocs, bytes;
+	unsigned int len;
+	double start;
+
+	/* both must give the same bytes */
+	for (i = 0; i < 2; i++) {
+		len = tirpc_encode(msgbuf, 1, i, &st);
+		if (len != nsm_encode(other, 1, i, &st) ||
+		    memcmp(msgbuf, other, len))
+			printf("XDR mismatch in %s message!\n",
+					i ? "GETPORT" : "status");
+	}
+
+	reply[0] = htonl(7);
+	reply[1] = htonl(1);		/* REPLY */
+	reply[2] = 0;			/* MSG_ACCEPTED */
+	reply[3] = 0; reply[4] = 0;	/* verf */
+	reply[5] = 0;			/* SUCCESS */
+	reply[6] = htonl(32768);
+	if (tirpc_decode(reply, sizeof(reply)) !=
+				nsm_decode(reply, sizeof(reply)))
+		printf("XDR mismatch in reply!\n");
+
+	printf("%-14s %12s %10s %10s\n", "xdr", "msgs/s", "allocs/msg",
+						"bytes/msg");
+
+	allocs = nr_allocs; bytes = alloc_bytes; start = nsm_now_sec();
+	for (i = 0; i < n; i++)
+		sum += tirpc_encode(msgbuf, i, i & 1, &st) + msgbuf[0];
+	xdr_report("tirpc encode", n, start, allocs, bytes);
+
+	allocs = nr_allocs; bytes = alloc_bytes; start = nsm_now_sec();
+	for (i = 0; i < n; i++)
+		sum += nsm_encode(msgbuf, i, i & 1, &st) + msgbuf[0];
+	xdr_report("nsm_xdr encode", n, start, allocs, bytes);
+
+	allocs = nr_allocs; bytes = alloc_bytes; start = nsm_now_sec();
+	for (i = 0; i < n; i++) {
+		reply[0] = i;
+		sum += tirpc_decode(reply, sizeof(reply));
+	}
+	xdr_report("tirpc decode", n, start, allocs, bytes);
+
+	allocs = nr_allocs; bytes = alloc_bytes; start = nsm_now_sec();
+	for (i = 0; i < n; i++) {
+		reply[0] = i;
+		sum += nsm_decode(reply, sizeof(reply));
+	}
+	xdr_report("nsm_xdr decode", n, start, allocs, bytes);
+	printf("(checksum %08x)\n\n", sum);
+}
+
+static int bench_socket(struct sockaddr_in *sin)
+{
+	socklen_t len = sizeof(*sin);
+	int sock, bufsize = BENCH_SOCKBUF;
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &bufsize, sizeof(bufsize)) < 0)
+		setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(sock, (struct sockaddr *)sin, sizeof(*sin)) < 0 ||
+	    getsockname(sock, (struct sockaddr *)sin, &len) < 0) {
+		perror("bind");
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/*
+ * The stand-in rpc.statd: answer every call with an accepted, successful
+ * reply carrying the same XID.
+ */
+static void stand_in(int sock)
+{
+	struct nsm_batch rx, tx;
+	uint32_t *req, *rep;
+	int res, i;
+
+	if (nsm_batch_init(&rx, NSM_BATCH_SIZE) < 0 ||
+	    nsm_batch_init(&tx, NSM_BATCH_SIZE) < 0) {
+		perror("stand-in");
+		exit(1);
+	}
+
+	while (1) {
+		struct pollfd pfd = { .fd = sock, .events = POLLIN };
+
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			exit(1);
+
+		while ((res = nsm_batch_recv(sock, &rx)) > 0) {
+			for (i = 0; i < res; i++) {
+				req = nsm_batch_buf(&rx, i);
+				rep = nsm_batch_buf(&tx, tx.count);
+				rep[0] = req[0];
+				rep[1] = htonl(1);
+				rep[2] = rep[3] = rep[4] = rep[5] = 0;
+				nsm_batch_queue(&tx, REPLY_SIZE,
+					(struct sockaddr *)&rx.addrs[i],
+					rx.msgs[i].msg_hdr.msg_namelen);
+			}
+			while (nsm_batch_flush(sock, &tx) > 0)
+				;
+		}
+	}
+}
+
+static int check_reply(uint32_t *msgbuf, int len)
+{
+	return len >= REPLY_SIZE && msgbuf[1] == htonl(1) && !msgbuf[2] &&
+		!msgbuf[3] && !msgbuf[4] && !msgbuf[5];
+}
+
+/*
+ * One syscall per packet: the way the tools used to talk to statd.
+ */
+static void run_single(int sock, struct sockaddr_in *server,
+			unsigned long packets, unsigned int window,
+			struct bench_result *r)
+{
+	uint32_t msgbuf[NSM_BATCH_MSGSIZE];
+	struct pollfd pfd = { .fd = sock, .events = POLLIN };
+	unsigned long in_flight = 0;
+	uint32_t xid = getpid();
+	unsigned int len;
+	int res;
+
+	memset(r, 0, sizeof(*r));
+	r->seconds = nsm_now_sec();
+
+	while (r->sent < packets || in_flight) {
+		while (r->sent < packets && in_flight < window) {
+			len = build_notify(msgbuf, xid + r->sent, BENCH_CLIENT,
+						2 * r->sent + 1);
+			if (sendto(sock, msgbuf, len, 0,
+				   (struct sockaddr *)server, sizeof(*server)) < 0)
+				break;
+			r->sent++;
+			in_flight++;
+		}
+
+		if (poll(&pfd, 1, BENCH_TIMEOUT) != 1) {
+			r->lost += in_flight;
+			in_flight = 0;
+			continue;
+		}
+
+		res = recv(sock, msgbuf, sizeof(msgbuf), MSG_DONTWAIT);
+		if (res < 0)
+			continue;
+		if (check_reply(msgbuf, res))
+			r->answered++;
+		if (in_flight)
+			in_flight--;
+	}
+
+	r->seconds = nsm_now_sec() - r->seconds;
+}
+
+/*
+ * Batched path: sendmmsg()/recvmmsg() via nsm_batch, with the packets
+ * encoded in full or gathered from a template.
+ */
+static void run_batch(int sock, struct sockaddr_in *server,
+			unsigned long packets, unsigned int window,
+			unsigned int batch, int use_tmpl,
+			struct bench_result *r)
+{
+	struct nsm_tmpl tmpl;
+	struct nsm_batch tx, rx;
+	struct pollfd pfd = { .fd = sock };
+	unsigned long in_flight = 0;
+	uint32_t xid = getpid();
+	unsigned int len;
+	int res, i;
+
+	if (nsm_batch_init(&tx, batch) < 0 || nsm_batch_init(&rx, batch) < 0) {
+		perror("nsm_batch_init");
+		exit(1);
+	}
+
+	nsm_tmpl_init(&tmpl, BENCH_CLIENT);
+
+	memset(r, 0, sizeof(*r));
+	r->seconds = nsm_now_sec();
+
+	while (r->sent < packets || in_flight) {
+		while (r->sent < packets && in_flight < window &&
+		       !nsm_batch_full(&tx)) {
+			i = tx.count;
+			if (use_tmpl) {
+				nsm_tmpl_fill(&tmpl, nsm_batch_buf(&tx, i),
+					xid + r->sent, 2 * r->sent + 1,
+					nsm_batch_iov(&tx, i));
+				nsm_batch_queue_iov(&tx, NSM_TMPL_IOVS,
+						(struct sockaddr *)server,
+						sizeof(*server));
+			} else {
+				len = build_notify(nsm_batch_buf(&tx, i),
+					xid + r->sent, BENCH_CLIENT,
+					2 * r->sent + 1);
+				nsm_batch_queue(&tx, len,
+						(struct sockaddr *)server,
+						sizeof(*server));
+			}
+			r->sent++;
+			in_flight++;
+		}
+
+		if (nsm_batch_flush(sock, &tx) < 0) {
+			perror("sendmmsg");
+			exit(1);
+		}
+
+		pfd.events = POLLIN;
+		if (nsm_batch_pending(&tx))
+			pfd.events |= POLLOUT;
+
+		if (poll(&pfd, 1, BENCH_TIMEOUT) != 1) {
+			r->lost += in_flight;
+			in_flight = 0;
+			continue;
+		}
+
+		while ((res = nsm_batch_recv(sock, &rx)) > 0) {
+			for (i = 0; i < res; i++)
+				if (check_reply(nsm_batch_buf(&rx, i),
+						nsm_batch_len(&rx, i)))
+					r->answered++;
+			in_flight -= MIN(in_flight, res);
+		}
+	}
+
+	r->seconds = nsm_now_sec() - r->seconds;
+	nsm_batch_fini(&tx);
+	nsm_batch_fini(&rx);
+}
+
+static void report(const char *mode, struct bench_result *r)
+{
+	printf("%-10s %10lu %10lu %10lu %8.3f %12.0f\n", mode, r->sent,
+			r->answered, r->lost, r->seconds,
+			r->answered / r->seconds);
+}
+
+static void help(char *name)
+{
+	printf("Usage: %s [OPTIONS]\n\n", name);
+	printf("\t-n packets                Notifications to send in each mode (default: 1000000).\n\n");
+	printf("\t-w window                 Notifications in flight (default: 4096).\n\n");
+	printf("\t-b batch                  Packets per sendmmsg()/recvmmsg() (default: %d).\n\n", NSM_BATCH_SIZE);
+	printf("\t-h                        This help.\n\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long packets = 1000000;
+	unsigned int window = 4096, batch = NSM_BATCH_SIZE;
+	struct sockaddr_in server, client;
+	struct bench_result r;
+	int srv_sock, sock, result;
+	pid_t pid;
+
+	while ((result = getopt(argc, argv, "n:w:b:h")) != EOF) {
+		switch (result) {
+			case 'n':
+				packets = strtoul(optarg, NULL, 0);
+				break;
+			case 'w':
+				window = atoi(optarg);
+				break;
+			case 'b':
+				batch = atoi(optarg);
+				break;
+			case 'h':
+				help(argv[0]);
+				exit(0);
+			default:
+				help(argv[0]);
+				exit(2);
+		}
+	}
+
+	if (!window || !batch) {
+		fprintf(stderr, "Window and batch must be at least 1.\n");
+		exit(1);
+	}
+
+	srv_sock = bench_socket(&server);
+	if (srv_sock < 0)
+		exit(1);
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (!pid)
+		stand_in(srv_sock);
+	close(srv_sock);
+
+	sock = bench_socket(&client);
+	if (sock < 0) {
+		kill(pid, SIGKILL);
+		exit(1);
+	}
+
+	bench_encode(packets);
+	bench_xdr(packets);
+
+	printf("Stand-in statd on 127.0.0.1:%d, window %u, batch %u\n\n",
+				ntohs(server.sin_port), window, batch);
+	printf("%-10s %10s %10s %10s %8s %12s\n", "mode", "sent", "answered",
+				"lost", "seconds", "packets/s");
+
+	run_single(sock, &server, packets, window, &r);
+	report("sendto", &r);
+
+	run_batch(sock, &server, packets, window, batch, 0, &r);
+	report("sendmmsg", &r);
+
+	run_batch(sock, &server, packets, window, batch, 1, &r);
+	report("template", &r);
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	close(sock);
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * Candidate rpc.statd states.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/param.h>
+
+#include "nsm_cand.h"
+
+/* Some rpc.statd versions don't drop locks for state 1 (the magic one),
+ * if they know state 3 for the client, so 3 goes first. */
+static const uint32_t magic_states[] = { 3, 1 };
+
+/*
+ * Add 'state' unless it's there already. Returns 1 if it's added, 0 if
+ * not and -ENOMEM.
+ */
+int nsm_cand_add(struct nsm_cand *c, uint32_t state)
+{
+	uint32_t *states;
+	unsigned int i;
+
+	for (i = 0; i < c->nr; i++)
+		if (c->states[i] == state)
+			return 0;
+
+	if (c->nr == c->size) {
+		states = realloc(c->states, (c->size * 2 + 16) *
+							sizeof(*states));
+		if (!states)
+			return -ENOMEM;
+		c->states = states;
+		c->size = c->size * 2 + 16;
+	}
+	c->states[c->nr++] = state;
+	return 1;
+}
+
+/*
+ * Add the newest NSM_CAND_HISTORY states of the history file, newest
+ * first. A missing file is an empty history.
+ */
+int nsm_cand_load(struct nsm_cand *c, const char *file)
+{
+	uint32_t history[NSM_CAND_HISTORY];
+	unsigned long state;
+	unsigned int nr = 0, i;
+	char line[64], *end;
+	FILE *f;
+	int res;
+
+	f = fopen(file, "r");
+	if (!f)
+		return errno == ENOENT ? 0 : -errno;
+
+	while (fgets(line, sizeof(line), f)) {
+		errno = 0;
+		state = strtoul(line, &end, 0);
+		if (errno || end == line || state > UINT32_MAX)
+			continue;
+		history[nr++ % NSM_CAND_HISTORY] = state;
+	}
+	fclose(f);
+
+	for (i = 0; i < MIN(nr, NSM_CAND_HISTORY); i++) {
+		res = nsm_cand_add(c, history[(nr - 1 - i) % NSM_CAND_HISTORY]);
+		if (res < 0)
+			return res;
+	}
+	return 0;
+}
+
+/*
+ * Add the states up to 'range' away from every one added so far,
+ * nearest first.
+ */
+int nsm_cand_around(struct nsm_cand *c, unsigned int range)
+{
+	unsigned int i, d, known = c->nr;
+	uint32_t state;
+	int res;
+
+	for (d = 1; d <= range; d++) {
+		for (i = 0; i < known; i++) {
+			state = c->states[i];
+			if (state <= UINT32_MAX - d &&
+			    (res = nsm_cand_add(c, state + d)) < 0)
+				return res;
+			if (state > d &&
+			    (res = nsm_cand_add(c, state - d)) < 0)
+				return res;
+		}
+	}
+	return 0;
+}
+
+int nsm_cand_magic(struct nsm_cand *c)
+{
+	unsigned int i;
+	int res;
+
+	for (i = 0; i < sizeof(magic_states) / sizeof(magic_states[0]); i++)
+		if ((res = nsm_cand_add(c, magic_states[i])) < 0)
+			return res;
+	return 0;
+}
+
+static int cmp_state(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * The states in ascending order, for the sweep to skip them. The caller
+ * frees the array.
+ */
+uint32_t *nsm_cand_sorted(const struct nsm_cand *c)
+{
+	uint32_t *sorted;
+
+	sorted = malloc((c->nr ? c->nr : 1) * sizeof(*sorted));
+	if (!sorted)
+		return NULL;
+	memcpy(sorted, c->states, c->nr * sizeof(*sorted));
+	qsort(sorted, c->nr, sizeof(*sorted), cmp_state);
+	return sorted;
+}
+
+/*
+ * Append the state, which worked, to the history file.
+ */
+int nsm_cand_save(const char *file, uint32_t state)
+{
+	FILE *f;
+	int res = 0;
+
+	f = fopen(file, "a");
+	if (!f)
+		return -errno;
+	if (fprintf(f, "%u\n", state) < 0)
+		res = -errno;
+	if (fclose(f) && !res)
+		res = -errno;
+	return res;
+}
+
+void nsm_cand_fini(struct nsm_cand *c)
+{
+	free(c->states);
+	memset(c, 0, sizeof(*c));
+}
@@ -0,0 +1,33 @@
+/*
+ * Candidate rpc.statd states.
+ *
+ * Before sweeping all the states, the ones most likely to work are tried:
+ * the state rpc.statd keeps, the states which worked before (kept in a
+ * history file, newest last), the states a few reboots around them and
+ * the magic ones. The list has no duplicates and keeps the order the
+ * states were added in.
+ */
+
+#ifndef __NSM_CAND_H__
+#define __NSM_CAND_H__
+
+#include <stdint.h>
+
+#define NSM_CAND_RANGE		4	/* states tried around every known one */
+#define NSM_CAND_HISTORY	16	/* newest history states used */
+
+struct nsm_cand {
+	uint32_t *		states;
+	unsigned int		nr;
+	unsigned int		size;
+};
+
+extern int		nsm_cand_add(struct nsm_cand *, uint32_t);
+extern int		nsm_cand_load(struct nsm_cand *, const char *);
+extern int		nsm_cand_around(struct nsm_cand *, unsigned int);
+extern int		nsm_cand_magic(struct nsm_cand *);
+extern uint32_t *	nsm_cand_sorted(const struct nsm_cand *);
+extern int		nsm_cand_save(const char *, uint32_t);
+extern void		nsm_cand_fini(struct nsm_cand *);
+
+#endif /* __NSM_CAND_H__ */
@@ -0,0 +1,33 @@
+/*
+ * Monotonic time for timeouts and latencies.
+ */
+
+#ifndef __NSM_CLOCK_H__
+#define __NSM_CLOCK_H__
+
+#include <time.h>
+
+static inline long nsm_now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static inline long nsm_now_usec(void)
+{
+	return nsm_now_nsec() / 1000;
+}
+
+static inline long nsm_now_msec(void)
+{
+	return nsm_now_nsec() / 1000000;
+}
+
+static inline double nsm_now_sec(void)
+{
+	return nsm_now_nsec() / 1e9;
+}
+
+#endif /* __NSM_CLOCK_H__ */
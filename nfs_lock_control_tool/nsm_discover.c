@@ -0,0 +1,314 @@
+/*
+ * Notify list discovery.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/param.h>
+
+#include "nsm_discover.h"
+
+#define NSM_RECORD_MAX		65536	/* bytes read of a monitor file */
+
+struct root_scan {
+	struct nsm_notify *	entries;
+	unsigned int		nr;
+	unsigned int		size;
+	int			error;
+};
+
+struct discover {
+	char **			roots;
+	unsigned int		nr_roots;
+	struct root_scan *	scans;
+	unsigned int		next;		/* root to take, atomic */
+};
+
+/*
+ * rpc.statd keeps its state as a native 4 byte integer.
+ */
+int nsm_statd_state(const char *dir, uint32_t *state)
+{
+	char path[PATH_MAX];
+	int fd, res;
+
+	if ((size_t)snprintf(path, sizeof(path), "%s/state", dir) >=
+								sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	res = read(fd, state, sizeof(*state));
+	close(fd);
+
+	if (res == sizeof(*state))
+		return 0;
+	if (res >= 0)
+		errno = EINVAL;
+	return -1;
+}
+
+static int add_entry(struct root_scan *scan, const char *root,
+			const char *client, const char *server, uint32_t state)
+{
+	struct nsm_notify *n;
+
+	if (scan->nr == scan->size) {
+		unsigned int size = MAX(scan->size * 2, 16);
+
+		n = realloc(scan->entries, size * sizeof(*n));
+		if (!n)
+			return -1;
+		scan->entries = n;
+		scan->size = size;
+	}
+
+	n = &scan->entries[scan->nr];
+	n->client = strdup(client);
+	n->server = strdup(server);
+	n->state = state;
+	n->root = root;
+	if (!n->client || !n->server) {
+		free(n->client);
+		free(n->server);
+		return -1;
+	}
+	scan->nr++;
+	return 0;
+}
+
+/*
+ * A monitor record is a line of
+ *
+ *	<addr> <prog> <vers> <proc> <cookie> <mon_name> <my_name>
+ *
+ * The server is mon_name and the client is my_name, the name the server
+ * knows it by. A file may hold several records.
+ */
+static int read_records(struct root_scan *scan, const char *root,
+			int dfd, const char *name, uint32_t state)
+{
+	char *buf, *line, *save, *field[7];
+	int fd, len, i;
+
+	fd = openat(dfd, name, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	buf = malloc(NSM_RECORD_MAX);
+	if (!buf) {
+		close(fd);
+		return -1;
+	}
+	len = read(fd, buf, NSM_RECORD_MAX - 1);
+	close(fd);
+	if (len < 0)
+		len = 0;
+	buf[len] = '\0';
+
+	for (line = strtok_r(buf, "\n", &save); line;
+	     line = strtok_r(NULL, "\n", &save)) {
+		char *fsave;
+
+		field[0] = strtok_r(line, " \t", &fsave);
+		for (i = 1; i < 7 && field[i - 1]; i++)
+			field[i] = strtok_r(NULL, " \t", &fsave);
+		if (i < 7 || !field[6])
+			continue;
+
+		if (add_entry(scan, root, field[6], field[5], state) < 0) {
+			free(buf);
+			return -1;
+		}
+	}
+
+	free(buf);
+	return 0;
+}
+
+static int scan_dir(struct root_scan *scan, const char *root,
+			const char *sub, uint32_t state)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	DIR *dir;
+	int res = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", root, sub);
+	dir = opendir(path);
+	if (!dir)
+		return errno == ENOENT ? 0 : -1;
+
+	while (!res && (de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		res = read_records(scan, root, dirfd(dir), de->d_name, state);
+	}
+
+	closedir(dir);
+	return res;
+}
+
+static void scan_root(struct root_scan *scan, const char *root)
+{
+	uint32_t state;
+
+	if (nsm_statd_state(root, &state) < 0 ||
+	    scan_dir(scan, root, "sm", state) < 0 ||
+	    scan_dir(scan, root, "sm.bak", state) < 0) {
+		scan->error = errno;
+		fprintf(stderr, "Failed to read rpc.statd data in %s: %s\n",
+				root, strerror(errno));
+	}
+}
+
+static void *discover_thread(void *arg)
+{
+	struct discover *d = arg;
+	unsigned int i;
+
+	while ((i = __sync_fetch_and_add(&d->next, 1)) < d->nr_roots)
+		scan_root(&d->scans[i], d->roots[i]);
+	return NULL;
+}
+
+static int cmp_notify(const void *a, const void *b)
+{
+	const struct nsm_notify *x = a, *y = b;
+	int res;
+
+	res = strcmp(x->client, y->client);
+	if (!res)
+		res = strcmp(x->server, y->server);
+	if (!res)
+		res = (x->state > y->state) - (x->state < y->state);
+	return res;
+}
+
+/*
+ * Merge the per root results, dropping the duplicates: the same server
+ * is usually in both "sm/" and "sm.bak/" while statd is notifying.
+ */
+static int merge(struct discover *d, struct nsm_notify_set *set)
+{
+	unsigned int i, j, nr = 0;
+
+	for (i = 0; i < d->nr_roots; i++) {
+		nr += d->scans[i].nr;
+		if (d->scans[i].error)
+			set->failed++;
+	}
+
+	set->entries = calloc(nr ? nr : 1, sizeof(struct nsm_notify));
+	if (!set->entries)
+		return -1;
+
+	for (i = 0; i < d->nr_roots; i++) {
+		memcpy(set->entries + set->nr, d->scans[i].entries,
+				d->scans[i].nr * sizeof(struct nsm_notify));
+		set->nr += d->scans[i].nr;
+		d->scans[i].nr = 0;
+	}
+
+	qsort(set->entries, set->nr, sizeof(struct nsm_notify), cmp_notify);
+
+	for (i = j = 0; i < set->nr; i++) {
+		if (j && !cmp_notify(&set->entries[j - 1], &set->entries[i])) {
+			free(set->entries[i].client);
+			free(set->entries[i].server);
+			continue;
+		}
+		set->entries[j++] = set->entries[i];
+	}
+	set->nr = j;
+	return 0;
+}
+
+/*
+ * Find the statd directories matching the patterns and collect what they
+ * have to notify. Unreadable directories are counted in 'failed'.
+ * Returns -1 if out of memory.
+ */
+int nsm_discover(char * const *patterns, unsigned int nr_patterns,
+				struct nsm_notify_set *set)
+{
+	pthread_t threads[NSM_DISCOVER_THREADS];
+	unsigned int i, nr_threads;
+	struct discover d;
+	glob_t gl;
+	int res = -1;
+
+	memset(set, 0, sizeof(*set));
+	memset(&d, 0, sizeof(d));
+	memset(&gl, 0, sizeof(gl));
+
+	for (i = 0; i < nr_patterns; i++)
+		if (glob(patterns[i], GLOB_ONLYDIR | GLOB_BRACE |
+				(i ? GLOB_APPEND : 0), NULL, &gl) == GLOB_NOSPACE)
+			goto out;
+
+	set->nr_roots = gl.gl_pathc;
+	set->roots = calloc(gl.gl_pathc + 1, sizeof(char *));
+	d.scans = calloc(gl.gl_pathc + 1, sizeof(struct root_scan));
+	if (!set->roots || !d.scans)
+		goto out;
+	for (i = 0; i < gl.gl_pathc; i++)
+		if (!(set->roots[i] = strdup(gl.gl_pathv[i])))
+			goto out;
+	d.roots = set->roots;
+	d.nr_roots = set->nr_roots;
+
+	nr_threads = MIN(d.nr_roots, NSM_DISCOVER_THREADS);
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&threads[i], NULL, discover_thread, &d))
+			break;
+	/* Without threads, do it here */
+	if (!i)
+		discover_thread(&d);
+	nr_threads = i;
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	res = merge(&d, set);
+out:
+	for (i = 0; d.scans && i < set->nr_roots; i++) {
+		while (d.scans[i].nr--) {
+			free(d.scans[i].entries[d.scans[i].nr].client);
+			free(d.scans[i].entries[d.scans[i].nr].server);
+		}
+		free(d.scans[i].entries);
+	}
+	free(d.scans);
+	globfree(&gl);
+	if (res < 0) {
+		nsm_notify_set_free(set);
+		errno = ENOMEM;
+	}
+	return res;
+}
+
+void nsm_notify_set_free(struct nsm_notify_set *set)
+{
+	unsigned int i;
+
+	for (i = 0; i < set->nr; i++) {
+		free(set->entries[i].client);
+		free(set->entries[i].server);
+	}
+	free(set->entries);
+	for (i = 0; set->roots && i < set->nr_roots; i++)
+		free(set->roots[i]);
+	free(set->roots);
+	memset(set, 0, sizeof(*set));
+}
@@ -0,0 +1,39 @@
+/*
+ * Notify list discovery.
+ *
+ * Every rpc.statd directory holds its state number in "state" and a file
+ * per monitored server in "sm/" ("sm.bak/" for the ones not notified
+ * yet), each with the client name the server knows. Many such
+ * directories, given by glob patterns (like the ones of all the
+ * containers on a host), are scanned at once by a few threads and give
+ * the (client, server, state) set to send SM_NOTIFY for.
+ */
+
+#ifndef __NSM_DISCOVER_H__
+#define __NSM_DISCOVER_H__
+
+#include <stdint.h>
+
+#define NSM_DISCOVER_THREADS	16
+
+struct nsm_notify {
+	char *			client;
+	char *			server;
+	uint32_t		state;
+	const char *		root;		/* statd directory */
+};
+
+struct nsm_notify_set {
+	struct nsm_notify *	entries;
+	unsigned int		nr;
+	unsigned int		nr_roots;	/* directories found */
+	unsigned int		failed;		/* of them unreadable */
+	char **			roots;
+};
+
+extern int	nsm_statd_state(const char *, uint32_t *);
+extern int	nsm_discover(char * const *, unsigned int,
+				struct nsm_notify_set *);
+extern void	nsm_notify_set_free(struct nsm_notify_set *);
+
+#endif /* __NSM_DISCOVER_H__ */
@@ -0,0 +1,557 @@
+/*
+ * SM_NOTIFY engine.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/poll.h>
+#include <sys/param.h>
+#include <arpa/inet.h>
+
+#include "nsm_engine.h"
+#include "nsm_clock.h"
+
+#define NSM_REPLY_SIZE		24
+#define NSM_FLUSH_TIMEOUT	10000	/* msec to wait for a full socket */
+
+#define e_printf(E, ...)	do { if ((E)->verbose) printf(__VA_ARGS__); } while (0)
+
+#define job_active(E, J)	((E)->slots[(J)->slot] == (J))
+#define job_all_failed(J)	((J)->failed == (1U << (J)->nr_addrs) - 1)
+
+/*
+ * Room for 'max_jobs' jobs at once. XIDs are the job slot in the low
+ * bits and a sequence number above, so answers are matched without
+ * searching.
+ */
+int nsm_engine_init(struct nsm_engine *e, const struct nsm_port_pool *ports,
+				unsigned int max_jobs, nsm_done_t done)
+{
+	unsigned int i, nr_slots, batch;
+
+	memset(e, 0, sizeof(*e));
+
+	while ((1U << e->slot_bits) < max_jobs)
+		e->slot_bits++;
+	nr_slots = 1U << e->slot_bits;
+	batch = MIN(nr_slots, NSM_BATCH_SIZE);
+	e->ports = ports;
+
+	e->slots = calloc(nr_slots, sizeof(struct nsm_job *));
+	e->free_slots = calloc(nr_slots, sizeof(unsigned int));
+	if (!e->slots || !e->free_slots ||
+	    nsm_batch_init(&e->rx, batch) < 0 ||
+	    nsm_timer_heap_init(&e->timers, nr_slots) < 0)
+		goto nomem;
+	for (i = 0; i < ports->nr; i++)
+		if (nsm_batch_init(&e->tx[i], batch) < 0)
+			goto nomem;
+
+	for (i = 0; i < max_jobs; i++)
+		e->free_slots[e->nr_free++] = max_jobs - 1 - i;
+
+	e->done = done;
+	e->seq = getpid() + time(NULL);
+	return 0;
+
+nomem:
+	nsm_engine_fini(e);
+	errno = ENOMEM;
+	return -1;
+}
+
+void nsm_engine_fini(struct nsm_engine *e)
+{
+	unsigned int i;
+
+	free(e->slots);
+	free(e->free_slots);
+	for (i = 0; i < NSM_PORT_POOL_MAX; i++)
+		nsm_batch_fini(&e->tx[i]);
+	nsm_batch_fini(&e->rx);
+	nsm_timer_heap_fini(&e->timers);
+	if (e->uring) {
+		nsm_uring_fini(e->uring);
+		free(e->uring);
+	}
+	memset(e, 0, sizeof(*e));
+}
+
+/*
+ * Do the I/O with io_uring from now on. Fails with the engine left on
+ * nsm_batch if the kernel can't do it.
+ */
+int nsm_engine_uring(struct nsm_engine *e)
+{
+	struct nsm_uring *u;
+	int res;
+
+	u = malloc(sizeof(*u));
+	if (!u)
+		return -ENOMEM;
+
+	res = nsm_uring_init(u, e->ports);
+	if (res < 0) {
+		free(u);
+		return res;
+	}
+	e->uring = u;
+	return 0;
+}
+
+static void job_finish(struct nsm_engine *e, struct nsm_job *job, int result)
+{
+	nsm_timer_del(&e->timers, &job->timer);
+	e->slots[job->slot] = NULL;
+	e->free_slots[e->nr_free++] = job->slot;
+	e->active--;
+
+	job->result = result;
+	job->finished = nsm_now_usec();
+	job->next = e->finished;
+	e->finished = job;
+}
+
+static struct nsm_job *find_job(struct nsm_engine *e, uint32_t xid)
+{
+	struct nsm_job *job;
+
+	job = e->slots[xid & ((1U << e->slot_bits) - 1)];
+	if (!job || job->xid != xid)
+		return NULL;
+	return job;
+}
+
+static int job_addr(struct nsm_job *job, const struct sockaddr *sap)
+{
+	unsigned int i;
+
+	for (i = 0; i < job->nr_addrs; i++)
+		if (nsm_addr_match((struct sockaddr *)&job->addrs[i], sap))
+			return i;
+	return -1;
+}
+
+/*
+ * Address 'i' of the job can't be sent to. The job fails only if it was
+ * the last one, otherwise the next address is tried at once.
+ */
+static void job_addr_failed(struct nsm_engine *e, struct nsm_job *job,
+						int i, int error)
+{
+	job->failed |= 1U << i;
+	if (job->answered == i)
+		job->answered = -1;
+
+	if (job_all_failed(job)) {
+		fprintf(stderr, "Sending clearing locks message to %s "
+			"failed: %s\n", job->name, strerror(error));
+		job_finish(e, job, -error);
+		return;
+	}
+
+	e_printf(e, "Sending to an address of %s failed: %s\n", job->name,
+							strerror(error));
+	if (job->tried < job->nr_addrs)
+		nsm_timer_add(&e->timers, &job->timer, nsm_now_usec() / 1000);
+}
+
+/*
+ * Packet 'n' of the socket's batch failed: fail its address.
+ */
+static void packet_failed(struct nsm_engine *e, struct nsm_batch *tx,
+						unsigned int n, int error)
+{
+	uint32_t *buffer = nsm_batch_buf(tx, n);
+	struct nsm_job *job;
+	int addr;
+
+	job = find_job(e, ntohl(buffer[0]));
+	addr = job ? job_addr(job, nsm_batch_addr(tx, n)) : -1;
+	if (addr >= 0)
+		job_addr_failed(e, job, addr, error);
+}
+
+/*
+ * Send all the packets queued on a socket. Sockets are non-blocking, so
+ * wait for it to drain if it's full. A packet, which can't be sent, fails
+ * its address.
+ */
+static void flush_sock(struct nsm_engine *e, unsigned int i)
+{
+	struct nsm_batch *tx = &e->tx[i];
+	struct pollfd pfd;
+	int result;
+
+	pfd.fd = e->ports->socks[i];
+	pfd.events = POLLOUT;
+
+	while ((result = nsm_batch_flush(pfd.fd, tx)) != 0) {
+		if (result > 0) {
+			poll(&pfd, 1, NSM_FLUSH_TIMEOUT);
+			continue;
+		}
+
+		/* Drop the failed packet and go on with the rest */
+		packet_failed(e, tx, tx->head++, errno);
+	}
+}
+
+/*
+ * Check the results of the packets of a socket sent through io_uring
+ * and empty its batch. The ones sent are shown to the tap in runs.
+ */
+static void uring_sent(struct nsm_engine *e, unsigned int i)
+{
+	struct nsm_batch *tx = &e->tx[i];
+	unsigned int n, run = tx->head;
+	int result;
+
+	for (n = tx->head; n <= tx->count; n++) {
+		result = n < tx->count ? nsm_uring_result(e->uring, i, n) : -1;
+		if (result >= 0) {
+			tx->msgs[n].msg_len = result;
+			continue;
+		}
+
+		if (nsm_batch_tap && n > run)
+			nsm_batch_tap(e->ports->socks[i], &tx->msgs[run],
+							n - run, 1);
+		run = n + 1;
+		if (n < tx->count)
+			packet_failed(e, tx, n, -result);
+	}
+	tx->head = tx->count = 0;
+}
+
+static void flush(struct nsm_engine *e)
+{
+	unsigned int i;
+
+	if (!e->uring) {
+		for (i = 0; i < e->ports->nr; i++)
+			flush_sock(e, i);
+		return;
+	}
+
+	/* all the sockets in one go */
+	for (i = 0; i < e->ports->nr; i++)
+		nsm_uring_queue(e->uring, i, &e->tx[i]);
+	nsm_uring_submit(e->uring);
+	for (i = 0; i < e->ports->nr; i++)
+		uring_sent(e, i);
+}
+
+/*
+ * Queue the current state for address 'i' of the job. Fails if the
+ * address can't be sent to, or the job failed meanwhile.
+ */
+static int job_queue(struct nsm_engine *e, struct nsm_job *job,
+						unsigned int i)
+{
+	struct nsm_batch *tx = &e->tx[job->sock];
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	unsigned int n;
+
+	if (job->failed & 1U << i)
+		return -1;
+
+	addrlen = nsm_addr_map(&addr, (struct sockaddr *)&job->addrs[i],
+						e->ports->family);
+	if (!addrlen) {
+		/* no socket of its family */
+		job->failed |= 1U << i;
+		return -1;
+	}
+
+	if (nsm_batch_full(tx)) {
+		if (e->uring) {
+			nsm_uring_queue(e->uring, job->sock, tx);
+			nsm_uring_submit(e->uring);
+			uring_sent(e, job->sock);
+		} else
+			flush_sock(e, job->sock);
+		if (!job_active(e, job))
+			return -1;
+	}
+
+	n = tx->count;
+	nsm_tmpl_fill(job->tmpl, nsm_batch_buf(tx, n), job->xid,
+			job->states[job->step], nsm_batch_iov(tx, n));
+	nsm_batch_queue_iov(tx, NSM_TMPL_IOVS, (struct sockaddr *)&addr,
+								addrlen);
+	nsm_metrics_count(job->stats, sent);
+	job->last = i;
+	return 0;
+}
+
+/*
+ * Send the current state to the next address, which wasn't tried yet.
+ * Returns 0 if there is none.
+ */
+static int job_launch(struct nsm_engine *e, struct nsm_job *job)
+{
+	while (job->tried < job->nr_addrs && job_active(e, job))
+		if (!job_queue(e, job, job->tried++))
+			return 1;
+	return 0;
+}
+
+/*
+ * Until the answer comes, the next address is tried after
+ * NSM_ADDR_DELAY, or the retransmit timeout if that's shorter.
+ */
+static void job_arm(struct nsm_engine *e, struct nsm_job *job)
+{
+	long timeout = nsm_rtt_timeout(&job->rtt, job->retries);
+
+	if (job->answered < 0 && job->tried < job->nr_addrs)
+		timeout = MIN(timeout, NSM_ADDR_DELAY);
+
+	job->sent = nsm_now_usec();
+	nsm_timer_add(&e->timers, &job->timer, job->sent / 1000 + timeout);
+}
+
+/*
+ * (Re)transmit the current state: to the address, which answered, if
+ * any, otherwise to all the addresses tried so far, or to the first one.
+ */
+static void job_xmit(struct nsm_engine *e, struct nsm_job *job)
+{
+	unsigned int i;
+
+	if (job->answered >= 0)
+		job_queue(e, job, job->answered);
+	else if (!job->tried)
+		job_launch(e, job);
+	else
+		for (i = 0; i < job->tried && job_active(e, job); i++)
+			job_queue(e, job, i);
+
+	if (!job_active(e, job))
+		return;
+	if (job_all_failed(job)) {
+		fprintf(stderr, "No address of %s can be reached from the "
+				"local address\n", job->name);
+		job_finish(e, job, -EAFNOSUPPORT);
+		return;
+	}
+
+	e_printf(e, "Sending clearing locks message to server %s with "
+			"state %u...\n", job->name, job->states[job->step]);
+	job_arm(e, job);
+}
+
+static void job_send_next(struct nsm_engine *e, struct nsm_job *job)
+{
+	job->xid = e->seq++ << e->slot_bits | job->slot;
+	job->retries = 0;
+	job->tried = 0;
+	job_xmit(e, job);
+}
+
+/*
+ * Start the job. Its packets are queued and go out on the next
+ * nsm_engine_process(). Returns -EBUSY if the engine is full.
+ */
+int nsm_engine_submit(struct nsm_engine *e, struct nsm_job *job)
+{
+	if (!e->nr_free)
+		return -EBUSY;
+
+	job->slot = e->free_slots[--e->nr_free];
+	e->slots[job->slot] = job;
+	e->active++;
+
+	/* spread the jobs over the source ports */
+	job->sock = e->next_sock++ % e->ports->nr;
+
+	job->timer.index = 0;
+	job->step = 0;
+	job->result = 0;
+	job->answered = -1;
+	job->failed = 0;
+	job->last = -1;
+	job->started = nsm_now_usec();
+	job->stats = nsm_metrics_server(job->name);
+	job_send_next(e, job);
+	return 0;
+}
+
+static int check_answer(struct nsm_job *job, uint32_t *buffer, int size)
+{
+	if (size < NSM_REPLY_SIZE) {
+		fprintf(stderr, "%s: server answer size is less, than it should "
+				"be (%d instead of %d).\n", job->name,
+				size, NSM_REPLY_SIZE);
+		return -EPROTO;
+	}
+
+	if (buffer[1] != htonl(1) ||	/* Reply code */
+	    buffer[2] != htonl(0) ||	/* Accepted code */
+	    buffer[3] != htonl(0) ||
+	    buffer[4] != htonl(0) ||
+	    buffer[5] != htonl(0)) {	/* Success code */
+		fprintf(stderr, "%s: server returned error. Notify failed!\n",
+				job->name);
+		return -EPROTO;
+	}
+
+	return 0;
+}
+
+/*
+ * Advance the jobs the 'nr' answers in e->rx belong to.
+ */
+static void handle_answers(struct nsm_engine *e, int nr)
+{
+	struct nsm_job *job;
+	uint32_t *buffer;
+	int error, i, from;
+
+	for (i = 0; i < nr; i++) {
+		buffer = nsm_batch_buf(&e->rx, i);
+		if (nsm_batch_len(&e->rx, i) < sizeof(uint32_t))
+			continue;
+
+		job = find_job(e, ntohl(buffer[0]));
+		if (!job) {
+			e_printf(e, "Dropping answer with unknown xid "
+					"0x%08x\n", ntohl(buffer[0]));
+			continue;
+		}
+
+		e_printf(e, "Received answer from %s. Checking...\n",
+						job->name);
+		nsm_metrics_reply(job->stats, buffer,
+					nsm_batch_len(&e->rx, i));
+
+		error = check_answer(job, buffer, nsm_batch_len(&e->rx, i));
+		if (error < 0) {
+			job_finish(e, job, error);
+			continue;
+		}
+
+		/* the first address to answer wins */
+		from = job_addr(job, nsm_batch_addr(&e->rx, i));
+		if (job->answered < 0)
+			job->answered = from;
+
+		/* Only messages sent once give a reliable RTT */
+		if (!job->retries && from == job->last) {
+			long rtt = nsm_now_usec() - job->sent;
+
+			nsm_rtt_update(&job->rtt, rtt);
+			nsm_metrics_rtt(job->stats, rtt);
+		}
+
+		if (++job->step == job->nr_states)
+			job_finish(e, job, 0);
+		else
+			job_send_next(e, job);
+	}
+}
+
+/*
+ * Read all the answers queued on a socket and advance the jobs they
+ * belong to.
+ */
+static void receive_answers(struct nsm_engine *e, int sock)
+{
+	int result;
+
+	while ((result = nsm_batch_recv(sock, &e->rx)) > 0)
+		handle_answers(e, result);
+
+	if (result < 0)
+		fprintf(stderr, "Failed to receive the answer from server: %s\n",
+							strerror(errno));
+}
+
+/*
+ * Retransmit the messages, which were not answered in time, with the
+ * same XID, so that a late answer still counts.
+ */
+static void expire(struct nsm_engine *e)
+{
+	struct nsm_timer *timer;
+	struct nsm_job *job;
+	long now = nsm_now_usec() / 1000;
+
+	while ((timer = nsm_timer_first(&e->timers)) &&
+	       timer->expires <= now) {
+		job = nsm_timer_entry(timer, struct nsm_job, timer);
+
+		if (job->answered < 0 && job->tried < job->nr_addrs) {
+			e_printf(e, "No answer from %s yet, trying its next "
+						"address\n", job->name);
+			if (job_launch(e, job)) {
+				job_arm(e, job);
+				continue;
+			}
+			if (!job_active(e, job))
+				continue;
+		}
+
+		if (job->retries == NSM_RETRIES) {
+			fprintf(stderr, "Failed to receive the answer from %s\n",
+							job->name);
+			nsm_metrics_count(job->stats, timeouts);
+			job_finish(e, job, -ETIMEDOUT);
+			continue;
+		}
+
+		job->retries++;
+		nsm_metrics_count(job->stats, retransmits);
+		e_printf(e, "No answer from %s, retransmitting\n", job->name);
+		job_xmit(e, job);
+	}
+}
+
+/*
+ * Handle the answers, the timeouts and the submitted jobs. Call this
+ * when a socket of the pool is readable (or nsm_uring_wait() returned)
+ * or nsm_engine_timeout() has passed. The finished jobs are handed to
+ * the callback after all their packets are gone, so it may free them.
+ */
+void nsm_engine_process(struct nsm_engine *e)
+{
+	struct nsm_job *job;
+	unsigned int i;
+	int result;
+
+	if (e->uring)
+		while ((result = nsm_uring_recv(e->uring, &e->rx)) > 0)
+			handle_answers(e, result);
+	else
+		for (i = 0; i < e->ports->nr; i++)
+			receive_answers(e, e->ports->socks[i]);
+	expire(e);
+	flush(e);
+
+	while ((job = e->finished)) {
+		e->finished = job->next;
+		e->done(e, job);
+	}
+}
+
+/*
+ * Milliseconds until nsm_engine_process() is due, -1 if no job is active.
+ */
+long nsm_engine_timeout(struct nsm_engine *e)
+{
+	unsigned int i;
+
+	if (e->finished)
+		return 0;
+	for (i = 0; i < e->ports->nr; i++)
+		if (e->tx[i].count)
+			return 0;
+	return nsm_timer_wait(&e->timers, nsm_now_usec() / 1000);
+}
@@ -0,0 +1,100 @@
+/*
+ * SM_NOTIFY engine.
+ *
+ * Runs any number of notification jobs at once over a pool of sockets.
+ * Every job sends its states one after another to one server and
+ * retransmits them on timeout. A server with several addresses gets
+ * staggered attempts: every NSM_ADDR_DELAY without an answer the same
+ * call goes to its next address too, and the first address to answer is
+ * used for the rest of the job. Jobs may be submitted at any time, the
+ * caller polls the socket and the engine reports finished jobs through
+ * a callback.
+ *
+ * The packets go through nsm_batch by default; nsm_engine_uring()
+ * switches the engine to io_uring, then the caller waits with
+ * nsm_uring_wait() on e->uring instead of polling the sockets.
+ */
+
+#ifndef __NSM_ENGINE_H__
+#define __NSM_ENGINE_H__
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "nsm_batch.h"
+#include "nsm_timer.h"
+#include "nsm_rto.h"
+#include "nsm_tmpl.h"
+#include "nsm_port.h"
+#include "nsm_resolv.h"
+#include "nsm_metrics.h"
+#include "nsm_uring.h"
+
+struct nsm_job {
+	/* set by the caller */
+	const char *		name;		/* server, for messages */
+	struct sockaddr_storage	addrs[NSM_RESOLV_MAXADDRS];
+	unsigned int		nr_addrs;	/* rpc.statd addresses with
+						   port, preferred first */
+	const struct nsm_tmpl *	tmpl;		/* client's SM_NOTIFY */
+	uint32_t		states[2];	/* sent one after another */
+	int			nr_states;
+	struct nsm_rtt		rtt;
+	void *			data;
+
+	/* results */
+	int			result;		/* 0 or negative errno */
+	long			started;	/* usec, monotonic */
+	long			finished;	/* usec, monotonic */
+	int			answered;	/* address, which answered, or -1 */
+
+	/* private */
+	struct nsm_timer	timer;		/* retransmit timer */
+	struct nsm_job *	next;		/* finished list */
+	uint32_t		xid;
+	unsigned int		slot;
+	unsigned int		sock;		/* index in the pool */
+	int			step;		/* index of the state being sent */
+	unsigned int		retries;
+	unsigned int		tried;		/* addresses the state went to */
+	unsigned int		failed;		/* addresses, which can't be
+						   sent to, bitmask */
+	int			last;		/* address sent to last */
+	long			sent;		/* usec, last transmission */
+	struct nsm_server_stats *stats;		/* NULL without metrics */
+};
+
+struct nsm_engine;
+
+typedef void (*nsm_done_t)(struct nsm_engine *, struct nsm_job *);
+
+struct nsm_engine {
+	const struct nsm_port_pool *ports;
+	int			verbose;
+	nsm_done_t		done;
+	struct nsm_job **	slots;		/* jobs by the low XID bits */
+	unsigned int		slot_bits;
+	unsigned int *		free_slots;
+	unsigned int		nr_free;
+	unsigned int		active;
+	uint32_t		seq;		/* high XID bits */
+	unsigned int		next_sock;
+	struct nsm_timer_heap	timers;
+	struct nsm_batch	tx[NSM_PORT_POOL_MAX];	/* per socket */
+	struct nsm_batch	rx;
+	struct nsm_job *	finished;
+	struct nsm_uring *	uring;		/* NULL with sendmmsg() */
+};
+
+extern int		nsm_engine_init(struct nsm_engine *,
+					const struct nsm_port_pool *,
+					unsigned int, nsm_done_t);
+extern void		nsm_engine_fini(struct nsm_engine *);
+extern int		nsm_engine_uring(struct nsm_engine *);
+extern int		nsm_engine_submit(struct nsm_engine *, struct nsm_job *);
+extern void		nsm_engine_process(struct nsm_engine *);
+extern long		nsm_engine_timeout(struct nsm_engine *);
+
+#define nsm_engine_full(E)	((E)->nr_free == 0)
+
+#endif /* __NSM_ENGINE_H__ */
@@ -0,0 +1,777 @@
+/*
+ * Loopback stand-in for the lock services of an NFS server.
+ *
+ * Three UDP sockets on one local address answer the portmapper (GETPORT
+ * and DUMP of version 2, GETADDR and DUMP of rpcbind versions 3 and 4),
+ * rpc.statd (SM_NOTIFY) and nlockmgr (NLM4_TEST). The portmapper takes
+ * TCP calls as well, the way libtirpc asks it for DUMP. The client's
+ * locks are held until an SM_NOTIFY brings the secret state, or any
+ * state if no secret is set: NLM4_TEST answers DENIED until then and
+ * GRANTED after.
+ *
+ * Requests may be lost and replies delayed: by a fixed latency, a uniform
+ * jitter on top of it and, for a share of the replies, a slow delay. All
+ * the randomness comes from a seeded generator, so that runs repeat.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/poll.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "nsm_batch.h"
+#include "nsm_timer.h"
+#include "nsm_xdr.h"
+#include "nsm_clock.h"
+
+#define PMAP_PROGRAM		100000
+#define NSM_PROGRAM		100024
+#define NLM_PROGRAM		100021
+#define PMAP_PORT		111
+
+#define PMAP_GETPORT		3	/* RPCBPROC_GETADDR in versions 3, 4 */
+#define PMAP_DUMP		4
+#define NSM_NOTIFY		6
+#define NLM4_TEST		1
+
+#define NLM4_GRANTED		0
+#define NLM4_DENIED		1
+#define FAKE_SVID		4242	/* pid of the lock holder */
+
+#define FAKE_PENDING		16384	/* delayed replies at most */
+#define FAKE_REPLY_WORDS	128
+#define FAKE_COOKIE_MAX		32	/* bytes of an NLM cookie */
+#define FAKE_SOCKBUF		(16 << 20)
+#define FAKE_TCP_TIMEOUT	1		/* sec for a TCP call to come */
+#define RPC_LAST_FRAG		0x80000000U
+
+enum {
+	FAKE_PMAP,
+	FAKE_STATD,
+	FAKE_NLM,
+	FAKE_SERVICES
+};
+
+struct fake_service {
+	const char *		name;
+	uint32_t		prog;
+	uint32_t		min_vers;
+	uint32_t		max_vers;
+	unsigned short		port;
+	int			sock;
+	struct nsm_batch	rx;
+	struct nsm_batch	tx;
+	unsigned long		calls;
+};
+
+/*
+ * Reply waiting for its delay to pass.
+ */
+struct fake_reply {
+	struct nsm_timer	timer;
+	struct fake_reply *	next;		/* free list */
+	struct fake_service *	service;
+	unsigned int		len;
+	struct sockaddr_storage	addr;
+	socklen_t		addrlen;
+	uint32_t		buf[FAKE_REPLY_WORDS];
+};
+
+static struct fake_service services[FAKE_SERVICES] = {
+	{ .name = "portmapper", .prog = PMAP_PROGRAM, .min_vers = 2,
+	  .max_vers = 4, .port = PMAP_PORT },
+	{ .name = "rpc.statd", .prog = NSM_PROGRAM, .min_vers = 1,
+	  .max_vers = 1 },
+	{ .name = "nlockmgr", .prog = NLM_PROGRAM, .min_vers = 4,
+	  .max_vers = 4 },
+};
+
+static struct sockaddr_storage local;
+static int pmap_tcp = -1;
+static char local_uaddr[INET6_ADDRSTRLEN];
+
+static unsigned int delay;		/* msec before every reply */
+static unsigned int jitter;		/* msec, uniform on top of it */
+static unsigned int slow_delay;		/* msec, on top for slow replies */
+static unsigned int loss;		/* requests lost, per million */
+static unsigned int slow;		/* slow replies, per million */
+static uint32_t secret;
+static int has_secret;
+static int verbose;
+
+static int locked = 1;
+static uint64_t rnd_state;
+static struct fake_reply *replies, *free_replies;
+static struct nsm_timer_heap timers;
+static volatile sig_atomic_t stop;
+
+static unsigned long notified, released, tests, dropped, delayed, overflow;
+
+#define v_printf	if (verbose) printf
+
+/*
+ * xorshift64*: cheap and the same on every run with the same seed.
+ */
+static uint32_t rnd(void)
+{
+	rnd_state ^= rnd_state >> 12;
+	rnd_state ^= rnd_state << 25;
+	rnd_state ^= rnd_state >> 27;
+	return (rnd_state * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+static int chance(unsigned int per_million)
+{
+	return per_million && rnd() % 1000000 < per_million;
+}
+
+/*
+ * Percent with up to 4 decimals, in per million.
+ */
+static int parse_percent(const char *str, unsigned int *res)
+{
+	char *end;
+	double v = strtod(str, &end);
+
+	if (end == str || *end || v < 0 || v > 100)
+		return -1;
+	*res = v * 10000 + 0.5;
+	return 0;
+}
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static uint32_t *reply_hdr(uint32_t *rep, uint32_t xid, uint32_t stat)
+{
+	rep[0] = xid;			/* as it came */
+	rep[1] = htonl(NSM_XDR_REPLY);
+	rep[2] = 0;			/* MSG_ACCEPTED */
+	rep[3] = 0; rep[4] = 0;		/* verf */
+	rep[5] = htonl(stat);
+	return rep + 6;
+}
+
+static const struct fake_service *find_service(uint32_t prog, uint32_t vers)
+{
+	unsigned int i;
+
+	for (i = 0; i < FAKE_SERVICES; i++)
+		if (services[i].prog == prog && vers >= services[i].min_vers &&
+		    vers <= services[i].max_vers)
+			return &services[i];
+	return NULL;
+}
+
+/*
+ * "h1.h2.h3.h4.p1.p2" or "<inet6>.p1.p2" for 'port' of the local address.
+ */
+static uint32_t *put_uaddr(uint32_t *p, unsigned short port)
+{
+	char uaddr[INET6_ADDRSTRLEN + 8];
+	int len;
+
+	len = snprintf(uaddr, sizeof(uaddr), "%s.%u.%u", local_uaddr,
+						port >> 8, port & 0xff);
+	return nsm_xdr_string(p, uaddr, len);
+}
+
+/*
+ * Mappings of all the services, in the list version 'vers' returns.
+ */
+static uint32_t *put_dump(uint32_t *p, uint32_t vers)
+{
+	const char *netid = local.ss_family == AF_INET6 ? "udp6" : "udp";
+	unsigned int i;
+	uint32_t v;
+
+	for (i = 0; i < FAKE_SERVICES; i++) {
+		for (v = services[i].min_vers; v <= services[i].max_vers; v++) {
+			p = nsm_xdr_u32(p, 1);		/* one more */
+			p = nsm_xdr_u32(p, services[i].prog);
+			p = nsm_xdr_u32(p, v);
+			if (vers == 2) {
+				p = nsm_xdr_u32(p, IPPROTO_UDP);
+				p = nsm_xdr_u32(p, services[i].port);
+				continue;
+			}
+			p = nsm_xdr_string(p, netid, strlen(netid));
+			p = put_uaddr(p, services[i].port);
+			p = nsm_xdr_string(p, "", 0);	/* owner */
+		}
+	}
+	return nsm_xdr_u32(p, 0);
+}
+
+static unsigned int pmap_call(uint32_t vers, uint32_t proc, uint32_t xid,
+			const uint32_t *args, const uint32_t *end,
+			uint32_t *rep)
+{
+	const struct fake_service *s;
+	uint32_t prog, pvers, prot, len, *p;
+	char netid[8];
+
+	switch (proc) {
+	case 0:
+		p = reply_hdr(rep, xid, NSM_XDR_SUCCESS);
+		break;
+	case PMAP_GETPORT:
+		if (nsm_xdr_get_u32(&args, end, &prog) < 0 ||
+		    nsm_xdr_get_u32(&args, end, &pvers) < 0)
+			goto garbage;
+		s = find_service(prog, pvers);
+
+		p = reply_hdr(rep, xid, NSM_XDR_SUCCESS);
+		if (vers == 2) {
+			if (nsm_xdr_get_u32(&args, end, &prot) < 0)
+				goto garbage;
+			p = nsm_xdr_u32(p, s && prot == IPPROTO_UDP ?
+							s->port : 0);
+			break;
+		}
+
+		/* r_netid: "udp" or "udp6" */
+		if (nsm_xdr_get_u32(&args, end, &len) < 0 ||
+		    len > (end - args) * 4)
+			goto garbage;
+		memset(netid, 0, sizeof(netid));
+		memcpy(netid, args, MIN(len, sizeof(netid) - 1));
+		if (s && !strncmp(netid, "udp", 3))
+			p = put_uaddr(p, s->port);
+		else
+			p = nsm_xdr_string(p, "", 0);
+		break;
+	case PMAP_DUMP:
+		p = put_dump(reply_hdr(rep, xid, NSM_XDR_SUCCESS), vers);
+		break;
+	default:
+		p = reply_hdr(rep, xid, NSM_XDR_PROC_UNAVAIL);
+		break;
+	}
+	return (p - rep) << 2;
+
+garbage:
+	return (reply_hdr(rep, xid, NSM_XDR_GARBAGE_ARGS) - rep) << 2;
+}
+
+static unsigned int statd_call(uint32_t proc, uint32_t xid,
+			const uint32_t *args, const uint32_t *end,
+			uint32_t *rep)
+{
+	uint32_t len, state;
+	const uint32_t *name;
+
+	if (!proc)
+		return (reply_hdr(rep, xid, NSM_XDR_SUCCESS) - rep) << 2;
+	if (proc != NSM_NOTIFY)
+		return (reply_hdr(rep, xid, NSM_XDR_PROC_UNAVAIL) - rep) << 2;
+
+	/* mon_name, state */
+	name = args + 1;
+	if (nsm_xdr_get_u32(&args, end, &len) < 0 || len > (end - args) * 4)
+		return (reply_hdr(rep, xid, NSM_XDR_GARBAGE_ARGS) - rep) << 2;
+	args += (len + 3) >> 2;
+	if (nsm_xdr_get_u32(&args, end, &state) < 0)
+		return (reply_hdr(rep, xid, NSM_XDR_GARBAGE_ARGS) - rep) << 2;
+
+	notified++;
+	if (!has_secret || state == secret) {
+		if (locked)
+			printf("Locks released by %.*s at state %u, after %lu "
+				"notifications\n", (int)len,
+				(const char *)name, state, notified);
+		locked = 0;
+		released++;
+	}
+	v_printf("SM_NOTIFY %.*s state %u\n", (int)len, (const char *)name,
+								state);
+
+	/* rpc.statd answers any state */
+	return (reply_hdr(rep, xid, NSM_XDR_SUCCESS) - rep) << 2;
+}
+
+static unsigned int nlm_call(uint32_t proc, uint32_t xid,
+			const uint32_t *args, const uint32_t *end,
+			uint32_t *rep)
+{
+	uint32_t *p, len;
+	const uint32_t *cookie = args + 1;
+
+	if (!proc)
+		return (reply_hdr(rep, xid, NSM_XDR_SUCCESS) - rep) << 2;
+	if (proc != NLM4_TEST)
+		return (reply_hdr(rep, xid, NSM_XDR_PROC_UNAVAIL) - rep) << 2;
+
+	if (nsm_xdr_get_u32(&args, end, &len) < 0 ||
+	    len > (end - args) * 4 || len > FAKE_COOKIE_MAX)
+		return (reply_hdr(rep, xid, NSM_XDR_GARBAGE_ARGS) - rep) << 2;
+
+	tests++;
+	v_printf("NLM4_TEST: %s\n", locked ? "denied" : "granted");
+
+	p = reply_hdr(rep, xid, NSM_XDR_SUCCESS);
+	p = nsm_xdr_string(p, (const char *)cookie, len);
+	if (!locked)
+		p = nsm_xdr_u32(p, NLM4_GRANTED);
+	else {
+		p = nsm_xdr_u32(p, NLM4_DENIED);
+		p = nsm_xdr_u32(p, 1);			/* exclusive */
+		p = nsm_xdr_u32(p, FAKE_SVID);
+		p = nsm_xdr_string(p, "", 0);		/* owner */
+		p = nsm_xdr_u64(p, 0);			/* offset */
+		p = nsm_xdr_u64(p, 0);			/* whole file */
+	}
+	return (p - rep) << 2;
+}
+
+/*
+ * Build the reply to the call in 'req', 0 if there is none to send.
+ */
+static unsigned int handle_call(struct fake_service *s, const uint32_t *req,
+					unsigned int len, uint32_t *rep)
+{
+	const uint32_t *p = req + 6, *end = req + len / 4;
+	uint32_t xid, prog, vers, proc, auth_len;
+	unsigned int i;
+	uint32_t *r;
+
+	if (len < 40 || req[1] != htonl(NSM_XDR_CALL) ||
+	    req[2] != htonl(NSM_XDR_RPCVERS))
+		return 0;
+
+	xid = req[0];
+	prog = ntohl(req[3]);
+	vers = ntohl(req[4]);
+	proc = ntohl(req[5]);
+
+	/* credentials and verifier of any flavor */
+	for (i = 0; i < 2; i++) {
+		p++;
+		if (nsm_xdr_get_u32(&p, end, &auth_len) < 0 ||
+		    auth_len > (end - p) * 4)
+			return 0;
+		p += (auth_len + 3) >> 2;
+	}
+
+	if (prog != s->prog)
+		return (reply_hdr(rep, xid, NSM_XDR_PROG_UNAVAIL) - rep) << 2;
+	if (vers < s->min_vers || vers > s->max_vers) {
+		r = reply_hdr(rep, xid, NSM_XDR_PROG_MISMATCH);
+		r = nsm_xdr_u32(r, s->min_vers);
+		r = nsm_xdr_u32(r, s->max_vers);
+		return (r - rep) << 2;
+	}
+
+	switch (s - services) {
+	case FAKE_PMAP:
+		return pmap_call(vers, proc, xid, p, end, rep);
+	case FAKE_STATD:
+		return statd_call(proc, xid, p, end, rep);
+	default:
+		return nlm_call(proc, xid, p, end, rep);
+	}
+}
+
+static void flush_service(struct fake_service *s)
+{
+	int res;
+
+	while ((res = nsm_batch_flush(s->sock, &s->tx)) != 0) {
+		if (res < 0)
+			s->tx.head++;		/* skip the bad one */
+	}
+}
+
+static void send_reply(struct fake_service *s, const uint32_t *buf,
+			unsigned int len, const struct sockaddr *addr,
+			socklen_t addrlen)
+{
+	if (nsm_batch_full(&s->tx))
+		flush_service(s);
+	memcpy(nsm_batch_buf(&s->tx, s->tx.count), buf, len);
+	nsm_batch_queue(&s->tx, len, addr, addrlen);
+}
+
+static unsigned int reply_delay(void)
+{
+	unsigned int msec = delay;
+
+	if (jitter)
+		msec += rnd() % (jitter + 1);
+	if (chance(slow))
+		msec += slow_delay;
+	return msec;
+}
+
+static void receive(struct fake_service *s, long now)
+{
+	uint32_t rep[FAKE_REPLY_WORDS];
+	struct fake_reply *r;
+	unsigned int len, msec;
+	int res, i;
+
+	while ((res = nsm_batch_recv(s->sock, &s->rx)) > 0) {
+		for (i = 0; i < res; i++) {
+			struct sockaddr *addr = nsm_batch_addr(&s->rx, i);
+			socklen_t addrlen = s->rx.msgs[i].msg_hdr.msg_namelen;
+
+			s->calls++;
+			if (chance(loss)) {
+				dropped++;
+				continue;
+			}
+
+			len = handle_call(s, nsm_batch_buf(&s->rx, i),
+					nsm_batch_len(&s->rx, i), rep);
+			if (!len)
+				continue;
+
+			msec = reply_delay();
+			if (!msec) {
+				send_reply(s, rep, len, addr, addrlen);
+				continue;
+			}
+
+			r = free_replies;
+			if (!r) {
+				overflow++;
+				continue;
+			}
+			free_replies = r->next;
+			r->service = s;
+			r->len = len;
+			memcpy(r->buf, rep, len);
+			memcpy(&r->addr, addr, addrlen);
+			r->addrlen = addrlen;
+			nsm_timer_add(&timers, &r->timer, now + msec);
+			delayed++;
+		}
+	}
+}
+
+/*
+ * Send the delayed replies, which are due.
+ */
+static void expire(long now)
+{
+	struct nsm_timer *timer;
+	struct fake_reply *r;
+
+	while ((timer = nsm_timer_first(&timers)) && timer->expires <= now) {
+		r = nsm_timer_entry(timer, struct fake_reply, timer);
+		nsm_timer_del(&timers, timer);
+		send_reply(r->service, r->buf, r->len,
+				(struct sockaddr *)&r->addr, r->addrlen);
+		r->next = free_replies;
+		free_replies = r;
+	}
+}
+
+static int read_full(int sock, void *buf, size_t len)
+{
+	ssize_t res;
+
+	while (len) {
+		res = read(sock, buf, len);
+		if (res <= 0)
+			return -1;
+		buf = (char *)buf + res;
+		len -= res;
+	}
+	return 0;
+}
+
+/*
+ * Serve the portmapper calls of a TCP connection, one record each, until
+ * it's closed. Losses and delays are for the datagrams only.
+ */
+static void serve_tcp(void)
+{
+	uint32_t req[FAKE_REPLY_WORDS], rep[FAKE_REPLY_WORDS + 1], mark;
+	struct timeval tv = { .tv_sec = FAKE_TCP_TIMEOUT };
+	unsigned int len;
+	int sock;
+
+	sock = accept(pmap_tcp, NULL, NULL);
+	if (sock < 0)
+		return;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	while (!read_full(sock, &mark, sizeof(mark))) {
+		len = ntohl(mark) & ~RPC_LAST_FRAG;
+		if (!(ntohl(mark) & RPC_LAST_FRAG) || len > sizeof(req) ||
+		    read_full(sock, req, len) < 0)
+			break;
+
+		services[FAKE_PMAP].calls++;
+		len = handle_call(&services[FAKE_PMAP], req, len, rep + 1);
+		if (!len)
+			break;
+		rep[0] = htonl(RPC_LAST_FRAG | len);
+		if (write(sock, rep, len + 4) != len + 4)
+			break;
+	}
+	close(sock);
+}
+
+static int open_tcp(void)
+{
+	struct sockaddr_storage addr = local;
+	int on = 1;
+
+	if (addr.ss_family == AF_INET)
+		((struct sockaddr_in *)&addr)->sin_port =
+				htons(services[FAKE_PMAP].port);
+	else
+		((struct sockaddr_in6 *)&addr)->sin6_port =
+				htons(services[FAKE_PMAP].port);
+
+	pmap_tcp = socket(addr.ss_family, SOCK_STREAM, 0);
+	if (pmap_tcp < 0)
+		return -1;
+	setsockopt(pmap_tcp, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (bind(pmap_tcp, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(pmap_tcp, 16) < 0)
+		return -1;
+	return 0;
+}
+
+static int open_service(struct fake_service *s)
+{
+	struct sockaddr_storage addr = local;
+	socklen_t len = sizeof(addr);
+	int bufsize = FAKE_SOCKBUF;
+
+	s->sock = socket(addr.ss_family, SOCK_DGRAM, 0);
+	if (s->sock < 0)
+		return -1;
+
+	if (setsockopt(s->sock, SOL_SOCKET, SO_RCVBUFFORCE, &bufsize, sizeof(bufsize)) < 0)
+		setsockopt(s->sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+	if (addr.ss_family == AF_INET)
+		((struct sockaddr_in *)&addr)->sin_port = htons(s->port);
+	else
+		((struct sockaddr_in6 *)&addr)->sin6_port = htons(s->port);
+
+	if (bind(s->sock, (struct sockaddr *)&addr, len) < 0 ||
+	    getsockname(s->sock, (struct sockaddr *)&addr, &len) < 0)
+		return -1;
+
+	s->port = ntohs(addr.ss_family == AF_INET ?
+			((struct sockaddr_in *)&addr)->sin_port :
+			((struct sockaddr_in6 *)&addr)->sin6_port);
+
+	if (nsm_batch_init(&s->rx, NSM_BATCH_SIZE) < 0 ||
+	    nsm_batch_init(&s->tx, NSM_BATCH_SIZE) < 0)
+		return -1;
+	return 0;
+}
+
+static int parse_local(const char *name)
+{
+	struct addrinfo *ai, hint = {
+		.ai_flags	= AI_NUMERICHOST,
+		.ai_protocol	= IPPROTO_UDP,
+	};
+	const void *in;
+
+	if (getaddrinfo(name, NULL, &hint, &ai))
+		return -1;
+	memcpy(&local, ai->ai_addr, ai->ai_addrlen);
+	freeaddrinfo(ai);
+
+	if (local.ss_family == AF_INET)
+		in = &((struct sockaddr_in *)&local)->sin_addr;
+	else
+		in = &((struct sockaddr_in6 *)&local)->sin6_addr;
+	inet_ntop(local.ss_family, in, local_uaddr, sizeof(local_uaddr));
+	return 0;
+}
+
+static void report(void)
+{
+	printf("Calls: portmapper %lu, rpc.statd %lu, nlockmgr %lu\n",
+			services[FAKE_PMAP].calls, services[FAKE_STATD].calls,
+			services[FAKE_NLM].calls);
+	printf("SM_NOTIFY %lu (%lu with the secret state), NLM4_TEST %lu, "
+			"locks %s\n", notified, released, tests,
+			locked ? "held" : "released");
+	printf("Lost %lu, delayed %lu, over the delay queue %lu\n", dropped,
+			delayed, overflow);
+	fflush(stdout);
+}
+
+static void help(char *name)
+{
+	printf("Usage: %s [OPTIONS]\n\n", name);
+	printf("\t-a address                Local address to serve on (default: 127.0.0.1).\n\n");
+	printf("\t-m port                   Portmapper port (default: %d).\n\n", PMAP_PORT);
+	printf("\t-p port                   rpc.statd port (default: any free one).\n\n");
+	printf("\t-n port                   nlockmgr port (default: any free one).\n\n");
+	printf("\t-S state                  Secret state: only SM_NOTIFY with it releases the locks (default: any state).\n\n");
+	printf("\t-d msec                   Delay of every reply (default: 0).\n\n");
+	printf("\t-j msec                   Uniform random jitter added to the delay (default: 0).\n\n");
+	printf("\t-l percent                Requests lost (default: 0).\n\n");
+	printf("\t-s percent:msec           Replies slowed down by 'msec' more, for tail latency (default: none).\n\n");
+	printf("\t-r seed                   Seed of the loss and delay randomness (default: 1).\n\n");
+	printf("\t-v                        Print every notification and test.\n\n");
+	printf("\t-h                        This help.\n\n");
+	printf("Ports are printed on start, statistics on SIGINT or SIGTERM.\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct pollfd pfd[FAKE_SERVICES + 1];
+	struct sigaction sa;
+	char *address = "127.0.0.1", *colon;
+	unsigned long seed = 1;
+	unsigned int i;
+	long wait;
+	int result;
+
+	while ((result = getopt(argc, argv, "a:m:p:n:S:d:j:l:s:r:vh")) != EOF) {
+		switch (result) {
+			case 'a':
+				address = optarg;
+				break;
+			case 'm':
+				services[FAKE_PMAP].port = atoi(optarg);
+				break;
+			case 'p':
+				services[FAKE_STATD].port = atoi(optarg);
+				break;
+			case 'n':
+				services[FAKE_NLM].port = atoi(optarg);
+				break;
+			case 'S':
+				secret = strtoul(optarg, NULL, 0);
+				has_secret = 1;
+				break;
+			case 'd':
+				delay = atoi(optarg);
+				break;
+			case 'j':
+				jitter = atoi(optarg);
+				break;
+			case 'l':
+				if (parse_percent(optarg, &loss) < 0) {
+					fprintf(stderr, "Bad loss: %s\n", optarg);
+					exit(2);
+				}
+				break;
+			case 's':
+				colon = strchr(optarg, ':');
+				if (!colon) {
+					fprintf(stderr, "Slow replies must be "
+						"given as percent:msec\n");
+					exit(2);
+				}
+				*colon = '\0';
+				if (parse_percent(optarg, &slow) < 0) {
+					fprintf(stderr, "Bad share of slow "
+						"replies: %s\n", optarg);
+					exit(2);
+				}
+				slow_delay = atoi(colon + 1);
+				break;
+			case 'r':
+				seed = strtoul(optarg, NULL, 0);
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			case 'h':
+				help(argv[0]);
+				exit(0);
+			default:
+				help(argv[0]);
+				exit(2);
+		}
+	}
+
+	/* xorshift never leaves zero */
+	rnd_state = seed ? seed : 1;
+
+	if (parse_local(address) < 0) {
+		fprintf(stderr, "Not a numeric address: \"%s\"\n", address);
+		exit(1);
+	}
+
+	for (i = 0; i < FAKE_SERVICES; i++) {
+		if (open_service(&services[i]) < 0) {
+			fprintf(stderr, "Failed to open %s on port %u: %s\n",
+				services[i].name, services[i].port,
+				strerror(errno));
+			exit(1);
+		}
+		pfd[i].fd = services[i].sock;
+		pfd[i].events = POLLIN;
+	}
+
+	/* on the port the datagram one got */
+	if (open_tcp() < 0) {
+		fprintf(stderr, "Failed to open portmapper TCP port %u: %s\n",
+			services[FAKE_PMAP].port, strerror(errno));
+		exit(1);
+	}
+	pfd[FAKE_SERVICES].fd = pmap_tcp;
+	pfd[FAKE_SERVICES].events = POLLIN;
+
+	replies = calloc(FAKE_PENDING, sizeof(*replies));
+	if (!replies || nsm_timer_heap_init(&timers, FAKE_PENDING) < 0) {
+		fprintf(stderr, "Failed to allocate the delay queue\n");
+		exit(1);
+	}
+	for (i = 0; i < FAKE_PENDING; i++) {
+		replies[i].next = free_replies;
+		free_replies = &replies[i];
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	printf("portmapper %s:%u, rpc.statd %u, nlockmgr %u\n", local_uaddr,
+			services[FAKE_PMAP].port, services[FAKE_STATD].port,
+			services[FAKE_NLM].port);
+	fflush(stdout);
+
+	while (!stop) {
+		wait = nsm_timer_wait(&timers, nsm_now_msec());
+
+		if (poll(pfd, FAKE_SERVICES + 1, wait) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			exit(1);
+		}
+
+		for (i = 0; i < FAKE_SERVICES; i++)
+			if (pfd[i].revents & POLLIN)
+				receive(&services[i], nsm_now_msec());
+		if (pfd[FAKE_SERVICES].revents & POLLIN)
+			serve_tcp();
+		expire(nsm_now_msec());
+
+		for (i = 0; i < FAKE_SERVICES; i++)
+			flush_service(&services[i]);
+	}
+
+	report();
+	return 0;
+}
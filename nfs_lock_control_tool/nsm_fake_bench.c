@@ -0,0 +1,558 @@
+/*
+ * Notification benchmark against the loopback stand-in server.
+ *
+ * Every run starts nsm_fake with the given latency and loss, then runs
+ * a bulk of clear_nfs_locks jobs through its engine ("-f job_file") and
+ * a forced notify sweep, which stops when NLM4_TEST tells the secret
+ * state was hit. The bulk gives jobs per second and the percentiles of
+ * the job times clear_nfs_locks reports, the sweep gives states per
+ * second and the time to find the state. The same seed gives the same
+ * losses and delays, so runs are comparable. The CPU time clear_nfs_locks
+ * takes, and with "-c" the syscalls it makes, are given per 100k jobs, to
+ * compare its I/O methods ("-I").
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <sys/param.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "nsm_clock.h"
+
+#define BENCH_JOBS		10000
+#define BENCH_RUNS		3
+#define BENCH_SECRET		100001
+#define BENCH_STATE		5	/* of the bulk jobs, one step each */
+#define BENCH_FH		"0x0102030405060708"
+#define BENCH_ARGS		32	/* nsm_fake options at most */
+#define BENCH_PER		100000	/* jobs the costs are given for */
+
+struct bench_run {
+	unsigned long	jobs;
+	unsigned long	failed;
+	double		seconds;
+	long		p50, p90, p99, p999, max;	/* usec */
+	double		cpu;		/* seconds per BENCH_PER jobs */
+	unsigned long	syscalls;	/* per BENCH_PER jobs */
+	unsigned long	states;
+	double		sweep_seconds;
+	int		found;
+};
+
+static char *bin_dir = ".";
+static char server[64];			/* nsm_fake's address */
+static char *fake_args[BENCH_ARGS];
+static int nr_fake_args;
+static char *io_method;
+static int count_syscalls;
+static int verbose;
+
+#define v_printf	if (verbose) printf
+
+static char *bin_path(const char *name)
+{
+	static char path[3][PATH_MAX];
+	static int next;
+	char *p = path[next++ % 3];
+
+	snprintf(p, PATH_MAX, "%s/%s", bin_dir, name);
+	return p;
+}
+
+static double tv_sec(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/*
+ * Run the program traced, counting its syscalls: every one stops it on
+ * the way in and out. This is the child of spawn(), which the bench
+ * waits for; it writes "<syscalls> <cpu seconds>" of the program to
+ * 'report' and exits with its status.
+ */
+static void trace(char **argv, int report)
+{
+	unsigned long stops = 0;
+	struct rusage ru;
+	int status, sig = 0;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		_exit(127);
+	if (!pid) {
+		ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+		execv(argv[0], argv);
+		fprintf(stderr, "Failed to run %s: %s\n", argv[0],
+							strerror(errno));
+		_exit(127);
+	}
+
+	/* it stops at exec */
+	if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status))
+		_exit(127);
+	ptrace(PTRACE_SETOPTIONS, pid, NULL,
+		(void *)(PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL));
+
+	for (;;) {
+		ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(long)sig);
+		if (wait4(pid, &status, 0, &ru) < 0)
+			_exit(127);
+		if (!WIFSTOPPED(status))
+			break;
+
+		sig = WSTOPSIG(status);
+		if (sig == (SIGTRAP | 0x80)) {
+			stops++;
+			sig = 0;
+		}
+	}
+
+	/* exit_group() doesn't return */
+	dprintf(report, "%lu %f\n", (stops + 1) / 2,
+			tv_sec(&ru.ru_utime) + tv_sec(&ru.ru_stime));
+	_exit(WIFEXITED(status) ? WEXITSTATUS(status) : 127);
+}
+
+/*
+ * Start the program with its stdout in '*out'. Returns its pid. With
+ * 'report' other than -1 it runs under trace().
+ */
+static pid_t spawn(char **argv, FILE **out, int report)
+{
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds) < 0)
+		return -1;
+
+	pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if (!pid) {
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		if (report >= 0)
+			trace(argv, report);
+		execv(argv[0], argv);
+		fprintf(stderr, "Failed to run %s: %s\n", argv[0],
+							strerror(errno));
+		_exit(127);
+	}
+
+	close(fds[1]);
+	*out = fdopen(fds[0], "r");
+	return pid;
+}
+
+/*
+ * Wait for the program, its CPU time goes to '*cpu' unless it's NULL.
+ */
+static int finish(pid_t pid, FILE *out, double *cpu)
+{
+	struct rusage ru;
+	int status;
+
+	fclose(out);
+	if (wait4(pid, &status, 0, &ru) < 0 || !WIFEXITED(status))
+		return -1;
+	if (cpu)
+		*cpu = tv_sec(&ru.ru_utime) + tv_sec(&ru.ru_stime);
+	return WEXITSTATUS(status);
+}
+
+/*
+ * Start nsm_fake and take the ports it's serving on.
+ */
+static pid_t start_fake(uint32_t secret, unsigned int seed, FILE **out,
+			unsigned short *statd_port)
+{
+	char *argv[BENCH_ARGS + 8], secret_arg[16], seed_arg[16];
+	char line[256], *colon;
+	unsigned int pmap, statd, nlm;
+	int argc = 0, i;
+	pid_t pid;
+
+	snprintf(secret_arg, sizeof(secret_arg), "%u", secret);
+	snprintf(seed_arg, sizeof(seed_arg), "%u", seed);
+
+	argv[argc++] = bin_path("nsm_fake");
+	argv[argc++] = "-S";
+	argv[argc++] = secret_arg;
+	argv[argc++] = "-r";
+	argv[argc++] = seed_arg;
+	for (i = 0; i < nr_fake_args; i++)
+		argv[argc++] = fake_args[i];
+	argv[argc] = NULL;
+
+	pid = spawn(argv, out, -1);
+	if (pid < 0)
+		return -1;
+
+	if (!fgets(line, sizeof(line), *out) ||
+	    sscanf(line, "portmapper %63[^ ] rpc.statd %u, nlockmgr %u",
+				server, &statd, &nlm) != 3 ||
+	    !(colon = strrchr(server, ':'))) {
+		fprintf(stderr, "nsm_fake didn't start\n");
+		kill(pid, SIGKILL);
+		finish(pid, *out, NULL);
+		return -1;
+	}
+	*colon = '\0';
+	pmap = atoi(colon + 1);
+	v_printf("nsm_fake: portmapper %u, rpc.statd %u, nlockmgr %u\n",
+						pmap, statd, nlm);
+	*statd_port = statd;
+	return pid;
+}
+
+static void stop_fake(pid_t pid, FILE *out)
+{
+	char line[256];
+
+	kill(pid, SIGINT);
+	while (fgets(line, sizeof(line), out))
+		v_printf("nsm_fake: %s", line);
+	finish(pid, out, NULL);
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static long percentile(const long *v, unsigned long n, double p)
+{
+	unsigned long i;
+
+	if (!n)
+		return 0;
+	i = p * n;
+	return v[MIN(i, n - 1)];
+}
+
+/*
+ * clear_nfs_locks with 'jobs' clients notified to the stand-in at once,
+ * 'max_jobs' of them in flight.
+ */
+static int run_bulk(unsigned long jobs, unsigned int max_jobs,
+			unsigned short statd_port, struct bench_run *r)
+{
+	char job_file[] = "/tmp/nsm_bench.XXXXXX", jobs_arg[16];
+	char *argv[] = { bin_path("clear_nfs_locks"), "-f", job_file,
+			 "-j", jobs_arg, "-C", "", "-P", "", NULL, NULL, NULL };
+	char line[512], result[16];
+	unsigned long i, n = 0, syscalls = 0;
+	long usec, *times;
+	FILE *f, *out, *rep;
+	int fd, report[2] = { -1, -1 };
+	double cpu = 0;
+	pid_t pid;
+
+	times = calloc(jobs, sizeof(*times));
+	fd = mkstemp(job_file);
+	if (!times || fd < 0 || !(f = fdopen(fd, "w"))) {
+		fprintf(stderr, "Failed to make the job file: %s\n",
+							strerror(errno));
+		free(times);
+		return -1;
+	}
+	for (i = 0; i < jobs; i++)
+		fprintf(f, "bench-%lu %s %u %u\n", i, server, BENCH_STATE,
+								statd_port);
+	fclose(f);
+
+	snprintf(jobs_arg, sizeof(jobs_arg), "%u", max_jobs);
+	if (io_method) {
+		argv[9] = "-I";
+		argv[10] = io_method;
+	}
+	if (count_syscalls && pipe(report) < 0) {
+		unlink(job_file);
+		free(times);
+		return -1;
+	}
+
+	r->seconds = nsm_now_sec();
+	pid = spawn(argv, &out, report[1]);
+	if (report[1] >= 0)
+		close(report[1]);
+	if (pid < 0) {
+		if (report[0] >= 0)
+			close(report[0]);
+		unlink(job_file);
+		free(times);
+		return -1;
+	}
+
+	/* line,client,server,state,port,result,error,usec */
+	r->failed = 0;
+	while (fgets(line, sizeof(line), out)) {
+		if (sscanf(line, "%*u,%*[^,],%*[^,],%*u,%*u,%15[^,],%*[^,],%ld",
+						result, &usec) != 2 &&
+		    sscanf(line, "%*u,%*[^,],%*[^,],%*u,%*u,%15[^,],,%ld",
+						result, &usec) != 2)
+			continue;
+		if (strcmp(result, "ok"))
+			r->failed++;
+		else if (n < jobs)
+			times[n++] = usec;
+	}
+	finish(pid, out, &cpu);
+	r->seconds = nsm_now_sec() - r->seconds;
+	unlink(job_file);
+
+	/* under the tracer the CPU time is the tracee's, from the report */
+	if (report[0] >= 0 && (rep = fdopen(report[0], "r"))) {
+		if (fscanf(rep, "%lu %lf", &syscalls, &cpu) != 2)
+			syscalls = 0;
+		fclose(rep);
+	}
+
+	qsort(times, n, sizeof(*times), cmp_long);
+	r->jobs = n + r->failed;
+	r->p50 = percentile(times, n, 0.5);
+	r->p90 = percentile(times, n, 0.9);
+	r->p99 = percentile(times, n, 0.99);
+	r->p999 = percentile(times, n, 0.999);
+	r->max = n ? times[n - 1] : 0;
+	r->cpu = r->jobs ? cpu * BENCH_PER / r->jobs : 0;
+	r->syscalls = r->jobs ? (double)syscalls * BENCH_PER / r->jobs : 0;
+	free(times);
+	return 0;
+}
+
+/*
+ * notify -f until the probes see the locks gone.
+ */
+static int run_sweep(unsigned short statd_port, struct bench_run *r)
+{
+	char port_arg[8], line[256];
+	char *argv[] = { bin_path("notify"), "-c", "bench-client", "-s",
+			 server, "-p", port_arg, "-f", "-t", BENCH_FH,
+			 "-C", "", "-P", "", NULL };
+	FILE *out;
+	pid_t pid;
+
+	snprintf(port_arg, sizeof(port_arg), "%u", statd_port);
+
+	r->found = 0;
+	r->sweep_seconds = nsm_now_sec();
+	pid = spawn(argv, &out, -1);
+	if (pid < 0)
+		return -1;
+	while (fgets(line, sizeof(line), out)) {
+		v_printf("notify: %s", line);
+		if (!strncmp(line, "Locks are released", 18))
+			r->found = 1;
+		sscanf(line, "Sweep: %lu states sent", &r->states);
+	}
+	finish(pid, out, NULL);
+	r->sweep_seconds = nsm_now_sec() - r->sweep_seconds;
+	return 0;
+}
+
+static void report_run(const char *name, const struct bench_run *r)
+{
+	printf("%-6s %8lu %6lu %8.3f %9.0f %7ld %7ld %7ld %7ld %7ld %8.3f",
+		name, r->jobs, r->failed, r->seconds, r->jobs / r->seconds,
+		r->p50, r->p90, r->p99, r->p999, r->max, r->cpu);
+	if (count_syscalls)
+		printf(" %9lu", r->syscalls);
+	if (r->states)
+		printf(" %10lu %8.3f %10.0f%s", r->states, r->sweep_seconds,
+			r->states / r->sweep_seconds, r->found ? "" : " (not found)");
+	printf("\n");
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * The median of every column over the runs.
+ */
+static void report_median(const struct bench_run *runs, unsigned int nr)
+{
+	struct bench_run m = { .found = 1 };
+	double v[nr];
+	unsigned int i, col;
+
+	for (col = 0; col < 12; col++) {
+		for (i = 0; i < nr; i++) {
+			const struct bench_run *r = &runs[i];
+			double c[] = { r->jobs, r->failed, r->seconds, r->p50,
+				       r->p90, r->p99, r->p999, r->max,
+				       r->states, r->sweep_seconds, r->cpu,
+				       r->syscalls };
+			v[i] = c[col];
+		}
+		qsort(v, nr, sizeof(v[0]), cmp_double);
+		switch (col) {
+		case 0: m.jobs = v[nr / 2]; break;
+		case 1: m.failed = v[nr / 2]; break;
+		case 2: m.seconds = v[nr / 2]; break;
+		case 3: m.p50 = v[nr / 2]; break;
+		case 4: m.p90 = v[nr / 2]; break;
+		case 5: m.p99 = v[nr / 2]; break;
+		case 6: m.p999 = v[nr / 2]; break;
+		case 7: m.max = v[nr / 2]; break;
+		case 8: m.states = v[nr / 2]; break;
+		case 9: m.sweep_seconds = v[nr / 2]; break;
+		case 10: m.cpu = v[nr / 2]; break;
+		case 11: m.syscalls = v[nr / 2]; break;
+		}
+	}
+	for (i = 0; i < nr; i++)
+		m.found &= runs[i].found || !runs[i].states;
+	report_run("median", &m);
+}
+
+static void help(char *name)
+{
+	printf("Usage: %s [OPTIONS] [-- nsm_fake options]\n\n", name);
+	printf("\t-b dir                    Directory of nsm_fake, clear_nfs_locks and notify (default: .).\n\n");
+	printf("\t-n jobs                   clear_nfs_locks jobs of a run (default: %d).\n\n", BENCH_JOBS);
+	printf("\t-j jobs                   Jobs in flight (default: 1024).\n\n");
+	printf("\t-r runs                   Runs (default: %d).\n\n", BENCH_RUNS);
+	printf("\t-S state                  State the sweep has to find (default: %d), 0 skips the sweep.\n\n", BENCH_SECRET);
+	printf("\t-s seed                   Seed of nsm_fake's losses and delays (default: 1).\n\n");
+	printf("\t-I mmsg|uring             I/O method of clear_nfs_locks (default: its own).\n\n");
+	printf("\t-c                        Count the syscalls of clear_nfs_locks, under ptrace: it\n"
+	       "\t                          runs slower, the CPU time is still its own.\n\n");
+	printf("\t-v                        Print the output of nsm_fake and notify.\n\n");
+	printf("\t-h                        This help.\n\n");
+	printf("nsm_fake serves the portmapper on port 111, unless '-m port' is given to it,\n");
+	printf("and notify asks it there for nlockmgr. Latency and loss are nsm_fake options,\n");
+	printf("e.g. \"%s -- -d 1 -j 2 -l 0.1 -s 1:50\".\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long jobs = BENCH_JOBS;
+	unsigned int runs = BENCH_RUNS, max_jobs = 1024, seed = 1, i;
+	uint32_t secret = BENCH_SECRET;
+	unsigned short statd_port;
+	struct bench_run *r;
+	FILE *fake_out;
+	pid_t fake;
+	int result;
+
+	while ((result = getopt(argc, argv, "b:n:j:r:S:s:I:cvh")) != EOF) {
+		switch (result) {
+			case 'b':
+				bin_dir = optarg;
+				break;
+			case 'n':
+				jobs = strtoul(optarg, NULL, 0);
+				break;
+			case 'j':
+				max_jobs = atoi(optarg);
+				break;
+			case 'r':
+				runs = atoi(optarg);
+				break;
+			case 'S':
+				secret = strtoul(optarg, NULL, 0);
+				break;
+			case 's':
+				seed = strtoul(optarg, NULL, 0);
+				break;
+			case 'I':
+				io_method = optarg;
+				break;
+			case 'c':
+				count_syscalls = 1;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			case 'h':
+				help(argv[0]);
+				exit(0);
+			default:
+				help(argv[0]);
+				exit(2);
+		}
+	}
+
+	for (; optind < argc; optind++) {
+		if (nr_fake_args == BENCH_ARGS) {
+			fprintf(stderr, "Too many nsm_fake options\n");
+			exit(2);
+		}
+		fake_args[nr_fake_args++] = argv[optind];
+	}
+
+	/* notify finds nlockmgr for the probes through port 111 only */
+	for (i = 0; secret && i < nr_fake_args; i++) {
+		if (!strncmp(fake_args[i], "-m", 2)) {
+			printf("The portmapper is not on port 111, no sweep\n");
+			secret = 0;
+		}
+	}
+
+	if (!jobs || !runs || !max_jobs) {
+		fprintf(stderr, "Jobs and runs must be at least 1.\n");
+		exit(1);
+	}
+
+	r = calloc(runs, sizeof(*r));
+	if (!r) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	printf("%-6s %8s %6s %8s %9s %7s %7s %7s %7s %7s %8s", "run", "jobs",
+		"failed", "seconds", "jobs/s", "p50us", "p90us", "p99us",
+		"p999us", "maxus", "cpu/100k");
+	if (count_syscalls)
+		printf(" %9s", "sys/100k");
+	if (secret)
+		printf(" %10s %8s %10s", "states", "seconds", "states/s");
+	printf("\n");
+
+	for (i = 0; i < runs; i++) {
+		char name[16];
+
+		fake = start_fake(secret, seed, &fake_out, &statd_port);
+		if (fake < 0)
+			exit(1);
+
+		result = run_bulk(jobs, max_jobs, statd_port, &r[i]);
+		if (!result && secret)
+			result = run_sweep(statd_port, &r[i]);
+		stop_fake(fake, fake_out);
+		if (result < 0) {
+			fprintf(stderr, "Run %u failed\n", i + 1);
+			exit(1);
+		}
+
+		snprintf(name, sizeof(name), "%u", i + 1);
+		report_run(name, &r[i]);
+	}
+
+	if (runs > 1)
+		report_median(r, runs);
+	free(r);
+	return 0;
+}
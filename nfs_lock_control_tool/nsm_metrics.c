@@ -0,0 +1,492 @@
+/*
+ * Counters and latency histograms of the notification tools.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <arpa/inet.h>
+
+#include "nsm_metrics.h"
+
+struct nsm_metrics {
+	const char *		file;		/* NULL if not collected */
+	int			json;
+	struct nsm_server_stats **hash;
+	struct nsm_hist		dns;		/* successful lookups */
+	unsigned long		dns_failures;
+	struct nsm_hist		pmap;		/* ports found */
+	unsigned long		pmap_failures;
+};
+
+static struct nsm_metrics metrics;
+/* lookups may run in threads of their own */
+static pthread_mutex_t lookup_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t dump_pending;
+
+static const char *reply_names[NSM_REPLY_KINDS] = {
+	"success", "prog_unavail", "prog_mismatch", "proc_unavail",
+	"garbage_args", "system_err", "denied", "malformed",
+};
+
+/* Prometheus histogram bounds, usec */
+static const uint32_t prom_bounds[] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+	100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
+};
+
+static unsigned int hist_index(uint32_t v)
+{
+	unsigned int e;
+
+	if (v < NSM_HIST_SUB)
+		return v;
+	e = 31 - __builtin_clz(v);
+	return (e - NSM_HIST_SUB_BITS + 1) * NSM_HIST_SUB +
+			(v >> (e - NSM_HIST_SUB_BITS)) - NSM_HIST_SUB;
+}
+
+/*
+ * The highest value, which goes to bucket 'i'.
+ */
+static uint32_t hist_highest(unsigned int i)
+{
+	unsigned int shift;
+
+	if (i < 2 * NSM_HIST_SUB)
+		return i;
+	shift = i / NSM_HIST_SUB - 1;
+	return ((uint64_t)(NSM_HIST_SUB + i % NSM_HIST_SUB) << shift) +
+						(1U << shift) - 1;
+}
+
+void nsm_hist_add(struct nsm_hist *h, long usec)
+{
+	uint32_t v = usec < 0 ? 0 : usec > UINT32_MAX ? UINT32_MAX : usec;
+
+	if (!h->count || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->count++;
+	h->sum += v;
+	h->buckets[hist_index(v)]++;
+}
+
+/*
+ * The value, which 'q' of the samples don't exceed, as the highest one
+ * of its bucket.
+ */
+uint32_t nsm_hist_quantile(const struct nsm_hist *h, double q)
+{
+	uint64_t rank, seen = 0;
+	unsigned int i;
+
+	if (!h->count)
+		return 0;
+	rank = q * h->count;
+	if (rank < h->count)
+		rank++;
+
+	for (i = 0; i < NSM_HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			return MIN(hist_highest(i), h->max);
+	}
+	return h->max;
+}
+
+/*
+ * Add the samples of 'from' to 'to'.
+ */
+void nsm_hist_merge(struct nsm_hist *to, const struct nsm_hist *from)
+{
+	unsigned int i;
+
+	if (!from->count)
+		return;
+	if (!to->count || from->min < to->min)
+		to->min = from->min;
+	to->max = MAX(to->max, from->max);
+	to->count += from->count;
+	to->sum += from->sum;
+	for (i = 0; i < NSM_HIST_BUCKETS; i++)
+		to->buckets[i] += from->buckets[i];
+}
+
+static void metrics_signal(int sig)
+{
+	dump_pending = 1;
+}
+
+static void metrics_dump(void)
+{
+	int res;
+
+	res = nsm_metrics_write();
+	if (res < 0)
+		fprintf(stderr, "Failed to write metrics to %s: %s\n",
+					metrics.file, strerror(-res));
+}
+
+/*
+ * Start collecting the metrics for 'file'. They are written there on
+ * exit and every time SIGUSR1 comes, the caller calls
+ * nsm_metrics_check() for that in its loops.
+ */
+int nsm_metrics_init(const char *file)
+{
+	struct sigaction sa;
+	size_t len = strlen(file);
+
+	metrics.hash = calloc(NSM_METRICS_HASH, sizeof(*metrics.hash));
+	if (!metrics.hash)
+		return -ENOMEM;
+	metrics.file = file;
+	metrics.json = len > 5 && !strcmp(file + len - 5, ".json");
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = metrics_signal;
+	sigaction(SIGUSR1, &sa, NULL);
+	atexit(metrics_dump);
+	return 0;
+}
+
+static unsigned int hash_name(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619U;
+	return h % NSM_METRICS_HASH;
+}
+
+/*
+ * The stats of the server, created on first use. NULL if the metrics
+ * are not collected or there is no memory for them.
+ */
+struct nsm_server_stats *nsm_metrics_server(const char *name)
+{
+	struct nsm_server_stats **head, *s;
+
+	if (!metrics.file)
+		return NULL;
+
+	head = &metrics.hash[hash_name(name)];
+	for (s = *head; s; s = s->next)
+		if (!strcmp(s->name, name))
+			return s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s || !(s->name = strdup(name))) {
+		free(s);
+		return NULL;
+	}
+	s->next = *head;
+	*head = s;
+	return s;
+}
+
+/*
+ * Count the reply of 'len' bytes by its accept status.
+ */
+void nsm_metrics_reply(struct nsm_server_stats *s, const uint32_t *buf,
+							int len)
+{
+	unsigned int words = len / sizeof(uint32_t), off, kind = NSM_REPLY_BAD;
+
+	if (!s)
+		return;
+
+	if (words >= 3 && buf[1] == htonl(1)) {		/* REPLY */
+		if (buf[2] == htonl(1))			/* MSG_DENIED */
+			kind = NSM_REPLY_DENIED;
+		else if (buf[2] == htonl(0) && words >= 5) {
+			/* skip the verifier body */
+			off = 5 + (MIN(ntohl(buf[4]), 400) + 3) / 4;
+			if (off < words && ntohl(buf[off]) < NSM_REPLY_DENIED)
+				kind = ntohl(buf[off]);
+		}
+	}
+	s->replies[kind]++;
+}
+
+void nsm_metrics_rtt(struct nsm_server_stats *s, long usec)
+{
+	if (s)
+		nsm_hist_add(&s->rtt, usec);
+}
+
+void nsm_metrics_dns(long usec, int error)
+{
+	if (!metrics.file)
+		return;
+	pthread_mutex_lock(&lookup_lock);
+	if (error)
+		metrics.dns_failures++;
+	else
+		nsm_hist_add(&metrics.dns, usec);
+	pthread_mutex_unlock(&lookup_lock);
+}
+
+void nsm_metrics_pmap(long usec, int error)
+{
+	if (!metrics.file)
+		return;
+	pthread_mutex_lock(&lookup_lock);
+	if (error)
+		metrics.pmap_failures++;
+	else
+		nsm_hist_add(&metrics.pmap, usec);
+	pthread_mutex_unlock(&lookup_lock);
+}
+
+/*
+ * Write the label value, quoted and escaped the way Prometheus wants it.
+ */
+static void prom_quote(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '\\' || *s == '"')
+			fprintf(f, "\\%c", *s);
+		else if (*s == '\n')
+			fputs("\\n", f);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+static void prom_head(FILE *f, const char *name, const char *type,
+							const char *help)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void prom_labels(FILE *f, const char *server, const char *extra)
+{
+	if (!server && !extra)
+		return;
+	fputc('{', f);
+	if (server) {
+		fputs("server=", f);
+		prom_quote(f, server);
+	}
+	if (extra)
+		fprintf(f, "%s%s", server ? "," : "", extra);
+	fputc('}', f);
+}
+
+static void prom_hist(FILE *f, const char *name, const char *server,
+						const struct nsm_hist *h)
+{
+	unsigned int i = 0, b;
+	uint64_t count = 0;
+	char le[32];
+
+	for (b = 0; b < sizeof(prom_bounds) / sizeof(prom_bounds[0]); b++) {
+		while (i < NSM_HIST_BUCKETS && hist_highest(i) <= prom_bounds[b])
+			count += h->buckets[i++];
+		snprintf(le, sizeof(le), "le=\"%g\"", prom_bounds[b] / 1e6);
+		fprintf(f, "%s_bucket", name);
+		prom_labels(f, server, le);
+		fprintf(f, " %llu\n", (unsigned long long)count);
+	}
+	fprintf(f, "%s_bucket", name);
+	prom_labels(f, server, "le=\"+Inf\"");
+	fprintf(f, " %llu\n%s_sum", (unsigned long long)h->count, name);
+	prom_labels(f, server, NULL);
+	fprintf(f, " %g\n%s_count", h->sum / 1e6, name);
+	prom_labels(f, server, NULL);
+	fprintf(f, " %llu\n", (unsigned long long)h->count);
+}
+
+#define for_each_server(S, I)						\
+	for ((I) = 0; (I) < NSM_METRICS_HASH; (I)++)			\
+		for ((S) = metrics.hash[I]; (S); (S) = (S)->next)
+
+static void prom_counter(FILE *f, const char *name, const char *help,
+						size_t offset)
+{
+	struct nsm_server_stats *s;
+	unsigned int i;
+
+	prom_head(f, name, "counter", help);
+	for_each_server(s, i) {
+		fputs(name, f);
+		prom_labels(f, s->name, NULL);
+		fprintf(f, " %lu\n", *(unsigned long *)((char *)s + offset));
+	}
+}
+
+static void write_prom(FILE *f)
+{
+	struct nsm_server_stats *s;
+	unsigned int i, k;
+	char status[32];
+
+	prom_counter(f, "nsm_sent_packets_total", "SM_NOTIFY packets sent, "
+		"retransmissions included.",
+		offsetof(struct nsm_server_stats, sent));
+	prom_counter(f, "nsm_retransmits_total", "SM_NOTIFY retransmissions.",
+		offsetof(struct nsm_server_stats, retransmits));
+	prom_counter(f, "nsm_timeouts_total", "SM_NOTIFY calls never "
+		"answered.", offsetof(struct nsm_server_stats, timeouts));
+
+	prom_head(f, "nsm_replies_total", "counter",
+			"SM_NOTIFY replies by accept status.");
+	for_each_server(s, i) {
+		for (k = 0; k < NSM_REPLY_KINDS; k++) {
+			if (!s->replies[k])
+				continue;
+			snprintf(status, sizeof(status), "status=\"%s\"",
+							reply_names[k]);
+			fputs("nsm_replies_total", f);
+			prom_labels(f, s->name, status);
+			fprintf(f, " %lu\n", s->replies[k]);
+		}
+	}
+
+	prom_head(f, "nsm_rtt_seconds", "histogram",
+			"Round trip time of SM_NOTIFY calls sent once.");
+	for_each_server(s, i)
+		prom_hist(f, "nsm_rtt_seconds", s->name, &s->rtt);
+
+	prom_head(f, "nsm_dns_seconds", "histogram",
+			"Time of successful name lookups.");
+	prom_hist(f, "nsm_dns_seconds", NULL, &metrics.dns);
+	prom_head(f, "nsm_dns_failures_total", "counter",
+			"Failed name lookups.");
+	fprintf(f, "nsm_dns_failures_total %lu\n", metrics.dns_failures);
+
+	prom_head(f, "nsm_pmap_seconds", "histogram",
+			"Time of successful portmapper queries.");
+	prom_hist(f, "nsm_pmap_seconds", NULL, &metrics.pmap);
+	prom_head(f, "nsm_pmap_failures_total", "counter",
+			"Failed portmapper queries.");
+	fprintf(f, "nsm_pmap_failures_total %lu\n", metrics.pmap_failures);
+}
+
+static void json_quote(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '\\' || *s == '"')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+/*
+ * The summary and the non-empty buckets as [highest value, count] pairs.
+ */
+static void json_hist(FILE *f, const struct nsm_hist *h)
+{
+	unsigned int i;
+	int first = 1;
+
+	fprintf(f, "{\"count\": %llu, \"sum\": %llu, \"min\": %u, "
+		"\"max\": %u, \"p50\": %u, \"p90\": %u, \"p99\": %u, "
+		"\"p999\": %u, \"buckets\": [",
+		(unsigned long long)h->count, (unsigned long long)h->sum,
+		h->min, h->max, nsm_hist_quantile(h, 0.5),
+		nsm_hist_quantile(h, 0.9), nsm_hist_quantile(h, 0.99),
+		nsm_hist_quantile(h, 0.999));
+	for (i = 0; i < NSM_HIST_BUCKETS; i++) {
+		if (!h->buckets[i])
+			continue;
+		fprintf(f, "%s[%u, %u]", first ? "" : ", ", hist_highest(i),
+							h->buckets[i]);
+		first = 0;
+	}
+	fputs("]}", f);
+}
+
+static void write_json(FILE *f)
+{
+	struct nsm_server_stats *s;
+	unsigned int i, k;
+	int first = 1;
+
+	fputs("{\n\"servers\": [", f);
+	for_each_server(s, i) {
+		fprintf(f, "%s\n{\"name\": ", first ? "" : ",");
+		json_quote(f, s->name);
+		fprintf(f, ", \"sent\": %lu, \"retransmits\": %lu, "
+			"\"timeouts\": %lu, \"replies\": {", s->sent,
+			s->retransmits, s->timeouts);
+		for (k = 0; k < NSM_REPLY_KINDS; k++)
+			fprintf(f, "%s\"%s\": %lu", k ? ", " : "",
+					reply_names[k], s->replies[k]);
+		fputs("},\n \"rtt_usec\": ", f);
+		json_hist(f, &s->rtt);
+		fputc('}', f);
+		first = 0;
+	}
+	fprintf(f, "],\n\"dns\": {\"failures\": %lu, \"usec\": ",
+						metrics.dns_failures);
+	json_hist(f, &metrics.dns);
+	fprintf(f, "},\n\"pmap\": {\"failures\": %lu, \"usec\": ",
+						metrics.pmap_failures);
+	json_hist(f, &metrics.pmap);
+	fputs("}\n}\n", f);
+}
+
+/*
+ * Replace the file with the current metrics. The new one is written
+ * aside and renamed, so that readers never see it half-written.
+ */
+int nsm_metrics_write(void)
+{
+	char tmp[PATH_MAX];
+	FILE *f;
+	int res = 0;
+
+	if (!metrics.file)
+		return 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", metrics.file);
+	f = fopen(tmp, "w");
+	if (!f)
+		return -errno;
+
+	pthread_mutex_lock(&lookup_lock);
+	if (metrics.json)
+		write_json(f);
+	else
+		write_prom(f);
+	pthread_mutex_unlock(&lookup_lock);
+
+	if (ferror(f))
+		res = -EIO;
+	if (fclose(f) && !res)
+		res = -errno;
+	if (!res && rename(tmp, metrics.file) < 0)
+		res = -errno;
+	if (res)
+		unlink(tmp);
+	return res;
+}
+
+/*
+ * Write the metrics if SIGUSR1 came since the last call.
+ */
+void nsm_metrics_check(void)
+{
+	if (!dump_pending)
+		return;
+	dump_pending = 0;
+	metrics_dump();
+}
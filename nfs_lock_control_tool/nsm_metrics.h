@@ -0,0 +1,68 @@
+/*
+ * Counters and latency histograms of the notification tools.
+ *
+ * Every server gets counters of the SM_NOTIFY packets sent, the
+ * retransmissions among them, the calls, which timed out, and the
+ * replies by their accept status, and a histogram of the round trip
+ * times. Name lookups and portmapper queries get a latency histogram
+ * each. Histograms are log-linear like HDR ones: NSM_HIST_SUB buckets
+ * per power of two, so that any value up to 2^32 usec is kept within
+ * 1/NSM_HIST_SUB of itself.
+ *
+ * Metrics are collected once nsm_metrics_init() is called, and are
+ * written to the file on exit and on SIGUSR1: in Prometheus text format,
+ * or as JSON if the file name ends in ".json".
+ */
+
+#ifndef __NSM_METRICS_H__
+#define __NSM_METRICS_H__
+
+#include <stdint.h>
+
+#define NSM_HIST_SUB_BITS	4
+#define NSM_HIST_SUB		(1U << NSM_HIST_SUB_BITS)
+#define NSM_HIST_BUCKETS	((33 - NSM_HIST_SUB_BITS) * NSM_HIST_SUB)
+
+#define NSM_METRICS_HASH	4096	/* server hash chains */
+
+/* Reply kinds: RPC accept_stat values, then these */
+#define NSM_REPLY_DENIED	6	/* MSG_DENIED */
+#define NSM_REPLY_BAD		7	/* not a valid RPC reply */
+#define NSM_REPLY_KINDS		8
+
+struct nsm_hist {
+	uint64_t		count;
+	uint64_t		sum;		/* usec */
+	uint32_t		min;
+	uint32_t		max;
+	uint32_t		buckets[NSM_HIST_BUCKETS];
+};
+
+struct nsm_server_stats {
+	struct nsm_server_stats *next;		/* hash chain */
+	char *			name;
+	unsigned long		sent;		/* packets, retransmits too */
+	unsigned long		retransmits;
+	unsigned long		timeouts;	/* calls never answered */
+	unsigned long		replies[NSM_REPLY_KINDS];
+	struct nsm_hist		rtt;
+};
+
+#define nsm_metrics_count(S, F)	do { if (S) (S)->F++; } while (0)
+
+extern void		nsm_hist_add(struct nsm_hist *, long);
+extern uint32_t		nsm_hist_quantile(const struct nsm_hist *, double);
+extern void		nsm_hist_merge(struct nsm_hist *,
+						const struct nsm_hist *);
+
+extern int		nsm_metrics_init(const char *);
+extern struct nsm_server_stats *nsm_metrics_server(const char *);
+extern void		nsm_metrics_reply(struct nsm_server_stats *,
+						const uint32_t *, int);
+extern void		nsm_metrics_rtt(struct nsm_server_stats *, long);
+extern void		nsm_metrics_dns(long, int);
+extern void		nsm_metrics_pmap(long, int);
+extern int		nsm_metrics_write(void);
+extern void		nsm_metrics_check(void);
+
+#endif /* __NSM_METRICS_H__ */
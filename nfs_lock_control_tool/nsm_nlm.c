@@ -0,0 +1,287 @@
+/*
+ * NLM lock probes.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <netinet/in.h>
+
+#include "nsm_nlm.h"
+#include "nsm_rto.h"
+#include "nsm_port.h"
+#include "nsm_resolv.h"
+#include "nsm_xdr.h"
+#include "nsm_batch.h"
+#include "nsm_clock.h"
+
+#define NLM4_TEST		1
+#define NLM_MSGSIZE		256	/* 32-bit words */
+#define NLM_CALLER_MAX		256
+
+#define NFS_SUPER_MAGIC		0x6969
+
+/*
+ * The Linux NFS client exports its files with the server's file handle
+ * embedded after the file id and type: a 16-bit size and the handle.
+ */
+#define NFS_EMBED_FH_OFF	12	/* bytes */
+
+static int hex_fh(const char *str, struct nsm_nlm_file *f)
+{
+	unsigned int i, len;
+
+	if (!strncmp(str, "0x", 2))
+		str += 2;
+	len = strlen(str);
+	if (!len || len & 1 || len / 2 > NSM_NLM_FHSIZE ||
+	    strspn(str, "0123456789abcdefABCDEF") != len)
+		return -EINVAL;
+
+	for (i = 0; i < len / 2; i++)
+		sscanf(str + 2 * i, "%2hhx", &f->fh[i]);
+	f->fhlen = len / 2;
+	return 0;
+}
+
+static int path_fh(const char *path, struct nsm_nlm_file *f)
+{
+	union {
+		struct file_handle	h;
+		char			buf[sizeof(struct file_handle) +
+					    MAX_HANDLE_SZ];
+	} u;
+	struct statfs sfs;
+	unsigned short size;
+	int mount_id;
+
+	if (statfs(path, &sfs) < 0)
+		return -errno;
+	if (sfs.f_type != NFS_SUPER_MAGIC)
+		return -EMEDIUMTYPE;
+
+	u.h.handle_bytes = MAX_HANDLE_SZ;
+	if (name_to_handle_at(AT_FDCWD, path, &u.h, &mount_id, 0) < 0)
+		return -errno;
+	if (u.h.handle_bytes < NFS_EMBED_FH_OFF + sizeof(size))
+		return -EPROTO;
+
+	memcpy(&size, u.h.f_handle + NFS_EMBED_FH_OFF, sizeof(size));
+	if (!size || size > NSM_NLM_FHSIZE ||
+	    NFS_EMBED_FH_OFF + sizeof(size) + size > u.h.handle_bytes)
+		return -EPROTO;
+
+	memcpy(f->fh, u.h.f_handle + NFS_EMBED_FH_OFF + sizeof(size), size);
+	f->fhlen = size;
+	return 0;
+}
+
+/*
+ * Take the file handle from 'arg': a file on an NFS mount, or the handle
+ * itself in hex. Returns 0 or negative errno.
+ */
+int nsm_nlm_fh(const char *arg, struct nsm_nlm_file *f)
+{
+	struct stat st;
+	int error;
+
+	memset(f, 0, sizeof(*f));
+	f->name = arg;
+
+	if (!stat(arg, &st))
+		return path_fh(arg, f);
+	error = -errno;
+	return hex_fh(arg, f) < 0 ? error : 0;
+}
+
+const char *nsm_nlm_status(int status)
+{
+	static const char *names[] = {
+		"granted", "denied", "denied, no locks", "blocked",
+		"grace period", "deadlock", "read-only file system",
+		"stale file handle", "file too big", "failed",
+	};
+
+	if (status < 0)
+		return strerror(-status);
+	if (status < sizeof(names) / sizeof(names[0]))
+		return names[status];
+	return "unknown status";
+}
+
+/*
+ * NLM4_TEST for an exclusive lock on the whole file. The owner is the
+ * caller's pid, so that the client's own locks conflict with it.
+ */
+static unsigned int build_test(uint32_t *msgbuf, struct nsm_nlm_file *f,
+				const char *caller, unsigned int len)
+{
+	uint32_t *p, cookie = htonl(f->xid);
+
+	p = nsm_xdr_call(msgbuf, f->xid, NLM_PROGRAM, NLM_VERSION, NLM4_TEST);
+	p = nsm_xdr_string(p, (const char *)&cookie, sizeof(cookie));
+	p = nsm_xdr_u32(p, 1);			/* exclusive */
+	p = nsm_xdr_string(p, caller, len);	/* caller_name */
+	p = nsm_xdr_string(p, (const char *)f->fh, f->fhlen);
+	p = nsm_xdr_string(p, caller, len);	/* owner handle */
+	p = nsm_xdr_u32(p, getpid());		/* svid */
+	p = nsm_xdr_u64(p, 0);			/* offset */
+	p = nsm_xdr_u64(p, 0);			/* up to the end */
+
+	return (p - msgbuf) << 2;
+}
+
+/*
+ * nlm4_testres: the cookie, the status and the holder if it's DENIED.
+ */
+static int parse_test(struct nsm_nlm_file *f, const uint32_t *msgbuf,
+							int len)
+{
+	const uint32_t *p, *end = msgbuf + len / 4;
+	uint32_t xid, stat, exclusive, svid;
+	int result;
+
+	result = nsm_xdr_reply(msgbuf, len, &xid, &p);
+	if (result < 0)
+		return result;
+	if (result != NSM_XDR_SUCCESS)
+		return -EPROTONOSUPPORT;	/* no NLM4 there */
+
+	if (nsm_xdr_skip_opaque(&p, end) < 0 ||
+	    nsm_xdr_get_u32(&p, end, &stat) < 0)
+		return -EPROTO;
+
+	f->svid = 0;
+	if (stat == NSM_NLM_DENIED &&
+	    !nsm_xdr_get_u32(&p, end, &exclusive) &&
+	    !nsm_xdr_get_u32(&p, end, &svid))
+		f->svid = svid;
+	return stat;
+}
+
+static void send_test(int sock, const struct sockaddr *sap,
+			struct nsm_nlm_file *f, const char *caller,
+			unsigned int len, struct nsm_rtt *rtt)
+{
+	uint32_t msgbuf[NLM_MSGSIZE];
+	unsigned int size = build_test(msgbuf, f, caller, len);
+
+	/* A failed send is retried by the timer like a lost one */
+	if (sendto(sock, msgbuf, size, 0, sap, nsm_addrlen(sap)) >= 0)
+		nsm_batch_tap_buf(sock, msgbuf, size, sap, 1);
+
+	f->sent = nsm_now_usec();
+	f->deadline = f->sent / 1000 + nsm_rtt_timeout(rtt, f->retries);
+}
+
+/*
+ * Ask nlockmgr at 'sap' (port included) about all the files at once,
+ * from 'local' if it's given. The files not answered within 'timeout'
+ * msec get -ETIMEDOUT.
+ *
+ * Returns the number of files, which are not known to be unlocked.
+ */
+int nsm_nlm_test(const struct sockaddr *sap, const struct sockaddr *local,
+		const char *caller, struct nsm_nlm_file *files,
+		unsigned int nr, long timeout)
+{
+	struct sockaddr_in6 any6 = { .sin6_family = AF_INET6 };
+	uint32_t msgbuf[NLM_MSGSIZE], xid_base;
+	unsigned int i, len, pending = 0, failed = 0;
+	struct nsm_rtt rtt;
+	struct pollfd pfd;
+	long now, end;
+	int res;
+
+	len = MIN(strlen(caller), NLM_CALLER_MAX);
+
+	pfd.fd = socket(sap->sa_family, SOCK_DGRAM, 0);
+	if (pfd.fd < 0) {
+		for (i = 0; i < nr; i++)
+			files[i].status = -errno;
+		return nr;
+	}
+	pfd.events = POLLIN;
+	fcntl(pfd.fd, F_SETFL, O_NONBLOCK);
+
+	/* lockd may insist on a privileged port, take one if we can */
+	if (!local || local->sa_family != sap->sa_family)
+		local = sap->sa_family == AF_INET6 ?
+				(struct sockaddr *)&any6 : NULL;
+	nsm_port_bind(pfd.fd, local);
+
+	nsm_rtt_init(&rtt);
+	xid_base = getpid() ^ nsm_now_usec();
+	end = nsm_now_usec() / 1000 + timeout;
+
+	for (i = 0; i < nr; i++) {
+		files[i].xid = xid_base + i;
+		files[i].retries = 0;
+		files[i].status = -EINPROGRESS;
+		send_test(pfd.fd, sap, &files[i], caller, len, &rtt);
+		pending++;
+	}
+
+	while (pending && (now = nsm_now_usec() / 1000) < end) {
+		long wait = end - now;
+
+		for (i = 0; i < nr; i++) {
+			struct nsm_nlm_file *f = &files[i];
+
+			if (f->status != -EINPROGRESS)
+				continue;
+			if (f->deadline <= now) {
+				if (f->retries == NSM_RETRIES) {
+					f->status = -ETIMEDOUT;
+					pending--;
+					continue;
+				}
+				f->retries++;
+				send_test(pfd.fd, sap, f, caller, len, &rtt);
+			}
+			if (f->deadline - now < wait)
+				wait = f->deadline - now;
+		}
+
+		if (!pending || poll(&pfd, 1, wait) <= 0)
+			continue;
+
+		while ((res = recv(pfd.fd, msgbuf, sizeof(msgbuf),
+						MSG_DONTWAIT)) >= 4) {
+			uint32_t offset = ntohl(msgbuf[0]) - xid_base;
+			struct nsm_nlm_file *f;
+
+			/* nlockmgr answers from the address it was asked at */
+			nsm_batch_tap_buf(pfd.fd, msgbuf, res, sap, 0);
+			if (offset >= nr)
+				continue;
+			f = &files[offset];
+			if (f->status != -EINPROGRESS)
+				continue;
+
+			if (!f->retries)
+				nsm_rtt_update(&rtt, nsm_now_usec() - f->sent);
+			f->status = parse_test(f, msgbuf, res);
+			pending--;
+		}
+	}
+
+	close(pfd.fd);
+
+	for (i = 0; i < nr; i++) {
+		if (files[i].status == -EINPROGRESS)
+			files[i].status = -ETIMEDOUT;
+		if (files[i].status != NSM_NLM_GRANTED)
+			failed++;
+	}
+	return failed;
+}
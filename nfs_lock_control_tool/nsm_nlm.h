@@ -0,0 +1,46 @@
+/*
+ * NLM lock probes.
+ *
+ * An NLM4_TEST call asks the server's nlockmgr, whether an exclusive lock
+ * on the whole file would be granted to somebody else, i.e. whether the
+ * locks on it are gone. All the files are asked at once over one socket.
+ */
+
+#ifndef __NSM_NLM_H__
+#define __NSM_NLM_H__
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define NLM_PROGRAM		100021
+#define NLM_VERSION		4	/* NLM4, NFSv3 file handles */
+#define NSM_NLM_FHSIZE		64
+
+/* nlm4_stats */
+#define NSM_NLM_GRANTED		0
+#define NSM_NLM_DENIED		1
+#define NSM_NLM_DENIED_GRACE	4
+
+struct nsm_nlm_file {
+	const char *		name;		/* for messages */
+	unsigned char		fh[NSM_NLM_FHSIZE];
+	unsigned int		fhlen;
+
+	/* results */
+	int			status;		/* nlm4_stats or negative errno */
+	int32_t			svid;		/* of the holder, if DENIED */
+
+	/* private */
+	uint32_t		xid;
+	unsigned int		retries;
+	long			deadline;	/* msec */
+	long			sent;		/* usec */
+};
+
+extern int	nsm_nlm_fh(const char *, struct nsm_nlm_file *);
+extern int	nsm_nlm_test(const struct sockaddr *, const struct sockaddr *,
+				const char *, struct nsm_nlm_file *,
+				unsigned int, long);
+extern const char *nsm_nlm_status(int);
+
+#endif /* __NSM_NLM_H__ */
@@ -0,0 +1,337 @@
+/*
+ * Packet capture of the notification traffic.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "nsm_batch.h"
+#include "nsm_pcap.h"
+
+#define PCAP_MAGIC		0xa1b2c3d4	/* usec timestamps */
+#define PCAP_LINKTYPE_RAW	101		/* IPv4 or IPv6, no link header */
+#define PCAP_CACHELINE		64
+
+struct pcap_file_hdr {
+	uint32_t		magic;
+	uint16_t		version_major;
+	uint16_t		version_minor;
+	int32_t			thiszone;
+	uint32_t		sigfigs;
+	uint32_t		snaplen;
+	uint32_t		linktype;
+};
+
+struct pcap_rec_hdr {
+	uint32_t		sec;
+	uint32_t		usec;
+	uint32_t		caplen;
+	uint32_t		len;
+};
+
+struct pcap_slot {
+	struct timespec		time;		/* wall clock */
+	struct in6_addr		local;		/* IPv4 ones are mapped */
+	struct in6_addr		peer;
+	uint16_t		lport;		/* network order */
+	uint16_t		pport;
+	uint16_t		caplen;
+	uint16_t		out;		/* sent, not received */
+	uint32_t		len;
+	unsigned char		data[NSM_PCAP_SNAPLEN];
+};
+
+/*
+ * Single producer, single consumer ring: the producer only moves 'head'
+ * and the writer only moves 'tail', each on its own cache line.
+ */
+struct nsm_pcap {
+	struct pcap_slot *	slots;
+	FILE *			f;
+	pthread_t		writer;
+	int			stop;
+	unsigned long		captured;
+	unsigned long		dropped;
+	unsigned long		head __attribute__((aligned(PCAP_CACHELINE)));
+	unsigned long		tail __attribute__((aligned(PCAP_CACHELINE)));
+};
+
+static struct nsm_pcap pcap;
+
+static void put16(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static uint32_t csum_add(uint32_t sum, const unsigned char *p,
+						unsigned int len)
+{
+	for (; len > 1; p += 2, len -= 2)
+		sum += p[0] << 8 | p[1];
+	if (len)
+		sum += p[0] << 8;
+	return sum;
+}
+
+static unsigned int csum_fold(uint32_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum & 0xffff;
+}
+
+static void addr_in6(const struct sockaddr *sap, struct in6_addr *addr,
+							uint16_t *port)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)sap;
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sap;
+
+	memset(addr, 0, sizeof(*addr));
+	*port = 0;
+
+	if (sap->sa_family == AF_INET) {
+		addr->s6_addr[10] = addr->s6_addr[11] = 0xff;
+		memcpy(&addr->s6_addr[12], &sin->sin_addr, 4);
+		*port = sin->sin_port;
+	} else if (sap->sa_family == AF_INET6) {
+		*addr = sin6->sin6_addr;
+		*port = sin6->sin6_port;
+	}
+}
+
+/*
+ * The IPv4 address in 'addr', 0.0.0.0 if it's not a mapped one (an
+ * unbound dual-stack socket has "::").
+ */
+static void ipv4_addr(unsigned char *p, const struct in6_addr *addr)
+{
+	if (IN6_IS_ADDR_V4MAPPED(addr))
+		memcpy(p, &addr->s6_addr[12], 4);
+	else
+		memset(p, 0, 4);
+}
+
+/*
+ * Write the packet in the slot with IP and UDP headers made up from its
+ * addresses: IPv4 if the peer is an IPv4 one, IPv6 otherwise.
+ */
+static void write_slot(FILE *f, const struct pcap_slot *s)
+{
+	const struct in6_addr *src = s->out ? &s->local : &s->peer;
+	const struct in6_addr *dst = s->out ? &s->peer : &s->local;
+	unsigned int udplen = 8 + s->len, hlen;
+	unsigned char hdr[48], *udp;
+	struct pcap_rec_hdr rec;
+	uint32_t sum;
+
+	memset(hdr, 0, sizeof(hdr));
+	if (IN6_IS_ADDR_V4MAPPED(&s->peer)) {
+		hlen = 28;
+		udp = hdr + 20;
+		hdr[0] = 0x45;
+		put16(hdr + 2, 20 + udplen);
+		put16(hdr + 6, 0x4000);		/* don't fragment */
+		hdr[8] = 64;
+		hdr[9] = IPPROTO_UDP;
+		ipv4_addr(hdr + 12, src);
+		ipv4_addr(hdr + 16, dst);
+		put16(hdr + 10, csum_fold(csum_add(0, hdr, 20)));
+		/* UDP checksum 0 is "none" over IPv4 */
+	} else {
+		hlen = 48;
+		udp = hdr + 40;
+		hdr[0] = 0x60;
+		put16(hdr + 4, udplen);
+		hdr[6] = IPPROTO_UDP;
+		hdr[7] = 64;
+		memcpy(hdr + 8, src, 16);
+		memcpy(hdr + 24, dst, 16);
+	}
+	memcpy(udp, s->out ? &s->lport : &s->pport, 2);
+	memcpy(udp + 2, s->out ? &s->pport : &s->lport, 2);
+	put16(udp + 4, udplen);
+
+	/* IPv6 needs the checksum, it's known only for whole packets */
+	if (hlen == 48 && s->caplen == s->len) {
+		sum = csum_add(0, hdr + 8, 32) + udplen + IPPROTO_UDP;
+		sum = csum_add(sum, udp, 8);
+		sum = csum_fold(csum_add(sum, s->data, s->caplen));
+		put16(udp + 6, sum ? sum : 0xffff);
+	}
+
+	rec.sec = s->time.tv_sec;
+	rec.usec = s->time.tv_nsec / 1000;
+	rec.caplen = hlen + s->caplen;
+	rec.len = hlen + s->len;
+	fwrite(&rec, sizeof(rec), 1, f);
+	fwrite(hdr, hlen, 1, f);
+	fwrite(s->data, s->caplen, 1, f);
+}
+
+/*
+ * Write the packets as they come, until told to stop and the ring is
+ * empty. The file is flushed every time the ring runs dry, so that it
+ * may be looked at while the tool runs.
+ */
+static void *pcap_writer(void *arg)
+{
+	struct timespec idle = { 0, NSM_PCAP_IDLE * 1000000 };
+	unsigned long head, tail = pcap.tail;
+	int stop;
+
+	for (;;) {
+		/* 'stop' first: the packets before it are all in 'head' */
+		stop = __atomic_load_n(&pcap.stop, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&pcap.head, __ATOMIC_ACQUIRE);
+		if (tail == head) {
+			if (stop)
+				break;
+			fflush(pcap.f);
+			nanosleep(&idle, NULL);
+			continue;
+		}
+
+		for (; tail != head; tail++) {
+			write_slot(pcap.f, &pcap.slots[tail &
+						(NSM_PCAP_SLOTS - 1)]);
+			__atomic_store_n(&pcap.tail, tail + 1,
+						__ATOMIC_RELEASE);
+		}
+	}
+	return NULL;
+}
+
+static unsigned int copy_iov(unsigned char *dst, const struct msghdr *hdr,
+							unsigned int len)
+{
+	unsigned int i, n, done = 0;
+
+	len = MIN(len, NSM_PCAP_SNAPLEN);
+	for (i = 0; i < hdr->msg_iovlen && done < len; i++) {
+		n = MIN(hdr->msg_iov[i].iov_len, len - done);
+		memcpy(dst + done, hdr->msg_iov[i].iov_base, n);
+		done += n;
+	}
+	return done;
+}
+
+/*
+ * The nsm_batch tap: copy the packets to the ring. The local address is
+ * asked once per call, which is a whole batch on the busy paths.
+ */
+static void pcap_tap(int sock, const struct mmsghdr *msgs, unsigned int nr,
+								int out)
+{
+	struct sockaddr_storage local;
+	socklen_t locallen = sizeof(local);
+	struct pcap_slot *s;
+	struct timespec now;
+	unsigned long head = pcap.head, tail;
+	unsigned int i;
+
+	if (getsockname(sock, (struct sockaddr *)&local, &locallen) < 0)
+		local.ss_family = AF_UNSPEC;
+	clock_gettime(CLOCK_REALTIME, &now);
+	tail = __atomic_load_n(&pcap.tail, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < nr; i++) {
+		const struct msghdr *hdr = &msgs[i].msg_hdr;
+
+		if (head - tail == NSM_PCAP_SLOTS) {
+			tail = __atomic_load_n(&pcap.tail, __ATOMIC_ACQUIRE);
+			if (head - tail == NSM_PCAP_SLOTS) {
+				pcap.dropped += nr - i;
+				break;
+			}
+		}
+
+		s = &pcap.slots[head++ & (NSM_PCAP_SLOTS - 1)];
+		s->time = now;
+		s->out = out;
+		s->len = msgs[i].msg_len;
+		s->caplen = copy_iov(s->data, hdr, s->len);
+		addr_in6((struct sockaddr *)&local, &s->local, &s->lport);
+		addr_in6(hdr->msg_name, &s->peer, &s->pport);
+	}
+
+	pcap.captured += i;
+	__atomic_store_n(&pcap.head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Capture all the traffic to 'file' from now on, until exit.
+ */
+int nsm_pcap_open(const char *file)
+{
+	struct pcap_file_hdr hdr = {
+		.magic		= PCAP_MAGIC,
+		.version_major	= 2,
+		.version_minor	= 4,
+		.snaplen	= 48 + NSM_PCAP_SNAPLEN,
+		.linktype	= PCAP_LINKTYPE_RAW,
+	};
+	int res;
+
+	pcap.slots = malloc(NSM_PCAP_SLOTS * sizeof(*pcap.slots));
+	if (!pcap.slots)
+		return -ENOMEM;
+	/* fault the ring in now, not in the sending loop */
+	memset(pcap.slots, 0, NSM_PCAP_SLOTS * sizeof(*pcap.slots));
+
+	pcap.f = fopen(file, "w");
+	if (!pcap.f) {
+		res = -errno;
+		goto free;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, pcap.f) != 1) {
+		res = -errno;
+		goto close;
+	}
+
+	res = -pthread_create(&pcap.writer, NULL, pcap_writer, NULL);
+	if (res)
+		goto close;
+
+	nsm_batch_tap = pcap_tap;
+	atexit(nsm_pcap_close);
+	return 0;
+
+close:
+	fclose(pcap.f);
+	pcap.f = NULL;
+free:
+	free(pcap.slots);
+	return res;
+}
+
+/*
+ * Write out what's left in the ring and close the file.
+ */
+void nsm_pcap_close(void)
+{
+	if (!pcap.f)
+		return;
+
+	nsm_batch_tap = NULL;
+	__atomic_store_n(&pcap.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(pcap.writer, NULL);
+
+	if (fclose(pcap.f))
+		fprintf(stderr, "Failed to write the capture: %s\n",
+						strerror(errno));
+	if (pcap.dropped)
+		fprintf(stderr, "%lu of %lu packets not captured: the ring "
+			"was full\n", pcap.dropped,
+			pcap.captured + pcap.dropped);
+	free(pcap.slots);
+	memset(&pcap, 0, sizeof(pcap));
+}
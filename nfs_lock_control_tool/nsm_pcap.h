@@ -0,0 +1,23 @@
+/*
+ * Packet capture of the notification traffic.
+ *
+ * Once nsm_pcap_open() is called, every datagram the tools send or
+ * receive (through nsm_batch and its tap) is copied with a timestamp into
+ * a ring of NSM_PCAP_SLOTS preallocated slots. The ring has a single
+ * producer, the sending thread, and a single consumer, a thread, which
+ * writes the packets to a pcap file with made up IP and UDP headers, so
+ * that the sending loop never waits for the disk. A packet, which finds
+ * the ring full, is dropped and counted.
+ */
+
+#ifndef __NSM_PCAP_H__
+#define __NSM_PCAP_H__
+
+#define NSM_PCAP_SLOTS		8192	/* power of 2 */
+#define NSM_PCAP_SNAPLEN	512	/* bytes of UDP payload kept */
+#define NSM_PCAP_IDLE		1	/* msec the writer sleeps on empty ring */
+
+extern int		nsm_pcap_open(const char *);
+extern void		nsm_pcap_close(void);
+
+#endif /* __NSM_PCAP_H__ */
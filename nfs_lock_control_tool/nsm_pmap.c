@@ -0,0 +1,552 @@
+/*
+ * RPC service port lookup.
+ *
+ * Cache file format, one service per line:
+ *
+ *	<address> <program> <version> <protocol> <port> <expiry, seconds since Epoch>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/file.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "nsm_pmap.h"
+#include "nsm_rto.h"
+#include "nsm_xdr.h"
+#include "nsm_metrics.h"
+#include "nsm_batch.h"
+#include "nsm_clock.h"
+
+#define PMAP_PROGRAM		100000
+#define PMAP_PORT		111
+#define PMAP_GETPORT		3	/* RPCBPROC_GETADDR in versions 3, 4 */
+#define PMAP_MSGSIZE		64	/* 32-bit words */
+
+struct pmap_key {
+	char			addr[INET6_ADDRSTRLEN];
+	struct nsm_pmap_query	*q;
+};
+
+static int cmp_key(const void *a, const void *b)
+{
+	return strcmp(((const struct pmap_key *)a)->addr,
+			((const struct pmap_key *)b)->addr);
+}
+
+static struct pmap_key *find_key(struct pmap_key *keys, unsigned int nr,
+						struct pmap_key *key)
+{
+	struct pmap_key *k;
+
+	k = bsearch(key, keys, nr, sizeof(*keys), cmp_key);
+	/* step back to the first query for this server */
+	while (k && k > keys && !cmp_key(k - 1, key))
+		k--;
+	return k;
+}
+
+static int addr_key(const struct sockaddr *sap, char *buf)
+{
+	const void *addr;
+
+	if (sap->sa_family == AF_INET)
+		addr = &((const struct sockaddr_in *)sap)->sin_addr;
+	else if (sap->sa_family == AF_INET6)
+		addr = &((const struct sockaddr_in6 *)sap)->sin6_addr;
+	else
+		return -1;
+
+	return inet_ntop(sap->sa_family, addr, buf, INET6_ADDRSTRLEN) ? 0 : -1;
+}
+
+/*
+ * Go over the valid cache lines for the service. With 'keep' set, the
+ * lines, which are not for one of the keys, are copied there. Otherwise
+ * the keys found get their ports.
+ */
+static void cache_scan(FILE *f, struct pmap_key *keys, unsigned int nr,
+		uint32_t prog, uint32_t vers, int prot, FILE *keep)
+{
+	struct pmap_key key, *k, *end = keys + nr;
+	unsigned long l_prog, l_vers;
+	unsigned int port;
+	long expires;
+	int l_prot;
+	char *line = NULL;
+	size_t size = 0;
+	time_t now = time(NULL);
+
+	while (getline(&line, &size, f) > 0) {
+		if (sscanf(line, "%45s %lu %lu %d %u %ld", key.addr, &l_prog,
+			   &l_vers, &l_prot, &port, &expires) != 6 ||
+		    expires <= now)
+			continue;
+
+		k = NULL;
+		if (l_prog == prog && l_vers == vers && l_prot == prot)
+			k = find_key(keys, nr, &key);
+
+		if (keep) {
+			if (!k || (k->q && k->q->cached))
+				fputs(line, keep);
+			continue;
+		}
+
+		if (!k || !k->q || k->q->cached || !port || port > 65535)
+			continue;
+		for (; k < end && !cmp_key(k, &key); k++) {
+			k->q->port = port;
+			k->q->cached = 1;
+		}
+	}
+	free(line);
+}
+
+static void cache_load(const char *cache, struct pmap_key *keys,
+		unsigned int nr, uint32_t prog, uint32_t vers, int prot)
+{
+	FILE *f;
+
+	f = fopen(cache, "r");
+	if (!f)
+		return;
+
+	flock(fileno(f), LOCK_SH);
+	cache_scan(f, keys, nr, prog, vers, prot, NULL);
+	fclose(f);
+}
+
+/*
+ * Replace the cache lines for the keys with their new ports. Keys
+ * without a port are just removed.
+ */
+static void cache_store(const char *cache, struct pmap_key *keys,
+		unsigned int nr, uint32_t prog, uint32_t vers, int prot)
+{
+	time_t expires = time(NULL) + NSM_PMAP_TTL;
+	char buf[256];
+	FILE *f, *keep;
+	unsigned int i;
+	size_t len;
+	int fd;
+
+	fd = open(cache, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return;
+
+	f = fdopen(fd, "r+");
+	keep = tmpfile();
+	if (!f || !keep) {
+		if (f)
+			fclose(f);
+		else
+			close(fd);
+		if (keep)
+			fclose(keep);
+		return;
+	}
+
+	flock(fd, LOCK_EX);
+
+	cache_scan(f, keys, nr, prog, vers, prot, keep);
+
+	for (i = 0; i < nr; i++) {
+		struct nsm_pmap_query *q = keys[i].q;
+
+		if (!q || q->cached || !q->port)
+			continue;
+		/* a server listed twice is stored once */
+		if (i && !strcmp(keys[i - 1].addr, keys[i].addr))
+			continue;
+		fprintf(keep, "%s %u %u %d %u %ld\n", keys[i].addr, prog, vers,
+					prot, q->port, (long)expires);
+	}
+
+	rewind(keep);
+	rewind(f);
+	if (ftruncate(fd, 0) == 0) {
+		while ((len = fread(buf, 1, sizeof(buf), keep)) > 0)
+			fwrite(buf, 1, len, f);
+	}
+
+	fclose(keep);
+	fclose(f);
+}
+
+/*
+ * Drop the cached port of a service on a server, e.g. when it stopped
+ * answering there after a reboot.
+ */
+void nsm_pmap_forget(const char *cache, const struct sockaddr *sap,
+			uint32_t prog, uint32_t vers, int prot)
+{
+	struct pmap_key key = { .q = NULL };
+
+	if (cache && !addr_key(sap, key.addr))
+		cache_store(cache, &key, 1, prog, vers, prot);
+}
+
+static uint32_t *put_string(uint32_t *p, const char *str)
+{
+	return nsm_xdr_string(p, str, strlen(str));
+}
+
+static unsigned int build_call(uint32_t *msgbuf, struct nsm_pmap_query *q,
+				uint32_t prog, uint32_t vers, int prot)
+{
+	uint32_t *p = msgbuf;
+	int inet6 = q->addr.ss_family == AF_INET6;
+
+	p = nsm_xdr_call(p, q->xid, PMAP_PROGRAM, q->vers, PMAP_GETPORT);
+	if (q->vers == 2)
+		p = nsm_xdr_pmap(p, prog, vers, prot, 0);
+	else {
+		p = nsm_xdr_u32(p, prog);
+		p = nsm_xdr_u32(p, vers);
+		if (prot == IPPROTO_UDP)
+			p = put_string(p, inet6 ? "udp6" : "udp");
+		else
+			p = put_string(p, inet6 ? "tcp6" : "tcp");
+		p = put_string(p, "");	/* r_addr */
+		p = put_string(p, "");	/* r_owner */
+	}
+
+	return (p - msgbuf) << 2;
+}
+
+/*
+ * Port of a universal address: "h1.h2.h3.h4.p1.p2" or "<inet6>.p1.p2".
+ */
+static int uaddr_port(const char *uaddr, unsigned int len)
+{
+	unsigned int hi = 0, lo = 0, shift = 1, dots = 0;
+
+	while (len--) {
+		char c = uaddr[len];
+
+		if (c == '.') {
+			if (++dots == 2)
+				break;
+			shift = 1;
+			continue;
+		}
+		if (c < '0' || c > '9')
+			return -1;
+		if (dots)
+			hi += (c - '0') * shift;
+		else
+			lo += (c - '0') * shift;
+		shift *= 10;
+	}
+
+	if (dots != 2 || hi > 255 || lo > 255)
+		return -1;
+	return hi << 8 | lo;
+}
+
+/*
+ * Returns 0 with the port set, 1 if an older portmapper version has to
+ * be tried, or negative errno.
+ */
+static int parse_reply(struct nsm_pmap_query *q, uint32_t *msgbuf, int len)
+{
+	const uint32_t *p, *end = msgbuf + len / 4;
+	uint32_t xid, word;
+	int port;
+
+	switch (nsm_xdr_reply(msgbuf, len, &xid, &p)) {
+	case NSM_XDR_SUCCESS:
+		break;
+	case NSM_XDR_PROG_MISMATCH:
+	case NSM_XDR_PROC_UNAVAIL:
+		return q->vers > 3 ? 1 : -EPROTONOSUPPORT;
+	case -EACCES:
+		return -EACCES;
+	default:
+		return -EPROTO;
+	}
+
+	if (nsm_xdr_get_u32(&p, end, &word) < 0)
+		return -EPROTO;
+
+	if (q->vers == 2)
+		port = word;
+	else {
+		if (word > (end - p) * 4)
+			return -EPROTO;
+		port = word ? uaddr_port((const char *)p, word) : 0;
+	}
+
+	if (port < 0 || port > 65535)
+		return -EPROTO;
+	if (!port)
+		return -ENOENT;		/* service is not registered */
+
+	q->port = port;
+	return 0;
+}
+
+static void send_call(int sock, struct nsm_pmap_query *q, struct nsm_rtt *rtt,
+			uint32_t prog, uint32_t vers, int prot)
+{
+	struct sockaddr_storage addr = q->addr;
+	uint32_t msgbuf[PMAP_MSGSIZE];
+	unsigned int len;
+
+	if (addr.ss_family == AF_INET)
+		((struct sockaddr_in *)&addr)->sin_port = htons(PMAP_PORT);
+	else
+		((struct sockaddr_in6 *)&addr)->sin6_port = htons(PMAP_PORT);
+
+	len = build_call(msgbuf, q, prog, vers, prot);
+
+	/* A failed send is retried by the timer like a lost one */
+	if (sendto(sock, msgbuf, len, 0, (struct sockaddr *)&addr,
+		   addr.ss_family == AF_INET ? sizeof(struct sockaddr_in) :
+					       sizeof(struct sockaddr_in6)) >= 0)
+		nsm_batch_tap_buf(sock, msgbuf, len, (struct sockaddr *)&addr,
+									1);
+
+	q->sent = nsm_now_usec();
+	if (!q->started)
+		q->started = q->sent;
+	q->deadline = q->sent / 1000 + nsm_rtt_timeout(rtt, q->retries);
+}
+
+/*
+ * The port was found on 'q': the other addresses of the server are not
+ * needed any more. Returns the number of them, which were still pending.
+ */
+static unsigned int cancel_others(struct nsm_pmap_query *queries,
+			unsigned int nr, struct nsm_pmap_query *q)
+{
+	unsigned int i, cancelled = 0;
+
+	for (i = q->first; i < nr; i++) {
+		struct nsm_pmap_query *o = &queries[i];
+
+		if (i > q->first && !queries[i - 1].more)
+			break;
+		if (o == q || o->port || o->error)
+			continue;
+		o->error = -ECANCELED;
+		cancelled++;
+	}
+	return cancelled;
+}
+
+/*
+ * Asking 'q' failed: don't let the next address of the server wait.
+ */
+static void start_next(struct nsm_pmap_query *queries, unsigned int nr,
+			struct nsm_pmap_query *q, long now)
+{
+	for (; q->more && q + 1 < queries + nr; q++) {
+		if (q[1].waiting) {
+			q[1].deadline = now;
+			return;
+		}
+	}
+}
+
+/*
+ * Find the port of program 'prog' version 'vers' over 'prot' on all the
+ * servers at once. If 'cache' is set, cached ports are used without
+ * asking, and the found ones are stored there.
+ *
+ * Returns the number of servers, which port wasn't found on.
+ */
+int nsm_pmap_getport(struct nsm_pmap_query *queries, unsigned int nr,
+		uint32_t prog, uint32_t vers, int prot, const char *cache)
+{
+	struct pmap_key *keys;
+	struct nsm_rtt rtt;
+	struct pollfd pfd[2];
+	uint32_t msgbuf[PMAP_MSGSIZE], xid_base;
+	unsigned int i, nr_keys = 0, pending = 0, asked = 0;
+	long now, delay = 0;
+	int failed = 0, found = 0;
+
+	keys = calloc(nr, sizeof(*keys));
+	if (!keys) {
+		for (i = 0; i < nr; i++)
+			queries[i].error = -ENOMEM;
+		return nr;
+	}
+
+	for (i = 0; i < nr; i++) {
+		queries[i].port = 0;
+		queries[i].error = 0;
+		queries[i].cached = 0;
+		queries[i].waiting = 0;
+		queries[i].started = 0;
+		queries[i].first = i && queries[i - 1].more ?
+					queries[i - 1].first : i;
+		if (addr_key((struct sockaddr *)&queries[i].addr,
+					keys[nr_keys].addr) < 0) {
+			queries[i].error = -EAFNOSUPPORT;
+			continue;
+		}
+		keys[nr_keys++].q = &queries[i];
+	}
+	qsort(keys, nr_keys, sizeof(*keys), cmp_key);
+
+	if (cache)
+		cache_load(cache, keys, nr_keys, prog, vers, prot);
+
+	for (i = 0; i < nr; i++)
+		if (queries[i].cached)
+			cancel_others(queries, nr, &queries[i]);
+
+	pfd[0].fd = pfd[1].fd = -1;
+	pfd[0].events = pfd[1].events = POLLIN;
+
+	nsm_rtt_init(&rtt);
+	xid_base = getpid() + time(NULL);
+	now = nsm_now_usec() / 1000;
+
+	for (i = 0; i < nr; i++) {
+		struct nsm_pmap_query *q = &queries[i];
+		int inet6 = q->addr.ss_family == AF_INET6;
+
+		if (q->first == i)
+			delay = 0;
+		if (q->error || q->cached)
+			continue;
+
+		if (pfd[inet6].fd < 0) {
+			pfd[inet6].fd = socket(q->addr.ss_family, SOCK_DGRAM,
+								0);
+			if (pfd[inet6].fd < 0) {
+				q->error = -errno;
+				continue;
+			}
+			fcntl(pfd[inet6].fd, F_SETFL, O_NONBLOCK);
+		}
+
+		q->xid = xid_base + i;
+		q->vers = inet6 ? 4 : 2;
+		q->retries = 0;
+		if (delay) {
+			/* the server's next address waits for its turn */
+			q->waiting = 1;
+			q->deadline = now + delay;
+		} else
+			send_call(pfd[inet6].fd, q, &rtt, prog, vers, prot);
+		delay += NSM_ADDR_DELAY;
+		pending++;
+	}
+	asked = pending;
+
+	while (pending) {
+		long wait = -1;
+		int j;
+
+		now = nsm_now_usec() / 1000;
+		for (i = 0; i < nr; i++) {
+			struct nsm_pmap_query *q = &queries[i];
+
+			if (q->error || q->port)
+				continue;
+			if (q->deadline <= now) {
+				if (q->waiting) {
+					q->waiting = 0;
+				} else if (q->retries == NSM_RETRIES) {
+					q->error = -ETIMEDOUT;
+					nsm_metrics_pmap(nsm_now_usec() - q->started,
+								q->error);
+					pending--;
+					start_next(queries, nr, q, now);
+					continue;
+				} else
+					q->retries++;
+				send_call(pfd[q->addr.ss_family == AF_INET6].fd,
+						q, &rtt, prog, vers, prot);
+			}
+			if (wait < 0 || q->deadline - now < wait)
+				wait = q->deadline - now;
+		}
+
+		if (!pending || poll(pfd, 2, wait) <= 0)
+			continue;
+
+		for (j = 0; j < 2; j++) {
+			struct sockaddr_storage from;
+			socklen_t fromlen = sizeof(from);
+			int len;
+
+			if (pfd[j].fd < 0 || !(pfd[j].revents & POLLIN))
+				continue;
+
+			while ((len = recvfrom(pfd[j].fd, msgbuf, sizeof(msgbuf),
+					MSG_DONTWAIT, (struct sockaddr *)&from,
+					&fromlen)) >= 4) {
+				uint32_t offset = ntohl(msgbuf[0]) - xid_base;
+				struct nsm_pmap_query *q;
+				int result;
+
+				nsm_batch_tap_buf(pfd[j].fd, msgbuf, len,
+						(struct sockaddr *)&from, 0);
+				fromlen = sizeof(from);
+
+				/* xid moves on by nr on version fallback */
+				if (offset >= 2 * nr)
+					continue;
+				q = &queries[offset % nr];
+				if (q->error || q->port ||
+				    q->xid != ntohl(msgbuf[0]))
+					continue;
+
+				if (!q->retries)
+					nsm_rtt_update(&rtt,
+						nsm_now_usec() - q->sent);
+
+				result = parse_reply(q, msgbuf, len);
+				if (result > 0) {
+					q->xid += nr;
+					q->vers--;
+					q->retries = 0;
+					send_call(pfd[j].fd, q, &rtt, prog,
+							vers, prot);
+					continue;
+				}
+				pending--;
+				nsm_metrics_pmap(nsm_now_usec() - q->started,
+								result);
+				if (result < 0) {
+					q->error = result;
+					start_next(queries, nr, q,
+							nsm_now_usec() / 1000);
+				} else
+					pending -= cancel_others(queries, nr, q);
+			}
+		}
+	}
+
+	for (i = 0; i < 2; i++)
+		if (pfd[i].fd >= 0)
+			close(pfd[i].fd);
+
+	if (cache && asked)
+		cache_store(cache, keys, nr_keys, prog, vers, prot);
+
+	for (i = 0; i < nr; i++) {
+		if (queries[i].port)
+			found = 1;
+		if (!queries[i].more || i == nr - 1) {
+			failed += !found;
+			found = 0;
+		}
+	}
+
+	free(keys);
+	return failed;
+}
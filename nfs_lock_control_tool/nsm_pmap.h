@@ -0,0 +1,46 @@
+/*
+ * RPC service port lookup.
+ *
+ * One PMAPPROC_GETPORT (IPv4) or RPCBPROC_GETADDR (IPv6) datagram per
+ * server, all the servers are asked at once. Found ports are kept in a
+ * cache file, so that next runs don't ask the portmapper again.
+ *
+ * Several addresses of one server are consecutive queries, all but the
+ * last one with 'more' set. They are asked NSM_ADDR_DELAY apart, and the
+ * first port found cancels the rest.
+ */
+
+#ifndef __NSM_PMAP_H__
+#define __NSM_PMAP_H__
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define NSM_PMAP_CACHE		"/var/cache/nsm_pmap"
+#define NSM_PMAP_TTL		3600	/* seconds a cached port is trusted */
+
+struct nsm_pmap_query {
+	struct sockaddr_storage	addr;		/* server, port is ignored */
+	int			more;		/* next query is another
+						   address of this server */
+	unsigned short		port;		/* result */
+	int			error;		/* 0 or negative errno */
+	int			cached;		/* port came from the cache */
+
+	/* private */
+	uint32_t		xid;
+	uint32_t		vers;		/* portmapper version in use */
+	unsigned int		retries;
+	unsigned int		first;		/* first query of the server */
+	int			waiting;	/* not asked yet */
+	long			deadline;	/* msec */
+	long			sent;		/* usec */
+	long			started;	/* usec, first transmission */
+};
+
+extern int	nsm_pmap_getport(struct nsm_pmap_query *, unsigned int,
+				uint32_t, uint32_t, int, const char *);
+extern void	nsm_pmap_forget(const char *, const struct sockaddr *,
+				uint32_t, uint32_t, int);
+
+#endif /* __NSM_PMAP_H__ */
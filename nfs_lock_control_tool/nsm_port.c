@@ -0,0 +1,177 @@
+/*
+ * Reserved source ports.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "nsm_port.h"
+
+#define NSM_PORT_RANGE		(NSM_PORT_LAST - NSM_PORT_FIRST + 1)
+
+static unsigned char known[(NSM_PORT_RANGE + 7) / 8];
+static int known_read;
+static unsigned int next_port;
+
+static int port_known(unsigned int port)
+{
+	port -= NSM_PORT_FIRST;
+	return known[port / 8] & (1 << port % 8);
+}
+
+/*
+ * Mark all the UDP ports of /etc/services in our range. Done once.
+ */
+static void read_services(void)
+{
+	struct servent *se;
+	unsigned int port;
+
+	setservent(1);
+	while ((se = getservent())) {
+		if (strcmp(se->s_proto, "udp"))
+			continue;
+		port = ntohs(se->s_port);
+		if (port < NSM_PORT_FIRST || port > NSM_PORT_LAST)
+			continue;
+		port -= NSM_PORT_FIRST;
+		known[port / 8] |= 1 << port % 8;
+	}
+	endservent();
+
+	/* start anywhere, so that tools running at once don't collide */
+	next_port = NSM_PORT_FIRST + (getpid() + time(NULL)) % NSM_PORT_RANGE;
+	known_read = 1;
+}
+
+/*
+ * Bind the socket to a privileged port, which is neither in use nor a known
+ * service's, on the local address (any, if NULL). Ports are taken one after
+ * another, so consecutive calls get different ones. Returns the port or
+ * -1 with errno set.
+ */
+int nsm_port_bind(int sock, const struct sockaddr *local)
+{
+	struct sockaddr_storage addr;
+	struct sockaddr_in *sin = (struct sockaddr_in *)&addr;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&addr;
+	socklen_t addrlen;
+	unsigned int i, port;
+
+	if (!known_read)
+		read_services();
+
+	memset(&addr, 0, sizeof(addr));
+	if (local && local->sa_family == AF_INET6) {
+		memcpy(sin6, local, sizeof(*sin6));
+		addrlen = sizeof(*sin6);
+	} else {
+		if (local)
+			memcpy(sin, local, sizeof(*sin));
+		sin->sin_family = AF_INET;
+		addrlen = sizeof(*sin);
+	}
+
+	for (i = 0; i < NSM_PORT_RANGE; i++) {
+		port = next_port;
+		if (++next_port > NSM_PORT_LAST)
+			next_port = NSM_PORT_FIRST;
+		if (port_known(port))
+			continue;
+
+		if (addr.ss_family == AF_INET6)
+			sin6->sin6_port = htons(port);
+		else
+			sin->sin_port = htons(port);
+
+		if (!bind(sock, (struct sockaddr *)&addr, addrlen))
+			return port;
+		if (errno != EADDRINUSE)
+			return -1;
+	}
+
+	errno = EADDRINUSE;
+	return -1;
+}
+
+/*
+ * A socket of 'family', bound to a reserved port on 'local'. Without the
+ * privilege to bind one, the socket is returned unbound with errno set.
+ */
+static int pool_socket(int family, const struct sockaddr *local, int *bound)
+{
+	int sock, off = 0;
+
+	sock = socket(family, SOCK_DGRAM, 0);
+	if (sock < 0)
+		return -1;
+	fcntl(sock, F_SETFL, O_NONBLOCK);
+	if (family == AF_INET6 && local->sa_family == AF_INET6 &&
+	    IN6_IS_ADDR_UNSPECIFIED(&((struct sockaddr_in6 *)local)->sin6_addr))
+		setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
+	*bound = nsm_port_bind(sock, local) >= 0;
+	return sock;
+}
+
+/*
+ * Bind 'nr' non-blocking UDP sockets to reserved ports. Without a local
+ * address they are dual-stack IPv6 ones, or IPv4 ones where there is no
+ * IPv6. Without the privilege to bind them, a single socket on an ordinary
+ * port is used, like bindresvport() callers always did. Returns the number
+ * of sockets or -1.
+ */
+int nsm_port_pool_init(struct nsm_port_pool *pool, unsigned int nr,
+					const struct sockaddr *local)
+{
+	struct sockaddr_in6 any6 = { .sin6_family = AF_INET6 };
+	int sock, bound;
+
+	memset(pool, 0, sizeof(*pool));
+	if (nr > NSM_PORT_POOL_MAX)
+		nr = NSM_PORT_POOL_MAX;
+
+	pool->family = local ? local->sa_family : AF_INET6;
+	if (!local) {
+		local = (struct sockaddr *)&any6;
+		sock = socket(AF_INET6, SOCK_DGRAM, 0);
+		if (sock < 0) {
+			pool->family = AF_INET;
+			local = NULL;
+		} else
+			close(sock);
+	}
+
+	while (pool->nr < nr) {
+		sock = pool_socket(pool->family, local, &bound);
+		if (sock < 0)
+			break;
+
+		if (!bound) {
+			if (!pool->nr && (errno == EACCES || errno == EPERM)) {
+				pool->socks[pool->nr++] = sock;
+				return pool->nr;
+			}
+			close(sock);
+			break;
+		}
+		pool->socks[pool->nr++] = sock;
+	}
+
+	if (!pool->nr)
+		return -1;
+	return pool->nr;
+}
+
+void nsm_port_pool_fini(struct nsm_port_pool *pool)
+{
+	while (pool->nr)
+		close(pool->socks[--pool->nr]);
+}
@@ -0,0 +1,33 @@
+/*
+ * Reserved source ports.
+ *
+ * The UDP ports listed in /etc/services are read into a bitmap once, and
+ * sockets are bound to the free privileged ports around it directly,
+ * instead of asking getservbyport() after every bindresvport(). A pool
+ * keeps a number of such sockets, so that many notifications go out from
+ * different source ports. Without a local address they are dual-stack
+ * IPv6 sockets, which reach IPv4 servers through IPv4-mapped addresses.
+ */
+
+#ifndef __NSM_PORT_H__
+#define __NSM_PORT_H__
+
+#include <sys/socket.h>
+
+#define NSM_PORT_FIRST		600	/* same range as bindresvport() */
+#define NSM_PORT_LAST		1023
+#define NSM_PORT_POOL		8	/* default sockets in a pool */
+#define NSM_PORT_POOL_MAX	64
+
+struct nsm_port_pool {
+	int			socks[NSM_PORT_POOL_MAX];
+	unsigned int		nr;
+	int			family;		/* of all the sockets */
+};
+
+extern int	nsm_port_bind(int, const struct sockaddr *);
+extern int	nsm_port_pool_init(struct nsm_port_pool *, unsigned int,
+					const struct sockaddr *);
+extern void	nsm_port_pool_fini(struct nsm_port_pool *);
+
+#endif /* __NSM_PORT_H__ */
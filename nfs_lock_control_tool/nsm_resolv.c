@@ -0,0 +1,460 @@
+/*
+ * Name resolution for notification targets.
+ *
+ * Cache file format, one name per line:
+ *
+ *	<name> <expiry, seconds since Epoch> <address> [<address> ...]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/file.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "nsm_resolv.h"
+#include "nsm_metrics.h"
+#include "nsm_clock.h"
+
+socklen_t nsm_addrlen(const struct sockaddr *sap)
+{
+	switch (sap->sa_family) {
+	case AF_INET:
+		return sizeof(struct sockaddr_in);
+	case AF_INET6:
+		return sizeof(struct sockaddr_in6);
+	}
+	return sizeof(struct sockaddr_storage);
+}
+
+/*
+ * Copy 'src' to 'dst' in the form a socket of 'family' sends to: IPv4
+ * addresses become IPv4-mapped ones for a dual-stack IPv6 socket.
+ * Returns the address length, or 0 if such a socket can't reach 'src'.
+ */
+socklen_t nsm_addr_map(struct sockaddr_storage *dst, const struct sockaddr *src,
+							int family)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)src;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)dst;
+
+	if (src->sa_family == family) {
+		memcpy(dst, src, nsm_addrlen(src));
+		return nsm_addrlen(src);
+	}
+	if (src->sa_family != AF_INET || family != AF_INET6)
+		return 0;
+
+	memset(sin6, 0, sizeof(*sin6));
+	sin6->sin6_family = AF_INET6;
+	sin6->sin6_port = sin->sin_port;
+	sin6->sin6_addr.s6_addr[10] = 0xff;
+	sin6->sin6_addr.s6_addr[11] = 0xff;
+	memcpy(&sin6->sin6_addr.s6_addr[12], &sin->sin_addr, 4);
+	return sizeof(*sin6);
+}
+
+/*
+ * Same address and port, IPv4-mapped IPv6 addresses match their IPv4
+ * ones.
+ */
+int nsm_addr_match(const struct sockaddr *a, const struct sockaddr *b)
+{
+	struct sockaddr_storage ma, mb;
+	struct sockaddr_in6 *sa = (struct sockaddr_in6 *)&ma;
+	struct sockaddr_in6 *sb = (struct sockaddr_in6 *)&mb;
+
+	if (!nsm_addr_map(&ma, a, AF_INET6) || !nsm_addr_map(&mb, b, AF_INET6))
+		return 0;
+	return sa->sin6_port == sb->sin6_port &&
+	       IN6_ARE_ADDR_EQUAL(&sa->sin6_addr, &sb->sin6_addr);
+}
+
+/*
+ * Move address 'i' to the front, keeping the order of the others.
+ */
+void nsm_addr_prefer(struct sockaddr_storage *addrs, unsigned int i)
+{
+	struct sockaddr_storage first = addrs[i];
+
+	memmove(&addrs[1], &addrs[0], i * sizeof(*addrs));
+	addrs[0] = first;
+}
+
+/*
+ * Alternate the address families, starting with the family of the first
+ * address getaddrinfo() prefers, the way RFC 8305 orders the addresses
+ * for connection attempts. A dead family then costs one attempt delay,
+ * not one per address.
+ */
+static void interleave(struct nsm_target *t)
+{
+	struct sockaddr_storage addrs[NSM_RESOLV_MAXADDRS];
+	int first = t->addrs[0].ss_family;
+	unsigned int i = 0, j = 0, n = 0;
+
+	while (n < t->nr_addrs) {
+		while (i < t->nr_addrs && t->addrs[i].ss_family != first)
+			i++;
+		if (i < t->nr_addrs)
+			addrs[n++] = t->addrs[i++];
+		while (j < t->nr_addrs && t->addrs[j].ss_family == first)
+			j++;
+		if (j < t->nr_addrs)
+			addrs[n++] = t->addrs[j++];
+	}
+	memcpy(t->addrs, addrs, n * sizeof(*addrs));
+}
+
+static int add_addr(struct nsm_target *t, int family, const char *str)
+{
+	struct sockaddr_storage *ss;
+	struct sockaddr_in *sin;
+	struct sockaddr_in6 *sin6;
+
+	if (t->nr_addrs == NSM_RESOLV_MAXADDRS)
+		return 0;
+
+	ss = &t->addrs[t->nr_addrs];
+	memset(ss, 0, sizeof(*ss));
+	sin = (struct sockaddr_in *)ss;
+	sin6 = (struct sockaddr_in6 *)ss;
+
+	if (family != AF_INET6 && inet_pton(AF_INET, str, &sin->sin_addr) == 1)
+		sin->sin_family = AF_INET;
+	else if (family != AF_INET &&
+		 inet_pton(AF_INET6, str, &sin6->sin6_addr) == 1)
+		sin6->sin6_family = AF_INET6;
+	else
+		return 0;
+
+	t->nr_addrs++;
+	return 1;
+}
+
+static void add_addrinfo(struct nsm_target *t, struct addrinfo *ai)
+{
+	for (; ai && t->nr_addrs < NSM_RESOLV_MAXADDRS; ai = ai->ai_next) {
+		if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+			continue;
+		memcpy(&t->addrs[t->nr_addrs++], ai->ai_addr, ai->ai_addrlen);
+	}
+}
+
+static const char *addr_str(struct sockaddr_storage *ss, char *buf,
+						socklen_t len)
+{
+	if (ss->ss_family == AF_INET)
+		return inet_ntop(AF_INET, &((struct sockaddr_in *)ss)->sin_addr,
+								buf, len);
+	return inet_ntop(AF_INET6, &((struct sockaddr_in6 *)ss)->sin6_addr,
+								buf, len);
+}
+
+static int cmp_target(const void *a, const void *b)
+{
+	const struct nsm_target *ta = *(const struct nsm_target **)a;
+	const struct nsm_target *tb = *(const struct nsm_target **)b;
+
+	return strcmp(ta->name, tb->name);
+}
+
+static struct nsm_target **find_target(struct nsm_target **index,
+				unsigned int nr, const char *name)
+{
+	struct nsm_target key = { .name = name }, *kp = &key, **t;
+
+	t = bsearch(&kp, index, nr, sizeof(*index), cmp_target);
+	if (!t)
+		return NULL;
+	/* step back to the first target with this name */
+	while (t > index && !strcmp((*(t - 1))->name, name))
+		t--;
+	return t;
+}
+
+/*
+ * Fill the targets from the cache. If 'keep' is given, the valid lines
+ * for names, which are not in the index or were taken from the cache,
+ * are copied there instead.
+ */
+static void cache_scan(FILE *f, struct nsm_target **index, unsigned int nr,
+				int family, FILE *keep)
+{
+	char *line = NULL, *name, *addr, *save;
+	size_t size = 0;
+	time_t now = time(NULL);
+	long expires;
+
+	while (getline(&line, &size, f) > 0) {
+		struct nsm_target **t, **end = index + nr, *first;
+		char *copy = keep ? strdup(line) : NULL;
+
+		name = strtok_r(line, " \t\n", &save);
+		addr = strtok_r(NULL, " \t\n", &save);
+		if (!name || !addr)
+			goto next;
+
+		expires = atol(addr);
+		if (expires <= now)
+			goto next;
+
+		t = find_target(index, nr, name);
+		if (keep) {
+			if ((!t || (*t)->cached) && copy)
+				fputs(copy, keep);
+			goto next;
+		}
+		if (!t || (*t)->nr_addrs)
+			goto next;
+
+		while ((addr = strtok_r(NULL, " \t\n", &save)))
+			add_addr(*t, family, addr);
+		if (!(*t)->nr_addrs)
+			goto next;
+
+		/* other targets with this name get the same addresses */
+		first = *t;
+		first->cached = 1;
+		for (t++; t < end && !strcmp((*t)->name, name); t++) {
+			memcpy((*t)->addrs, first->addrs, sizeof(first->addrs));
+			(*t)->nr_addrs = first->nr_addrs;
+			(*t)->cached = 1;
+		}
+next:
+		free(copy);
+	}
+	free(line);
+}
+
+static void cache_load(const char *cache, struct nsm_target **index,
+				unsigned int nr, int family)
+{
+	FILE *f;
+
+	f = fopen(cache, "r");
+	if (!f)
+		return;
+
+	flock(fileno(f), LOCK_SH);
+	cache_scan(f, index, nr, family, NULL);
+	fclose(f);
+}
+
+/*
+ * Write freshly resolved targets to the cache, keeping the valid entries
+ * of other names.
+ */
+static void cache_store(const char *cache, struct nsm_target **index,
+				unsigned int nr)
+{
+	char buf[INET6_ADDRSTRLEN];
+	const char *prev = NULL;
+	time_t expires = time(NULL) + NSM_RESOLV_TTL;
+	FILE *f, *keep;
+	unsigned int i, j;
+	int fd;
+
+	fd = open(cache, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return;
+
+	f = fdopen(fd, "r+");
+	keep = tmpfile();
+	if (!f || !keep) {
+		if (f)
+			fclose(f);
+		else
+			close(fd);
+		if (keep)
+			fclose(keep);
+		return;
+	}
+
+	flock(fd, LOCK_EX);
+
+	cache_scan(f, index, nr, AF_UNSPEC, keep);
+
+	for (i = 0; i < nr; i++) {
+		struct nsm_target *t = index[i];
+
+		if (!t->nr_addrs || t->cached ||
+		    (prev && !strcmp(prev, t->name)))
+			continue;
+		prev = t->name;
+
+		fprintf(keep, "%s %ld", t->name, (long)expires);
+		for (j = 0; j < t->nr_addrs; j++)
+			if (addr_str(&t->addrs[j], buf, sizeof(buf)))
+				fprintf(keep, " %s", buf);
+		fprintf(keep, "\n");
+	}
+
+	rewind(keep);
+	rewind(f);
+	if (ftruncate(fd, 0) == 0) {
+		size_t len;
+
+		while ((len = fread(buf, 1, sizeof(buf), keep)) > 0)
+			fwrite(buf, 1, len, f);
+	}
+
+	fclose(keep);
+	fclose(f);
+}
+
+/*
+ * Resolve all the targets concurrently. Addresses of 'family' only are
+ * used, AF_UNSPEC means any. If 'cache' is set, valid cached entries
+ * are used instead of DNS, and new results are stored there.
+ *
+ * Returns the number of targets, which could not be resolved.
+ */
+int nsm_resolve(struct nsm_target *targets, unsigned int nr, int family,
+						const char *cache)
+{
+	struct addrinfo *hints;
+	struct nsm_target **index, **lookups;
+	struct gaicb *reqs, **list;
+	struct timespec timeout;
+	unsigned int i, nr_lookups = 0, nr_index = 0, pending;
+	time_t deadline;
+	long start = 0;
+	int failed = 0, submitted = 0, busy = 0;
+
+	index = calloc(nr, sizeof(*index));
+	lookups = calloc(nr, sizeof(*lookups));
+	reqs = calloc(nr, sizeof(*reqs));
+	list = calloc(nr, sizeof(*list));
+	hints = calloc(1, sizeof(*hints));
+	if (!index || !lookups || !reqs || !list || !hints) {
+		free(index);
+		free(lookups);
+		free(reqs);
+		free(list);
+		free(hints);
+		for (i = 0; i < nr; i++)
+			targets[i].error = EAI_MEMORY;
+		return nr;
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct nsm_target *t = &targets[i];
+
+		t->nr_addrs = 0;
+		t->error = t->cached = 0;
+
+		/* Addresses need no lookup */
+		if (!add_addr(t, family, t->name))
+			index[nr_index++] = t;
+	}
+
+	qsort(index, nr_index, sizeof(*index), cmp_target);
+
+	hints->ai_family = family;
+	hints->ai_socktype = SOCK_DGRAM;
+	hints->ai_protocol = IPPROTO_UDP;
+
+	if (cache)
+		cache_load(cache, index, nr_index, family);
+
+	for (i = 0; i < nr_index; i++) {
+		if (index[i]->nr_addrs)
+			continue;
+		/* one lookup per name */
+		if (nr_lookups && !strcmp(lookups[nr_lookups - 1]->name,
+							index[i]->name))
+			continue;
+		lookups[nr_lookups] = index[i];
+		reqs[nr_lookups].ar_name = index[i]->name;
+		reqs[nr_lookups].ar_request = hints;
+		list[nr_lookups] = &reqs[nr_lookups];
+		nr_lookups++;
+	}
+
+	if (nr_lookups) {
+		start = nsm_now_usec();
+		submitted = !getaddrinfo_a(GAI_NOWAIT, list, nr_lookups, NULL);
+	}
+
+	if (submitted) {
+		deadline = time(NULL) + NSM_RESOLV_TIMEOUT;
+		pending = nr_lookups;
+
+		/*
+		 * Finished lookups leave the list, gai_suspend() ignores
+		 * them then and waits for the next one to finish.
+		 */
+		while (pending && time(NULL) < deadline) {
+			timeout.tv_sec = 1;
+			timeout.tv_nsec = 0;
+			gai_suspend((const struct gaicb **)list, nr_lookups,
+								&timeout);
+			for (i = 0; i < nr_lookups; i++) {
+				if (!list[i] ||
+				    gai_error(&reqs[i]) == EAI_INPROGRESS)
+					continue;
+				nsm_metrics_dns(nsm_now_usec() - start,
+							gai_error(&reqs[i]));
+				list[i] = NULL;
+				pending--;
+			}
+		}
+
+		for (i = 0; i < nr_lookups; i++) {
+			if (!list[i])
+				continue;
+			nsm_metrics_dns(nsm_now_usec() - start, EAI_AGAIN);
+			if (gai_cancel(&reqs[i]) == EAI_NOTCANCELED)
+				busy = 1;
+		}
+	}
+
+	for (i = 0; i < nr_lookups; i++) {
+		struct nsm_target **t = find_target(index, nr_index,
+							lookups[i]->name);
+		int error = submitted ? gai_error(&reqs[i]) : EAI_SYSTEM;
+
+		if (error == EAI_INPROGRESS || error == EAI_CANCELED)
+			error = EAI_AGAIN;
+
+		for (; t < index + nr_index &&
+		       !strcmp((*t)->name, lookups[i]->name); t++) {
+			(*t)->error = error;
+			if (!error)
+				add_addrinfo(*t, reqs[i].ar_result);
+		}
+		if (!error && reqs[i].ar_result)
+			freeaddrinfo(reqs[i].ar_result);
+	}
+
+	if (cache && nr_lookups)
+		cache_store(cache, index, nr_index);
+
+	for (i = 0; i < nr; i++) {
+		if (!targets[i].nr_addrs) {
+			if (!targets[i].error)
+				targets[i].error = EAI_NONAME;
+			failed++;
+			continue;
+		}
+		interleave(&targets[i]);
+	}
+
+	free(index);
+	free(lookups);
+	free(list);
+	/* A lookup still running in the background owns these */
+	if (!busy) {
+		free(reqs);
+		free(hints);
+	}
+	return failed;
+}
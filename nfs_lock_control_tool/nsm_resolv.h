@@ -0,0 +1,36 @@
+/*
+ * Name resolution for notification targets.
+ *
+ * All the targets are resolved at once with getaddrinfo_a(), and the
+ * results are kept in a small on-disk cache shared between runs.
+ */
+
+#ifndef __NSM_RESOLV_H__
+#define __NSM_RESOLV_H__
+
+#include <sys/socket.h>
+
+#define NSM_RESOLV_CACHE	"/var/cache/nsm_resolv"
+#define NSM_RESOLV_TTL		300	/* seconds a cached entry is valid */
+#define NSM_RESOLV_TIMEOUT	10	/* seconds to wait for DNS */
+#define NSM_RESOLV_MAXADDRS	8
+
+struct nsm_target {
+	const char *		name;
+	struct sockaddr_storage	addrs[NSM_RESOLV_MAXADDRS];
+	unsigned int		nr_addrs;
+	int			error;		/* EAI_* code, 0 if resolved */
+	int			cached;		/* came from the cache */
+};
+
+extern int		nsm_resolve(struct nsm_target *, unsigned int, int,
+					const char *);
+extern socklen_t	nsm_addrlen(const struct sockaddr *);
+extern socklen_t	nsm_addr_map(struct sockaddr_storage *,
+					const struct sockaddr *, int);
+extern int		nsm_addr_match(const struct sockaddr *,
+					const struct sockaddr *);
+extern void		nsm_addr_prefer(struct sockaddr_storage *,
+					unsigned int);
+
+#endif /* __NSM_RESOLV_H__ */
@@ -0,0 +1,93 @@
+/*
+ * Retransmission timeouts and send window control for NSM calls.
+ */
+
+#include <string.h>
+#include <sys/param.h>
+
+#include "nsm_rto.h"
+
+void nsm_rtt_init(struct nsm_rtt *rtt)
+{
+	memset(rtt, 0, sizeof(*rtt));
+	rtt->rto = NSM_RTO_INITIAL;
+}
+
+/*
+ * Feed a round trip time (usec) of a call, which was sent only once.
+ */
+void nsm_rtt_update(struct nsm_rtt *rtt, long sample)
+{
+	long rto;
+
+	if (!rtt->srtt) {
+		rtt->srtt = sample;
+		rtt->rttvar = sample / 2;
+	} else {
+		long delta = sample - rtt->srtt;
+
+		if (delta < 0)
+			delta = -delta;
+		rtt->rttvar += (delta - rtt->rttvar) / 4;
+		rtt->srtt += (sample - rtt->srtt) / 8;
+	}
+
+	rto = (rtt->srtt + 4 * rtt->rttvar) / 1000;
+	rtt->rto = MIN(MAX(rto, NSM_RTO_MIN), NSM_RTO_MAX);
+}
+
+/*
+ * Timeout for a call, which has been retransmitted 'retries' times.
+ */
+unsigned int nsm_rtt_timeout(struct nsm_rtt *rtt, unsigned int retries)
+{
+	unsigned long timeout = rtt->rto;
+
+	while (retries-- && timeout < NSM_RTO_MAX)
+		timeout <<= 1;
+
+	return MIN(timeout, NSM_RTO_MAX);
+}
+
+void nsm_cwnd_init(struct nsm_cwnd *cw, unsigned int limit)
+{
+	memset(cw, 0, sizeof(*cw));
+	cw->limit = limit;
+	cw->ssthresh = limit;
+	cw->cwnd = MIN(NSM_CWND_INITIAL, limit);
+}
+
+/*
+ * A call was answered: grow by one per answer in slow start, by one per
+ * window of answers afterwards.
+ */
+void nsm_cwnd_ack(struct nsm_cwnd *cw)
+{
+	if (cw->cwnd >= cw->limit)
+		return;
+
+	if (cw->cwnd < cw->ssthresh) {
+		cw->cwnd++;
+		return;
+	}
+
+	if (++cw->acked >= cw->cwnd) {
+		cw->acked = 0;
+		cw->cwnd++;
+	}
+}
+
+/*
+ * A call sent at 'sent' (msec) timed out. The window is halved once per
+ * round: losses of calls sent before the previous decrease are ignored.
+ */
+void nsm_cwnd_loss(struct nsm_cwnd *cw, long sent, long now)
+{
+	if (sent < cw->recover)
+		return;
+
+	cw->ssthresh = MAX(cw->cwnd / 2, 2);
+	cw->cwnd = MIN(cw->ssthresh, cw->limit);
+	cw->acked = 0;
+	cw->recover = now;
+}
@@ -0,0 +1,43 @@
+/*
+ * Retransmission timeouts and send window control for NSM calls.
+ *
+ * RTT is estimated per server the same way TCP does it (RFC 6298), and
+ * the number of calls in flight follows AIMD: it grows while calls are
+ * answered and is halved when they are lost.
+ */
+
+#ifndef __NSM_RTO_H__
+#define __NSM_RTO_H__
+
+#define NSM_RTO_INITIAL		1000	/* msec, before the first sample */
+#define NSM_RTO_MIN		200	/* msec */
+#define NSM_RTO_MAX		10000	/* msec */
+#define NSM_RETRIES		5	/* retransmissions before giving up */
+#define NSM_CWND_INITIAL	16	/* calls in flight on start */
+#define NSM_ADDR_DELAY		250	/* msec before the next address of a
+					   server is tried as well */
+
+struct nsm_rtt {
+	long			srtt;		/* smoothed RTT, usec */
+	long			rttvar;		/* RTT variation, usec */
+	unsigned int		rto;		/* msec */
+};
+
+struct nsm_cwnd {
+	unsigned int		cwnd;		/* calls allowed in flight */
+	unsigned int		ssthresh;
+	unsigned int		limit;		/* never go above this */
+	unsigned int		acked;		/* answers since last increase */
+	long			recover;	/* calls sent before this time
+						   don't shrink the window */
+};
+
+extern void		nsm_rtt_init(struct nsm_rtt *);
+extern void		nsm_rtt_update(struct nsm_rtt *, long);
+extern unsigned int	nsm_rtt_timeout(struct nsm_rtt *, unsigned int);
+
+extern void		nsm_cwnd_init(struct nsm_cwnd *, unsigned int);
+extern void		nsm_cwnd_ack(struct nsm_cwnd *);
+extern void		nsm_cwnd_loss(struct nsm_cwnd *, long, long);
+
+#endif /* __NSM_RTO_H__ */
@@ -0,0 +1,139 @@
+/*
+ * Timers kept in a binary min-heap ordered by expiry time.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "nsm_timer.h"
+
+int nsm_timer_heap_init(struct nsm_timer_heap *h, unsigned int size)
+{
+	memset(h, 0, sizeof(*h));
+
+	if (!size)
+		size = 16;
+
+	h->timers = calloc(size, sizeof(struct nsm_timer *));
+	if (!h->timers) {
+		errno = ENOMEM;
+		return -1;
+	}
+	h->size = size;
+	return 0;
+}
+
+void nsm_timer_heap_fini(struct nsm_timer_heap *h)
+{
+	free(h->timers);
+	memset(h, 0, sizeof(*h));
+}
+
+static void heap_set(struct nsm_timer_heap *h, unsigned int i,
+					struct nsm_timer *t)
+{
+	h->timers[i] = t;
+	t->index = i + 1;
+}
+
+static void heap_up(struct nsm_timer_heap *h, unsigned int i)
+{
+	struct nsm_timer *t = h->timers[i];
+
+	while (i) {
+		unsigned int parent = (i - 1) / 2;
+
+		if (h->timers[parent]->expires <= t->expires)
+			break;
+		heap_set(h, i, h->timers[parent]);
+		i = parent;
+	}
+	heap_set(h, i, t);
+}
+
+static void heap_down(struct nsm_timer_heap *h, unsigned int i)
+{
+	struct nsm_timer *t = h->timers[i];
+
+	while (1) {
+		unsigned int child = 2 * i + 1;
+
+		if (child >= h->count)
+			break;
+		if (child + 1 < h->count &&
+		    h->timers[child + 1]->expires < h->timers[child]->expires)
+			child++;
+		if (t->expires <= h->timers[child]->expires)
+			break;
+		heap_set(h, i, h->timers[child]);
+		i = child;
+	}
+	heap_set(h, i, t);
+}
+
+/*
+ * Arm the timer to expire at 'expires', or re-arm it if it's pending.
+ */
+int nsm_timer_add(struct nsm_timer_heap *h, struct nsm_timer *t, long expires)
+{
+	unsigned int i;
+
+	if (nsm_timer_pending(t)) {
+		i = t->index - 1;
+		t->expires = expires;
+		heap_up(h, i);
+		heap_down(h, t->index - 1);
+		return 0;
+	}
+
+	if (h->count == h->size) {
+		struct nsm_timer **timers;
+
+		timers = realloc(h->timers, 2 * h->size * sizeof(*timers));
+		if (!timers) {
+			errno = ENOMEM;
+			return -1;
+		}
+		h->timers = timers;
+		h->size *= 2;
+	}
+
+	t->expires = expires;
+	heap_set(h, h->count++, t);
+	heap_up(h, h->count - 1);
+	return 0;
+}
+
+void nsm_timer_del(struct nsm_timer_heap *h, struct nsm_timer *t)
+{
+	struct nsm_timer *last;
+	unsigned int i;
+
+	if (!nsm_timer_pending(t))
+		return;
+
+	i = t->index - 1;
+	t->index = 0;
+
+	if (i == --h->count)
+		return;
+
+	/* Move the last timer into the hole and restore the order */
+	last = h->timers[h->count];
+	heap_set(h, i, last);
+	heap_up(h, i);
+	heap_down(h, last->index - 1);
+}
+
+/*
+ * Time in msec until the first timer expires, -1 if there are no timers.
+ */
+long nsm_timer_wait(struct nsm_timer_heap *h, long now)
+{
+	struct nsm_timer *t = nsm_timer_first(h);
+
+	if (!t)
+		return -1;
+	return t->expires > now ? t->expires - now : 0;
+}
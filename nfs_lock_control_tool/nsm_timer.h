@@ -0,0 +1,33 @@
+/*
+ * Timers kept in a binary min-heap ordered by expiry time.
+ */
+
+#ifndef __NSM_TIMER_H__
+#define __NSM_TIMER_H__
+
+#include <stddef.h>
+
+struct nsm_timer {
+	long			expires;	/* msec, monotonic */
+	unsigned int		index;		/* heap slot + 1, 0 if idle */
+};
+
+struct nsm_timer_heap {
+	struct nsm_timer **	timers;
+	unsigned int		count;
+	unsigned int		size;
+};
+
+extern int		nsm_timer_heap_init(struct nsm_timer_heap *, unsigned int);
+extern void		nsm_timer_heap_fini(struct nsm_timer_heap *);
+extern int		nsm_timer_add(struct nsm_timer_heap *, struct nsm_timer *,
+					long);
+extern void		nsm_timer_del(struct nsm_timer_heap *, struct nsm_timer *);
+extern long		nsm_timer_wait(struct nsm_timer_heap *, long);
+
+#define nsm_timer_first(H)	((H)->count ? (H)->timers[0] : NULL)
+#define nsm_timer_pending(T)	((T)->index != 0)
+#define nsm_timer_entry(T, type, member) \
+	((type *)((char *)(T) - offsetof(type, member)))
+
+#endif /* __NSM_TIMER_H__ */
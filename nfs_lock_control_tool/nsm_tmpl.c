@@ -0,0 +1,68 @@
+/*
+ * Precompiled SM_NOTIFY packets.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#include "nsm_tmpl.h"
+
+#define SM_PROG			100024
+#define SM_VERS			1
+#define SM_NOTIFY		6
+
+/*
+ * Encode the call header and mon_name of 'client_name' notifications.
+ */
+int nsm_tmpl_init(struct nsm_tmpl *t, const char *client_name)
+{
+	uint32_t *p = t->body;
+	unsigned int len = strlen(client_name);
+
+	if (len > NSM_TMPL_MAXNAME) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	*p++ = 0;			/* CALL */
+	*p++ = htonl(2);		/* RPC version */
+	*p++ = htonl(SM_PROG);
+	*p++ = htonl(SM_VERS);
+	*p++ = htonl(SM_NOTIFY);
+
+	/* Auth and verf */
+	*p++ = 0; *p++ = 0;
+	*p++ = 0; *p++ = 0;
+
+	*p++ = htonl(len);
+	p[len >> 2] = 0;
+	memcpy(p, client_name, len);
+	p += (len + 3) >> 2;
+
+	t->len = (p - t->body) << 2;
+	return 0;
+}
+
+/*
+ * Make a packet of the template: 'words' gets the XID and the state, and
+ * the NSM_TMPL_IOVS iovecs at 'iov' are pointed to the packet parts.
+ * 'words' and the template must stay intact until it is sent.
+ *
+ * Returns the packet length in bytes.
+ */
+unsigned int nsm_tmpl_fill(const struct nsm_tmpl *t, uint32_t *words,
+			uint32_t xid, uint32_t state, struct iovec *iov)
+{
+	words[0] = htonl(xid);
+	words[1] = htonl(state);
+
+	iov[0].iov_base = &words[0];
+	iov[0].iov_len = sizeof(uint32_t);
+	iov[1].iov_base = (void *)t->body;
+	iov[1].iov_len = t->len;
+	iov[2].iov_base = &words[1];
+	iov[2].iov_len = sizeof(uint32_t);
+
+	return t->len + 2 * sizeof(uint32_t);
+}
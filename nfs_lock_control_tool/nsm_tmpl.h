@@ -0,0 +1,29 @@
+/*
+ * Precompiled SM_NOTIFY packets.
+ *
+ * Everything between the XID and the new state of an SM_NOTIFY call
+ * depends on the client name only, so it is encoded once. A packet is
+ * then sent as three iovecs: the XID word, the shared template body and
+ * the state word, and building one costs two stores.
+ */
+
+#ifndef __NSM_TMPL_H__
+#define __NSM_TMPL_H__
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define NSM_TMPL_MAXNAME	1024	/* SM_MAXSTRLEN */
+#define NSM_TMPL_IOVS		3	/* iovecs per packet */
+
+struct nsm_tmpl {
+	unsigned int		len;		/* body length in bytes */
+	/* the header, the name and the word nsm_tmpl_init() zeroes past it */
+	uint32_t		body[10 + NSM_TMPL_MAXNAME / 4 + 1];
+};
+
+extern int		nsm_tmpl_init(struct nsm_tmpl *, const char *);
+extern unsigned int	nsm_tmpl_fill(const struct nsm_tmpl *, uint32_t *,
+					uint32_t, uint32_t, struct iovec *);
+
+#endif /* __NSM_TMPL_H__ */
@@ -0,0 +1,484 @@
+/*
+ * io_uring datagram I/O for the SM_NOTIFY engine.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "nsm_uring.h"
+
+#if defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+#ifdef IORING_RECV_MULTISHOT
+
+#define URING_SEND		(1ULL << 63)	/* user_data of SENDMSGs */
+#define URING_BUFSIZE		(sizeof(struct io_uring_recvmsg_out) + \
+				 sizeof(struct sockaddr_storage) + \
+				 NSM_BATCH_MSGSIZE * sizeof(uint32_t))
+#define URING_BGID		0
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_register(int fd, unsigned int op, void *arg,
+						unsigned int nr)
+{
+	return syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+/*
+ * Hand the queued SQEs to the kernel and wait for 'wait' completions,
+ * 'msec' at most (-1 is no limit). Returns the io_uring_enter() result.
+ */
+static int uring_enter(struct nsm_uring *u, unsigned int wait, long msec)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int flags = 0;
+	int res;
+
+	__atomic_store_n(u->sq_tail, u->sq_local, __ATOMIC_RELEASE);
+
+	if (wait)
+		flags |= IORING_ENTER_GETEVENTS;
+	memset(&arg, 0, sizeof(arg));
+	if (msec >= 0) {
+		ts.tv_sec = msec / 1000;
+		ts.tv_nsec = msec % 1000 * 1000000;
+		arg.ts = (uintptr_t)&ts;
+	}
+
+	res = syscall(__NR_io_uring_enter, u->fd, u->sq_pending, wait,
+			flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	if (res > 0)
+		u->sq_pending -= res;
+	return res;
+}
+
+/*
+ * The next free SQE, zeroed. The queue is submitted first if it's full.
+ */
+static struct io_uring_sqe *uring_sqe(struct nsm_uring *u)
+{
+	struct io_uring_sqe *sqe;
+
+	while (u->sq_local - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) ==
+							u->sq_entries)
+		uring_enter(u, 0, 0);
+
+	sqe = &u->sqes[u->sq_local++ & u->sq_mask];
+	u->sq_pending++;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static void uring_recycle(struct nsm_uring *u, unsigned short bid)
+{
+	struct io_uring_buf *b;
+
+	b = &u->br->bufs[u->br_tail & (NSM_URING_BUFS - 1)];
+	b->addr = (uintptr_t)(u->bufs + bid * URING_BUFSIZE);
+	b->len = URING_BUFSIZE;
+	b->bid = bid;
+	__atomic_store_n(&u->br->tail, ++u->br_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Multishot receive on socket 'i', until it runs out of buffers or
+ * fails. The message header only gives the room for the address.
+ */
+static void uring_arm(struct nsm_uring *u, unsigned int i)
+{
+	static struct msghdr msg = {
+		.msg_namelen = sizeof(struct sockaddr_storage),
+	};
+	struct io_uring_sqe *sqe = uring_sqe(u);
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = i;
+	sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+	sqe->addr = (uintptr_t)&msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = i;
+	u->armed |= 1ULL << i;
+}
+
+/*
+ * Take the completions: results of the sends, received packets to the
+ * FIFO. Sockets, which stopped receiving, are noted to be armed again.
+ */
+static void uring_reap(struct nsm_uring *u)
+{
+	unsigned int head = *u->cq_head;
+	unsigned int tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	struct io_uring_cqe *cqe;
+	unsigned short bid;
+
+	for (; head != tail; head++) {
+		cqe = &u->cqes[head & u->cq_mask];
+
+		if (cqe->user_data & URING_SEND) {
+			u->results[cqe->user_data & ~URING_SEND] = cqe->res;
+			u->sending--;
+			continue;
+		}
+
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			u->armed &= ~(1ULL << cqe->user_data);
+		if (!(cqe->flags & IORING_CQE_F_BUFFER))
+			continue;
+
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if (cqe->res < 0) {
+			uring_recycle(u, bid);
+			continue;
+		}
+		u->rx[(u->rx_head + u->rx_count++) &
+				(NSM_URING_BUFS - 1)] = (struct nsm_uring_rx) {
+			.bid = bid,
+			.sock = cqe->user_data,
+			.len = cqe->res,
+		};
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static int uring_map(struct nsm_uring *u, struct io_uring_params *p)
+{
+	unsigned int i, *array;
+	void *cq;
+
+	u->ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+	u->cq_ring_size = p->cq_off.cqes +
+				p->cq_entries * sizeof(struct io_uring_cqe);
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		u->ring_size = MAX(u->ring_size, u->cq_ring_size);
+
+	u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->ring == MAP_FAILED) {
+		u->ring = NULL;
+		return -errno;
+	}
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		cq = u->ring;
+	else {
+		u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED) {
+			u->cq_ring = NULL;
+			return -errno;
+		}
+		cq = u->cq_ring;
+	}
+
+	u->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		return -errno;
+	}
+
+	u->sq_head = (unsigned int *)((char *)u->ring + p->sq_off.head);
+	u->sq_tail = (unsigned int *)((char *)u->ring + p->sq_off.tail);
+	u->sq_mask = *(unsigned int *)((char *)u->ring + p->sq_off.ring_mask);
+	u->sq_entries = p->sq_entries;
+	array = (unsigned int *)((char *)u->ring + p->sq_off.array);
+	for (i = 0; i < p->sq_entries; i++)
+		array[i] = i;
+	u->sq_local = *u->sq_tail;
+
+	u->cq_head = (unsigned int *)((char *)cq + p->cq_off.head);
+	u->cq_tail = (unsigned int *)((char *)cq + p->cq_off.tail);
+	u->cq_mask = *(unsigned int *)((char *)cq + p->cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)cq + p->cq_off.cqes);
+	return 0;
+}
+
+static int uring_buffers(struct nsm_uring *u)
+{
+	struct io_uring_buf_reg reg;
+	unsigned int i;
+
+	u->bufs = malloc(NSM_URING_BUFS * URING_BUFSIZE);
+	if (!u->bufs)
+		return -ENOMEM;
+
+	u->br_size = NSM_URING_BUFS * sizeof(struct io_uring_buf);
+	u->br = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->br == MAP_FAILED) {
+		u->br = NULL;
+		return -errno;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)u->br;
+	reg.ring_entries = NSM_URING_BUFS;
+	reg.bgid = URING_BGID;
+	if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return -errno;
+
+	for (i = 0; i < NSM_URING_BUFS; i++)
+		uring_recycle(u, i);
+	return 0;
+}
+
+static void socks_nonblock(const struct nsm_port_pool *ports, int on)
+{
+	unsigned int i;
+	int flags;
+
+	for (i = 0; i < ports->nr; i++) {
+		flags = fcntl(ports->socks[i], F_GETFL);
+		fcntl(ports->socks[i], F_SETFL,
+				on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+	}
+}
+
+/*
+ * Set the ring up for the sockets of the pool. They are switched to
+ * blocking mode: a send, which finds a socket full, waits in the kernel
+ * for room then, instead of failing with EAGAIN.
+ */
+int nsm_uring_init(struct nsm_uring *u, const struct nsm_port_pool *ports)
+{
+	struct io_uring_params p;
+	unsigned int i;
+	int res;
+
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+	if (ports->nr > 64)
+		return -EINVAL;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = NSM_URING_CQ;
+	u->fd = uring_setup(NSM_URING_SQ, &p);
+	if (u->fd < 0) {
+		res = -errno;
+		goto fail;
+	}
+	if (!(p.features & IORING_FEAT_EXT_ARG)) {
+		res = -EOPNOTSUPP;
+		goto fail;
+	}
+
+	res = uring_map(u, &p);
+	if (res < 0)
+		goto fail;
+	res = uring_buffers(u);
+	if (res < 0)
+		goto fail;
+
+	if (uring_register(u->fd, IORING_REGISTER_FILES,
+				(void *)ports->socks, ports->nr) < 0) {
+		res = -errno;
+		goto fail;
+	}
+	u->socks = ports->socks;
+	u->nr_socks = ports->nr;
+
+	u->results = calloc(ports->nr * NSM_BATCH_SIZE, sizeof(int));
+	if (!u->results) {
+		res = -ENOMEM;
+		goto fail;
+	}
+
+	socks_nonblock(ports, 0);
+	for (i = 0; i < ports->nr; i++)
+		uring_arm(u, i);
+
+	/* kernels without multishot receive fail it at once */
+	if (uring_enter(u, 0, 0) < 0) {
+		res = -errno;
+		goto fail_blocking;
+	}
+	uring_reap(u);
+	if (u->armed != (ports->nr == 64 ? ~0ULL : (1ULL << ports->nr) - 1)) {
+		res = -EOPNOTSUPP;
+		goto fail_blocking;
+	}
+	return 0;
+
+fail_blocking:
+	/* back to what the sendmmsg() path the caller falls back to needs */
+	nsm_uring_fini(u);
+	socks_nonblock(ports, 1);
+	return res;
+fail:
+	nsm_uring_fini(u);
+	return res;
+}
+
+void nsm_uring_fini(struct nsm_uring *u)
+{
+	if (u->fd >= 0)
+		close(u->fd);
+	if (u->ring)
+		munmap(u->ring, u->ring_size);
+	if (u->cq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_size);
+	if (u->br)
+		munmap(u->br, u->br_size);
+	free(u->bufs);
+	free(u->results);
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+}
+
+/*
+ * Queue the packets of the batch of socket 'i' for nsm_uring_submit().
+ * The batch must stay intact until then.
+ */
+void nsm_uring_queue(struct nsm_uring *u, unsigned int i,
+						struct nsm_batch *b)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int n;
+
+	for (n = b->head; n < b->count; n++) {
+		sqe = uring_sqe(u);
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = i;
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->addr = (uintptr_t)&b->msgs[n].msg_hdr;
+		sqe->len = 1;
+		sqe->user_data = URING_SEND | (i * NSM_BATCH_SIZE + n);
+		nsm_uring_result(u, i, n) = -EINPROGRESS;
+		u->sending++;
+	}
+}
+
+/*
+ * Send the queued packets and wait until all of them are gone. Usually
+ * that's a single io_uring_enter(), UDP sends complete inline.
+ */
+void nsm_uring_submit(struct nsm_uring *u)
+{
+	unsigned int wait = 0;
+
+	while (u->sq_pending || u->sending) {
+		if (uring_enter(u, wait, -1) < 0 && errno != EINTR &&
+		    errno != EBUSY && errno != EAGAIN)
+			break;
+		uring_reap(u);
+		wait = 1;
+	}
+}
+
+/*
+ * Move up to a batch of the received packets to 'b', as nsm_batch_recv()
+ * does, without a syscall. Sockets, which stopped receiving, are armed
+ * again. Returns the number of packets.
+ */
+int nsm_uring_recv(struct nsm_uring *u, struct nsm_batch *b)
+{
+	const struct io_uring_recvmsg_out *out;
+	struct nsm_uring_rx *rx;
+	struct iovec *iov;
+	unsigned char *buf;
+	unsigned int i, n, len;
+
+	uring_reap(u);
+
+	for (n = 0; n < b->size && u->rx_count; n++) {
+		rx = &u->rx[u->rx_head++ & (NSM_URING_BUFS - 1)];
+		u->rx_count--;
+
+		buf = u->bufs + rx->bid * URING_BUFSIZE;
+		out = (const struct io_uring_recvmsg_out *)buf;
+		len = rx->len - sizeof(*out) - sizeof(struct sockaddr_storage);
+		len = MIN(len, out->payloadlen);
+
+		memcpy(nsm_batch_buf(b, n), buf + sizeof(*out) +
+				sizeof(struct sockaddr_storage), len);
+		b->msgs[n].msg_len = len;
+		b->msgs[n].msg_hdr.msg_namelen = MIN(out->namelen,
+					sizeof(struct sockaddr_storage));
+		memcpy(&b->addrs[n], buf + sizeof(*out),
+					b->msgs[n].msg_hdr.msg_namelen);
+		uring_recycle(u, rx->bid);
+
+		iov = nsm_batch_iov(b, n);
+		iov->iov_base = nsm_batch_buf(b, n);
+		iov->iov_len = len;
+		b->msgs[n].msg_hdr.msg_iovlen = 1;
+		if (nsm_batch_tap)
+			nsm_batch_tap(u->socks[rx->sock], &b->msgs[n], 1, 0);
+	}
+	b->head = 0;
+	b->count = n;
+
+	for (i = 0; i < u->nr_socks; i++)
+		if (!(u->armed & 1ULL << i))
+			uring_arm(u, i);
+	if (u->sq_pending)
+		uring_enter(u, 0, 0);
+	return n;
+}
+
+/*
+ * Wait up to 'msec' (-1 is no limit) for packets to come, unless some
+ * are there already.
+ */
+void nsm_uring_wait(struct nsm_uring *u, long msec)
+{
+	if (u->rx_count || *u->cq_head !=
+			__atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+		return;
+	uring_enter(u, 1, msec);
+}
+
+#else /* no io_uring headers */
+
+int nsm_uring_init(struct nsm_uring *u, const struct nsm_port_pool *ports)
+{
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+	return -ENOSYS;
+}
+
+void nsm_uring_fini(struct nsm_uring *u)
+{
+}
+
+void nsm_uring_queue(struct nsm_uring *u, unsigned int i,
+						struct nsm_batch *b)
+{
+}
+
+void nsm_uring_submit(struct nsm_uring *u)
+{
+}
+
+int nsm_uring_recv(struct nsm_uring *u, struct nsm_batch *b)
+{
+	return 0;
+}
+
+void nsm_uring_wait(struct nsm_uring *u, long msec)
+{
+}
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ * io_uring datagram I/O for the SM_NOTIFY engine.
+ *
+ * An alternative to nsm_batch's sendmmsg()/recvmmsg() and poll(). The
+ * sockets of a pool are registered with the ring and every one has a
+ * multishot RECVMSG armed, which takes its buffers from a ring of
+ * provided buffers, so answers pile up in the completion queue without
+ * a syscall per socket. The packets queued on all the sockets go out as
+ * SENDMSG requests in a single io_uring_enter(), which reaps their
+ * results as well, and waiting for answers or a timeout is another one.
+ *
+ * The ring is set up with raw syscalls, without liburing.
+ * nsm_uring_init() fails on kernels without io_uring or without
+ * multishot receive (before 6.0), and the caller goes on with nsm_batch.
+ */
+
+#ifndef __NSM_URING_H__
+#define __NSM_URING_H__
+
+#include <stdint.h>
+
+#include "nsm_batch.h"
+#include "nsm_port.h"
+
+#define NSM_URING_SQ		1024	/* submission queue entries */
+#define NSM_URING_CQ		8192	/* completion queue entries */
+#define NSM_URING_BUFS		1024	/* receive buffers, power of 2 */
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+struct nsm_uring_rx {
+	unsigned short		bid;		/* buffer */
+	unsigned short		sock;		/* index in the pool */
+	unsigned int		len;		/* bytes in it */
+};
+
+struct nsm_uring {
+	int			fd;
+	const int *		socks;		/* of the pool */
+	unsigned int		nr_socks;
+
+	/* submission queue */
+	unsigned int *		sq_head;
+	unsigned int *		sq_tail;
+	unsigned int		sq_mask;
+	unsigned int		sq_entries;
+	struct io_uring_sqe *	sqes;
+	unsigned int		sq_local;	/* next SQE to fill */
+	unsigned int		sq_pending;	/* SQEs not taken yet */
+
+	/* completion queue */
+	unsigned int *		cq_head;
+	unsigned int *		cq_tail;
+	unsigned int		cq_mask;
+	struct io_uring_cqe *	cqes;
+
+	/* provided receive buffers */
+	struct io_uring_buf_ring *br;
+	unsigned short		br_tail;
+	unsigned char *		bufs;
+	struct nsm_uring_rx	rx[NSM_URING_BUFS];	/* received, FIFO */
+	unsigned int		rx_head;
+	unsigned int		rx_count;
+	uint64_t		armed;		/* sockets receiving, bitmask */
+
+	/* sends */
+	int *			results;	/* NSM_BATCH_SIZE per socket */
+	unsigned int		sending;	/* SENDMSGs not completed */
+
+	void *			ring;		/* mappings, for fini */
+	size_t			ring_size;
+	void *			cq_ring;
+	size_t			cq_ring_size;
+	size_t			sqes_size;
+	size_t			br_size;
+};
+
+extern int		nsm_uring_init(struct nsm_uring *,
+					const struct nsm_port_pool *);
+extern void		nsm_uring_fini(struct nsm_uring *);
+extern void		nsm_uring_queue(struct nsm_uring *, unsigned int,
+					struct nsm_batch *);
+extern void		nsm_uring_submit(struct nsm_uring *);
+extern int		nsm_uring_recv(struct nsm_uring *, struct nsm_batch *);
+extern void		nsm_uring_wait(struct nsm_uring *, long);
+
+/* Bytes sent or negative errno of packet 'i' of the socket's last batch */
+#define nsm_uring_result(U, S, I)	((U)->results[(S) * NSM_BATCH_SIZE + (I)])
+
+#endif /* __NSM_URING_H__ */
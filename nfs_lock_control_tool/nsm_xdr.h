@@ -0,0 +1,159 @@
+/*
+ * XDR for the few RPC messages we use.
+ *
+ * The call header, SM_NOTIFY status, PMAP mapping, NLM lock and the
+ * reply header have a simple layout, so they are encoded with plain
+ * stores into word buffers and decoded by indexing, without XDR streams
+ * and the indirect calls of the generic libtirpc path. Buffers must be 4 byte aligned and
+ * big enough: the caller knows the message sizes.
+ */
+
+#ifndef __NSM_XDR_H__
+#define __NSM_XDR_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+
+#define NSM_XDR_CALL		0
+#define NSM_XDR_REPLY		1
+#define NSM_XDR_RPCVERS		2
+#define NSM_XDR_CALL_WORDS	10	/* call header with AUTH_NULL */
+#define NSM_XDR_PRIV_SIZE	16	/* SM_PRIV_SIZE */
+
+/* accept_stat of a reply */
+#define NSM_XDR_SUCCESS		0
+#define NSM_XDR_PROG_UNAVAIL	1
+#define NSM_XDR_PROG_MISMATCH	2
+#define NSM_XDR_PROC_UNAVAIL	3
+#define NSM_XDR_GARBAGE_ARGS	4
+
+static inline uint32_t *nsm_xdr_u32(uint32_t *p, uint32_t v)
+{
+	*p++ = htonl(v);
+	return p;
+}
+
+static inline uint32_t *nsm_xdr_u64(uint32_t *p, uint64_t v)
+{
+	p[0] = htonl(v >> 32);
+	p[1] = htonl(v);
+	return p + 2;
+}
+
+/*
+ * Call header with AUTH_NULL credentials and verifier.
+ */
+static inline uint32_t *nsm_xdr_call(uint32_t *p, uint32_t xid,
+				uint32_t prog, uint32_t vers, uint32_t proc)
+{
+	p[0] = htonl(xid);
+	p[1] = htonl(NSM_XDR_CALL);
+	p[2] = htonl(NSM_XDR_RPCVERS);
+	p[3] = htonl(prog);
+	p[4] = htonl(vers);
+	p[5] = htonl(proc);
+	p[6] = 0; p[7] = 0;		/* cred */
+	p[8] = 0; p[9] = 0;		/* verf */
+	return p + NSM_XDR_CALL_WORDS;
+}
+
+/*
+ * Opaque data of fixed length, zero padded.
+ */
+static inline uint32_t *nsm_xdr_opaque(uint32_t *p, const void *data,
+							unsigned int len)
+{
+	p[len >> 2] = 0;
+	memcpy(p, data, len);
+	return p + ((len + 3) >> 2);
+}
+
+static inline uint32_t *nsm_xdr_string(uint32_t *p, const char *str,
+							unsigned int len)
+{
+	*p++ = htonl(len);
+	return nsm_xdr_opaque(p, str, len);
+}
+
+/*
+ * struct status of SM_NOTIFY callbacks: mon_name, state, priv.
+ */
+static inline uint32_t *nsm_xdr_status(uint32_t *p, const char *mon_name,
+				unsigned int len, int32_t state,
+				const void *priv)
+{
+	p = nsm_xdr_string(p, mon_name, len);
+	*p++ = htonl(state);
+	memcpy(p, priv, NSM_XDR_PRIV_SIZE);
+	return p + NSM_XDR_PRIV_SIZE / 4;
+}
+
+/*
+ * struct pmap of PMAPPROC_GETPORT.
+ */
+static inline uint32_t *nsm_xdr_pmap(uint32_t *p, uint32_t prog,
+				uint32_t vers, uint32_t prot, uint32_t port)
+{
+	p[0] = htonl(prog);
+	p[1] = htonl(vers);
+	p[2] = htonl(prot);
+	p[3] = htonl(port);
+	return p + 4;
+}
+
+/*
+ * Check the reply header of a 'len' bytes message. Returns the
+ * accept_stat with 'xid' set and '*res' pointed to the results, -EACCES
+ * if the call was denied or -EPROTO if it's not a reply at all.
+ */
+static inline int nsm_xdr_reply(const uint32_t *buf, unsigned int len,
+				uint32_t *xid, const uint32_t **res)
+{
+	const uint32_t *end = buf + len / 4;
+	uint32_t verf_len;
+
+	if (len < 24 || buf[1] != htonl(NSM_XDR_REPLY))
+		return -EPROTO;
+	*xid = ntohl(buf[0]);
+	if (buf[2] != 0)		/* MSG_DENIED */
+		return -EACCES;
+
+	verf_len = ntohl(buf[4]);
+	if (verf_len > len - 24)
+		return -EPROTO;
+	buf += 5 + ((verf_len + 3) >> 2);
+	if (buf >= end)
+		return -EPROTO;
+
+	*res = buf + 1;
+	return ntohl(*buf);
+}
+
+/*
+ * Take a word of the results, if there is one before 'end'.
+ */
+static inline int nsm_xdr_get_u32(const uint32_t **p, const uint32_t *end,
+							uint32_t *v)
+{
+	if (*p >= end)
+		return -EPROTO;
+	*v = ntohl(*(*p)++);
+	return 0;
+}
+
+/*
+ * Skip variable length opaque data (a string or netobj) of the results.
+ */
+static inline int nsm_xdr_skip_opaque(const uint32_t **p, const uint32_t *end)
+{
+	uint32_t len;
+
+	if (nsm_xdr_get_u32(p, end, &len) < 0 || len > (end - *p) * 4)
+		return -EPROTO;
+	*p += (len + 3) >> 2;
+	return 0;
+}
+
+#endif /* __NSM_XDR_H__ */
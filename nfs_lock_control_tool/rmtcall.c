@@ -27,6 +27,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <net/if.h>
 #include <arpa/inet.h>
@@ -36,7 +37,10 @@
 #include <rpcsvc/sm_inter.h>
 #include <time.h>
 #include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #ifdef HAVE_IFADDRS_H
 #include <ifaddrs.h>
@@ -44,25 +48,41 @@
 //#include "sm_inter.h"
 //#include "statd.h"
 #include "notlist.h"
+#include "nsm_port.h"
+#include "nsm_xdr.h"
+#include "nsm_clock.h"
 //#include "log.h"
 //#include "ha-callout.h"
 
-#if SIZEOF_SOCKLEN_T - 0 == 0
-#define socklen_t int
-#endif
-
 #define MAXMSGSIZE	(2048 / sizeof(unsigned int))
 
-#ifdef FD_SETSIZE
-# define FD_SET_TYPE	fd_set
-# define SVC_FDSET	svc_fdset
-#else
-# define FD_SET_TYPE	int
-# define SVC_FDSET	svc_fds
+#ifndef SM_PRIV_SIZE
+#define SM_PRIV_SIZE	16
 #endif
 
+#define NOTIFY_TIMEOUT	5		/* seconds before re-xmit */
+#define NOTIFY_TRIES	5
+#define NOTIFY_WINDOW	256		/* calls in flight */
+#define XID_HASH_BITS	14
+#define XID_HASH_SIZE	(1 << XID_HASH_BITS)
+
 static unsigned long	xid = 0;	/* RPC XID counter */
 static int		sockfd = -1;	/* notify socket */
+static int		epfd = -1;	/* waits for the socket */
+
+/*
+ * Calls in flight are found by XID in a hash table, and wait for
+ * retransmission in a timer heap, so that neither costs a walk over the
+ * whole notify list. The entries not started yet wait in a queue, up to
+ * NOTIFY_WINDOW are in flight at once.
+ */
+static notify_list *	xid_hash[XID_HASH_SIZE];
+static struct nsm_timer_heap timers;
+static notify_list *	queue;
+static notify_list **	queue_tail = &queue;
+static unsigned int	pending;	/* entries not done yet */
+static unsigned int	succeeded;
+static int		verbose;
 
 /*
  * Initialize socket used to notify lockd of peer reboots.
@@ -80,182 +100,159 @@ static int		sockfd = -1;	/* notify socket */
 int
 statd_get_socket(void)
 {
-	struct sockaddr_in	sin;
-	struct servent *se;
-	int loopcnt = 100;
+	struct epoll_event	ev;
 
 	if (sockfd >= 0)
 		return sockfd;
 
-	while (loopcnt-- > 0) {
+	if ((sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+		printf("%s: Can't create socket: %m", __func__);
+		return -1;
+	}
 
-		if (sockfd >= 0) close(sockfd);
+	/* a free reserved port, which is not a known service's */
+	if (nsm_port_bind(sockfd, NULL) < 0)
+		printf("%s: can't bind to reserved port", __func__);
 
-		if ((sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
-			printf("%s: Can't create socket: %m", __func__);
-			return -1;
-		}
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		printf("%s: Can't create epoll: %m", __func__);
+		close(sockfd);
+		return sockfd = -1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.fd = sockfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev);
 
+	return sockfd;
+}
 
-		memset(&sin, 0, sizeof(sin));
-		sin.sin_family = AF_INET;
-		sin.sin_addr.s_addr = INADDR_ANY;
+static void
+xid_hash_add(notify_list *lp)
+{
+	notify_list **head = &xid_hash[lp->xid & (XID_HASH_SIZE - 1)];
 
-		if (bindresvport(sockfd, &sin) < 0) {
-			printf("%s: can't bind to reserved port",
-					__func__);
+	lp->xnext = *head;
+	*head = lp;
+}
+
+static void
+xid_hash_del(notify_list *lp)
+{
+	notify_list **pp = &xid_hash[lp->xid & (XID_HASH_SIZE - 1)];
+
+	for (; *pp; pp = &(*pp)->xnext)
+		if (*pp == lp) {
+			*pp = lp->xnext;
 			break;
 		}
-		se = getservbyport(sin.sin_port, "udp");
-		if (se == NULL)
-			break;
-		/* rather not use that port, try again */
-	}
-	FD_SET(sockfd, &SVC_FDSET);
-	return sockfd;
 }
 
+static notify_list *
+xid_hash_find(u_int32_t x)
+{
+	notify_list *lp;
+
+	for (lp = xid_hash[x & (XID_HASH_SIZE - 1)]; lp; lp = lp->xnext)
+		if (lp->xid == x)
+			return lp;
+	return NULL;
+}
+
+/*
+ * Send the status callback, or the portmapper query for its port if
+ * that's not known yet. Messages are laid out directly by nsm_xdr.
+ */
 static unsigned long
 xmit_call(struct sockaddr_in *sin,
 	  u_int32_t prog, u_int32_t vers, u_int32_t proc,
-	  xdrproc_t func, void *obj)
+	  const struct status *status)
 /* 		__u32 prog, __u32 vers, __u32 proc, xdrproc_t func, void *obj) */
 {
-	unsigned int		msgbuf[MAXMSGSIZE], msglen;
-	struct rpc_msg		mesg;
-	struct pmap		pmap;
-	XDR			xdr, *xdrs = &xdr;
+	uint32_t		msgbuf[MAXMSGSIZE], *p;
+	unsigned int		msglen;
 	int			err;
 
 	if (!xid)
 		xid = getpid() + time(NULL);
 
-	mesg.rm_xid = ++xid;
-	mesg.rm_direction = CALL;
-	mesg.rm_call.cb_rpcvers = 2;
+	++xid;
 	if (sin->sin_port == 0) {
 		sin->sin_port = htons(PMAPPORT);
-		mesg.rm_call.cb_prog = PMAPPROG;
-		mesg.rm_call.cb_vers = PMAPVERS;
-		mesg.rm_call.cb_proc = PMAPPROC_GETPORT;
-		pmap.pm_prog = prog;
-		pmap.pm_vers = vers;
-		pmap.pm_prot = IPPROTO_UDP;
-		pmap.pm_port = 0;
-		func = (xdrproc_t) xdr_pmap;
-		obj  = &pmap;
+		p = nsm_xdr_call(msgbuf, xid, PMAPPROG, PMAPVERS,
+						PMAPPROC_GETPORT);
+		p = nsm_xdr_pmap(p, prog, vers, IPPROTO_UDP, 0);
 	} else {
-		mesg.rm_call.cb_prog = prog;
-		mesg.rm_call.cb_vers = vers;
-		mesg.rm_call.cb_proc = proc;
-	}
-	mesg.rm_call.cb_cred.oa_flavor = AUTH_NULL;
-	mesg.rm_call.cb_cred.oa_base = (caddr_t) NULL;
-	mesg.rm_call.cb_cred.oa_length = 0;
-	mesg.rm_call.cb_verf.oa_flavor = AUTH_NULL;
-	mesg.rm_call.cb_verf.oa_base = (caddr_t) NULL;
-	mesg.rm_call.cb_verf.oa_length = 0;
-
-	/* Create XDR memory object for encoding */
-	xdrmem_create(xdrs, (caddr_t) msgbuf, sizeof(msgbuf), XDR_ENCODE);
-
-	/* Encode the RPC header part and payload */
-	if (!xdr_callmsg(xdrs, &mesg) || !func(xdrs, obj)) {
-		printf("%s: can't encode RPC message!", __func__);
-		xdr_destroy(xdrs);
-		return 0;
+		p = nsm_xdr_call(msgbuf, xid, prog, vers, proc);
+		p = nsm_xdr_status(p, status->mon_name,
+				strlen(status->mon_name), status->state,
+				status->priv);
 	}
 
 	/* Get overall length of datagram */
-	msglen = xdr_getpos(xdrs);
+	msglen = (p - msgbuf) << 2;
 
 	if ((err = sendto(sockfd, msgbuf, msglen, 0,
 			(struct sockaddr *) sin, sizeof(*sin))) < 0) {
-		printf("%s: sendto failed: %m", __func__);
+		printf("%s: sendto failed: %m\n", __func__);
 	} else if (err != msglen) {
-		printf("%s: short write: %m", __func__);
+		printf("%s: short write: %m\n", __func__);
 	}
 
-	xdr_destroy(xdrs);
-
-	return err == msglen? xid : 0;
+	return err == msglen? (u_int32_t) xid : 0;
 }
-#if 0
+
+/*
+ * Decode a reply datagram and find the call it answers.
+ */
 static notify_list *
-recv_rply(struct sockaddr_in *sin, u_long *portp)
+recv_rply(unsigned int *msgbuf, int msglen, struct sockaddr_in *sin,
+	  u_long *portp)
 {
-	unsigned int		msgbuf[MAXMSGSIZE], msglen;
-	struct rpc_msg		mesg;
-	notify_list		*lp = NULL;
-	XDR			xdr, *xdrs = &xdr;
-	socklen_t		alen = sizeof(*sin);
-
-	/* Receive message */
-	if ((msglen = recvfrom(sockfd, msgbuf, sizeof(msgbuf), 0,
-			(struct sockaddr *) sin, &alen)) < 0) {
-		printf("%s: recvfrom failed: %m", __func__);
-		return NULL;
-	}
-
-	/* Create XDR object for decoding buffer */
-	xdrmem_create(xdrs, (caddr_t) msgbuf, msglen, XDR_DECODE);
-
-	memset(&mesg, 0, sizeof(mesg));
-	mesg.rm_reply.rp_acpt.ar_results.where = NULL;
-	mesg.rm_reply.rp_acpt.ar_results.proc = (xdrproc_t) xdr_void;
-
-	if (!xdr_replymsg(xdrs, &mesg)) {
-		printf("%s: can't decode RPC message!", __func__);
-		goto done;
-	}
+	const uint32_t		*res, *end = msgbuf + msglen / 4;
+	notify_list		*lp;
+	uint32_t		x, port;
+	int			stat;
 
-	if (mesg.rm_reply.rp_stat != 0) {
-		printf("%s: [%s] RPC status %d", 
-				__func__,
-				inet_ntoa(sin->sin_addr),
-				mesg.rm_reply.rp_stat);
-		goto done;
+	stat = nsm_xdr_reply(msgbuf, msglen, &x, &res);
+	if (stat < 0) {
+		printf("%s: can't decode RPC message!\n", __func__);
+		return NULL;
 	}
-	if (mesg.rm_reply.rp_acpt.ar_stat != 0) {
-		printf("%s: [%s] RPC status %d",
+	if (stat != NSM_XDR_SUCCESS) {
+		printf("%s: [%s] RPC status %d\n",
 				__func__,
 				inet_ntoa(sin->sin_addr),
-				mesg.rm_reply.rp_acpt.ar_stat);
-		goto done;
+				stat);
+		return NULL;
 	}
 
-	for (lp = notify; lp != NULL; lp = lp->next) {
-		/* LH - this was a bug... it should have been checking
-		 * the xid from the response message from the client,
-		 * not the static, internal xid */
-		if (lp->xid != mesg.rm_xid)
-			continue;
-		if (lp->addr.s_addr != sin->sin_addr.s_addr) {
-			char addr [18];
-			strncpy (addr, inet_ntoa(lp->addr),
-				 sizeof (addr) - 1);
-			addr [sizeof (addr) - 1] = '\0';
-			printf("%s: address mismatch: "
-				"expected %s, got %s", __func__,
-				addr, inet_ntoa(sin->sin_addr));
-		}
-		if (lp->port == 0) {
-			if (!xdr_u_long(xdrs, portp)) {
-				printf("%s: [%s] can't decode reply body!",
-					__func__,
-					inet_ntoa(sin->sin_addr));
-				lp = NULL;
-				goto done;
-			}
+	lp = xid_hash_find(x);
+	if (!lp)
+		return NULL;
+
+	if (lp->addr.s_addr != sin->sin_addr.s_addr) {
+		char addr [18];
+		strncpy (addr, inet_ntoa(lp->addr),
+			 sizeof (addr) - 1);
+		addr [sizeof (addr) - 1] = '\0';
+		printf("%s: address mismatch: "
+			"expected %s, got %s\n", __func__,
+			addr, inet_ntoa(sin->sin_addr));
+	}
+	if (lp->port == 0) {
+		if (nsm_xdr_get_u32(&res, end, &port) < 0) {
+			printf("%s: [%s] can't decode reply body!\n",
+				__func__,
+				inet_ntoa(sin->sin_addr));
+			return NULL;
 		}
-		break;
+		*portp = port;
 	}
 
-done:
-	xdr_destroy(xdrs);
 	return lp;
 }
-#endif
+
 /*
  * Notify operation for a single list entry
  */
@@ -264,13 +261,11 @@ process_entry(notify_list *lp)
 {
 	struct sockaddr_in	sin;
 	struct status		new_status;
-	xdrproc_t		func;
-	void			*objp;
 	u_int32_t		proc, vers, prog;
 /* 	__u32			proc, vers, prog; */
 
 	if (lp->times == 0) {
-		printf("%s: Cannot notify %s, giving up.",
+		printf("%s: Cannot notify %s, giving up.\n",
 				__func__, inet_ntoa(lp->addr));
 		return 0;
 	}
@@ -288,100 +283,241 @@ process_entry(notify_list *lp)
 	/* Just in case we somehow ignored it thus far */
 	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
-	func = (xdrproc_t) xdr_status;
-	objp = &new_status;
-//	new_status.mon_name = NL_MON_NAME(lp);
-//	new_status.state    = NL_STATE(lp);
-//	memcpy(new_status.priv, NL_PRIV(lp), SM_PRIV_SIZE);
+	new_status.mon_name = NL_MON_NAME(lp);
+	new_status.state    = NL_STATE(lp);
+	memcpy(new_status.priv, NL_PRIV(lp), SM_PRIV_SIZE);
 
-	lp->xid = xmit_call(&sin, prog, vers, proc, func, objp);
+	lp->xid = xmit_call(&sin, prog, vers, proc, &new_status);
 	if (!lp->xid) {
-		printf("%s: failed to notify port %d",
+		printf("%s: failed to notify port %d\n",
 				__func__, ntohs(lp->port));
 	}
 	lp->times -= 1;
 
 	return 1;
 }
-#if 0
+
+static void
+nlist_done(notify_list *lp)
+{
+	nsm_timer_del(&timers, &lp->timer);
+	xid_hash_del(lp);
+	free(NL_MON_NAME(lp));
+	free(NL_MY_NAME(lp));
+	free(lp);
+	pending--;
+}
+
 /*
- * Process a datagram received on the notify socket
+ * (Re)send the entry and wait for the answer up to NOTIFY_TIMEOUT.
+ */
+static void
+nlist_xmit(notify_list *lp)
+{
+	xid_hash_del(lp);
+	if (!process_entry(lp)) {
+		printf("%s: Can't callback %s (%d,%d), giving up.\n",
+				__func__,
+				NL_MY_NAME(lp),
+				NL_MY_PROG(lp),
+				NL_MY_VERS(lp));
+		nlist_done(lp);
+		return;
+	}
+	if (lp->xid)
+		xid_hash_add(lp);
+	nsm_timer_add(&timers, &lp->timer,
+			nsm_now_msec() + NOTIFY_TIMEOUT * 1000);
+}
+
+/*
+ * Process the datagrams received on the notify socket
  */
 int
-process_reply(FD_SET_TYPE *rfds)
+process_reply(void)
 {
+	unsigned int		msgbuf[MAXMSGSIZE];
 	struct sockaddr_in	sin;
+	socklen_t		alen;
 	notify_list		*lp;
 	u_long			port;
+	int			msglen, nr = 0;
 
-	if (sockfd == -1 || !FD_ISSET(sockfd, rfds))
+	if (sockfd == -1)
 		return 0;
 
-	if (!(lp = recv_rply(&sin, &port)))
-		return 1;
+	for (;;) {
+		alen = sizeof(sin);
+		msglen = recvfrom(sockfd, msgbuf, sizeof(msgbuf), MSG_DONTWAIT,
+				(struct sockaddr *) &sin, &alen);
+		if (msglen < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				printf("%s: recvfrom failed: %m\n", __func__);
+			break;
+		}
+		nr++;
+
+		if (!(lp = recv_rply(msgbuf, msglen, &sin, &port)))
+			continue;
 
-	if (lp->port == 0) {
-		if (port != 0) {
-			lp->port = htons((unsigned short) port);
-			process_entry(lp);
-			NL_WHEN(lp) = time(NULL) + NOTIFY_TIMEOUT;
-			nlist_remove(&notify, lp);
-			nlist_insert_timer(&notify, lp);
-			return 1;
+		if (lp->port == 0) {
+			if (port != 0) {
+				lp->port = htons((unsigned short) port);
+				nlist_xmit(lp);
+				continue;
+			}
+			printf("%s: [%s] service %d not registered\n",
+				__func__, inet_ntoa(lp->addr), NL_MY_PROG(lp));
+		} else {
+			succeeded++;
+			if (verbose)
+				printf("%s: Callback to %s (for %s) "
+					"succeeded.\n", __func__,
+					NL_MY_NAME(lp), NL_MON_NAME(lp));
 		}
-		note(N_WARNING, "%s: [%s] service %d not registered",
-			__func__, inet_ntoa(lp->addr), NL_MY_PROG(lp));
-	} else {
-		dprintf(N_DEBUG, "%s: Callback to %s (for %d) succeeded.",
-			__func__, NL_MY_NAME(lp), NL_MON_NAME(lp));
+		nlist_done(lp);
 	}
-	nlist_free(&notify, lp);
-	return 1;
+
+	return nr;
 }
 
 /*
  * Process a notify list, either for notifying remote hosts after reboot
  * or for calling back (local) statd clients when the remote has notified
- * us of a crash. 
+ * us of a crash. Only the entries, which timers have expired, are
+ * looked at, and queued ones are started while there is room.
  */
 
 int
 process_notify_list(void)
 {
-	notify_list	*entry;
-	time_t		now;
-
-	while ((entry = notify) != NULL && NL_WHEN(entry) < time(&now)) {
-		if (process_entry(entry)) {
-			NL_WHEN(entry) = time(NULL) + NOTIFY_TIMEOUT;
-			nlist_remove(&notify, entry);
-			nlist_insert_timer(&notify, entry);
-		} else {
-			note(N_ERROR,
-				"%s: Can't callback %s (%d,%d), giving up.",
-					__func__,
-					NL_MY_NAME(entry),
-					NL_MY_PROG(entry),
-					NL_MY_VERS(entry));
-			nlist_free(&notify, entry);
-		}
+	struct nsm_timer	*timer;
+	notify_list		*lp;
+	long			now = nsm_now_msec();
+
+	while ((timer = nsm_timer_first(&timers)) && timer->expires <= now) {
+		nsm_timer_del(&timers, timer);
+		nlist_xmit(nsm_timer_entry(timer, notify_list, timer));
+	}
+
+	while ((lp = queue) && timers.count < NOTIFY_WINDOW) {
+		if (!(queue = lp->next))
+			queue_tail = &queue;
+		nlist_xmit(lp);
 	}
 
 	return 1;
 }
-#endif
+
+/*
+ * Queue a callback to be sent on the next process_notify_list().
+ */
+static int
+nlist_add(const char *mon_name, const char *my_name, int state,
+	  int prog, int vers, int proc, const unsigned char *priv)
+{
+	notify_list	*lp;
+
+	lp = calloc(1, sizeof(*lp));
+	if (!lp)
+		return -1;
+	NL_MON_NAME(lp) = strdup(mon_name);
+	NL_MY_NAME(lp) = strdup(my_name);
+	if (!NL_MON_NAME(lp) || !NL_MY_NAME(lp)) {
+		free(NL_MON_NAME(lp));
+		free(NL_MY_NAME(lp));
+		free(lp);
+		return -1;
+	}
+	NL_MY_PROG(lp) = prog;
+	NL_MY_VERS(lp) = vers;
+	NL_MY_PROC(lp) = proc;
+	NL_STATE(lp) = state;
+	NL_TIMES(lp) = NOTIFY_TRIES;
+	memcpy(NL_PRIV(lp), priv, SM_PRIV_SIZE);
+	lp->addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	*queue_tail = lp;
+	queue_tail = &lp->next;
+	pending++;
+	return 0;
+}
+
+/*
+ * Wait for replies or the next re-xmit
+ */
+static void
+notify_wait(void)
+{
+	struct epoll_event	ev;
+
+	epoll_wait(epfd, &ev, 1, nsm_timer_wait(&timers, nsm_now_msec()));
+}
+
+/*
+ * Callbacks are read from stdin, one per line:
+ *
+ *	<mon_name> <state> [<prog> <vers> <proc> [<priv>]]
+ *
+ * The defaults are lockd's: NLM program 100021, version 3, procedure 16
+ * (NLMPROC_NSM_NOTIFY). priv is 16 bytes in hex.
+ */
 int main(int argc, char **argv)
 {
-	notify_list lp;
+	char line[1024], mon_name[SM_MAXSTRLEN + 1], hex[2 * SM_PRIV_SIZE + 1];
+	unsigned char priv[SM_PRIV_SIZE];
+	int state, prog, vers, proc, i, n;
+	unsigned int total = 0;
+
+	if (argc > 1 && !strcmp(argv[1], "-v"))
+		verbose = 1;
 
 	if (statd_get_socket() < 0) {
 		printf("Failed to create socket\n");
 		return -1;
 	}
 
-	
-	return 0;
-}
+	if (nsm_timer_heap_init(&timers, 0) < 0) {
+		printf("Out of memory\n");
+		return -1;
+	}
 
+	while (fgets(line, sizeof(line), stdin)) {
+		prog = 100021;
+		vers = 3;
+		proc = 16;
+		hex[0] = '\0';
+		n = sscanf(line, "%1024s %d %d %d %d %32s", mon_name, &state,
+				&prog, &vers, &proc, hex);
+		if (n < 2) {
+			if (n > 0 && mon_name[0] != '#')
+				printf("Bad line: %s", line);
+			continue;
+		}
 
+		memset(priv, 0, sizeof(priv));
+		for (i = 0; i < SM_PRIV_SIZE && sscanf(hex + 2 * i, "%2hhx",
+						&priv[i]) == 1; i++)
+			;
 
+		if (nlist_add(mon_name, "localhost", state, prog, vers, proc,
+								priv) < 0) {
+			printf("Out of memory\n");
+			return -1;
+		}
+		total++;
+	}
+
+	while (pending) {
+		process_notify_list();
+		if (!pending)
+			break;
+		notify_wait();
+		/* answers free room for the queued entries */
+		process_reply();
+	}
+
+	printf("%u callbacks: %u succeeded, %u failed\n", total, succeeded,
+						total - succeeded);
+	return succeeded == total ? 0 : 1;
+}
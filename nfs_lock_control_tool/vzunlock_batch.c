@@ -0,0 +1,467 @@
+/*
+ * Batch kernel NFS unlock.
+ *
+ * Reads (client, server) pairs in clear_nfs_locks job file format and
+ * drops the locks of each with the VZCTL_NFS_UNLOCK ioctl, as vzunlock
+ * does for one pair. A pool of threads shares one /dev/vzctl descriptor,
+ * so a slow server doesn't hold the rest up. Pairs the kernel can't
+ * unlock that way (no /dev/vzctl, ENOTTY or ENOENT from the ioctl) are
+ * run through "clear_nfs_locks -f" at the end, which sends SM_NOTIFY
+ * instead. A result line is printed per pair, with its latency, and a
+ * summary with the throughput and the latency percentiles of both ways.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/param.h>
+#include <sys/wait.h>
+#include <linux/ioctl.h>
+
+#include "nsm_clock.h"
+
+struct vzctl_nfs_unlock {
+	char *srv_name;
+	char *cln_name;
+};
+
+#define VZCTLTYPE '.'
+#define VZCTL_NFS_UNLOCK	_IOW(VZCTLTYPE, 15,			\
+					struct vzctl_nfs_unlock)
+
+#define UNLOCK_WORKERS		8
+#define UNLOCK_MAX_WORKERS	256
+#define UNLOCK_ARGS		32	/* clear_nfs_locks options at most */
+#define UNLOCK_LINE		2048
+
+enum {
+	PAIR_IOCTL,
+	PAIR_NOTIFY,
+};
+
+struct pair {
+	char *		line;		/* as read, for clear_nfs_locks */
+	char *		client;
+	char *		server;
+	unsigned long	nr;		/* line in the job file */
+	int		method;
+	int		result;		/* 0 or negative errno */
+	char		error[64];	/* clear_nfs_locks' reason */
+	long		usec;
+};
+
+static struct pair *pairs;
+static unsigned long nr_pairs;
+static unsigned long next_pair;		/* taken by the workers */
+static int vzctl_fd = -1;
+static int no_ioctl;			/* the kernel doesn't know it */
+static char *notify_bin = "clear_nfs_locks";
+static char *notify_args[UNLOCK_ARGS];
+static int nr_notify_args;
+static int verbose;
+
+#define v_printf	if (verbose) printf
+
+static void print_pair(const struct pair *p)
+{
+	printf("%lu,%s,%s,%s,%s,%s,%ld\n", p->nr, p->client, p->server,
+		p->method == PAIR_IOCTL ? "ioctl" : "notify",
+		p->result ? "error" : "ok",
+		p->result ? (*p->error ? p->error : strerror(-p->result)) : "",
+		p->usec);
+}
+
+/*
+ * The pair is left for SM_NOTIFY if the kernel can't unlock it: the
+ * ioctl is unknown (ENOTTY, then nobody calls it again) or the server
+ * isn't known to lockd (ENOENT).
+ */
+static void unlock_pair(struct pair *p)
+{
+	struct vzctl_nfs_unlock s = {
+		.srv_name = p->server,
+		.cln_name = p->client,
+	};
+	long start;
+
+	p->method = PAIR_NOTIFY;
+	if (__atomic_load_n(&no_ioctl, __ATOMIC_RELAXED))
+		return;
+
+	start = nsm_now_usec();
+	if (!ioctl(vzctl_fd, VZCTL_NFS_UNLOCK, &s))
+		p->result = 0;
+	else if (errno == ENOTTY) {
+		__atomic_store_n(&no_ioctl, 1, __ATOMIC_RELAXED);
+		return;
+	} else if (errno == ENOENT)
+		return;
+	else
+		p->result = -errno;
+	p->usec = nsm_now_usec() - start;
+	p->method = PAIR_IOCTL;
+
+	/* a line is written whole, the threads don't mix them */
+	print_pair(p);
+}
+
+static void *worker(void *arg)
+{
+	unsigned long i;
+
+	while ((i = __atomic_fetch_add(&next_pair, 1, __ATOMIC_RELAXED)) <
+								nr_pairs)
+		unlock_pair(&pairs[i]);
+	return NULL;
+}
+
+static int run_workers(unsigned int nr)
+{
+	pthread_t threads[UNLOCK_MAX_WORKERS];
+	unsigned int i, started;
+	int result = 0;
+
+	nr = MIN(nr, MAX(nr_pairs, 1));
+	for (started = 0; started < nr; started++) {
+		result = pthread_create(&threads[started], NULL, worker, NULL);
+		if (result)
+			break;
+	}
+	if (!started) {
+		fprintf(stderr, "Failed to start workers: %s\n",
+						strerror(result));
+		return -1;
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	return 0;
+}
+
+/*
+ * Run the pairs left over through "clear_nfs_locks -f" and take its
+ * results: "line,client,server,state,port,result,error,usec", the line
+ * being the one in the file it was given.
+ */
+static void run_notify(void)
+{
+	char job_file[] = "/tmp/vzunlock.XXXXXX", line[UNLOCK_LINE];
+	char *argv[UNLOCK_ARGS + 4], result[16], error[64];
+	unsigned long i, n = 0, *index, nr;
+	int fds[2], argc = 0, status, fd;
+	FILE *f, *out;
+	long usec;
+	pid_t pid;
+
+	index = calloc(nr_pairs, sizeof(*index));
+	fd = mkstemp(job_file);
+	if (!index || fd < 0 || !(f = fdopen(fd, "w"))) {
+		fprintf(stderr, "Failed to make the job file: %s\n",
+						strerror(errno));
+		for (i = 0; i < nr_pairs; i++) {
+			if (pairs[i].method != PAIR_NOTIFY)
+				continue;
+			pairs[i].result = -EIO;
+			strcpy(pairs[i].error, "not run");
+			print_pair(&pairs[i]);
+		}
+		free(index);
+		return;
+	}
+	for (i = 0; i < nr_pairs; i++) {
+		if (pairs[i].method != PAIR_NOTIFY)
+			continue;
+		fprintf(f, "%s\n", pairs[i].line);
+		index[n++] = i;
+	}
+	fclose(f);
+
+	if (!n)
+		goto out;
+	v_printf("Sending SM_NOTIFY for %lu pairs\n", n);
+	fflush(stdout);
+
+	argv[argc++] = notify_bin;
+	argv[argc++] = "-f";
+	argv[argc++] = job_file;
+	for (i = 0; i < nr_notify_args; i++)
+		argv[argc++] = notify_args[i];
+	argv[argc] = NULL;
+
+	if (pipe(fds) < 0 || (pid = fork()) < 0) {
+		fprintf(stderr, "Failed to run %s: %s\n", notify_bin,
+						strerror(errno));
+		goto left;
+	}
+	if (!pid) {
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		execvp(argv[0], argv);
+		fprintf(stderr, "Failed to run %s: %s\n", argv[0],
+						strerror(errno));
+		_exit(127);
+	}
+	close(fds[1]);
+	out = fdopen(fds[0], "r");
+
+	while (fgets(line, sizeof(line), out)) {
+		*error = '\0';
+		if (sscanf(line, "%lu,%*[^,],%*[^,],%*u,%*u,%15[^,],%63[^,],%ld",
+					&nr, result, error, &usec) != 4 &&
+		    sscanf(line, "%lu,%*[^,],%*[^,],%*u,%*u,%15[^,],,%ld",
+					&nr, result, &usec) != 3)
+			continue;
+		if (!nr || nr > n || index[nr - 1] == nr_pairs)
+			continue;
+
+		i = index[nr - 1];
+		pairs[i].result = strcmp(result, "ok") ? -EIO : 0;
+		strcpy(pairs[i].error, error);
+		pairs[i].usec = usec;
+		print_pair(&pairs[i]);
+		index[nr - 1] = nr_pairs;	/* answered */
+	}
+	fclose(out);
+	waitpid(pid, &status, 0);
+
+left:
+	/* the ones clear_nfs_locks didn't get to */
+	for (i = 0; i < n; i++) {
+		if (index[i] == nr_pairs)
+			continue;
+		pairs[index[i]].result = -EIO;
+		strcpy(pairs[index[i]].error, "no result");
+		print_pair(&pairs[index[i]]);
+	}
+
+out:
+	unlink(job_file);
+	free(index);
+}
+
+/*
+ * Comments and empty lines aside, every line is "<client_name> <server>
+ * [<statd_state> [<port>]]", comma or space separated, the rest goes to
+ * clear_nfs_locks only.
+ */
+static int read_pairs(FILE *f)
+{
+	char buf[UNLOCK_LINE], *line, *save, *delim = " \t\r\n,";
+	unsigned long nr = 0, size = 0;
+	struct pair *p;
+
+	while (fgets(buf, sizeof(buf), f)) {
+		nr++;
+		line = buf + strspn(buf, delim);
+		if (!*line || *line == '#')
+			continue;
+		line[strcspn(line, "\n")] = '\0';
+
+		if (nr_pairs == size) {
+			size = size ? size * 2 : 1024;
+			p = realloc(pairs, size * sizeof(*pairs));
+			if (!p)
+				goto nomem;
+			pairs = p;
+		}
+
+		p = &pairs[nr_pairs];
+		memset(p, 0, sizeof(*p));
+		p->nr = nr;
+		p->method = PAIR_NOTIFY;	/* until the ioctl is done */
+		p->line = strdup(line);
+		if (!p->line || !(line = strdup(line)))
+			goto nomem;
+		p->client = strtok_r(line, delim, &save);
+		p->server = strtok_r(NULL, delim, &save);
+		if (!p->server) {
+			fprintf(stderr, "Line %lu: usage: <client_name> "
+				"<server> [<statd_state> [<port>]]\n", nr);
+			free(p->line);
+			free(line);
+			continue;
+		}
+		nr_pairs++;
+	}
+	return 0;
+
+nomem:
+	fprintf(stderr, "Out of memory\n");
+	return -1;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void summary_line(const char *name, int method)
+{
+	unsigned long i, n = 0, failed = 0;
+	long *v;
+
+	v = calloc(MAX(nr_pairs, 1), sizeof(*v));
+	if (!v)
+		return;
+	for (i = 0; i < nr_pairs; i++) {
+		if (pairs[i].method != method)
+			continue;
+		if (pairs[i].result)
+			failed++;
+		else
+			v[n++] = pairs[i].usec;
+	}
+	qsort(v, n, sizeof(*v), cmp_long);
+
+	fprintf(stderr, "%-7s %8lu %6lu", name, n, failed);
+	if (n)
+		fprintf(stderr, " %8ld %8ld %8ld %8ld", v[n / 2],
+			v[MIN(n * 9 / 10, n - 1)],
+			v[MIN(n * 99 / 100, n - 1)], v[n - 1]);
+	fprintf(stderr, "\n");
+	free(v);
+}
+
+static void summary(double seconds)
+{
+	unsigned long i, failed = 0;
+
+	for (i = 0; i < nr_pairs; i++)
+		if (pairs[i].result)
+			failed++;
+
+	fprintf(stderr, "%lu pairs, %lu failed, in %.3f seconds: %.0f "
+			"pairs/s\n", nr_pairs, failed, seconds,
+			seconds > 0 ? nr_pairs / seconds : 0);
+	fprintf(stderr, "%-7s %8s %6s %8s %8s %8s %8s\n", "method", "ok",
+			"failed", "p50us", "p90us", "p99us", "maxus");
+	summary_line("ioctl", PAIR_IOCTL);
+	summary_line("notify", PAIR_NOTIFY);
+}
+
+static void help(char *name)
+{
+	printf("Usage: %s [-f job_file] [OPTIONS] [-- clear_nfs_locks "
+				"options]\n\n", name);
+	printf("\t-f job_file               Pairs to unlock (\"-\" for stdin, "
+					    "the default), one per line:\n"
+	       "\t                          \"<client_name> <server> "
+					    "[<statd_state> [<port>]]\",\n"
+	       "\t                          as for clear_nfs_locks -f.\n\n");
+	printf("\t-w workers                Threads issuing the ioctls. "
+					    "Default is %d.\n\n", UNLOCK_WORKERS);
+	printf("\t-d device                 Default is /dev/vzctl.\n\n");
+	printf("\t-b clear_nfs_locks        Program the pairs the kernel can't "
+					    "unlock go to.\n\n");
+	printf("\t-N                        No SM_NOTIFY: such pairs fail.\n\n");
+	printf("\t-v                        Be verbose: print work progress\n\n");
+	printf("\t-h                        This help.\n\n");
+	printf("A line per pair goes to stdout: "
+			"\"line,client,server,method,result,error,usec\",\n");
+	printf("the summary to stderr.\n");
+}
+
+int main(int argc, char **argv)
+{
+	char *job_file = "-", *device = "/dev/vzctl";
+	unsigned int workers = UNLOCK_WORKERS;
+	int fallback = 1, result;
+	unsigned long i;
+	long start;
+	FILE *f;
+
+	while ((result = getopt(argc, argv, "f:w:d:b:Nvh")) != EOF) {
+		switch (result) {
+			case 'f':
+				job_file = optarg;
+				break;
+			case 'w':
+				workers = atoi(optarg);
+				if (!workers || workers > UNLOCK_MAX_WORKERS) {
+					fprintf(stderr, "Bad number of workers: "
+							"%s\n", optarg);
+					exit(2);
+				}
+				break;
+			case 'd':
+				device = optarg;
+				break;
+			case 'b':
+				notify_bin = optarg;
+				break;
+			case 'N':
+				fallback = 0;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			case 'h':
+				help(argv[0]);
+				exit(0);
+			default:
+				help(argv[0]);
+				exit(2);
+		}
+	}
+
+	for (; optind < argc; optind++) {
+		if (nr_notify_args == UNLOCK_ARGS) {
+			fprintf(stderr, "Too many clear_nfs_locks options\n");
+			exit(2);
+		}
+		notify_args[nr_notify_args++] = argv[optind];
+	}
+
+	f = strcmp(job_file, "-") ? fopen(job_file, "r") : stdin;
+	if (!f) {
+		fprintf(stderr, "Failed to open job file %s: %s\n", job_file,
+						strerror(errno));
+		exit(1);
+	}
+	if (read_pairs(f) < 0)
+		exit(1);
+	if (f != stdin)
+		fclose(f);
+
+	start = nsm_now_usec();
+
+	vzctl_fd = open(device, O_RDWR);
+	if (vzctl_fd < 0) {
+		v_printf("Can't open %s: %s\n", device, strerror(errno));
+		no_ioctl = 1;
+	} else if (run_workers(workers) < 0)
+		exit(1);
+	if (no_ioctl && vzctl_fd >= 0)
+		v_printf("%s doesn't know VZCTL_NFS_UNLOCK\n", device);
+	fflush(stdout);
+
+	/* without the fallback the pairs left for SM_NOTIFY fail */
+	for (i = 0; i < nr_pairs; i++)
+		if (pairs[i].method == PAIR_NOTIFY && !fallback) {
+			pairs[i].result = -EOPNOTSUPP;
+			print_pair(&pairs[i]);
+		}
+	if (fallback)
+		run_notify();
+
+	fflush(stdout);
+	summary((nsm_now_usec() - start) / 1e6);
+
+	if (vzctl_fd >= 0)
+		close(vzctl_fd);
+	for (i = 0; i < nr_pairs; i++)
+		if (pairs[i].result)
+			return 1;
+	return 0;
+}